@@ -70,24 +70,22 @@ static int		 ndirs;
 int			 insecure;
 
 /* Known shlibs on the standard system search path.  Persistent,
-   common to all applications */
+   common to all applications: only scanned again when the hints file
+   or one of its directories changed.  Read-only between two scans, so
+   it can be searched from several threads. */
 static struct shlib_list *shlibs = NULL;
 
-/* Known shlibs on the specific RPATH or RUNPATH of one binary.
-   Evanescent. */
-static struct shlib_list *rpath = NULL;
-
-void
-shlib_list_init(void)
-{
-	assert(HASH_COUNT(shlibs) == 0);
-}
-
-void
-rpath_list_init(void)
-{
-	assert(HASH_COUNT(rpath) == 0);
-}
+/* What the hints file and each of its directories looked like when
+   shlibs was scanned */
+struct hints_stamp {
+	dev_t	dev;
+	ino_t	ino;
+	off_t	size;
+	time_t	mtime;
+};
+static char		 hints_path[MAXPATHLEN];
+static struct hints_stamp stamps[MAXDIRS + 1];
+static bool		 shlibs_loaded = false;
 
 static int
 shlib_list_add(struct shlib_list **shlib_list, const char *dir,
@@ -123,7 +121,7 @@ shlib_list_add(struct shlib_list **shlib_list, const char *dir,
 }
 
 const char *
-shlib_list_find_by_name(const char *shlib_file)
+shlib_list_find_by_name(struct shlib_list *rpath, const char *shlib_file)
 {
 	struct shlib_list *sl;
 
@@ -150,18 +148,19 @@ shlib_list_free(void)
 		free(sl1);
 	}
 	shlibs = NULL;
+	shlibs_loaded = false;
 }
 
 void
-rpath_list_free(void)
+rpath_list_free(struct shlib_list **rpath)
 {
 	struct shlib_list	*sl1, *sl2;
 
-	HASH_ITER(hh, rpath, sl1, sl2) {
-		HASH_DEL(rpath, sl1);
+	HASH_ITER(hh, *rpath, sl1, sl2) {
+		HASH_DEL(*rpath, sl1);
 		free(sl1);
 	}
-	rpath = NULL;
+	*rpath = NULL;
 }
 
 static void
@@ -265,7 +264,8 @@ scan_dirs_for_shlibs(struct shlib_list **shlib_list, int numdirs,
 
 #define ORIGIN	"$ORIGIN"
 
-int shlib_list_from_rpath(const char *rpath_str, const char *dirpath)
+int shlib_list_from_rpath(struct shlib_list **rpath, const char *rpath_str,
+    const char *dirpath)
 {
 	const char    **dirlist;
 	char	       *buf;
@@ -310,19 +310,72 @@ int shlib_list_from_rpath(const char *rpath_str, const char *dirpath)
 
 	assert(i <= numdirs);
 
-	ret = scan_dirs_for_shlibs(&rpath, i, dirlist, false);
+	ret = scan_dirs_for_shlibs(rpath, i, dirlist, false);
 
 	free(dirlist);
 
 	return (ret);
 }
 
+static void
+hints_stamp(struct hints_stamp *hs, const char *path)
+{
+	struct stat	st;
+
+	memset(hs, 0, sizeof(*hs));
+	if (stat(path, &st) == -1)
+		return;
+	hs->dev = st.st_dev;
+	hs->ino = st.st_ino;
+	hs->size = st.st_size;
+	hs->mtime = st.st_mtime;
+}
+
+static bool
+hints_changed(const char *hintsfile)
+{
+	struct hints_stamp	hs;
+	int	i;
+
+	if (!shlibs_loaded || strcmp(hints_path, hintsfile) != 0)
+		return (true);
+
+	hints_stamp(&hs, hintsfile);
+	if (memcmp(&hs, &stamps[0], sizeof(hs)) != 0)
+		return (true);
+
+	for (i = 0; i < ndirs; i++) {
+		hints_stamp(&hs, dirs[i]);
+		if (memcmp(&hs, &stamps[i + 1], sizeof(hs)) != 0)
+			return (true);
+	}
+
+	return (false);
+}
+
 int 
 shlib_list_from_elf_hints(const char *hintsfile)
 {
+	int	i, ret;
+
+	if (!hints_changed(hintsfile))
+		return (EPKG_OK);
+
+	shlib_list_free();
+	ndirs = 0;
 	read_elf_hints(hintsfile, 1);
 
-	return (scan_dirs_for_shlibs(&shlibs, ndirs, dirs, true));
+	/* Stamp before scanning: a change racing the scan means another
+	   scan next time */
+	strlcpy(hints_path, hintsfile, sizeof(hints_path));
+	hints_stamp(&stamps[0], hintsfile);
+	for (i = 0; i < ndirs; i++)
+		hints_stamp(&stamps[i + 1], dirs[i]);
+
+	ret = scan_dirs_for_shlibs(&shlibs, ndirs, dirs, true);
+	shlibs_loaded = (ret == EPKG_OK);
+
+	return (ret);
 }
 
 void
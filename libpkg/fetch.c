@@ -43,12 +43,76 @@
 #include <fetch.h>
 #include <paths.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "pkg.h"
 #include "private/event.h"
 #include "private/pkg.h"
 #include "private/utils.h"
 
+/*
+ * Mirror discovery fills the repository lists lazily, and pkg_jobs_fetch()
+ * may have several downloads racing to do it.
+ */
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * libfetch keeps its timeout and last error in globals: requests are issued
+ * and their outcome read back under this lock.
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * While several downloads run concurrently, their progress is summed here
+ * and reported by the caller instead of being emitted per file.
+ */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool progress_shared = false;
+static int64_t progress_done = 0;
+
+void
+pkg_fetch_progress_begin(void)
+{
+	pthread_mutex_lock(&progress_lock);
+	progress_shared = true;
+	progress_done = 0;
+	pthread_mutex_unlock(&progress_lock);
+}
+
+int64_t
+pkg_fetch_progress_get(void)
+{
+	int64_t done;
+
+	pthread_mutex_lock(&progress_lock);
+	done = progress_done;
+	pthread_mutex_unlock(&progress_lock);
+
+	return (done);
+}
+
+void
+pkg_fetch_progress_end(void)
+{
+	pthread_mutex_lock(&progress_lock);
+	progress_shared = false;
+	pthread_mutex_unlock(&progress_lock);
+}
+
+static bool
+fetch_progress_add(off_t r)
+{
+	bool shared;
+
+	pthread_mutex_lock(&progress_lock);
+	shared = progress_shared;
+	if (shared)
+		progress_done += r;
+	pthread_mutex_unlock(&progress_lock);
+
+	return (shared);
+}
+
 static void
 gethttpmirrors(struct pkg_repo *repo, const char *url) {
 	FILE *f;
@@ -58,7 +122,10 @@ gethttpmirrors(struct pkg_repo *repo, const char *url) {
 	struct http_mirror *m;
 	struct url *u;
 
-	if ((f = fetchGetURL(url, "")) == NULL)
+	pthread_mutex_lock(&fetch_lock);
+	f = fetchGetURL(url, "");
+	pthread_mutex_unlock(&fetch_lock);
+	if (f == NULL)
 		return;
 
 	while ((linelen = getline(&line, &linecap, f)) > 0) {
@@ -162,6 +229,12 @@ pkg_fetch_file(struct pkg_repo *repo, const char *url, char *dest, time_t t)
 	return (retcode);
 }
 
+static int
+fetch_timeout(void)
+{
+	return ((int)pkg_object_int(pkg_config_get("FETCH_TIMEOUT")));
+}
+
 static int
 ssh_read(void *data, char *buf, int len)
 {
@@ -169,13 +242,14 @@ ssh_read(void *data, char *buf, int len)
 	struct timeval now, timeout, delta;
 	struct pollfd pfd;
 	ssize_t rlen;
-	int deltams;
+	int deltams, timeo;
 
 	pkg_debug(2, "ssh: start reading %d");
 
-	if (fetchTimeout > 0) {
+	timeo = fetch_timeout();
+	if (timeo > 0) {
 		gettimeofday(&timeout, NULL);
-		timeout.tv_sec += fetchTimeout;
+		timeout.tv_sec += timeo;
 	}
 
 	deltams = INFTIM;
@@ -198,7 +272,7 @@ ssh_read(void *data, char *buf, int len)
 		}
 
 		/* only EAGAIN should get here */
-		if (fetchTimeout > 0) {
+		if (timeo > 0) {
 			gettimeofday(&now, NULL);
 			if (!timercmp(&timeout, &now, >)) {
 				errno = ETIMEDOUT;
@@ -233,21 +307,22 @@ ssh_writev(int fd, struct iovec *iov, int iovcnt)
 	struct timeval now, timeout, delta;
 	struct pollfd pfd;
 	ssize_t wlen, total;
-	int deltams;
+	int deltams, timeo;
 	struct msghdr msg;
 
 	memset(&pfd, 0, sizeof pfd);
 
-	if (fetchTimeout) {
+	timeo = fetch_timeout();
+	if (timeo) {
 		pfd.fd = fd;
 		pfd.events = POLLOUT | POLLERR;
 		gettimeofday(&timeout, NULL);
-		timeout.tv_sec += fetchTimeout;
+		timeout.tv_sec += timeo;
 	}
 
 	total = 0;
 	while (iovcnt > 0) {
-		while (fetchTimeout && pfd.revents == 0) {
+		while (timeo && pfd.revents == 0) {
 			gettimeofday(&now, NULL);
 			if (!timercmp(&timeout, &now, >)) {
 				errno = ETIMEDOUT;
@@ -459,7 +534,8 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	off_t		 r;
 
 	int64_t		 max_retry, retry;
-	int64_t		 fetch_timeout;
+	int		 errcode, rerrno = 0;
+	char		 errstr[MAXERRSTRING];
 	char		 buf[10240];
 	char		*doc = NULL;
 	char		 docpath[MAXPATHLEN];
@@ -469,11 +545,9 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	struct http_mirror	*http_current = NULL;
 	off_t		 sz = 0;
 	bool		 pkg_url_scheme = false;
+	bool		 shared;
 
 	max_retry = pkg_object_int(pkg_config_get("FETCH_RETRY"));
-	fetch_timeout = pkg_object_int(pkg_config_get("FETCH_TIMEOUT"));
-
-	fetchTimeout = (int) fetch_timeout;
 
 	retry = max_retry;
 
@@ -530,15 +604,19 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 
 				snprintf(zone, sizeof(zone),
 				    "_%s._tcp.%s", u->scheme, u->host);
+				pthread_mutex_lock(&mirror_lock);
 				if (repo->srv == NULL)
 					repo->srv = dns_getsrvinfo(zone);
+				pthread_mutex_unlock(&mirror_lock);
 				srv_current = repo->srv;
 			} else if (repo != NULL && repo->mirror_type == HTTP &&
 			           strncmp(u->scheme, "http", 4) == 0) {
 				snprintf(zone, sizeof(zone),
 				    "%s://%s", u->scheme, u->host);
+				pthread_mutex_lock(&mirror_lock);
 				if (repo->http == NULL)
 					gethttpmirrors(repo, zone);
+				pthread_mutex_unlock(&mirror_lock);
 				http_current = repo->http;
 			}
 		}
@@ -561,16 +639,20 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 		    u->user[0] != '\0' ? "@" : "",
 		    u->host,
 		    u->doc);
+		pthread_mutex_lock(&fetch_lock);
+		fetchTimeout = fetch_timeout();
 		remote = fetchXGet(u, &st, "i");
+		errcode = fetchLastErrCode;
+		strlcpy(errstr, fetchLastErrString, sizeof(errstr));
+		pthread_mutex_unlock(&fetch_lock);
 		if (remote == NULL) {
-			if (fetchLastErrCode == FETCH_OK) {
+			if (errcode == FETCH_OK) {
 				retcode = EPKG_UPTODATE;
 				goto cleanup;
 			}
 			--retry;
-			if (retry <= 0 || fetchLastErrCode == FETCH_UNAVAIL) {
-				pkg_emit_error("%s: %s", url,
-				    fetchLastErrString);
+			if (retry <= 0 || errcode == FETCH_UNAVAIL) {
+				pkg_emit_error("%s: %s", url, errstr);
 				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
@@ -599,15 +681,21 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 		sz = st.size;
 	}
 
-	pkg_emit_fetch_begin(url);
-	pkg_emit_progress_start(NULL);
+	shared = fetch_progress_add(0);
+	if (!shared) {
+		pkg_emit_fetch_begin(url);
+		pkg_emit_progress_start(NULL);
+	}
 	while (done < sz) {
 		int to_read = MIN(sizeof(buf), sz - done);
 
 		pkg_debug(1, "Reading status: want read %d over %d, %d already done",
 			to_read, sz, done);
-		if ((r = fread(buf, 1, to_read, remote)) < 1)
+		errno = 0;
+		if ((r = fread(buf, 1, to_read, remote)) < 1) {
+			rerrno = errno;
 			break;
+		}
 
 		if (write(dest, buf, r) != r) {
 			pkg_emit_errno("write", "");
@@ -618,18 +706,24 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 		done += r;
 		pkg_debug(1, "Read status: %d over %d", done, sz);
 
-		pkg_emit_progress_tick(done, sz);
+		if (!shared)
+			pkg_emit_progress_tick(done, sz);
+		else
+			fetch_progress_add(r);
 	}
 
 	if (done < sz) {
+		if (rerrno != 0)
+			pkg_emit_error("%s: %s", url, strerror(rerrno));
 		pkg_emit_error("An error occurred while fetching package");
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
-	pkg_emit_fetch_finished(url);
+	if (!shared)
+		pkg_emit_fetch_finished(url);
 
 	if (strcmp(u->scheme, "ssh") != 0 && ferror(remote)) {
-		pkg_emit_error("%s: %s", url, fetchLastErrString);
+		pkg_emit_error("%s: read error", url);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
@@ -349,15 +349,44 @@ packing_finish(struct packing *pack)
 	return (EPKG_OK);
 }
 
+/*
+ * xz and zstd compress with one thread per worker.  Multi-threaded xz
+ * output is split in independent blocks, which pkg_open2() decompresses
+ * in parallel as well; small packages still fit in a single block.
+ */
+static void
+packing_set_threads(struct archive *a, const char *filter)
+{
+	char threads[16];
+
+	snprintf(threads, sizeof(threads), "%d", worker_count());
+	/* Older libarchive does not know the option: stay single threaded */
+	if (archive_write_set_filter_option(a, filter, "threads", threads) !=
+	    ARCHIVE_OK)
+		pkg_debug(1, "%s: cannot use %s threads: %s", filter, threads,
+		    archive_error_string(a));
+}
+
 static const char *
 packing_set_format(struct archive *a, pkg_formats format)
 {
 	const char *notsupp_fmt = "%s is not supported, trying %s";
 
 	switch (format) {
+	case TZS:
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+		if (archive_write_add_filter_zstd(a) == ARCHIVE_OK) {
+			packing_set_threads(a, "zstd");
+			return ("tzst");
+		}
+		else
+#endif
+			pkg_emit_error(notsupp_fmt, "zstd", "xz");
 	case TXZ:
-		if (archive_write_add_filter_xz(a) == ARCHIVE_OK)
+		if (archive_write_add_filter_xz(a) == ARCHIVE_OK) {
+			packing_set_threads(a, "xz");
 			return ("txz");
+		}
 		else
 			pkg_emit_error(notsupp_fmt, "xz", "bzip2");
 	case TBZ:
@@ -390,10 +419,26 @@ packing_format_from_string(const char *str)
 		return TGZ;
 	if (strcmp(str, "tar") == 0)
 		return TAR;
+	if (strcmp(str, "tzst") == 0)
+		return TZS;
 	pkg_emit_error("unknown format %s, using txz", str);
 	return TXZ;
 }
 
+/*
+ * Whether ext, without the leading dot, is the extension of a package
+ * archive.
+ */
+bool
+packing_is_package_ext(const char *ext)
+{
+	return (strcmp(ext, "txz") == 0 ||
+	    strcmp(ext, "tzst") == 0 ||
+	    strcmp(ext, "tbz") == 0 ||
+	    strcmp(ext, "tgz") == 0 ||
+	    strcmp(ext, "tar") == 0);
+}
+
 const char*
 packing_format_to_string(pkg_formats format)
 {
@@ -412,6 +457,9 @@ packing_format_to_string(pkg_formats format)
 	case TAR:
 		res = "tar";
 		break;
+	case TZS:
+		res = "tzst";
+		break;
 	}
 
 	return (res);
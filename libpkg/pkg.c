@@ -32,8 +32,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -117,6 +123,8 @@ pkg_reset(struct pkg *pkg, pkg_t type)
 	pkg_list_free(pkg, PKG_SHLIBS_REQUIRED);
 	pkg_list_free(pkg, PKG_SHLIBS_PROVIDED);
 	pkg_list_free(pkg, PKG_PROVIDES);
+	pkg_version_key_free(pkg->version_key);
+	pkg->version_key = NULL;
 	if (pkg->rootfd != -1)
 		close(pkg->rootfd);
 	pkg->rootfd = -1;
@@ -144,6 +152,7 @@ pkg_free(struct pkg *pkg)
 	pkg_list_free(pkg, PKG_GROUPS);
 	pkg_list_free(pkg, PKG_SHLIBS_REQUIRED);
 	pkg_list_free(pkg, PKG_SHLIBS_PROVIDED);
+	pkg_version_key_free(pkg->version_key);
 	if (pkg->rootfd != -1)
 		close(pkg->rootfd);
 
@@ -329,6 +338,11 @@ pkg_vset(struct pkg *pkg, va_list ap)
 			return (EPKG_FATAL);
 		}
 
+		if (attr == PKG_VERSION && pkg->version_key != NULL) {
+			pkg_version_key_free(pkg->version_key);
+			pkg->version_key = NULL;
+		}
+
 		switch (pkg_keys[attr].type) {
 		case UCL_STRING:
 			str = va_arg(ap, const char *);
@@ -655,6 +669,32 @@ pkg_addgroup(struct pkg *pkg, const char *name)
 	return (pkg_addgid(pkg, name, NULL));
 }
 
+static int
+pkg_dep_set(struct pkg_dep *d, const char *name, const char *origin,
+    const char *version)
+{
+	char *uid;
+	size_t len;
+
+	len = strlen(name) + strlen(origin) + 2;
+	if ((uid = malloc(len)) == NULL) {
+		pkg_emit_errno("malloc", "pkg_dep_set");
+		return (EPKG_FATAL);
+	}
+	snprintf(uid, len, "%s~%s", name, origin);
+	d->origin = pkg_intern(origin);
+	d->name = pkg_intern(name);
+	d->version = pkg_intern(version);
+	d->uid = pkg_intern(uid);
+	free(uid);
+
+	if (d->origin == NULL || d->name == NULL || d->version == NULL ||
+	    d->uid == NULL)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
 int
 pkg_adddep(struct pkg *pkg, const char *name, const char *origin, const char *version, bool locked)
 {
@@ -683,10 +723,10 @@ pkg_adddep(struct pkg *pkg, const char *name, const char *origin, const char *ve
 
 	pkg_dep_new(&d);
 
-	sbuf_set(&d->origin, origin);
-	sbuf_set(&d->name, name);
-	sbuf_set(&d->version, version);
-	asprintf(&d->uid, "%s~%s", name, origin);
+	if (pkg_dep_set(d, name, origin, version) != EPKG_OK) {
+		pkg_dep_free(d);
+		return (EPKG_FATAL);
+	}
 	d->locked = locked;
 
 	HASH_ADD_KEYPTR(hh, pkg->deps, pkg_dep_get(d, PKG_DEP_ORIGIN),
@@ -708,10 +748,10 @@ pkg_addrdep(struct pkg *pkg, const char *name, const char *origin, const char *v
 	pkg_debug(3, "Pkg: add a new reverse dependency origin: %s, name: %s, version: %s", origin, name, version);
 	pkg_dep_new(&d);
 
-	sbuf_set(&d->origin, origin);
-	sbuf_set(&d->name, name);
-	sbuf_set(&d->version, version);
-	asprintf(&d->uid, "%s~%s", name, origin);
+	if (pkg_dep_set(d, name, origin, version) != EPKG_OK) {
+		pkg_dep_free(d);
+		return (EPKG_FATAL);
+	}
 	d->locked = locked;
 
 	HASH_ADD_KEYPTR(hh, pkg->rdeps, pkg_dep_get(d, PKG_DEP_ORIGIN),
@@ -730,6 +770,7 @@ int
 pkg_addfile_attr(struct pkg *pkg, const char *path, const char *sha256, const char *uname, const char *gname, mode_t perm, bool check_duplicates)
 {
 	struct pkg_file *f = NULL;
+	size_t len;
 
 	assert(pkg != NULL);
 	assert(path != NULL && path[0] != '\0');
@@ -749,22 +790,31 @@ pkg_addfile_attr(struct pkg *pkg, const char *path, const char *sha256, const ch
 		}
 	}
 
-	pkg_file_new(&f);
-	strlcpy(f->path, path, sizeof(f->path));
+	len = strlen(path);
+	f = pkg_arena_alloc(&pkg->file_arena, sizeof(*f) + len + 1);
+	if (f == NULL) {
+		pkg_emit_errno("malloc", "struct pkg_file");
+		return (EPKG_FATAL);
+	}
+	memset(f, 0, sizeof(*f));
+	memcpy(f->path, path, len + 1);
 
 	if (sha256 != NULL)
 		strlcpy(f->sum, sha256, sizeof(f->sum));
 
-	if (uname != NULL)
-		strlcpy(f->uname, uname, sizeof(f->uname));
-
-	if (gname != NULL)
-		strlcpy(f->gname, gname, sizeof(f->gname));
+	f->uname = pkg_arena_intern(&pkg->file_arena,
+	    uname != NULL ? uname : "");
+	f->gname = pkg_arena_intern(&pkg->file_arena,
+	    gname != NULL ? gname : "");
+	if (f->uname == NULL || f->gname == NULL) {
+		pkg_emit_errno("malloc", "struct pkg_file");
+		return (EPKG_FATAL);
+	}
 
 	if (perm != 0)
 		f->perm = perm;
 
-	HASH_ADD_STR(pkg->files, path, f);
+	HASH_ADD(hh, pkg->files, path[0], len, f);
 
 	return (EPKG_OK);
 }
@@ -1119,7 +1169,10 @@ pkg_addshlib_required(struct pkg *pkg, const char *name)
 	assert(name != NULL && name[0] != '\0');
 
 	pkg_shlib_new(&s);
-	sbuf_set(&s->name, name);
+	if ((s->name = pkg_intern(name)) == NULL) {
+		pkg_shlib_free(s);
+		return (EPKG_FATAL);
+	}
 
 	HASH_FIND_STR(pkg->shlibs_required, pkg_shlib_name(s), f);
 	/* silently ignore duplicates in case of shlibs */
@@ -1149,7 +1202,10 @@ pkg_addshlib_provided(struct pkg *pkg, const char *name)
 	assert(name != NULL && name[0] != '\0');
 
 	pkg_shlib_new(&s);
-	sbuf_set(&s->name, name);
+	if ((s->name = pkg_intern(name)) == NULL) {
+		pkg_shlib_free(s);
+		return (EPKG_FATAL);
+	}
 	HASH_FIND_STR(pkg->shlibs_provided, pkg_shlib_name(s), f);
 	/* silently ignore duplicates in case of shlibs */
 	if (f != NULL) {
@@ -1320,7 +1376,8 @@ pkg_list_free(struct pkg *pkg, pkg_list list)  {
 		pkg->flags &= ~PKG_LOAD_OPTIONS;
 		break;
 	case PKG_FILES:
-		HASH_FREE(pkg->files, pkg_file_free);
+		HASH_CLEAR(hh, pkg->files);
+		pkg_arena_free(&pkg->file_arena);
 		pkg->flags &= ~PKG_LOAD_FILES;
 		break;
 	case PKG_DIRS:
@@ -1390,9 +1447,10 @@ pkg_open_fd(struct pkg **pkg_p, int fd, struct pkg_manifest_key *keys, int flags
 	return (EPKG_OK);
 }
 
-int
-pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
-    const char *path, struct pkg_manifest_key *keys, int flags, int fd)
+static int
+pkg_read_manifest_entries(struct pkg **pkg_p, struct archive *a,
+    struct archive_entry **ae, const char *path,
+    struct pkg_manifest_key *keys, int flags)
 {
 	struct pkg	*pkg;
 	pkg_error_t	 retcode = EPKG_OK;
@@ -1404,7 +1462,6 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	off_t		 offset = 0;
 	struct sbuf	*sbuf;
 	int		 i, r;
-	bool		 read_from_stdin = 0;
 
 	struct {
 		const char *name;
@@ -1414,49 +1471,16 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 		{ NULL, 0 }
 	};
 
-	*a = archive_read_new();
-	archive_read_support_filter_all(*a);
-	archive_read_support_format_tar(*a);
-
-	/* archive_read_open_filename() treats a path of NULL as
-	 * meaning "read from stdin," but we want this behaviour if
-	 * path is exactly "-". In the unlikely event of wanting to
-	 * read an on-disk file called "-", just say "./-" or some
-	 * other leading path. */
-
-	if (fd == -1) {
-		read_from_stdin = (strncmp(path, "-", 2) == 0);
-
-		if (archive_read_open_filename(*a,
-		    read_from_stdin ? NULL : path, 4096) != ARCHIVE_OK) {
-			if ((flags & PKG_OPEN_TRY) == 0)
-				pkg_emit_error("archive_read_open_filename(%s): %s", path,
-					archive_error_string(*a));
-
-			retcode = EPKG_FATAL;
-			goto cleanup;
-		}
-	} else {
-		if (archive_read_open_fd(*a, fd, 4096) != ARCHIVE_OK) {
-			if ((flags & PKG_OPEN_TRY) == 0)
-				pkg_emit_error("archive_read_open_fd: %s",
-					archive_error_string(*a));
-
-			retcode = EPKG_FATAL;
-			goto cleanup;
-		}
-	}
-
 	if (*pkg_p == NULL) {
 		retcode = pkg_new(pkg_p, PKG_FILE);
 		if (retcode != EPKG_OK)
-			goto cleanup;
+			return (retcode);
 	} else
 		pkg_reset(*pkg_p, PKG_FILE);
 
 	pkg = *pkg_p;
 
-	while ((ret = archive_read_next_header(*a, ae)) == ARCHIVE_OK) {
+	while ((ret = archive_read_next_header(a, ae)) == ARCHIVE_OK) {
 		fpath = archive_entry_pathname(*ae);
 		if (fpath[0] != '+')
 			break;
@@ -1469,13 +1493,11 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 
 			size_t len = archive_entry_size(*ae);
 			buffer = malloc(len);
-			archive_read_data(*a, buffer, archive_entry_size(*ae));
+			archive_read_data(a, buffer, archive_entry_size(*ae));
 			ret = pkg_parse_manifest(pkg, buffer, len, keys);
 			free(buffer);
-			if (ret != EPKG_OK) {
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+			if (ret != EPKG_OK)
+				return (EPKG_FATAL);
 			/* Do not read anything more */
 			break;
 		}
@@ -1485,7 +1507,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 
 			size_t len = archive_entry_size(*ae);
 			buffer = malloc(len);
-			archive_read_data(*a, buffer, archive_entry_size(*ae));
+			archive_read_data(a, buffer, archive_entry_size(*ae));
 			ret = pkg_parse_manifest(pkg, buffer, len, keys);
 			free(buffer);
 			if (ret != EPKG_OK) {
@@ -1493,8 +1515,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 					pkg_emit_error("%s is not a valid package: "
 						"Invalid manifest", path);
 
-				retcode = EPKG_FATAL;
-				goto cleanup;
+				return (EPKG_FATAL);
 			}
 			if (flags & PKG_OPEN_MANIFEST_ONLY)
 				break;
@@ -1505,19 +1526,19 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 				sbuf = sbuf_new_auto();
 				offset = 0;
 				for (;;) {
-					if ((r = archive_read_data_block(*a, &buf,
+					if ((r = archive_read_data_block(a, &buf,
 							&size, &offset)) == 0) {
 						sbuf_bcat(sbuf, buf, size);
 					}
 					else {
 						if (r == ARCHIVE_FATAL) {
-							retcode = EPKG_FATAL;
 							if ((flags & PKG_OPEN_TRY) == 0)
 								pkg_emit_error("%s is not a valid package: "
 									"%s is corrupted: %s", path, fpath,
-										archive_error_string(*a));
+										archive_error_string(a));
 
-							goto cleanup;
+							sbuf_delete(sbuf);
+							return (EPKG_FATAL);
 						}
 						else if (r == ARCHIVE_EOF)
 							break;
@@ -1533,7 +1554,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	if (ret != ARCHIVE_OK && ret != ARCHIVE_EOF) {
 		if ((flags & PKG_OPEN_TRY) == 0)
 			pkg_emit_error("archive_read_next_header(): %s",
-				archive_error_string(*a));
+				archive_error_string(a));
 
 		retcode = EPKG_FATAL;
 	}
@@ -1547,6 +1568,191 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 			pkg_emit_error("%s is not a valid package: no manifest found", path);
 	}
 
+	return (retcode);
+}
+
+/*
+ * The multi-threaded decoder of liblzma decompresses the blocks of an xz
+ * stream in parallel; libarchive is then handed the tar stream.  Streams
+ * made of a single block are decoded as usual by the same decoder.
+ */
+#if LZMA_VERSION >= 50040002
+#define PKG_OPEN_XZ_MT
+
+static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+struct pkg_open_xz {
+	int fd;
+	bool eof;
+	bool done;
+	lzma_stream strm;
+	uint8_t in[65536];
+	uint8_t out[262144];
+};
+
+static ssize_t
+pkg_open_xz_read(struct archive *a, void *data, const void **buf)
+{
+	struct pkg_open_xz *xz = data;
+	lzma_ret lret;
+	ssize_t r;
+
+	*buf = xz->out;
+	if (xz->done)
+		return (0);
+
+	xz->strm.next_out = xz->out;
+	xz->strm.avail_out = sizeof(xz->out);
+	while (xz->strm.avail_out == sizeof(xz->out)) {
+		if (xz->strm.avail_in == 0 && !xz->eof) {
+			while ((r = read(xz->fd, xz->in, sizeof(xz->in))) == -1) {
+				if (errno == EINTR)
+					continue;
+				archive_set_error(a, errno, "read");
+				return (-1);
+			}
+			xz->eof = (r == 0);
+			xz->strm.next_in = xz->in;
+			xz->strm.avail_in = r;
+		}
+		lret = lzma_code(&xz->strm, xz->eof ? LZMA_FINISH : LZMA_RUN);
+		if (lret == LZMA_STREAM_END) {
+			xz->done = true;
+			break;
+		}
+		if (lret != LZMA_OK) {
+			archive_set_error(a, EIO,
+			    "xz decompression failed (%d)", lret);
+			return (-1);
+		}
+	}
+
+	return (sizeof(xz->out) - xz->strm.avail_out);
+}
+
+static int
+pkg_open_xz_close(struct archive *a __unused, void *data)
+{
+	struct pkg_open_xz *xz = data;
+
+	lzma_end(&xz->strm);
+	close(xz->fd);
+	free(xz);
+
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Returns EPKG_END if path is not an xz file, leaving it to libarchive.
+ */
+static int
+pkg_open_xz(struct archive *a, const char *path)
+{
+	struct pkg_open_xz *xz;
+	lzma_mt mt;
+	uint8_t magic[sizeof(xz_magic)];
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (EPKG_END);
+	if (read(fd, magic, sizeof(magic)) != sizeof(magic) ||
+	    memcmp(magic, xz_magic, sizeof(magic)) != 0 ||
+	    lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return (EPKG_END);
+	}
+
+	if ((xz = calloc(1, sizeof(*xz))) == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_open_xz");
+		close(fd);
+		return (EPKG_FATAL);
+	}
+	xz->fd = fd;
+
+	memset(&mt, 0, sizeof(mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = worker_count();
+	/* Fall back to a single thread rather than using too much memory */
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	if (lzma_stream_decoder_mt(&xz->strm, &mt) != LZMA_OK) {
+		pkg_debug(1, "cannot use the threaded xz decoder for %s", path);
+		close(fd);
+		free(xz);
+		return (EPKG_END);
+	}
+
+	/* The close callback releases xz, even on failure */
+	if (archive_read_open(a, xz, NULL, pkg_open_xz_read,
+	    pkg_open_xz_close) != ARCHIVE_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+#endif
+
+int
+pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
+    const char *path, struct pkg_manifest_key *keys, int flags, int fd)
+{
+	pkg_error_t	 retcode = EPKG_OK;
+	bool		 read_from_stdin = 0;
+
+	*a = archive_read_new();
+	archive_read_support_filter_all(*a);
+	archive_read_support_format_tar(*a);
+
+	/* archive_read_open_filename() treats a path of NULL as
+	 * meaning "read from stdin," but we want this behaviour if
+	 * path is exactly "-". In the unlikely event of wanting to
+	 * read an on-disk file called "-", just say "./-" or some
+	 * other leading path. */
+
+	if (fd == -1) {
+		read_from_stdin = (strncmp(path, "-", 2) == 0);
+
+#ifdef PKG_OPEN_XZ_MT
+		if (!read_from_stdin && worker_count() > 1) {
+			switch (pkg_open_xz(*a, path)) {
+			case EPKG_OK:
+				goto opened;
+			case EPKG_END:
+				break;
+			default:
+				if ((flags & PKG_OPEN_TRY) == 0)
+					pkg_emit_error("archive_read_open(%s): %s",
+					    path, archive_error_string(*a));
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+		}
+#endif
+
+		if (archive_read_open_filename(*a,
+		    read_from_stdin ? NULL : path, 4096) != ARCHIVE_OK) {
+			if ((flags & PKG_OPEN_TRY) == 0)
+				pkg_emit_error("archive_read_open_filename(%s): %s", path,
+					archive_error_string(*a));
+
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+	} else {
+		if (archive_read_open_fd(*a, fd, 4096) != ARCHIVE_OK) {
+			if ((flags & PKG_OPEN_TRY) == 0)
+				pkg_emit_error("archive_read_open_fd: %s",
+					archive_error_string(*a));
+
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+#ifdef PKG_OPEN_XZ_MT
+opened:
+#endif
+	retcode = pkg_read_manifest_entries(pkg_p, *a, ae, path, keys, flags);
+
 	cleanup:
 	if (retcode != EPKG_OK && retcode != EPKG_END) {
 		if (*a != NULL) {
@@ -1560,6 +1766,109 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	return (retcode);
 }
 
+struct pkg_open_tee {
+	int fd;
+	SHA256_CTX ctx;
+	char buf[65536];
+};
+
+static ssize_t
+pkg_open_tee_read(struct archive *a, void *data, const void **buf)
+{
+	struct pkg_open_tee *tee = data;
+	ssize_t r;
+
+	*buf = tee->buf;
+	while ((r = read(tee->fd, tee->buf, sizeof(tee->buf))) == -1) {
+		if (errno == EINTR)
+			continue;
+		archive_set_error(a, errno, "read");
+		return (-1);
+	}
+	SHA256_Update(&tee->ctx, tee->buf, r);
+
+	return (r);
+}
+
+int
+pkg_open_checksum(struct pkg **pkg_p, const char *path,
+    struct pkg_manifest_key *keys, int flags,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	struct pkg_open_tee *tee;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	const void *buf;
+	ssize_t r;
+	int ret;
+
+	/*
+	 * Every byte libarchive asks for goes through the SHA256 context on
+	 * its way in, and once the manifest is parsed the rest of the file
+	 * is drained through the same context, so the checksum and the
+	 * manifest come out of a single sequential read.
+	 */
+	if ((tee = malloc(sizeof(*tee))) == NULL) {
+		pkg_emit_errno("malloc", "struct pkg_open_tee");
+		return (EPKG_FATAL);
+	}
+	if ((tee->fd = open(path, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", path);
+		free(tee);
+		return (EPKG_FATAL);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(tee->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	SHA256_Init(&tee->ctx);
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open(a, tee, NULL, pkg_open_tee_read, NULL) !=
+	    ARCHIVE_OK) {
+		if ((flags & PKG_OPEN_TRY) == 0)
+			pkg_emit_error("archive_read_open(%s): %s", path,
+				archive_error_string(a));
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	ret = pkg_read_manifest_entries(pkg_p, a, &ae, path, keys, flags);
+	if (ret != EPKG_OK && ret != EPKG_END) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	do {
+		r = pkg_open_tee_read(a, tee, &buf);
+	} while (r > 0);
+
+	if (r == -1) {
+		pkg_emit_errno("read", path);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	SHA256_Final(hash, &tee->ctx);
+	sha256_hash(hash, cksum);
+	ret = EPKG_OK;
+
+cleanup:
+	archive_read_close(a);
+	archive_read_free(a);
+#ifdef POSIX_FADV_DONTNEED
+	/* The package will not be read again by the repo builder */
+	(void)posix_fadvise(tee->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(tee->fd);
+	free(tee);
+
+	return (ret);
+}
+
 int
 pkg_validate(struct pkg *pkg)
 {
@@ -1646,42 +1955,397 @@ pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 	return (packing_finish(pack));
 }
 
+#define FILESUM_CACHE_NAME	"checksums.cache"
+#define FILESUM_CACHE_MAGIC	"pkg-filesum-cache 1"
+
+struct pkg_filesum_entry {
+	UT_hash_handle	 hh;
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	time_t		 mtime;
+	time_t		 ctime;
+	bool		 seen;		/* looked up during this run */
+	char		 sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char		 path[];
+};
+
+struct pkg_filesum_cache {
+	struct pkg_filesum_entry *entries;
+	time_t		 start;
+	unsigned	 flags;
+	bool		 dirty;
+};
+
+/* A file of the package being checked */
+struct pkg_filesum_job {
+	struct pkg_file	*file;
+	struct stat	 st;
+	char		 sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	const char	*errfunc;	/* of the failed syscall */
+	int		 error;
+	bool		 hash;		/* to be hashed by a worker */
+};
+
+struct pkg_filesum_env {
+	struct pkg_filesum_job *jobs;
+	size_t		 njobs;
+	size_t		 next;
+	pthread_mutex_t	 lock;
+};
+
+static void
+pkg_filesum_cache_path(char *path, size_t len)
+{
+	snprintf(path, len, "%s/%s",
+	    pkg_object_string(pkg_config_get("PKG_DBDIR")), FILESUM_CACHE_NAME);
+}
+
+static bool
+pkg_filesum_entry_match(struct pkg_filesum_entry *e, struct stat *st)
+{
+	return (e->dev == st->st_dev && e->ino == st->st_ino &&
+	    e->size == st->st_size && e->mtime == st->st_mtime &&
+	    e->ctime == st->st_ctime);
+}
+
+static struct pkg_filesum_entry *
+pkg_filesum_cache_set(struct pkg_filesum_cache *cache, const char *path,
+    struct stat *st, const char *sum)
+{
+	struct pkg_filesum_entry *e;
+	size_t len;
+
+	/* Entries are saved one per line */
+	if (strchr(path, '\n') != NULL)
+		return (NULL);
+
+	HASH_FIND_STR(cache->entries, path, e);
+	if (e == NULL) {
+		len = strlen(path) + 1;
+		if ((e = calloc(1, sizeof(*e) + len)) == NULL)
+			return (NULL);
+		memcpy(e->path, path, len);
+		HASH_ADD_STR(cache->entries, path, e);
+	}
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->ctime = st->st_ctime;
+	strlcpy(e->sum, sum, sizeof(e->sum));
+	cache->dirty = true;
+
+	return (e);
+}
+
+static void
+pkg_filesum_cache_del(struct pkg_filesum_cache *cache,
+    struct pkg_filesum_entry *e)
+{
+	HASH_DEL(cache->entries, e);
+	free(e);
+	cache->dirty = true;
+}
+
+struct pkg_filesum_cache *
+pkg_filesum_cache_open(unsigned flags)
+{
+	struct pkg_filesum_cache *cache;
+	struct stat st;
+	FILE *f;
+	char path[MAXPATHLEN], sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	uintmax_t dev, ino;
+	intmax_t size, mtime, ctime;
+	int n;
+
+	if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_filesum_cache");
+		return (NULL);
+	}
+	cache->start = time(NULL);
+	cache->flags = flags;
+
+	/* Loaded even to rehash, for the entries of the files not checked */
+	pkg_filesum_cache_path(path, sizeof(path));
+	if ((f = fopen(path, "r")) == NULL)
+		return (cache);
+
+	if ((linelen = getline(&line, &linecap, f)) <= 0 ||
+	    strcmp(line, FILESUM_CACHE_MAGIC "\n") != 0) {
+		pkg_debug(1, "ignoring invalid checksum cache %s", path);
+		goto cleanup;
+	}
+
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		if (line[linelen - 1] != '\n')
+			break;
+		line[linelen - 1] = '\0';
+		if (sscanf(line, "%64s %ju %ju %jd %jd %jd %n", sum, &dev, &ino,
+		    &size, &mtime, &ctime, &n) != 6 || line[n] == '\0' ||
+		    strlen(sum) != SHA256_DIGEST_LENGTH * 2)
+			continue;
+		st.st_dev = dev;
+		st.st_ino = ino;
+		st.st_size = size;
+		st.st_mtime = mtime;
+		st.st_ctime = ctime;
+		pkg_filesum_cache_set(cache, line + n, &st, sum);
+	}
+	cache->dirty = false;
+
+cleanup:
+	free(line);
+	fclose(f);
+
+	return (cache);
+}
+
+int
+pkg_filesum_cache_close(struct pkg_filesum_cache *cache)
+{
+	struct pkg_filesum_entry *e, *etmp;
+	FILE *f = NULL;
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	int fd, ret = EPKG_OK;
+
+	if (cache == NULL)
+		return (EPKG_OK);
+
+	/* Every package was checked: the rest belongs to removed files */
+	if ((cache->flags & PKG_FILESUM_ALL) != 0) {
+		HASH_ITER(hh, cache->entries, e, etmp) {
+			if (!e->seen)
+				pkg_filesum_cache_del(cache, e);
+		}
+	}
+
+	if (!cache->dirty)
+		goto cleanup;
+
+	pkg_filesum_cache_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		/* pkg check -s only needs to read the database */
+		pkg_debug(1, "cannot save the checksum cache %s: %s", path,
+		    strerror(errno));
+		goto cleanup;
+	}
+	if (fchmod(fd, 0644) == -1) {
+		pkg_emit_errno("fchmod", tmp);
+		close(fd);
+		ret = EPKG_FATAL;
+		goto unlink;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		pkg_emit_errno("fdopen", tmp);
+		close(fd);
+		ret = EPKG_FATAL;
+		goto unlink;
+	}
+
+	fprintf(f, "%s\n", FILESUM_CACHE_MAGIC);
+	HASH_ITER(hh, cache->entries, e, etmp) {
+		fprintf(f, "%s %ju %ju %jd %jd %jd %s\n", e->sum,
+		    (uintmax_t)e->dev, (uintmax_t)e->ino, (intmax_t)e->size,
+		    (intmax_t)e->mtime, (intmax_t)e->ctime, e->path);
+	}
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) == -1) {
+		pkg_emit_errno("write", tmp);
+		ret = EPKG_FATAL;
+		goto unlink;
+	}
+	if (rename(tmp, path) == -1) {
+		pkg_emit_errno("rename", path);
+		ret = EPKG_FATAL;
+		goto unlink;
+	}
+	goto cleanup;
+
+unlink:
+	unlink(tmp);
+cleanup:
+	if (f != NULL)
+		fclose(f);
+	HASH_ITER(hh, cache->entries, e, etmp) {
+		HASH_DEL(cache->entries, e);
+		free(e);
+	}
+	free(cache);
+
+	return (ret);
+}
+
+static void
+pkg_filesum_hash(struct pkg_filesum_job *job)
+{
+	SHA256_CTX sha256;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	char buf[65536];
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(pkg_file_path(job->file), O_RDONLY)) == -1) {
+		job->errfunc = "open";
+		job->error = errno;
+		return;
+	}
+
+	SHA256_Init(&sha256);
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		SHA256_Update(&sha256, buf, r);
+	if (r == -1) {
+		job->errfunc = "read";
+		job->error = errno;
+	} else {
+		SHA256_Final(hash, &sha256);
+		sha256_hash(hash, job->sum);
+	}
+
+	close(fd);
+}
+
+static void *
+pkg_filesum_worker(void *arg)
+{
+	struct pkg_filesum_env *env = arg;
+	struct pkg_filesum_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&env->lock);
+		while (env->next < env->njobs && !env->jobs[env->next].hash)
+			env->next++;
+		job = env->next < env->njobs ? &env->jobs[env->next++] : NULL;
+		pthread_mutex_unlock(&env->lock);
+		if (job == NULL)
+			break;
+		pkg_filesum_hash(job);
+	}
+
+	return (NULL);
+}
+
 int
 pkg_test_filesum(struct pkg *pkg)
+{
+	return (pkg_test_filesum_cached(pkg, NULL));
+}
+
+int
+pkg_test_filesum_cached(struct pkg *pkg, struct pkg_filesum_cache *cache)
 {
 	struct pkg_file *f = NULL;
+	struct pkg_filesum_entry *e;
+	struct pkg_filesum_job *job;
+	struct pkg_filesum_env env;
+	pthread_t *threads = NULL;
 	const char *path;
 	const char *sum;
-	struct stat	 st;
-	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
+	size_t i, nhash = 0, nthreads, started = 0;
 	int rc = EPKG_OK;
 
 	assert(pkg != NULL);
 
+	memset(&env, 0, sizeof(env));
+	env.jobs = calloc(HASH_COUNT(pkg->files), sizeof(*env.jobs));
+	if (env.jobs == NULL && HASH_COUNT(pkg->files) != 0) {
+		pkg_emit_errno("calloc", "pkg_test_filesum");
+		return (EPKG_FATAL);
+	}
+	pthread_mutex_init(&env.lock, NULL);
+
 	while (pkg_files(pkg, &f) == EPKG_OK) {
+		if (*pkg_file_cksum(f) == '\0')
+			continue;
+		job = &env.jobs[env.njobs++];
+		job->file = f;
 		path = pkg_file_path(f);
-		sum = pkg_file_cksum(f);
-		if (*sum != '\0') {
-			if (lstat(path, &st) == -1) {
-				pkg_emit_errno("pkg_create_from_dir", "lstat failed");
-				return (EPKG_FATAL);
-			}
-			if (S_ISLNK(st.st_mode)) {
-				if (pkg_symlink_cksum(path, NULL, sha256) != EPKG_OK)
-					return (EPKG_FATAL);
+		if (lstat(path, &job->st) == -1) {
+			job->errfunc = "lstat";
+			job->error = errno;
+			break;
+		}
+		if (S_ISLNK(job->st.st_mode))
+			continue;
+		if (cache != NULL) {
+			HASH_FIND_STR(cache->entries, path, e);
+			if (e != NULL)
+				e->seen = true;
+			if (e != NULL &&
+			    (cache->flags & PKG_FILESUM_REHASH) == 0 &&
+			    pkg_filesum_entry_match(e, &job->st)) {
+				strlcpy(job->sum, e->sum, sizeof(job->sum));
+				continue;
 			}
-			else {
-				if (sha256_file(path, sha256) != EPKG_OK)
-					return (EPKG_FATAL);
+		}
+		job->hash = true;
+		nhash++;
+	}
 
-			}
-			if (strcmp(sha256, sum) != 0) {
-				pkg_emit_file_mismatch(pkg, f, sum);
+	/* The calling thread is one of the workers */
+	nthreads = MIN((size_t)worker_count(), nhash);
+	if (nthreads > 1) {
+		threads = calloc(nthreads - 1, sizeof(*threads));
+		if (threads == NULL)
+			nthreads = 1;
+	}
+	for (; started + 1 < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL,
+		    pkg_filesum_worker, &env) != 0)
+			break;
+	}
+	pkg_filesum_worker(&env);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < env.njobs; i++) {
+		job = &env.jobs[i];
+		path = pkg_file_path(job->file);
+		sum = pkg_file_cksum(job->file);
+		if (job->errfunc != NULL) {
+			errno = job->error;
+			if (strcmp(job->errfunc, "lstat") == 0)
+				pkg_emit_errno("pkg_create_from_dir", "lstat failed");
+			else
+				pkg_emit_errno(job->errfunc, path);
+			rc = EPKG_FATAL;
+			break;
+		}
+		if (S_ISLNK(job->st.st_mode)) {
+			if (pkg_symlink_cksum(path, NULL, job->sum) != EPKG_OK) {
 				rc = EPKG_FATAL;
+				break;
 			}
 		}
+		/*
+		 * Like git's index, do not trust the times of a file changed
+		 * in the same second as it was hashed.
+		 */
+		else if (job->hash && cache != NULL) {
+			if (job->st.st_mtime < cache->start &&
+			    job->st.st_ctime < cache->start) {
+				if ((e = pkg_filesum_cache_set(cache, path,
+				    &job->st, job->sum)) != NULL)
+					e->seen = true;
+			} else {
+				HASH_FIND_STR(cache->entries, path, e);
+				if (e != NULL)
+					pkg_filesum_cache_del(cache, e);
+			}
+		}
+		if (strcmp(job->sum, sum) != 0) {
+			pkg_emit_file_mismatch(pkg, job->file, sum);
+			rc = EPKG_FATAL;
+		}
 	}
 
+	free(threads);
+	free(env.jobs);
+	pthread_mutex_destroy(&env.lock);
+
 	return (rc);
 }
 
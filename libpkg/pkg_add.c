@@ -30,15 +30,20 @@
 #endif
 
 #include <sys/utsname.h>
+#include <sys/time.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <grp.h>
 #include <libgen.h>
+#include <pwd.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -76,16 +81,371 @@ pkg_add_file_random_suffix(char *buf, int buflen, int suflen)
 	*pos = '\0';
 }
 
+/*
+ * A package extracted by pkg_add_stage().  Its files are written under
+ * temporary names, and only put in place by pkg_add_staged() once the
+ * package is registered: until then nothing on disk belonging to another
+ * package can be overwritten.  The directories created are recorded to be
+ * removed if the package is discarded.
+ */
+struct pkg_stage_file {
+	char	*key;
+	char	*path;
+	char	*tmp;
+	bool	 conf;
+	bool	 done;
+	UT_hash_handle hh;
+	struct pkg_stage_file *next;
+};
+
+struct pkg_stage {
+	struct pkg		*pkg;
+	struct pkg_stage_file	*files;
+	struct pkg_stage_file	*dirs;
+};
+
+/*
+ * Record that path is extracted as tmp, or that the directory path has been
+ * created if tmp is NULL.  key is the path of the entry in the archive, so
+ * that hard links to it can be found.
+ */
+static int
+pkg_stage_add(struct pkg_stage *stage, const char *key, const char *path,
+    const char *tmp, bool conf)
+{
+	struct pkg_stage_file *sf;
+
+	if ((sf = calloc(1, sizeof(*sf))) == NULL ||
+	    (sf->key = strdup(key)) == NULL ||
+	    (sf->path = strdup(path)) == NULL ||
+	    (tmp != NULL && (sf->tmp = strdup(tmp)) == NULL)) {
+		pkg_emit_errno("malloc", "pkg_stage_file");
+		if (sf != NULL) {
+			free(sf->key);
+			free(sf->path);
+			free(sf);
+		}
+		return (EPKG_FATAL);
+	}
+	sf->conf = conf;
+	if (tmp == NULL)
+		LL_PREPEND(stage->dirs, sf);
+	else
+		HASH_ADD_KEYPTR(hh, stage->files, sf->key, strlen(sf->key),
+		    sf);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Rename the extracted files to their final names.  A configuration file
+ * created meanwhile is left alone.
+ */
+static int
+pkg_stage_commit(struct pkg_stage *stage)
+{
+	struct pkg_stage_file *sf, *tmp;
+	struct stat st;
+
+	HASH_ITER(hh, stage->files, sf, tmp) {
+		if (sf->conf && lstat(sf->path, &st) != -1)
+			continue;
+		if (rename(sf->tmp, sf->path) == -1) {
+			pkg_emit_error("cannot rename %s to %s: %s", sf->tmp,
+			    sf->path, strerror(errno));
+			return (EPKG_FATAL);
+		}
+		sf->done = true;
+	}
+
+	return (EPKG_OK);
+}
+
+static void
+pkg_stage_file_free(struct pkg_stage_file *sf)
+{
+	free(sf->key);
+	free(sf->path);
+	free(sf->tmp);
+	free(sf);
+}
+
+/*
+ * Remove what is left under a temporary name and, if the package is
+ * discarded, the directories created for it, deepest first.
+ */
+static void
+pkg_stage_free(struct pkg_stage *stage, bool discard)
+{
+	struct pkg_stage_file *sf, *tmp;
+
+	HASH_ITER(hh, stage->files, sf, tmp) {
+		HASH_DEL(stage->files, sf);
+		if (!sf->done)
+			unlink(sf->tmp);
+		pkg_stage_file_free(sf);
+	}
+	LL_FOREACH_SAFE(stage->dirs, sf, tmp) {
+		if (discard)
+			rmdir(sf->path);
+		pkg_stage_file_free(sf);
+	}
+	pkg_free(stage->pkg);
+	free(stage);
+}
+
+/*
+ * Plain regular files are written directly, relative to the root directory
+ * of the package.  When the package is an uncompressed tarball on disk the
+ * content is copied by the kernel from the archive file, without going
+ * through libarchive's buffers.
+ */
+struct pkg_extract {
+	int	 rootfd;
+	int	 srcfd;
+	uid_t	 euid;
+	char	 uname[MAXLOGNAME];
+	uid_t	 uid;
+	char	 gname[MAXLOGNAME];
+	gid_t	 gid;
+};
+
+static void
+pkg_extract_init(struct pkg_extract *ex, struct archive *a, struct pkg *pkg,
+    const char *path)
+{
+	char magic[5];
+
+	memset(ex, 0, sizeof(*ex));
+	ex->rootfd = -1;
+	ex->srcfd = -1;
+	ex->euid = geteuid();
+
+	if (pkg_open_root_fd(pkg) != EPKG_OK)
+		return;
+	ex->rootfd = pkg->rootfd;
+
+	if (path == NULL || strcmp(path, "-") == 0 ||
+	    archive_filter_code(a, 0) != ARCHIVE_FILTER_NONE ||
+	    (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_TAR)
+		return;
+
+	if ((ex->srcfd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return;
+
+	/* A compressed file may have been decompressed aside by pkg_open2() */
+	if (pread(ex->srcfd, magic, sizeof(magic), 257) != sizeof(magic) ||
+	    memcmp(magic, "ustar", sizeof(magic)) != 0) {
+		close(ex->srcfd);
+		ex->srcfd = -1;
+	}
+}
+
+static void
+pkg_extract_finish(struct pkg_extract *ex)
+{
+	if (ex->srcfd != -1)
+		close(ex->srcfd);
+	ex->srcfd = -1;
+}
+
+static uid_t
+pkg_extract_uid(struct pkg_extract *ex, struct archive_entry *ae)
+{
+	struct passwd pwd, *pw;
+	const char *name;
+	char buf[1024];
+
+	if ((name = archive_entry_uname(ae)) == NULL)
+		return (archive_entry_uid(ae));
+	if (strcmp(name, ex->uname) == 0)
+		return (ex->uid);
+
+	if (getpwnam_r(name, &pwd, buf, sizeof(buf), &pw) != 0 || pw == NULL)
+		return (archive_entry_uid(ae));
+
+	strlcpy(ex->uname, name, sizeof(ex->uname));
+	ex->uid = pw->pw_uid;
+
+	return (ex->uid);
+}
+
+static gid_t
+pkg_extract_gid(struct pkg_extract *ex, struct archive_entry *ae)
+{
+	struct group grp, *gr;
+	const char *name;
+	char buf[4096];
+
+	if ((name = archive_entry_gname(ae)) == NULL)
+		return (archive_entry_gid(ae));
+	if (strcmp(name, ex->gname) == 0)
+		return (ex->gid);
+
+	if (getgrnam_r(name, &grp, buf, sizeof(buf), &gr) != 0 || gr == NULL)
+		return (archive_entry_gid(ae));
+
+	strlcpy(ex->gname, name, sizeof(ex->gname));
+	ex->gid = gr->gr_gid;
+
+	return (ex->gid);
+}
+
+/*
+ * Copy the data of the current entry from the archive file.  EPKG_END is
+ * returned when that is not possible and the data must be read through
+ * libarchive.
+ */
+static int
+pkg_extract_copy(struct pkg_extract *ex, struct archive *a, int fd,
+    const char *path, int64_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t off;
+	int64_t done = 0;
+	ssize_t r = 0;
+
+	if (ex->srcfd == -1)
+		return (EPKG_END);
+
+	/* tar headers have been consumed, the data start on a block */
+	off = archive_filter_bytes(a, -1);
+	if (off % 512 != 0)
+		return (EPKG_END);
+
+	while (done < size) {
+		r = copy_file_range(ex->srcfd, &off, fd, NULL, size - done, 0);
+		if (r <= 0)
+			break;
+		done += r;
+	}
+
+	if (done == size)
+		return (EPKG_OK);
+
+	if (done == 0 && r == -1 && (errno == EXDEV || errno == EINVAL ||
+	    errno == ENOSYS || errno == EOPNOTSUPP)) {
+		/* Not supported here, do not try again */
+		pkg_extract_finish(ex);
+		return (EPKG_END);
+	}
+
+	if (r == 0)
+		errno = EIO;
+	pkg_emit_errno("copy_file_range", path);
+	return (EPKG_FATAL);
+#else
+	return (EPKG_END);
+#endif
+}
+
+/*
+ * Extract a regular file to path, relative to the package root directory.
+ * EPKG_END is returned for the entries which need the full
+ * archive_read_extract() machinery: anything which is not a plain regular
+ * file, or whose parent directory does not exist yet.
+ */
+static int
+pkg_extract_file(struct pkg_extract *ex, struct archive *a,
+    struct archive_entry *ae, const char *path)
+{
+	struct timeval tv[2];
+	unsigned long set, clear;
+	int64_t size;
+	mode_t mode;
+	int fd, ret = EPKG_FATAL;
+
+	if (ex->rootfd == -1 || archive_entry_filetype(ae) != AE_IFREG ||
+	    archive_entry_hardlink(ae) != NULL ||
+	    archive_entry_sparse_count(ae) > 0 ||
+	    archive_entry_xattr_count(ae) > 0 ||
+	    archive_entry_acl_count(ae, ARCHIVE_ENTRY_ACL_TYPE_ACCESS |
+	    ARCHIVE_ENTRY_ACL_TYPE_DEFAULT) > 0)
+		return (EPKG_END);
+
+	archive_entry_fflags(ae, &set, &clear);
+	if (set != 0)
+		return (EPKG_END);
+
+	while (*path == '/')
+		path++;
+
+	fd = openat(ex->rootfd, path,
+	    O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd == -1)
+		return (EPKG_END);
+
+	size = archive_entry_size(ae);
+	if (size > 0) {
+#ifdef HAVE_POSIX_FALLOCATE
+		/* Only a hint, not all file systems support it */
+		(void)posix_fallocate(fd, 0, size);
+#endif
+		ret = pkg_extract_copy(ex, a, fd, path, size);
+		if (ret == EPKG_FATAL)
+			goto cleanup;
+		if (ret == EPKG_END &&
+		    archive_read_data_into_fd(a, fd) != ARCHIVE_OK) {
+			pkg_emit_error("archive_read_data_into_fd(): %s",
+			    archive_error_string(a));
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+		ret = EPKG_FATAL;
+	}
+
+	mode = archive_entry_perm(ae);
+	if (ex->euid == 0) {
+		if (fchown(fd, pkg_extract_uid(ex, ae),
+		    pkg_extract_gid(ex, ae)) == -1) {
+			pkg_emit_errno("fchown", path);
+			goto cleanup;
+		}
+	} else {
+		mode &= ~(S_ISUID | S_ISGID);
+	}
+
+	if (fchmod(fd, mode) == -1) {
+		pkg_emit_errno("fchmod", path);
+		goto cleanup;
+	}
+
+	tv[1].tv_sec = archive_entry_mtime(ae);
+	tv[1].tv_usec = archive_entry_mtime_nsec(ae) / 1000;
+	if (archive_entry_atime_is_set(ae)) {
+		tv[0].tv_sec = archive_entry_atime(ae);
+		tv[0].tv_usec = archive_entry_atime_nsec(ae) / 1000;
+	} else {
+		tv[0] = tv[1];
+	}
+	if (futimes(fd, tv) == -1) {
+		pkg_emit_errno("futimes", path);
+		goto cleanup;
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	close(fd);
+	if (ret != EPKG_OK)
+		unlinkat(ex->rootfd, path, 0);
+
+	return (ret);
+}
+
 static int
 do_extract(struct archive *a, struct archive_entry *ae, const char *location,
-		int nfiles, struct pkg *pkg)
+		int nfiles, struct pkg *pkg, const char *archive_path, bool progress,
+		struct pkg_stage *stage)
 {
+	struct pkg_extract ex;
+	struct pkg_stage_file *sf;
 	int	retcode = EPKG_OK;
 	int	ret = 0, cur_file = 0;
 	char	path[MAXPATHLEN], pathname[MAXPATHLEN], rpath[MAXPATHLEN];
 	struct stat st;
-	const char *name;
-	bool renamed = false;
+	const char *name, *link;
+	bool renamed = false, exists;
 
 #ifndef HAVE_ARC4RANDOM
 	srand(time(NULL));
@@ -95,8 +455,12 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 		return (EPKG_OK);
 
 	pkg_get(pkg, PKG_NAME, &name);
-	pkg_emit_extract_begin(pkg);
-	pkg_emit_progress_start(NULL);
+	if (progress) {
+		pkg_emit_extract_begin(pkg);
+		pkg_emit_progress_start(NULL);
+	}
+
+	pkg_extract_init(&ex, a, pkg, archive_path);
 
 	do {
 		snprintf(pathname, sizeof(pathname), "%s/%s",
@@ -105,7 +469,29 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 		);
 		strlcpy(rpath, pathname, sizeof(rpath));
 
-		if (lstat(pathname, &st) != -1 && !S_ISDIR(st.st_mode)) {
+		exists = (lstat(pathname, &st) != -1);
+		if (stage != NULL && archive_entry_filetype(ae) == AE_IFDIR) {
+			if (!exists && pkg_stage_add(stage,
+			    archive_entry_pathname(ae), pathname, NULL,
+			    false) != EPKG_OK) {
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+		} else if (stage != NULL) {
+			/* Put in place by pkg_add_staged() */
+			pkg_add_file_random_suffix(rpath, sizeof(rpath), 12);
+			if (pkg_stage_add(stage, archive_entry_pathname(ae),
+			    pathname, rpath, false) != EPKG_OK) {
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			link = archive_entry_hardlink(ae);
+			if (link != NULL) {
+				HASH_FIND_STR(stage->files, link, sf);
+				if (sf != NULL)
+					archive_entry_set_hardlink(ae, sf->tmp);
+			}
+		} else if (exists && !S_ISDIR(st.st_mode)) {
 			/*
 			 * We have an existing file on the path, so handle it
 			 */
@@ -115,7 +501,16 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 
 		archive_entry_set_pathname(ae, rpath);
 
-		ret = archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
+		ret = pkg_extract_file(&ex, a, ae,
+		    rpath + (location ? strlen(location) : 0));
+		if (ret == EPKG_FATAL) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (ret == EPKG_OK)
+			ret = ARCHIVE_OK;
+		else
+			ret = archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
 		if (ret != ARCHIVE_OK) {
 			/*
 			 * show error except when the failure is during
@@ -132,7 +527,9 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 				goto cleanup;
 			}
 		}
-		pkg_emit_progress_tick(cur_file++, nfiles);
+		if (progress)
+			pkg_emit_progress_tick(cur_file, nfiles);
+		cur_file++;
 
 		/*
 		 * if the file is a configuration file and the configuration
@@ -144,7 +541,18 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 		 */
 		if (is_conf_file(pathname, path, sizeof(path))
 		    && lstat(path, &st) == -1 && errno == ENOENT) {
-			archive_entry_set_pathname(ae, path);
+			if (stage != NULL) {
+				strlcpy(rpath, path, sizeof(rpath));
+				pkg_add_file_random_suffix(rpath, sizeof(rpath),
+				    12);
+				if (pkg_stage_add(stage, path, path, rpath,
+				    true) != EPKG_OK) {
+					retcode = EPKG_FATAL;
+					goto cleanup;
+				}
+				archive_entry_set_pathname(ae, rpath);
+			} else
+				archive_entry_set_pathname(ae, path);
 			ret = archive_read_extract(a,ae, EXTRACT_ARCHIVE_FLAGS);
 			if (ret != ARCHIVE_OK) {
 				pkg_emit_error("archive_read_extract(): %s",
@@ -171,9 +579,12 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 	}
 
 cleanup:
+	pkg_extract_finish(&ex);
 
-	pkg_emit_progress_tick(nfiles, nfiles);
-	pkg_emit_extract_finished(pkg);
+	if (progress) {
+		pkg_emit_progress_tick(nfiles, nfiles);
+		pkg_emit_extract_finished(pkg);
+	}
 
 	if (renamed && retcode == EPKG_FATAL)
 		unlink(rpath);
@@ -379,6 +790,46 @@ pkg_add_cleanup_old(struct pkg *old, struct pkg *new, int flags)
 	return (ret);
 }
 
+static void
+pkg_add_set_remote(struct pkg *pkg, struct pkg *remote, unsigned flags)
+{
+	const char *manifestdigest;
+	bool automatic;
+
+	if (remote->repo != NULL) {
+		/* Save reponame */
+		pkg_addannotation(pkg, "repository", remote->repo->name);
+		pkg_addannotation(pkg, "repo_type", remote->repo->ops->type);
+	}
+
+	pkg_get(remote, PKG_DIGEST, &manifestdigest, PKG_AUTOMATIC, &automatic);
+	pkg_set(pkg, PKG_DIGEST, manifestdigest);
+	/* only preserve flags is -A has not been passed */
+	if ((flags & PKG_ADD_AUTOMATIC) == 0)
+		pkg_set(pkg, PKG_AUTOMATIC, automatic);
+}
+
+static void
+pkg_add_post_install(struct pkg *pkg, unsigned flags)
+{
+	/*
+	 * Execute post install scripts
+	 */
+	if ((flags & PKG_ADD_NOSCRIPT) == 0) {
+		if ((flags & PKG_ADD_USE_UPGRADE_SCRIPTS) == PKG_ADD_USE_UPGRADE_SCRIPTS)
+			pkg_script_run(pkg, PKG_SCRIPT_POST_UPGRADE);
+		else
+			pkg_script_run(pkg, PKG_SCRIPT_POST_INSTALL);
+	}
+
+	/*
+	 * start the different related services if the users do want that
+	 * and that the service is running
+	 */
+	if (pkg_object_bool(pkg_config_get("HANDLE_RC_SCRIPTS")))
+		pkg_start_stop_rc_scripts(pkg, PKG_RC_START);
+}
+
 static int
 pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
     struct pkg_manifest_key *keys, const char *location, struct pkg *remote,
@@ -388,9 +839,7 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 	struct archive_entry *ae;
 	struct pkg	*pkg = NULL;
 	bool		 extract = true;
-	bool		 handle_rc = false;
 	bool		 disable_mtree;
-	bool		 automatic;
 	char		*mtree;
 	char		*prefix;
 	int		 retcode = EPKG_OK;
@@ -437,19 +886,7 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 		}
 	}
 	else {
-		const char *manifestdigest;
-
-		if (remote->repo != NULL) {
-			/* Save reponame */
-			pkg_addannotation(pkg, "repository", remote->repo->name);
-			pkg_addannotation(pkg, "repo_type", remote->repo->ops->type);
-		}
-
-		pkg_get(remote, PKG_DIGEST, &manifestdigest, PKG_AUTOMATIC, &automatic);
-		pkg_set(pkg, PKG_DIGEST, manifestdigest);
-		/* only preserve flags is -A has not been passed */
-		if ((flags & PKG_ADD_AUTOMATIC) == 0)
-			pkg_set(pkg, PKG_AUTOMATIC, automatic);
+		pkg_add_set_remote(pkg, remote, flags);
 	}
 
 	if (location != NULL)
@@ -498,31 +935,16 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 	/*
 	 * Extract the files on disk.
 	 */
-	if (extract && (retcode = do_extract(a, ae, location, nfiles, pkg)) != EPKG_OK) {
+	if (extract &&
+	    (retcode = do_extract(a, ae, location, nfiles, pkg, path, true,
+	    NULL)) != EPKG_OK) {
 		/* If the add failed, clean up (silently) */
 		pkg_delete_files(pkg, 2);
 		pkg_delete_dirs(db, pkg);
 		goto cleanup_reg;
 	}
 
-	/*
-	 * Execute post install scripts
-	 */
-	if ((flags & PKG_ADD_NOSCRIPT) == 0) {
-		if ((flags & PKG_ADD_USE_UPGRADE_SCRIPTS) == PKG_ADD_USE_UPGRADE_SCRIPTS)
-			pkg_script_run(pkg, PKG_SCRIPT_POST_UPGRADE);
-		else
-			pkg_script_run(pkg, PKG_SCRIPT_POST_INSTALL);
-	}
-
-	/*
-	 * start the different related services if the users do want that
-	 * and that the service is running
-	 */
-
-	handle_rc = pkg_object_bool(pkg_config_get("HANDLE_RC_SCRIPTS"));
-	if (handle_rc)
-		pkg_start_stop_rc_scripts(pkg, PKG_RC_START);
+	pkg_add_post_install(pkg, flags);
 
 	cleanup_reg:
 	if ((flags & PKG_ADD_UPGRADE) == 0)
@@ -567,3 +989,141 @@ pkg_add_upgrade(struct pkgdb *db, const char *path, unsigned flags,
 
 	return pkg_add_common(db, path, flags, keys, location, rp, lp);
 }
+
+/*
+ * Extract the files of a new package under temporary names, without
+ * touching the database: this is safe to call from a worker thread.  The
+ * package is then registered and its files put in place by
+ * pkg_add_staged(), or removed by pkg_add_staged_discard().
+ *
+ * The files of a package with a pre-install script must not show up before
+ * that script has run, so such packages are not extracted: EPKG_END is
+ * returned and they are left to pkg_add_from_remote().  On failure the
+ * partially extracted package, if any, is still returned in stage_p.
+ */
+int
+pkg_add_stage(const char *path, unsigned flags, struct pkg_manifest_key *keys,
+    struct pkg_stage **stage_p)
+{
+	struct archive	*a;
+	struct archive_entry *ae;
+	struct pkg	*pkg = NULL;
+	struct pkg_stage *stage;
+	char		*mtree;
+	char		*prefix;
+	bool		 extract = true;
+	int		 ret;
+
+	*stage_p = NULL;
+
+	ret = pkg_open2(&pkg, &a, &ae, path, keys, 0, -1);
+	if (ret == EPKG_END)
+		extract = false;
+	else if (ret != EPKG_OK)
+		return (ret);
+
+	if (pkg_is_valid(pkg) != EPKG_OK ||
+	    ((flags & (PKG_ADD_NOSCRIPT | PKG_ADD_USE_UPGRADE_SCRIPTS)) == 0 &&
+	    (pkg_script_get(pkg, PKG_SCRIPT_PRE_INSTALL) != NULL ||
+	    pkg_script_get(pkg, PKG_SCRIPT_INSTALL) != NULL))) {
+		pkg_free(pkg);
+		ret = EPKG_END;
+		goto cleanup;
+	}
+
+	if ((stage = calloc(1, sizeof(*stage))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_stage");
+		pkg_free(pkg);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	stage->pkg = pkg;
+	*stage_p = stage;
+
+	if (!pkg_object_bool(pkg_config_get("DISABLE_MTREE"))) {
+		pkg_get(pkg, PKG_PREFIX, &prefix, PKG_MTREE, &mtree);
+		if ((ret = do_extract_mtree(mtree, prefix)) != EPKG_OK)
+			goto cleanup;
+	}
+
+	if (extract)
+		ret = do_extract(a, ae, NULL, HASH_COUNT(pkg->files), pkg, path,
+		    false, stage);
+
+cleanup:
+	if (a != NULL) {
+		archive_read_close(a);
+		archive_read_free(a);
+	}
+
+	return (ret);
+}
+
+/*
+ * Register a package extracted by pkg_add_stage(), put its files in place
+ * and run its post-install scripts.  The stage is consumed.
+ */
+int
+pkg_add_staged(struct pkgdb *db, struct pkg_stage *stage, unsigned flags,
+    struct pkg *remote)
+{
+	struct pkg *pkg = stage->pkg;
+	int retcode;
+	int nfiles;
+
+	if (flags & PKG_ADD_AUTOMATIC)
+		pkg_set(pkg, PKG_AUTOMATIC, (bool)true);
+
+	pkg_add_set_remote(pkg, remote, flags);
+
+	retcode = pkgdb_register_pkg(db, pkg, flags & PKG_ADD_UPGRADE,
+	    flags & PKG_ADD_FORCE);
+	if (retcode != EPKG_OK) {
+		pkg_add_staged_discard(db, stage);
+		return (retcode);
+	}
+
+	nfiles = HASH_COUNT(pkg->files);
+	if (nfiles > 0) {
+		pkg_emit_extract_begin(pkg);
+		pkg_emit_progress_start(NULL);
+	}
+	retcode = pkg_stage_commit(stage);
+	if (nfiles > 0) {
+		pkg_emit_progress_tick(nfiles, nfiles);
+		pkg_emit_extract_finished(pkg);
+	}
+
+	if (retcode == EPKG_OK) {
+		pkg_add_post_install(pkg, flags);
+	} else {
+		/* As pkg_add_common(), clean up silently */
+		pkg_delete_files(pkg, 2);
+		pkg_delete_dirs(db, pkg);
+	}
+
+	if ((flags & PKG_ADD_UPGRADE) == 0) {
+		pkgdb_register_finale(db, retcode);
+		if (retcode == EPKG_OK)
+			pkg_emit_install_finished(pkg);
+	}
+
+	pkg_stage_free(stage, false);
+
+	return (retcode);
+}
+
+/*
+ * Remove the files of a package extracted by pkg_add_stage() which will
+ * not be registered.  Nothing has been put in place yet: only the
+ * temporary files and the directories created for the package go away.
+ * The stage is consumed.
+ */
+void
+pkg_add_staged_discard(__unused struct pkgdb *db, struct pkg_stage *stage)
+{
+	if (stage == NULL)
+		return;
+
+	pkg_stage_free(stage, true);
+}
@@ -51,10 +51,6 @@ pkg_dep_free(struct pkg_dep *d)
 	if (d == NULL)
 		return;
 
-	sbuf_free(d->origin);
-	sbuf_free(d->name);
-	sbuf_free(d->version);
-	free(d->uid);
 	free(d);
 }
 
@@ -65,13 +61,13 @@ pkg_dep_get(struct pkg_dep const * const d, const pkg_dep_attr attr)
 
 	switch (attr) {
 	case PKG_DEP_NAME:
-		return (sbuf_get(d->name));
+		return (d->name);
 		break;
 	case PKG_DEP_ORIGIN:
-		return (sbuf_get(d->origin));
+		return (d->origin);
 		break;
 	case PKG_DEP_VERSION:
-		return (sbuf_get(d->version));
+		return (d->version);
 		break;
 	default:
 		return (NULL);
@@ -91,24 +87,6 @@ pkg_dep_is_locked(struct pkg_dep const * const d)
  * File
  */
 
-int
-pkg_file_new(struct pkg_file **file)
-{
-	if ((*file = calloc(1, sizeof(struct pkg_file))) == NULL)
-		return (EPKG_FATAL);
-
-	(*file)->perm = 0;
-	(*file)->keep = 0;
-
-	return (EPKG_OK);
-}
-
-void
-pkg_file_free(struct pkg_file *file)
-{
-	free(file);
-}
-
 const char *
 pkg_file_get(struct pkg_file const * const f, const pkg_file_attr attr)
 {
@@ -379,7 +357,6 @@ pkg_shlib_free(struct pkg_shlib *sl)
 	if (sl == NULL)
 		return;
 
-	sbuf_free(sl->name);
 	free(sl);
 }
 
@@ -388,7 +365,7 @@ pkg_shlib_name(struct pkg_shlib const * const sl)
 {
 	assert(sl != NULL);
 
-	return (sbuf_get(sl->name));
+	return (sl->name);
 }
 
 /*
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -51,6 +52,7 @@
 #include "pkg.h"
 #include "private/pkg.h"
 #include "private/event.h"
+#include "private/utils.h"
 
 #define EQ 1
 #define LT 2
@@ -69,6 +71,7 @@ static const char* vop_names[] = {
 
 struct pkg_audit_version {
 	char *version;
+	struct pkg_version_key *key;
 	int type;
 };
 
@@ -104,6 +107,7 @@ struct pkg_audit_entry {
 	char *desc;
 	char *id;
 	bool ref;
+	struct pkg_audit_entry *vuln;	/* Entry a reference was expanded from */
 	struct pkg_audit_entry *next;
 };
 
@@ -141,27 +145,124 @@ struct pkg_audit_item {
 				   different prefix */
 };
 
+/*
+ * The compiled index.
+ *
+ * Parsing vuln.xml is by far the most expensive part of an audit, so once
+ * the entries are parsed and sorted they are laid out in a single flat,
+ * position independent buffer, which is written next to vuln.xml by
+ * pkg_audit_fetch() and mapped as is by the next pkg_audit_load().
+ *
+ * The buffer starts with a header followed by the sorted items, the
+ * vulnerabilities they point to, the version ranges, the CVE names and the
+ * data area.  Strings live in the data area, together with the pre-built
+ * version keys of the range bounds; both are referred to by their offset in
+ * the data area, 0 meaning none.  Package names and versions are interned.
+ * The index is only meaningful on the host that built it: it is
+ * invalidated by any change of the mtime or size of vuln.xml, and by a
+ * different version of pkg.
+ */
+#define PKG_AUDIT_INDEX_MAGIC		"PKGAUDX1"
+#define PKG_AUDIT_INDEX_BYTEORDER	0x01020304
+
+struct pkg_audit_index_hdr {
+	char	 magic[8];
+	uint32_t byteorder;
+	uint32_t longsize;
+	char	 pkgversion[32];
+	int64_t	 xml_mtime;
+	int64_t	 xml_size;
+	uint64_t size;
+	uint64_t items;
+	uint64_t vulns;
+	uint64_t ranges;
+	uint64_t cves;
+	uint64_t data;
+	uint32_t nitems;
+	uint32_t nvulns;
+	uint32_t nranges;
+	uint32_t ncves;
+	/*
+	 * first_byte_idx[ch] is the index of the first item whose
+	 * non-globbing prefix starts with the character 'ch': it allows
+	 * to skip the items which are not relevant for a package name.
+	 */
+	uint32_t first_byte_idx[256];
+};
+
+struct pkg_audit_index_version {
+	uint32_t version;
+	uint32_t key;
+	uint32_t type;
+};
+
+struct pkg_audit_index_range {
+	struct pkg_audit_index_version v1;
+	struct pkg_audit_index_version v2;
+};
+
+struct pkg_audit_index_vuln {
+	uint32_t id;
+	uint32_t desc;
+	uint32_t url;
+	uint32_t cves;
+	uint32_t ncves;
+};
+
+struct pkg_audit_index_item {
+	uint32_t pkgname;
+	uint32_t noglob_len;
+	uint32_t next_pfx_incr;
+	uint32_t vuln;
+	uint32_t ranges;
+	uint32_t nranges;
+};
+
+/*
+ * Nothing in there is modified once pkg_audit_process() has returned, so
+ * that a processed structure can be shared by concurrent audits.
+ */
 struct pkg_audit {
 	struct pkg_audit_entry *entries;
-	struct pkg_audit_item *items;
 	bool parsed;
 	bool loaded;
 	void *map;
 	size_t len;
+	char *index;
+	size_t index_len;
+	bool index_mapped;
+	struct pkg_audit_names *names;
 };
 
-
 /*
- * Another small optimization to skip the beginning of the
- * VuXML entry array, if possible.
- *
- * audit_entry_first_byte_idx[ch] represents the index
- * of the first VuXML entry in the sorted array that has
- * its non-globbing prefix that is started with the character
- * 'ch'.  It allows to skip entries from the beginning of the
- * VuXML array that aren't relevant for the checked port name.
+ * For pkg_audit_check_it(), the items are split between the exact names,
+ * in the order of the index, and the globs, grouped by their non-globbing
+ * prefix.
  */
-static size_t audit_entry_first_byte_idx[256];
+struct pkg_audit_glob {
+	const char *prefix;
+	uint32_t *items;
+	uint32_t nitems;
+	UT_hash_handle hh;
+};
+
+struct pkg_audit_names {
+	uint32_t *exact;
+	uint32_t nexact;
+	struct pkg_audit_glob *globs;
+};
+
+#define AUDIT_HDR(audit)	((const struct pkg_audit_index_hdr *)(audit)->index)
+#define AUDIT_ITEMS(audit)	((const struct pkg_audit_index_item *) \
+	((audit)->index + AUDIT_HDR(audit)->items))
+#define AUDIT_VULNS(audit)	((const struct pkg_audit_index_vuln *) \
+	((audit)->index + AUDIT_HDR(audit)->vulns))
+#define AUDIT_RANGES(audit)	((const struct pkg_audit_index_range *) \
+	((audit)->index + AUDIT_HDR(audit)->ranges))
+#define AUDIT_CVES(audit)	((const uint32_t *) \
+	((audit)->index + AUDIT_HDR(audit)->cves))
+#define AUDIT_DATA(audit, off)	((audit)->index + AUDIT_HDR(audit)->data + (off))
+#define AUDIT_STR(audit, off)	((off) == 0 ? NULL : AUDIT_DATA(audit, off))
 
 static void
 pkg_audit_free_entry(struct pkg_audit_entry *e)
@@ -176,9 +277,11 @@ pkg_audit_free_entry(struct pkg_audit_entry *e)
 			LL_FOREACH_SAFE(ppkg->versions, vers, vers_tmp) {
 				if (vers->v1.version) {
 					free(vers->v1.version);
+					pkg_version_key_free(vers->v1.key);
 				}
 				if (vers->v2.version) {
 					free(vers->v2.version);
+					pkg_version_key_free(vers->v2.key);
 				}
 				free(vers);
 			}
@@ -259,6 +362,65 @@ pkg_audit_sandboxed_extract(int fd, void *ud)
 	return (rc);
 }
 
+static int pkg_audit_sandboxed_compile(int fd, void *ud);
+static int pkg_audit_map(struct pkg_audit *audit, int fd,
+    const struct stat *st);
+static int pkg_audit_index_load(struct pkg_audit *audit, const char *fname,
+    const struct stat *xml_st);
+
+struct pkg_audit_compile_cbdata {
+	int out;
+	const char *dest;
+	struct stat st;
+};
+
+/*
+ * (Re)build the index of dest if it is missing or stale.  The index is
+ * only a cache: failing to build it is not an error.
+ */
+static void
+pkg_audit_index_update(const char *dest)
+{
+	struct pkg_audit_compile_cbdata cbdata;
+	struct pkg_audit *audit;
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	int fd, outfd;
+
+	if (stat(dest, &cbdata.st) == -1)
+		return;
+
+	audit = pkg_audit_new();
+	if (audit == NULL)
+		return;
+	if (pkg_audit_index_load(audit, dest, &cbdata.st) == EPKG_OK) {
+		pkg_audit_free(audit);
+		return;
+	}
+	pkg_audit_free(audit);
+
+	if ((fd = open(dest, O_RDONLY)) == -1)
+		return;
+
+	snprintf(path, sizeof(path), "%s.idx", dest);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXXXX", path);
+	if ((outfd = mkstemp(tmp)) == -1) {
+		close(fd);
+		return;
+	}
+
+	cbdata.out = outfd;
+	cbdata.dest = dest;
+
+	if (pkg_emit_sandbox_call(pkg_audit_sandboxed_compile, fd,
+	    &cbdata) != EPKG_OK ||
+	    fchmod(outfd, S_IRUSR|S_IRGRP|S_IROTH) == -1 ||
+	    rename(tmp, path) == -1)
+		unlink(tmp);
+
+	close(outfd);
+	close(fd);
+}
+
 int
 pkg_audit_fetch(const char *src, const char *dest)
 {
@@ -285,6 +447,7 @@ pkg_audit_fetch(const char *src, const char *dest)
 		break;
 	case EPKG_UPTODATE:
 		pkg_emit_notice("vulnxml file up-to-date");
+		pkg_audit_index_update(dest);
 		retcode = EPKG_OK;
 		goto cleanup;
 	default:
@@ -312,6 +475,11 @@ pkg_audit_fetch(const char *src, const char *dest)
 
 	/* Call sandboxed */
 	retcode = pkg_emit_sandbox_call(pkg_audit_sandboxed_extract, fd, &cbdata);
+	close(outfd);
+	outfd = -1;
+
+	if (retcode == EPKG_OK)
+		pkg_audit_index_update(dest);
 
 cleanup:
 	unlink(tmp);
@@ -348,6 +516,7 @@ pkg_audit_expand_entry(struct pkg_audit_entry *entry, struct pkg_audit_entry **h
 			n->pkgname = ncur->pkgname;
 			/* Set new entry as reference entry */
 			n->ref = true;
+			n->vuln = entry;
 			n->cve = entry->cve;
 			n->desc = entry->desc;
 			n->versions = pcur->versions;
@@ -543,10 +712,12 @@ vulnxml_handle_data(void *data, const char *content, int length)
 		vers = ud->cur_entry->packages->versions;
 		if (ud->range_num == 1) {
 			vers->v1.version = strndup(content, length);
+			vers->v1.key = pkg_version_key_new(vers->v1.version);
 			vers->v1.type = range_type;
 		}
 		else if (ud->range_num == 2) {
 			vers->v2.version = strndup(content, length);
+			vers->v2.key = pkg_version_key_new(vers->v2.version);
 			vers->v2.type = range_type;
 		}
 	}
@@ -683,31 +854,472 @@ pkg_audit_preprocess(struct pkg_audit_entry *h)
 		}
 	}
 
+	return (ret);
+}
+
+struct pkg_audit_buf {
+	char	*data;
+	size_t	 len;
+	size_t	 cap;
+};
+
+struct pkg_audit_istr {
+	const char *str;
+	uint32_t off;
+	uint32_t key;
+	UT_hash_handle hh;
+};
+
+/* Vulnerabilities and version ranges already compiled, by address */
+struct pkg_audit_iptr {
+	const void *ptr;
+	uint32_t idx;
+	uint32_t n;
+	UT_hash_handle hh;
+};
+
+/*
+ * Append len bytes at the given alignment and return their offset.  When
+ * p is NULL the space is zeroed.
+ */
+static uint32_t
+pkg_audit_buf_add(struct pkg_audit_buf *b, const void *p, size_t len,
+    size_t align)
+{
+	size_t off;
+
+	off = (b->len + align - 1) & ~(align - 1);
+	if (off + len > b->cap) {
+		while (off + len > b->cap)
+			b->cap = b->cap == 0 ? 4096 : b->cap * 2;
+		b->data = realloc(b->data, b->cap);
+		if (b->data == NULL)
+			err(1, "realloc(audit_index)");
+	}
+	memset(b->data + b->len, 0, off - b->len);
+	if (p != NULL)
+		memcpy(b->data + off, p, len);
+	else
+		memset(b->data + off, 0, len);
+	b->len = off + len;
+
+	return (off);
+}
+
+static uint32_t
+pkg_audit_buf_str(struct pkg_audit_buf *b, const char *str)
+{
+	if (str == NULL)
+		return (0);
+
+	return (pkg_audit_buf_add(b, str, strlen(str) + 1, 1));
+}
+
+static struct pkg_audit_istr *
+pkg_audit_intern(struct pkg_audit_istr **strs, struct pkg_audit_buf *data,
+    const char *str)
+{
+	struct pkg_audit_istr *s;
+
+	if (str == NULL)
+		return (NULL);
+
+	HASH_FIND_STR(*strs, str, s);
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL)
+			err(1, "calloc(audit_istr)");
+		s->str = str;
+		s->off = pkg_audit_buf_str(data, str);
+		HASH_ADD_KEYPTR(hh, *strs, s->str, strlen(s->str), s);
+	}
+
+	return (s);
+}
+
+static struct pkg_audit_iptr *
+pkg_audit_iptr_add(struct pkg_audit_iptr **head, const void *ptr,
+    uint32_t idx)
+{
+	struct pkg_audit_iptr *p;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		err(1, "calloc(audit_iptr)");
+	p->ptr = ptr;
+	p->idx = idx;
+	HASH_ADD_PTR(*head, ptr, p);
+
+	return (p);
+}
+
+static void
+pkg_audit_intern_version(struct pkg_audit_istr **strs,
+    struct pkg_audit_buf *data, struct pkg_audit_version *v,
+    struct pkg_audit_index_version *iv)
+{
+	struct pkg_audit_istr *s;
+
+	iv->type = v->type;
+	if ((s = pkg_audit_intern(strs, data, v->version)) == NULL)
+		return;
+
+	if (s->key == 0 && v->key != NULL)
+		s->key = pkg_audit_buf_add(data, v->key,
+		    pkg_version_key_size(v->key), sizeof(uint64_t));
+	iv->version = s->off;
+	iv->key = s->key;
+}
+
+/*
+ * Compile the parsed entries into the index, dropping the entries.
+ */
+static void
+pkg_audit_index_build(struct pkg_audit *audit, const struct stat *st)
+{
+	struct pkg_audit_buf out, items, vulns, ranges, cves, data;
+	struct pkg_audit_index_hdr hdr;
+	struct pkg_audit_index_item item;
+	struct pkg_audit_index_vuln vuln;
+	struct pkg_audit_index_range range;
+	struct pkg_audit_istr *strs = NULL;
+	struct pkg_audit_iptr *vulnptrs = NULL, *rangeptrs = NULL, *p;
+	struct pkg_audit_item *sorted;
+	struct pkg_audit_entry *e;
+	struct pkg_audit_versions_range *vers;
+	struct pkg_audit_cve *cve;
+	uint32_t off;
+	size_t i, n;
+	int c;
+
+	memset(&out, 0, sizeof(out));
+	memset(&items, 0, sizeof(items));
+	memset(&vulns, 0, sizeof(vulns));
+	memset(&ranges, 0, sizeof(ranges));
+	memset(&cves, 0, sizeof(cves));
+	memset(&data, 0, sizeof(data));
+	memset(&hdr, 0, sizeof(hdr));
+
+	sorted = pkg_audit_preprocess(audit->entries);
+
+	/* Offset 0 of the data area stands for "none" */
+	pkg_audit_buf_add(&data, NULL, sizeof(uint64_t), sizeof(uint64_t));
+
+	for (n = 0; (e = sorted[n].e) != NULL; n++) {
+		memset(&item, 0, sizeof(item));
+		item.pkgname = pkg_audit_intern(&strs, &data, e->pkgname)->off;
+		item.noglob_len = sorted[n].noglob_len;
+		item.next_pfx_incr = sorted[n].next_pfx_incr;
+
+		/* All the names of a vulnerability share its description */
+		HASH_FIND_PTR(vulnptrs, &e->vuln, p);
+		if (p == NULL) {
+			p = pkg_audit_iptr_add(&vulnptrs, e->vuln, hdr.nvulns++);
+			memset(&vuln, 0, sizeof(vuln));
+			vuln.id = pkg_audit_buf_str(&data, e->id);
+			vuln.desc = pkg_audit_buf_str(&data, e->desc);
+			vuln.url = pkg_audit_buf_str(&data, e->url);
+			vuln.cves = hdr.ncves;
+			LL_FOREACH(e->cve, cve) {
+				if (cve->cvename == NULL)
+					continue;
+				off = pkg_audit_buf_str(&data, cve->cvename);
+				pkg_audit_buf_add(&cves, &off, sizeof(off),
+				    sizeof(uint32_t));
+				vuln.ncves++;
+			}
+			hdr.ncves += vuln.ncves;
+			pkg_audit_buf_add(&vulns, &vuln, sizeof(vuln),
+			    sizeof(uint32_t));
+		}
+		item.vuln = p->idx;
+
+		/* And all the names of a package its version ranges */
+		HASH_FIND_PTR(rangeptrs, &e->versions, p);
+		if (p == NULL) {
+			p = pkg_audit_iptr_add(&rangeptrs, e->versions,
+			    hdr.nranges);
+			LL_FOREACH(e->versions, vers) {
+				memset(&range, 0, sizeof(range));
+				pkg_audit_intern_version(&strs, &data,
+				    &vers->v1, &range.v1);
+				pkg_audit_intern_version(&strs, &data,
+				    &vers->v2, &range.v2);
+				pkg_audit_buf_add(&ranges, &range,
+				    sizeof(range), sizeof(uint32_t));
+				p->n++;
+			}
+			hdr.nranges += p->n;
+		}
+		item.ranges = p->idx;
+		item.nranges = p->n;
+
+		pkg_audit_buf_add(&items, &item, sizeof(item),
+		    sizeof(uint32_t));
+	}
+	hdr.nitems = n;
+
 	/* Calculate jump indexes for the first byte of the package name */
-	bzero(audit_entry_first_byte_idx, sizeof(audit_entry_first_byte_idx));
-	for (n = 1, i = 0; n < 256; n++) {
-		while (ret[i].e != NULL &&
-		    (size_t)(ret[i].e->pkgname[0]) < n)
+	for (c = 1, i = 0; c < 256; c++) {
+		while (i < n && (unsigned char)sorted[i].e->pkgname[0] < c)
 			i++;
-		audit_entry_first_byte_idx[n] = i;
+		hdr.first_byte_idx[c] = i;
 	}
 
-	return (ret);
+	memcpy(hdr.magic, PKG_AUDIT_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.byteorder = PKG_AUDIT_INDEX_BYTEORDER;
+	hdr.longsize = sizeof(long);
+	strlcpy(hdr.pkgversion, PKGVERSION, sizeof(hdr.pkgversion));
+	hdr.xml_mtime = st->st_mtime;
+	hdr.xml_size = st->st_size;
+
+	pkg_audit_buf_add(&out, NULL, sizeof(hdr), sizeof(uint64_t));
+	hdr.items = pkg_audit_buf_add(&out, items.data, items.len,
+	    sizeof(uint64_t));
+	hdr.vulns = pkg_audit_buf_add(&out, vulns.data, vulns.len,
+	    sizeof(uint64_t));
+	hdr.ranges = pkg_audit_buf_add(&out, ranges.data, ranges.len,
+	    sizeof(uint64_t));
+	hdr.cves = pkg_audit_buf_add(&out, cves.data, cves.len,
+	    sizeof(uint64_t));
+	hdr.data = pkg_audit_buf_add(&out, data.data, data.len,
+	    sizeof(uint64_t));
+	hdr.size = out.len;
+	memcpy(out.data, &hdr, sizeof(hdr));
+
+	audit->index = out.data;
+	audit->index_len = out.len;
+	audit->index_mapped = false;
+
+	HASH_FREE(strs, free);
+	HASH_FREE(vulnptrs, free);
+	HASH_FREE(rangeptrs, free);
+	free(items.data);
+	free(vulns.data);
+	free(ranges.data);
+	free(cves.data);
+	free(data.data);
+	free(sorted);
+	pkg_audit_free_list(audit->entries);
+	audit->entries = NULL;
 }
 
+/*
+ * Whether off is a string of the data area, or 0 if optional.
+ */
 static bool
-pkg_audit_version_match(const char *pkgversion, struct pkg_audit_version *v)
+pkg_audit_index_str_valid(const char *data, size_t datalen, uint32_t off,
+    bool optional)
+{
+	if (off == 0)
+		return (optional);
+
+	return (off < datalen && memchr(data + off, '\0', datalen - off) != NULL);
+}
+
+static bool
+pkg_audit_index_version_valid(const char *data, size_t datalen,
+    const struct pkg_audit_index_version *v)
+{
+	if (v->type > GTE ||
+	    !pkg_audit_index_str_valid(data, datalen, v->version, true))
+		return (false);
+
+	if (v->key == 0)
+		return (true);
+
+	return (v->key < datalen && v->key % sizeof(uint64_t) == 0 &&
+	    pkg_version_key_valid(data + v->key, datalen - v->key));
+}
+
+/*
+ * Check that a mapped index is sane and matches vuln.xml.  The index is
+ * used without any further check, so every offset and count in it is
+ * checked here: a damaged file is rebuilt instead of crashing the audit.
+ */
+static bool
+pkg_audit_index_valid(const char *index, size_t len, const struct stat *st)
+{
+	const struct pkg_audit_index_hdr *hdr;
+	const struct pkg_audit_index_item *items;
+	const struct pkg_audit_index_vuln *vulns;
+	const struct pkg_audit_index_range *ranges;
+	const uint32_t *cves;
+	const char *data;
+	size_t datalen;
+	uint32_t i;
+	int c;
+
+	if (len < sizeof(*hdr))
+		return (false);
+
+	hdr = (const struct pkg_audit_index_hdr *)index;
+	if (memcmp(hdr->magic, PKG_AUDIT_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->byteorder != PKG_AUDIT_INDEX_BYTEORDER ||
+	    hdr->longsize != sizeof(long) ||
+	    strncmp(hdr->pkgversion, PKGVERSION, sizeof(hdr->pkgversion)) != 0)
+		return (false);
+
+	if (hdr->xml_mtime != st->st_mtime || hdr->xml_size != st->st_size)
+		return (false);
+
+	if (hdr->size != len ||
+	    hdr->items > len || hdr->items % sizeof(uint64_t) != 0 ||
+	    hdr->nitems > (len - hdr->items) /
+	    sizeof(struct pkg_audit_index_item) ||
+	    hdr->vulns > len || hdr->vulns % sizeof(uint64_t) != 0 ||
+	    hdr->nvulns > (len - hdr->vulns) /
+	    sizeof(struct pkg_audit_index_vuln) ||
+	    hdr->ranges > len || hdr->ranges % sizeof(uint64_t) != 0 ||
+	    hdr->nranges > (len - hdr->ranges) /
+	    sizeof(struct pkg_audit_index_range) ||
+	    hdr->cves > len || hdr->cves % sizeof(uint64_t) != 0 ||
+	    hdr->ncves > (len - hdr->cves) / sizeof(uint32_t) ||
+	    hdr->data > len || hdr->data % sizeof(uint64_t) != 0)
+		return (false);
+
+	items = (const struct pkg_audit_index_item *)(index + hdr->items);
+	vulns = (const struct pkg_audit_index_vuln *)(index + hdr->vulns);
+	ranges = (const struct pkg_audit_index_range *)(index + hdr->ranges);
+	cves = (const uint32_t *)(index + hdr->cves);
+	data = index + hdr->data;
+	datalen = len - hdr->data;
+
+	for (c = 0; c < 256; c++)
+		if (hdr->first_byte_idx[c] > hdr->nitems)
+			return (false);
+
+	for (i = 0; i < hdr->nitems; i++) {
+		if (!pkg_audit_index_str_valid(data, datalen, items[i].pkgname,
+		    false) ||
+		    items[i].noglob_len > strlen(data + items[i].pkgname) ||
+		    items[i].next_pfx_incr == 0 ||
+		    items[i].next_pfx_incr > hdr->nitems - i ||
+		    items[i].vuln >= hdr->nvulns ||
+		    items[i].ranges > hdr->nranges ||
+		    items[i].nranges > hdr->nranges - items[i].ranges)
+			return (false);
+	}
+
+	for (i = 0; i < hdr->nvulns; i++) {
+		if (!pkg_audit_index_str_valid(data, datalen, vulns[i].id,
+		    true) ||
+		    !pkg_audit_index_str_valid(data, datalen, vulns[i].desc,
+		    true) ||
+		    !pkg_audit_index_str_valid(data, datalen, vulns[i].url,
+		    true) ||
+		    vulns[i].cves > hdr->ncves ||
+		    vulns[i].ncves > hdr->ncves - vulns[i].cves)
+			return (false);
+	}
+
+	for (i = 0; i < hdr->ncves; i++)
+		if (!pkg_audit_index_str_valid(data, datalen, cves[i], false))
+			return (false);
+
+	for (i = 0; i < hdr->nranges; i++) {
+		if (!pkg_audit_index_version_valid(data, datalen,
+		    &ranges[i].v1) ||
+		    !pkg_audit_index_version_valid(data, datalen,
+		    &ranges[i].v2))
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Map the index of fname, if there is an up-to-date one.
+ */
+static int
+pkg_audit_index_load(struct pkg_audit *audit, const char *fname,
+    const struct stat *xml_st)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	void *mem;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.idx", fname);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (EPKG_FATAL);
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return (EPKG_FATAL);
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return (EPKG_FATAL);
+
+	if (!pkg_audit_index_valid(mem, st.st_size, xml_st)) {
+		pkg_debug(1, "audit: ignoring stale or damaged index %s", path);
+		munmap(mem, st.st_size);
+		return (EPKG_FATAL);
+	}
+
+	audit->index = mem;
+	audit->index_len = st.st_size;
+	audit->index_mapped = true;
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_audit_sandboxed_compile(int fd, void *ud)
 {
+	struct pkg_audit_compile_cbdata *cbdata = ud;
+	struct pkg_audit *audit;
+	const char *p;
+	size_t len;
+	ssize_t w;
+	int rc = EPKG_FATAL;
+
+	audit = pkg_audit_new();
+	if (audit == NULL)
+		return (EPKG_FATAL);
+
+	if (pkg_audit_map(audit, fd, &cbdata->st) != EPKG_OK ||
+	    pkg_audit_parse_vulnxml(audit) != EPKG_OK)
+		goto cleanup;
+
+	pkg_audit_index_build(audit, &cbdata->st);
+
+	for (p = audit->index, len = audit->index_len; len > 0;
+	    p += w, len -= w) {
+		if ((w = write(cbdata->out, p, len)) == -1) {
+			pkg_emit_errno("write", cbdata->dest);
+			goto cleanup;
+		}
+	}
+	rc = EPKG_OK;
+
+cleanup:
+	pkg_audit_free(audit);
+
+	return (rc);
+}
+
+static bool
+pkg_audit_version_match(struct pkg_audit *audit,
+    const struct pkg_version_key *pkgversion,
+    const struct pkg_audit_index_version *v)
+{
+	const struct pkg_version_key *key;
 	bool res = false;
 
 	/*
 	 * Return true so it is easier for the caller to handle case where there is
 	 * only one version to match: the missing one will always match.
 	 */
-	if (v->version == NULL)
+	key = (const struct pkg_version_key *)AUDIT_STR(audit, v->key);
+	if (key == NULL)
 		return (true);
 
-	switch (pkg_version_cmp(pkgversion, v->version)) {
+	switch (pkg_version_key_cmp(pkgversion, key)) {
 	case -1:
 		if (v->type == LT || v->type == LTE)
 			res = true;
@@ -725,31 +1337,41 @@ pkg_audit_version_match(const char *pkgversion, struct pkg_audit_version *v)
 }
 
 static void
-pkg_audit_print_versions(struct pkg_audit_entry *e, struct sbuf *sb)
+pkg_audit_print_versions(struct pkg_audit *audit,
+    const struct pkg_audit_index_item *e, struct sbuf *sb)
 {
-	struct pkg_audit_versions_range *vers;
+	const struct pkg_audit_index_range *vers;
+	uint32_t i;
 
 	sbuf_cat(sb, "Affected versions:\n");
-	LL_FOREACH(e->versions, vers) {
+	for (i = 0; i < e->nranges; i++) {
+		vers = &AUDIT_RANGES(audit)[e->ranges + i];
 		if (vers->v1.type > 0 && vers->v2.type > 0)
 			sbuf_printf(sb, "%s %s : %s %s\n",
-				vop_names[vers->v1.type], vers->v1.version,
-				vop_names[vers->v2.type], vers->v2.version);
+				vop_names[vers->v1.type],
+				AUDIT_STR(audit, vers->v1.version),
+				vop_names[vers->v2.type],
+				AUDIT_STR(audit, vers->v2.version));
 		else if (vers->v1.type > 0)
 			sbuf_printf(sb, "%s %s\n",
-				vop_names[vers->v1.type], vers->v1.version);
+				vop_names[vers->v1.type],
+				AUDIT_STR(audit, vers->v1.version));
 		else
 			sbuf_printf(sb, "%s %s\n",
-				vop_names[vers->v2.type], vers->v2.version);
+				vop_names[vers->v2.type],
+				AUDIT_STR(audit, vers->v2.version));
 	}
 }
 
 static void
-pkg_audit_print_entry(struct pkg_audit_entry *e, struct sbuf *sb,
-	const char *pkgname, const char *pkgversion, bool quiet)
+pkg_audit_print_entry(struct pkg_audit *audit,
+    const struct pkg_audit_index_item *e, struct sbuf *sb,
+    const char *pkgname, const char *pkgversion, bool quiet)
 {
-	struct pkg_audit_cve *cve;
+	const struct pkg_audit_index_vuln *v;
+	uint32_t i;
 
+	v = &AUDIT_VULNS(audit)[e->vuln];
 	if (quiet) {
 		if (pkgversion != NULL)
 			sbuf_printf(sb, "%s-%s\n", pkgname, pkgversion);
@@ -761,38 +1383,58 @@ pkg_audit_print_entry(struct pkg_audit_entry *e, struct sbuf *sb,
 			sbuf_printf(sb, "%s-%s is vulnerable:\n", pkgname, pkgversion);
 		else {
 			sbuf_printf(sb, "%s is vulnerable:\n", pkgname);
-			pkg_audit_print_versions(e, sb);
+			pkg_audit_print_versions(audit, e, sb);
 		}
 
-		sbuf_printf(sb, "%s\n", e->desc);
+		sbuf_printf(sb, "%s\n", AUDIT_STR(audit, v->desc));
 		/* XXX: for vulnxml we should use more clever approach indeed */
-		if (e->cve) {
-			cve = e->cve;
-			while (cve) {
-				sbuf_printf(sb, "CVE: %s\n", cve->cvename);
-				cve = cve->next;
-			}
-		}
-		if (e->url)
-			sbuf_printf(sb, "WWW: %s\n\n", e->url);
-		else if (e->id)
+		for (i = 0; i < v->ncves; i++)
+			sbuf_printf(sb, "CVE: %s\n",
+			    AUDIT_DATA(audit, AUDIT_CVES(audit)[v->cves + i]));
+		if (v->url)
+			sbuf_printf(sb, "WWW: %s\n\n", AUDIT_DATA(audit, v->url));
+		else if (v->id)
 			sbuf_printf(sb,
 				"WWW: http://portaudit.FreeBSD.org/%s.html\n\n",
-				e->id);
+				AUDIT_DATA(audit, v->id));
+	}
+}
+
+/*
+ * Whether the version of a package is in one of the ranges of an item.  A
+ * package without version is assumed to be affected.
+ */
+static bool
+pkg_audit_item_match(struct pkg_audit *audit,
+    const struct pkg_audit_index_item *e, const struct pkg_version_key *pkgkey)
+{
+	const struct pkg_audit_index_range *vers;
+	uint32_t r;
+
+	if (pkgkey == NULL)
+		return (true);
+
+	for (r = 0; r < e->nranges; r++) {
+		vers = &AUDIT_RANGES(audit)[e->ranges + r];
+		if (pkg_audit_version_match(audit, pkgkey, &vers->v1) &&
+		    pkg_audit_version_match(audit, pkgkey, &vers->v2))
+			return (true);
 	}
+
+	return (false);
 }
 
 bool
 pkg_audit_is_vulnerable(struct pkg_audit *audit, struct pkg *pkg,
 		bool quiet, struct sbuf **result)
 {
-	struct pkg_audit_entry *e;
-	struct pkg_audit_versions_range *vers;
+	const struct pkg_audit_index_item *items, *a, *e;
 	const char *pkgname;
 	const char *pkgversion;
+	const struct pkg_version_key *pkgkey;
 	struct sbuf *sb;
-	struct pkg_audit_item *a;
-	bool res = false, res1, res2;
+	uint32_t idx, nitems;
+	bool res = false;
 
 	if (!audit->parsed)
 		return false;
@@ -801,49 +1443,39 @@ pkg_audit_is_vulnerable(struct pkg_audit *audit, struct pkg *pkg,
 		PKG_NAME, &pkgname,
 		PKG_VERSION, &pkgversion
 	);
+	pkgkey = pkg_version_key_get(pkg);
 
-	a = audit->items;
-	a += audit_entry_first_byte_idx[(size_t)pkgname[0]];
+	items = AUDIT_ITEMS(audit);
+	nitems = AUDIT_HDR(audit)->nitems;
+	idx = AUDIT_HDR(audit)->first_byte_idx[(unsigned char)pkgname[0]];
 	sb = sbuf_new_auto();
 
-	for (; (e = a->e) != NULL; a += a->next_pfx_incr) {
+	for (; idx < nitems; idx += a->next_pfx_incr) {
 		int cmp;
 		size_t i;
 
+		a = &items[idx];
 		/*
 		 * Audit entries are sorted, so if we had found one
 		 * that is lexicographically greater than our name,
 		 * it and the rest won't match our name.
 		 */
-		cmp = strncmp(pkgname, e->pkgname, a->noglob_len);
+		cmp = strncmp(pkgname, AUDIT_DATA(audit, a->pkgname),
+		    a->noglob_len);
 		if (cmp > 0)
 			continue;
 		else if (cmp < 0)
 			break;
 
 		for (i = 0; i < a->next_pfx_incr; i++) {
-			e = a[i].e;
-			if (fnmatch(e->pkgname, pkgname, 0) != 0)
+			e = &a[i];
+			if (fnmatch(AUDIT_DATA(audit, e->pkgname), pkgname, 0) != 0)
 				continue;
 
-			if (pkgversion == NULL) {
-				/*
-				 * Assume that all versions should be checked
-				 */
+			if (pkg_audit_item_match(audit, e, pkgkey)) {
 				res = true;
-				pkg_audit_print_entry(e, sb, pkgname, NULL, quiet);
-			}
-			else {
-				LL_FOREACH(e->versions, vers) {
-					res1 = pkg_audit_version_match(pkgversion, &vers->v1);
-					res2 = pkg_audit_version_match(pkgversion, &vers->v2);
-
-					if (res1 && res2) {
-						res = true;
-						pkg_audit_print_entry(e, sb, pkgname, pkgversion, quiet);
-						break;
-					}
-				}
+				pkg_audit_print_entry(audit, e, sb, pkgname,
+				    pkgkey != NULL ? pkgversion : NULL, quiet);
 			}
 
 			if (res && quiet)
@@ -863,6 +1495,335 @@ out:
 	return (res);
 }
 
+static void
+pkg_audit_glob_free(struct pkg_audit_glob *g)
+{
+	free(g->items);
+	free(g);
+}
+
+static void
+pkg_audit_names_free(struct pkg_audit_names *names)
+{
+	if (names == NULL)
+		return;
+
+	HASH_FREE(names->globs, pkg_audit_glob_free);
+	free(names->exact);
+	free(names);
+}
+
+static struct pkg_audit_names *
+pkg_audit_names_build(struct pkg_audit *audit)
+{
+	const struct pkg_audit_index_item *items;
+	struct pkg_audit_names *names;
+	struct pkg_audit_glob *g;
+	const char *name;
+	uint32_t i, nitems;
+
+	items = AUDIT_ITEMS(audit);
+	nitems = AUDIT_HDR(audit)->nitems;
+
+	names = calloc(1, sizeof(*names));
+	if (names == NULL)
+		err(1, "calloc(audit_names)");
+	names->exact = calloc(nitems + 1, sizeof(uint32_t));
+	if (names->exact == NULL)
+		err(1, "calloc(audit_names)");
+
+	for (i = 0; i < nitems; i++) {
+		name = AUDIT_DATA(audit, items[i].pkgname);
+		if (name[items[i].noglob_len] == '\0') {
+			names->exact[names->nexact++] = i;
+			continue;
+		}
+
+		HASH_FIND(hh, names->globs, name, items[i].noglob_len, g);
+		if (g == NULL) {
+			g = calloc(1, sizeof(*g));
+			if (g == NULL)
+				err(1, "calloc(audit_glob)");
+			g->prefix = name;
+			HASH_ADD_KEYPTR(hh, names->globs, g->prefix,
+			    items[i].noglob_len, g);
+		}
+		g->items = realloc(g->items,
+		    (g->nitems + 1) * sizeof(uint32_t));
+		if (g->items == NULL)
+			err(1, "realloc(audit_glob)");
+		g->items[g->nitems++] = i;
+	}
+
+	return (names);
+}
+
+static void
+pkg_audit_issue_free(struct pkg_audit_issue *issue)
+{
+	free(issue->cves);
+	free(issue);
+}
+
+void
+pkg_audit_result_free(struct pkg_audit_result *results)
+{
+	struct pkg_audit_result *r, *rtmp;
+	struct pkg_audit_issue *issue, *itmp;
+
+	LL_FOREACH_SAFE(results, r, rtmp) {
+		LL_FOREACH_SAFE(r->issues, issue, itmp)
+			pkg_audit_issue_free(issue);
+		pkg_free(r->pkg);
+		free(r);
+	}
+}
+
+/*
+ * Record that the package of result is affected by an item, unless
+ * the vulnerability is already known for that package.
+ */
+static void
+pkg_audit_add_issue(struct pkg_audit *audit, struct pkg_audit_result *result,
+    const struct pkg_audit_index_item *e)
+{
+	const struct pkg_audit_index_vuln *v;
+	struct pkg_audit_issue *issue;
+	uint32_t i;
+
+	v = &AUDIT_VULNS(audit)[e->vuln];
+	LL_FOREACH(result->issues, issue) {
+		if (issue->id == AUDIT_STR(audit, v->id) &&
+		    issue->topic == AUDIT_STR(audit, v->desc))
+			return;
+	}
+
+	issue = calloc(1, sizeof(*issue));
+	if (issue == NULL)
+		err(1, "calloc(audit_issue)");
+	issue->cves = calloc(v->ncves + 1, sizeof(char *));
+	if (issue->cves == NULL)
+		err(1, "calloc(audit_issue)");
+
+	issue->name = AUDIT_DATA(audit, e->pkgname);
+	issue->id = AUDIT_STR(audit, v->id);
+	issue->topic = AUDIT_STR(audit, v->desc);
+	issue->url = AUDIT_STR(audit, v->url);
+	for (i = 0; i < v->ncves; i++)
+		issue->cves[i] = AUDIT_DATA(audit, AUDIT_CVES(audit)[v->cves + i]);
+
+	LL_APPEND(result->issues, issue);
+	result->nissues++;
+}
+
+/*
+ * Index of the first exact name which is not lower than name.
+ */
+static uint32_t
+pkg_audit_exact_lower(struct pkg_audit *audit, struct pkg_audit_names *names,
+    const char *name, uint32_t lo)
+{
+	const struct pkg_audit_index_item *items;
+	uint32_t hi, mid;
+
+	items = AUDIT_ITEMS(audit);
+	hi = names->nexact;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(AUDIT_DATA(audit,
+		    items[names->exact[mid]].pkgname), name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+int
+pkg_audit_check_it(struct pkg_audit *audit, struct pkgdb_it *it,
+    unsigned flags, struct pkg_audit_result **results)
+{
+	const struct pkg_audit_index_item *items, *e;
+	const struct pkg_version_key *pkgkey;
+	struct pkg_audit_names *names;
+	struct pkg_audit_result *result = NULL, *tail = NULL;
+	struct pkg_audit_glob *g;
+	struct pkg *pkg = NULL;
+	const char *pkgname;
+	uint32_t cur = 0, i, j;
+	size_t len, l;
+	int ret;
+
+	*results = NULL;
+
+	if (!audit->parsed)
+		return (EPKG_FATAL);
+
+	names = audit->names;
+	items = AUDIT_ITEMS(audit);
+
+	while ((ret = pkgdb_it_next(it, &pkg, flags|PKG_LOAD_BASIC)) ==
+	    EPKG_OK) {
+		if (result == NULL) {
+			result = calloc(1, sizeof(*result));
+			if (result == NULL)
+				err(1, "calloc(audit_result)");
+		}
+
+		pkg_get(pkg, PKG_NAME, &pkgname);
+		pkgkey = pkg_version_key_get(pkg);
+
+		/*
+		 * Exact names: move forward along with the packages, unless
+		 * they are not sorted.
+		 */
+		if (cur > 0 && strcmp(AUDIT_DATA(audit,
+		    items[names->exact[cur - 1]].pkgname), pkgname) >= 0)
+			cur = 0;
+		cur = pkg_audit_exact_lower(audit, names, pkgname, cur);
+		for (i = cur; i < names->nexact; i++) {
+			e = &items[names->exact[i]];
+			if (strcmp(AUDIT_DATA(audit, e->pkgname), pkgname) != 0)
+				break;
+			if (pkg_audit_item_match(audit, e, pkgkey))
+				pkg_audit_add_issue(audit, result, e);
+		}
+
+		/* Globs: only the ones whose prefix starts the name */
+		len = strlen(pkgname);
+		for (l = 0; l <= len && names->globs != NULL; l++) {
+			HASH_FIND(hh, names->globs, pkgname, l, g);
+			if (g == NULL)
+				continue;
+			for (j = 0; j < g->nitems; j++) {
+				e = &items[g->items[j]];
+				if (fnmatch(AUDIT_DATA(audit, e->pkgname),
+				    pkgname, 0) == 0 &&
+				    pkg_audit_item_match(audit, e, pkgkey))
+					pkg_audit_add_issue(audit, result, e);
+			}
+		}
+
+		if (result->issues != NULL) {
+			result->pkg = pkg;
+			pkg = NULL;
+			/* Keep the order of the packages without walking */
+			if (tail == NULL)
+				*results = result;
+			else
+				tail->next = result;
+			tail = result;
+			result = NULL;
+		}
+	}
+
+	free(result);
+	pkg_free(pkg);
+
+	if (ret != EPKG_END) {
+		pkg_audit_result_free(*results);
+		*results = NULL;
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+struct pkg_audit_check_env {
+	struct pkg_audit *audit;
+	struct pkgdb_it **its;
+	struct pkg_audit_result **results;
+	size_t nits;
+	size_t next;
+	unsigned flags;
+	int ret;
+	pthread_mutex_t lock;
+};
+
+static void *
+pkg_audit_check_worker(void *arg)
+{
+	struct pkg_audit_check_env *env = arg;
+	size_t i;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&env->lock);
+		i = env->next++;
+		pthread_mutex_unlock(&env->lock);
+		if (i >= env->nits)
+			break;
+
+		ret = pkg_audit_check_it(env->audit, env->its[i], env->flags,
+		    &env->results[i]);
+		if (ret != EPKG_OK) {
+			pthread_mutex_lock(&env->lock);
+			env->ret = ret;
+			pthread_mutex_unlock(&env->lock);
+		}
+	}
+
+	return (NULL);
+}
+
+int
+pkg_audit_check_its(struct pkg_audit *audit, struct pkgdb_it **its,
+    size_t nits, unsigned flags, struct pkg_audit_result **results)
+{
+	struct pkg_audit_check_env env;
+	pthread_t *threads;
+	size_t i, nthreads;
+
+	memset(results, 0, nits * sizeof(*results));
+
+	if (!audit->parsed)
+		return (EPKG_FATAL);
+
+	memset(&env, 0, sizeof(env));
+	env.audit = audit;
+	env.its = its;
+	env.results = results;
+	env.nits = nits;
+	env.flags = flags;
+	env.ret = EPKG_OK;
+	pthread_mutex_init(&env.lock, NULL);
+
+	nthreads = MIN((size_t)worker_count(), nits);
+	threads = NULL;
+	if (nthreads > 1 &&
+	    (threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		pkg_emit_errno("calloc", "pthread_t");
+		nthreads = 0;
+	}
+
+	for (i = 0; i < nthreads && threads != NULL; i++) {
+		if (pthread_create(&threads[i], NULL, pkg_audit_check_worker,
+		    &env) != 0) {
+			pkg_emit_errno("pthread_create", "audit");
+			break;
+		}
+	}
+	nthreads = threads != NULL ? i : 0;
+
+	/* Whatever the threads did not pick is done here */
+	pkg_audit_check_worker(&env);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&env.lock);
+
+	if (env.ret != EPKG_OK) {
+		for (i = 0; i < nits; i++) {
+			pkg_audit_result_free(results[i]);
+			results[i] = NULL;
+		}
+	}
+
+	return (env.ret);
+}
+
 struct pkg_audit *
 pkg_audit_new(void)
 {
@@ -873,43 +1834,62 @@ pkg_audit_new(void)
 	return (audit);
 }
 
+static int
+pkg_audit_map(struct pkg_audit *audit, int fd, const struct stat *st)
+{
+	void *mem;
+
+	if ((mem = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return (EPKG_FATAL);
+
+	audit->map = mem;
+	audit->len = st->st_size;
+	audit->loaded = true;
+
+	return (EPKG_OK);
+}
+
 int
 pkg_audit_load(struct pkg_audit *audit, const char *fname)
 {
-	int fd;
-	void *mem;
+	int fd, ret;
 	struct stat st;
 
 	if (stat(fname, &st) == -1)
 		return (EPKG_FATAL);
 
+	/* An up-to-date index spares the parsing of vuln.xml */
+	if (pkg_audit_index_load(audit, fname, &st) == EPKG_OK) {
+		audit->loaded = true;
+		return (EPKG_OK);
+	}
+
 	if ((fd = open(fname, O_RDONLY)) == -1)
 		return (EPKG_FATAL);
 
-	if ((mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
-		close(fd);
-		return (EPKG_FATAL);
-	}
+	ret = pkg_audit_map(audit, fd, &st);
 	close(fd);
 
-	audit->map = mem;
-	audit->len = st.st_size;
-	audit->loaded = true;
-
-	return (EPKG_OK);
+	return (ret);
 }
 
 /* This can and should be executed after cap_enter(3) */
 int
 pkg_audit_process(struct pkg_audit *audit)
 {
+	struct stat st;
+
 	if (!audit->loaded)
 		return (EPKG_FATAL);
 
-	if (pkg_audit_parse_vulnxml(audit) == EPKG_FATAL)
-		return (EPKG_FATAL);
+	if (audit->index == NULL) {
+		if (pkg_audit_parse_vulnxml(audit) == EPKG_FATAL)
+			return (EPKG_FATAL);
 
-	audit->items = pkg_audit_preprocess(audit->entries);
+		memset(&st, 0, sizeof(st));
+		pkg_audit_index_build(audit, &st);
+	}
+	audit->names = pkg_audit_names_build(audit);
 	audit->parsed = true;
 
 	return (EPKG_OK);
@@ -919,13 +1899,15 @@ void
 pkg_audit_free (struct pkg_audit *audit)
 {
 	if (audit != NULL) {
-		if (audit->parsed) {
+		if (audit->entries != NULL)
 			pkg_audit_free_list(audit->entries);
-			free(audit->items);
-		}
-		if (audit->loaded) {
+		pkg_audit_names_free(audit->names);
+		if (audit->index_mapped)
+			munmap(audit->index, audit->index_len);
+		else
+			free(audit->index);
+		if (audit->map != NULL)
 			munmap(audit->map, audit->len);
-		}
 		free(audit);
 	}
 }
@@ -52,6 +52,7 @@
 #include "pkg.h"
 #include "private/pkg.h"
 #include "private/event.h"
+#include "private/ldconfig.h"
 #include "pkg_repos.h"
 
 #ifndef PORTSDIR
@@ -155,6 +156,12 @@ static struct config_entry c[] = {
 		"NO",
 		"Add extra strict, pedantic warnings as an aid to package maintainers",
 	},
+	{
+		PKG_BOOL,
+		"CHECKSUM_CACHE",
+		"NO",
+		"Only hash again the installed files changed since the last pkg check -s",
+	},
 	{
 		PKG_STRING,
 		"VULNXML_SITE",
@@ -167,6 +174,24 @@ static struct config_entry c[] = {
 		"3",
 		"How many times to retry fetching files",
 	},
+	{
+		PKG_INT,
+		"FETCH_CONCURRENCY",
+		"4",
+		"How many packages to download in parallel from one repository",
+	},
+	{
+		PKG_BOOL,
+		"INSTALL_WHILE_FETCHING",
+		"NO",
+		"Extract packages while later ones are still downloading",
+	},
+	{
+		PKG_INT,
+		"EXTRACT_CONCURRENCY",
+		"1",
+		"How many new packages to extract in parallel while installing",
+	},
 	{
 		PKG_STRING,
 		"PKG_PLUGINS_DIR",
@@ -281,6 +306,12 @@ static struct config_entry c[] = {
 		NULL,
 		"Experimental: tells pkg to use an external SAT solver",
 	},
+	{
+		PKG_BOOL,
+		"SOLVER_BATCH_QUERIES",
+		"NO",
+		"Expand the solver universe breadth-first with set-based repository queries",
+	},
 	{
 		PKG_BOOL,
 		"RUN_SCRIPTS",
@@ -311,11 +342,17 @@ static struct config_entry c[] = {
 		"NO",
 		"Profile sqlite queries"
 	},
+	{
+		PKG_BOOL,
+		"SQLITE_WAL",
+		"NO",
+		"Use write-ahead logging for the local database"
+	},
 	{
 		PKG_INT,
 		"WORKERS_COUNT",
 		"0",
-		"How many workers are used for pkg-repo (hw.ncpu if 0)"
+		"How many workers are used for pkg-repo and pkg-update (hw.ncpu if 0)"
 	},
 	{
 		PKG_BOOL,
@@ -423,6 +460,7 @@ add_repo(const ucl_object_t *obj, struct pkg_repo *r, const char *rname)
 	const char *signature_type = NULL, *fingerprints = NULL;
 	const char *key;
 	const char *type = NULL;
+	int64_t fetch_concurrency = -1;
 
 	pkg_debug(1, "PkgConfig: parsing repository object %s", rname);
 
@@ -500,6 +538,14 @@ add_repo(const ucl_object_t *obj, struct pkg_repo *r, const char *rname)
 				return;
 			}
 			type = ucl_object_tostring(cur);
+		} else if (strcasecmp(key, "fetch_concurrency") == 0) {
+			if (cur->type != UCL_INT) {
+				pkg_emit_error("Expecting an integer for the "
+					"'%s' key of the '%s' repo",
+					key, rname);
+				return;
+			}
+			fetch_concurrency = ucl_object_toint(cur);
 		}
 	}
 
@@ -541,6 +587,9 @@ add_repo(const ucl_object_t *obj, struct pkg_repo *r, const char *rname)
 		else
 			r->mirror_type = NOMIRROR;
 	}
+
+	if (fetch_concurrency >= 0)
+		r->fetch_concurrency = fetch_concurrency;
 }
 
 static void
@@ -1039,6 +1088,7 @@ pkg_shutdown(void)
 
 	ucl_object_unref(config);
 	HASH_FREE(repos, pkg_repo_free);
+	shlib_list_free();
 
 	parsed = false;
 
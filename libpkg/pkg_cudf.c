@@ -240,13 +240,9 @@ cudf_emit_request_packages(const char *op, struct pkg_jobs *j, FILE *f)
 static int
 pkg_cudf_version_cmp(struct pkg_job_universe_item *a, struct pkg_job_universe_item *b)
 {
-	const char *vera, *verb;
 	int ret;
 
-	pkg_get(a->pkg, PKG_VERSION, &vera);
-	pkg_get(b->pkg, PKG_VERSION, &verb);
-
-	ret = pkg_version_cmp(vera, verb);
+	ret = pkg_version_cmp_pkg(a->pkg, b->pkg);
 	if (ret == 0) {
 		/* Ignore remote packages whose versions are equal to ours */
 		if (a->pkg->type != PKG_INSTALLED)
@@ -45,16 +45,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <gelf.h>
-#include <libgen.h>
 #if defined(HAVE_LINK_H) && !defined(__DragonFly__)
 #include <link.h>
 #endif
 #include <paths.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <utlist.h>
 #ifdef HAVE_LIBELF
 #include <libelf.h>
 #endif
@@ -64,6 +68,7 @@
 #include "private/event.h"
 #include "private/elf_tables.h"
 #include "private/ldconfig.h"
+#include "private/utils.h"
 
 #ifndef NT_ABI_TAG
 #define NT_ABI_TAG 1
@@ -74,15 +79,46 @@
 
 #define roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
 
+/*
+ * The files of a package are analysed by several threads: what is found in
+ * each of them is recorded here, and only added to the package by the
+ * calling thread, in the order of the files, once they are all done.
+ */
+struct elf_shlib {
+	int		 status;	/* of filter_system_shlibs() */
+	struct elf_shlib *next;
+	char		 name[];
+};
+
+struct elf_analysis {
+	char		*fpath;
+	int		 ret;
+	bool		 is_elf;
+	bool		 is_shlib;
+	struct elf_shlib *provided;
+	struct elf_shlib *required;
+	char		*error;
+	char		*debug;
+};
+
+struct elf_env {
+	struct elf_analysis *files;
+	size_t		 nfiles;
+	size_t		 next;
+	const char	*abi;
+	pthread_mutex_t	 lock;
+};
+
 static const char * elf_corres_to_string(const struct _elf_corres* m, int e);
 static int elf_string_to_corres(const struct _elf_corres* m, const char *s);
 
 static int
-filter_system_shlibs(const char *name, char *path, size_t pathlen)
+filter_system_shlibs(struct shlib_list *rpath, const char *name, char *path,
+    size_t pathlen)
 {
 	const char *shlib_path;
 
-	shlib_path = shlib_list_find_by_name(name);
+	shlib_path = shlib_list_find_by_name(rpath, name);
 	if (shlib_path == NULL) {
 		/* dynamic linker could not resolve */
 		return (EPKG_FATAL);
@@ -99,16 +135,15 @@ filter_system_shlibs(const char *name, char *path, size_t pathlen)
 	return (EPKG_OK);
 } 
 
-/* ARGSUSED */
 static int
-add_shlibs_to_pkg(__unused void *actdata, struct pkg *pkg, const char *fpath,
-		  const char *name, bool is_shlib)
+add_shlibs_to_pkg(struct pkg *pkg, const char *fpath, const char *name,
+    int status, bool is_shlib)
 {
 	const char *pkgname, *pkgversion;
 	struct pkg_file *file = NULL;
 	const char *filepath;
 
-	switch(filter_system_shlibs(name, NULL, 0)) {
+	switch(status) {
 	case EPKG_OK:		/* A non-system library */
 		pkg_addshlib_required(pkg, name);
 		return (EPKG_OK);
@@ -136,8 +171,56 @@ add_shlibs_to_pkg(__unused void *actdata, struct pkg *pkg, const char *fpath,
 	}
 }
 
+/* Emitted later by the calling thread: none if out of memory */
+static void
+elf_msg(char **msg, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(msg, fmt, ap) == -1)
+		*msg = NULL;
+	va_end(ap);
+}
+
+static int
+elf_add_shlib(struct elf_analysis *a, struct elf_shlib **head,
+    const char *name, int status)
+{
+	struct elf_shlib *sl;
+	size_t len;
+
+	if (name == NULL)
+		return (EPKG_OK);
+
+	len = strlen(name) + 1;
+	if ((sl = malloc(sizeof(*sl) + len)) == NULL) {
+		elf_msg(&a->error, "malloc(%s): %s", name, strerror(errno));
+		return (EPKG_FATAL);
+	}
+	sl->status = status;
+	memcpy(sl->name, name, len);
+	LL_APPEND(*head, sl);
+
+	return (EPKG_OK);
+}
+
+static void
+elf_analysis_free(struct elf_analysis *a)
+{
+	struct elf_shlib *sl, *tmp;
+
+	LL_FOREACH_SAFE(a->provided, sl, tmp)
+		free(sl);
+	LL_FOREACH_SAFE(a->required, sl, tmp)
+		free(sl);
+	free(a->fpath);
+	free(a->error);
+	free(a->debug);
+}
+
 static bool
-shlib_valid_abi(const char *fpath, GElf_Ehdr *hdr, const char *abi)
+shlib_valid_abi(struct elf_analysis *a, GElf_Ehdr *hdr, const char *abi)
 {
 	int semicolon;
 	const char *p, *t;
@@ -193,27 +276,30 @@ shlib_valid_abi(const char *fpath, GElf_Ehdr *hdr, const char *abi)
 	 * 'x86'
 	 */
 	if ((int)hdr->e_ident[EI_CLASS] != wclass) {
-		pkg_debug(1, "not valid elf class for shlib: %s: %s",
+		elf_msg(&a->debug, "not valid elf class for shlib: %s: %s",
 		    elf_corres_to_string(wordsize_corres,
 		    (int)hdr->e_ident[EI_CLASS]),
-		    fpath);
+		    a->fpath);
 		return (false);
 	}
 
 	if (strcmp(shlib_arch, arch) != 0) {
-		pkg_debug(1, "not valid abi for shlib: %s: %s", shlib_arch,
-		    fpath);
+		elf_msg(&a->debug, "not valid abi for shlib: %s: %s",
+		    shlib_arch, a->fpath);
 		return (false);
 	}
 
 	return (true);
 }
 
+/*
+ * Runs on any thread: must not touch the package, nor emit events.
+ */
 static int
-analyse_elf(struct pkg *pkg, const char *fpath,
-	int (action)(void *, struct pkg *, const char *, const char *, bool),
-	void *actdata)
+analyse_elf(struct elf_analysis *a, const char *myarch)
 {
+	const char *fpath = a->fpath;
+	struct shlib_list *rpath = NULL;
 	Elf *e = NULL;
 	GElf_Ehdr elfhdr;
 	Elf_Scn *scn = NULL;
@@ -229,19 +315,18 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	size_t sh_link = 0;
 	size_t dynidx;
 	const char *osname;
-	const char *myarch;
 	const char *shlib;
+	const char *p;
+	char dirpath[MAXPATHLEN];
 
-	bool developer = false;
 	bool is_shlib = false;
 
-	developer = pkg_object_bool(pkg_config_get("DEVELOPER_MODE"));
-	myarch = pkg_object_string(pkg_config_get("ABI"));
-
 	int fd;
 
-	if (lstat(fpath, &sb) != 0)
-		pkg_emit_errno("fstat() failed for", fpath);
+	if (lstat(fpath, &sb) != 0) {
+		elf_msg(&a->error, "lstat(%s): %s", fpath, strerror(errno));
+		return (EPKG_FATAL);
+	}
 	/* ignore empty files and non regular files */
 	if (sb.st_size == 0 || !S_ISREG(sb.st_mode))
 		return (EPKG_END); /* Empty file or sym-link: no results */
@@ -252,7 +337,7 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 
 	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
 		ret = EPKG_FATAL;
-		pkg_emit_error("elf_begin() for %s failed: %s", fpath,
+		elf_msg(&a->error, "elf_begin() for %s failed: %s", fpath,
 		    elf_errmsg(-1));
 		goto cleanup;
 	}
@@ -263,12 +348,11 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 		goto cleanup;
 	}
 
-	if (developer)
-		pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+	a->is_elf = true;
 
 	if (gelf_getehdr(e, &elfhdr) == NULL) {
 		ret = EPKG_FATAL;
-		pkg_emit_error("getehdr() failed: %s.", elf_errmsg(-1));
+		elf_msg(&a->error, "getehdr() failed: %s.", elf_errmsg(-1));
 		goto cleanup;
 	}
 
@@ -276,8 +360,8 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	while ((scn = elf_nextscn(e, scn)) != NULL) {
 		if (gelf_getshdr(scn, &shdr) != &shdr) {
 			ret = EPKG_FATAL;
-			pkg_emit_error("getshdr() for %s failed: %s", fpath,
-					elf_errmsg(-1));
+			elf_msg(&a->error, "getshdr() for %s failed: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 		switch (shdr.sh_type) {
@@ -312,7 +396,7 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 		goto cleanup; /* not a dynamically linked elf: no results */
 	}
 
-	if (!shlib_valid_abi(fpath, &elfhdr, myarch)) {
+	if (!shlib_valid_abi(a, &elfhdr, myarch)) {
 		ret = EPKG_END;
 		goto cleanup; /* Invalid ABI */
 	}
@@ -356,12 +440,11 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	   against them would be required.  Shared libraries are
 	   distinguished by a DT_SONAME tag */
 
-	rpath_list_init();
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
 			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
-			    elf_errmsg(-1));
+			elf_msg(&a->error, "getdyn() failed for %s: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 
@@ -372,14 +455,25 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 			   *provided* by the package. Record this if
 			   appropriate */
 
-			pkg_addshlib_provided(pkg, elf_strptr(e, sh_link, dyn->d_un.d_val));
+			if (elf_add_shlib(a, &a->provided,
+			    elf_strptr(e, sh_link, dyn->d_un.d_val),
+			    EPKG_OK) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
 		}
 
 		if (dyn->d_tag != DT_RPATH && dyn->d_tag != DT_RUNPATH)
 			continue;
 		
-		shlib_list_from_rpath(elf_strptr(e, sh_link, dyn->d_un.d_val), 
-				      dirname(fpath));
+		/* dirname(3) is not reentrant everywhere */
+		strlcpy(dirpath, fpath, sizeof(dirpath));
+		if ((p = strrchr(dirpath, '/')) == NULL)
+			strlcpy(dirpath, ".", sizeof(dirpath));
+		else
+			dirpath[p == dirpath ? 1 : p - dirpath] = '\0';
+		shlib_list_from_rpath(&rpath,
+		    elf_strptr(e, sh_link, dyn->d_un.d_val), dirpath);
 		break;
 	}
 	if (!is_shlib) {
@@ -389,7 +483,12 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 		 */
 		if (elfhdr.e_type == ET_DYN) {
 			is_shlib = true;
-			pkg_addshlib_provided(pkg, basename(fpath));
+			p = strrchr(fpath, '/');
+			if (elf_add_shlib(a, &a->provided,
+			    p != NULL ? p + 1 : fpath, EPKG_OK) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
 		}
 	}
 
@@ -398,8 +497,8 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
 			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
-			    elf_errmsg(-1));
+			elf_msg(&a->error, "getdyn() failed for %s: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 
@@ -407,12 +506,19 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 			continue;
 
 		shlib = elf_strptr(e, sh_link, dyn->d_un.d_val);
+		if (shlib == NULL)
+			continue;
 
-		action(actdata, pkg, fpath, shlib, is_shlib);
+		if (elf_add_shlib(a, &a->required, shlib,
+		    filter_system_shlibs(rpath, shlib, NULL, 0)) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
 	}
 
 cleanup:
-	rpath_list_free();
+	a->is_shlib = is_shlib;
+	rpath_list_free(&rpath);
 
 	if (e != NULL)
 		elf_end(e);
@@ -441,11 +547,34 @@ analyse_fpath(struct pkg *pkg, const char *fpath)
 	return (EPKG_OK);
 }
 
+static void *
+analyse_elf_worker(void *arg)
+{
+	struct elf_env *env = arg;
+	struct elf_analysis *a;
+
+	for (;;) {
+		pthread_mutex_lock(&env->lock);
+		a = env->next < env->nfiles ? &env->files[env->next++] : NULL;
+		pthread_mutex_unlock(&env->lock);
+		if (a == NULL)
+			break;
+		a->ret = analyse_elf(a, env->abi);
+	}
+
+	return (NULL);
+}
+
 int
 pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 {
 	struct pkg_file *file = NULL;
 	struct pkg_shlib *sh, *shtmp, *found;
+	struct elf_shlib *sl;
+	struct elf_analysis *a;
+	struct elf_env env;
+	pthread_t *threads = NULL;
+	size_t i, nthreads, started = 0;
 	int ret = EPKG_OK;
 	char fpath[MAXPATHLEN];
 	const char *origin;
@@ -459,11 +588,10 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 	if (elf_version(EV_CURRENT) == EV_NONE)
 		return (EPKG_FATAL);
 
-	shlib_list_init();
-
+	/* Only rescanned if the system libraries changed since last time */
 	ret = shlib_list_from_elf_hints(_PATH_ELF_HINTS);
 	if (ret != EPKG_OK)
-		goto cleanup;
+		return (ret);
 
 	/* Assume no architecture dependence, for contradiction */
 	if (developer)
@@ -471,19 +599,73 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 				PKG_CONTAINS_STATIC_LIBS |
 				PKG_CONTAINS_H_OR_LA);
 
+	memset(&env, 0, sizeof(env));
+	pthread_mutex_init(&env.lock, NULL);
+	env.abi = pkg_object_string(pkg_config_get("ABI"));
+	env.nfiles = HASH_COUNT(pkg->files);
+	if (env.nfiles == 0)
+		goto merge;
+
+	env.files = calloc(env.nfiles, sizeof(*env.files));
+	if (env.files == NULL) {
+		pkg_emit_errno("calloc", "pkg_analyse_files");
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	i = 0;
 	while (pkg_files(pkg, &file) == EPKG_OK) {
 		if (stage != NULL)
 			snprintf(fpath, sizeof(fpath), "%s/%s", stage, pkg_file_path(file));
 		else
 			strlcpy(fpath, pkg_file_path(file), sizeof(fpath));
 
-		ret = analyse_elf(pkg, fpath, add_shlibs_to_pkg, db);
+		if ((env.files[i++].fpath = strdup(fpath)) == NULL) {
+			pkg_emit_errno("strdup", "pkg_analyse_files");
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	/* The calling thread is one of the workers */
+	nthreads = MIN((size_t)worker_count(), env.nfiles);
+	if (nthreads > 1) {
+		threads = calloc(nthreads - 1, sizeof(*threads));
+		if (threads == NULL)
+			nthreads = 1;
+	}
+	for (; started + 1 < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL,
+		    analyse_elf_worker, &env) != 0)
+			break;
+	}
+	analyse_elf_worker(&env);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+merge:
+	for (i = 0; i < env.nfiles; i++) {
+		a = &env.files[i];
+
+		if (a->debug != NULL)
+			pkg_debug(1, "%s", a->debug);
+		if (a->error != NULL)
+			pkg_emit_error("%s", a->error);
+		if (developer && a->is_elf)
+			pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+
+		LL_FOREACH(a->provided, sl)
+			pkg_addshlib_provided(pkg, sl->name);
+		LL_FOREACH(a->required, sl)
+			add_shlibs_to_pkg(pkg, a->fpath, sl->name, sl->status,
+			    a->is_shlib);
+
 		if (developer) {
-			if (ret != EPKG_OK && ret != EPKG_END) {
+			if (a->ret != EPKG_OK && a->ret != EPKG_END) {
 				failures = true;
 				continue;
 			}
-			analyse_fpath(pkg, fpath);
+			analyse_fpath(pkg, a->fpath);
 		}
 	}
 
@@ -507,7 +689,13 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 	ret = EPKG_OK;
 
 cleanup:
-	shlib_list_free();
+	if (env.files != NULL) {
+		for (i = 0; i < env.nfiles; i++)
+			elf_analysis_free(&env.files[i]);
+		free(env.files);
+	}
+	free(threads);
+	pthread_mutex_destroy(&env.lock);
 
 	return (ret);
 }
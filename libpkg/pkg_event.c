@@ -26,6 +26,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -37,6 +38,168 @@
 static pkg_event_cb _cb = NULL;
 static void *_data = NULL;
 
+static int pkg_emit_event(struct pkg_event *ev);
+
+/*
+ * Worker threads report through the same callback as the main thread,
+ * which is not expected to be reentrant: deliver one event at a time.
+ * The lock is recursive as a callback may emit events itself.
+ *
+ * A worker may instead queue its messages with pkg_event_queue_begin(), to
+ * have them emitted by the main thread where they belong in the output.
+ */
+static pthread_once_t event_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t event_lock;
+static pthread_key_t event_queue_key;
+
+struct pkg_event_queued {
+	struct pkg_event	 ev;
+	struct pkg_event_queued	*next;
+};
+
+static void
+event_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&event_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_key_create(&event_queue_key, NULL);
+}
+
+static void
+pkg_event_queued_free(struct pkg_event_queued *e)
+{
+	switch (e->ev.type) {
+	case PKG_EVENT_ERRNO:
+		free(__DECONST(char *, e->ev.e_errno.func));
+		free(__DECONST(char *, e->ev.e_errno.arg));
+		break;
+	case PKG_EVENT_ERROR:
+	case PKG_EVENT_DEVELOPER_MODE:
+		free(e->ev.e_pkg_error.msg);
+		break;
+	case PKG_EVENT_NOTICE:
+		free(e->ev.e_pkg_notice.msg);
+		break;
+	case PKG_EVENT_DEBUG:
+		free(e->ev.e_debug.msg);
+		break;
+	default:
+		break;
+	}
+	free(e);
+}
+
+/*
+ * Only the events made of strings are queued, the others are emitted
+ * right away.
+ */
+static bool
+pkg_event_enqueue(struct pkg_event_queue *q, struct pkg_event *ev)
+{
+	struct pkg_event_queued *e;
+	bool ok;
+
+	switch (ev->type) {
+	case PKG_EVENT_ERRNO:
+	case PKG_EVENT_ERROR:
+	case PKG_EVENT_DEVELOPER_MODE:
+	case PKG_EVENT_NOTICE:
+	case PKG_EVENT_DEBUG:
+		break;
+	default:
+		return (false);
+	}
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return (false);
+	e->ev.type = ev->type;
+	switch (ev->type) {
+	case PKG_EVENT_ERRNO:
+		e->ev.e_errno.func = strdup(ev->e_errno.func);
+		e->ev.e_errno.arg = strdup(ev->e_errno.arg != NULL ?
+		    ev->e_errno.arg : "");
+		e->ev.e_errno.no = ev->e_errno.no;
+		ok = (e->ev.e_errno.func != NULL && e->ev.e_errno.arg != NULL);
+		break;
+	case PKG_EVENT_NOTICE:
+		e->ev.e_pkg_notice.msg = strdup(ev->e_pkg_notice.msg);
+		ok = (e->ev.e_pkg_notice.msg != NULL);
+		break;
+	case PKG_EVENT_DEBUG:
+		e->ev.e_debug.level = ev->e_debug.level;
+		e->ev.e_debug.msg = strdup(ev->e_debug.msg);
+		ok = (e->ev.e_debug.msg != NULL);
+		break;
+	default:
+		e->ev.e_pkg_error.msg = strdup(ev->e_pkg_error.msg);
+		ok = (e->ev.e_pkg_error.msg != NULL);
+		break;
+	}
+	if (!ok) {
+		pkg_event_queued_free(e);
+		return (false);
+	}
+
+	if (q->tail == NULL)
+		q->head = e;
+	else
+		q->tail->next = e;
+	q->tail = e;
+
+	return (true);
+}
+
+/*
+ * Queue the messages of the calling thread in q until
+ * pkg_event_queue_end().
+ */
+void
+pkg_event_queue_begin(struct pkg_event_queue *q)
+{
+	pthread_once(&event_once, event_init);
+	pthread_setspecific(event_queue_key, q);
+}
+
+void
+pkg_event_queue_end(void)
+{
+	pthread_once(&event_once, event_init);
+	pthread_setspecific(event_queue_key, NULL);
+}
+
+/*
+ * Emit the queued messages, from a thread not queueing its own.
+ */
+void
+pkg_event_queue_flush(struct pkg_event_queue *q)
+{
+	struct pkg_event_queued *e, *next;
+
+	for (e = q->head; e != NULL; e = next) {
+		next = e->next;
+		pkg_emit_event(&e->ev);
+		pkg_event_queued_free(e);
+	}
+	q->head = q->tail = NULL;
+}
+
+void
+pkg_event_queue_clear(struct pkg_event_queue *q)
+{
+	struct pkg_event_queued *e, *next;
+
+	for (e = q->head; e != NULL; e = next) {
+		next = e->next;
+		pkg_event_queued_free(e);
+	}
+	q->head = q->tail = NULL;
+}
+
 static char *
 sbuf_json_escape(struct sbuf *buf, const char *str)
 {
@@ -408,11 +571,20 @@ pkg_event_register(pkg_event_cb cb, void *data)
 static int
 pkg_emit_event(struct pkg_event *ev)
 {
+	struct pkg_event_queue *q;
 	int ret = 0;
+
+	pthread_once(&event_once, event_init);
+	if ((q = pthread_getspecific(event_queue_key)) != NULL &&
+	    pkg_event_enqueue(q, ev))
+		return (0);
+
+	pthread_mutex_lock(&event_lock);
 	pkg_plugins_hook_run(PKG_PLUGIN_HOOK_EVENT, ev, NULL);
 	if (_cb != NULL)
 		ret = _cb(_data, ev);
 	pipeevent(ev);
+	pthread_mutex_unlock(&event_lock);
 	return (ret);
 }
 
@@ -37,9 +37,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <libutil.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <ctype.h>
 
@@ -50,7 +52,10 @@
 #include "private/pkg_jobs.h"
 
 static int pkg_jobs_find_upgrade(struct pkg_jobs *j, const char *pattern, match_t m);
-static int pkg_jobs_fetch(struct pkg_jobs *j);
+static int pkg_jobs_fetch(struct pkg_jobs *j, bool stream);
+static int pkg_jobs_fetch_wait(struct pkg_jobs_fetch_env *env, struct pkg *p,
+    bool progress);
+static int pkg_jobs_fetch_finish(struct pkg_jobs_fetch_env *env, bool abort);
 static bool new_pkg_version(struct pkg_jobs *j);
 static int pkg_jobs_check_conflicts(struct pkg_jobs *j);
 
@@ -163,13 +168,10 @@ pkg_jobs_maybe_match_file(struct job_pattern *jp, const char *pattern)
 	dot_pos = strrchr(pattern, '.');
 	if (dot_pos != NULL) {
 		/*
-		 * Compare suffix with .txz or .tbz
+		 * Compare suffix with the package archive ones
 		 */
 		dot_pos ++;
-		if (strcmp(dot_pos, "txz") == 0 ||
-			strcmp(dot_pos, "tbz") == 0 ||
-			strcmp(dot_pos, "tgz") == 0 ||
-			strcmp(dot_pos, "tar") == 0) {
+		if (packing_is_package_ext(dot_pos)) {
 			if ((pkg_path = realpath(pattern, NULL)) != NULL) {
 				/* Dot pos is one character after the dot */
 				int len = dot_pos - pattern;
@@ -385,7 +387,7 @@ pkg_jobs_test_automatic(struct pkg_jobs *j, struct pkg *p)
 	bool automatic;
 
 	while (pkg_rdeps(p, &d) == EPKG_OK && ret) {
-		unit = pkg_jobs_universe_find(j->universe, d->uid);
+		unit = pkg_jobs_universe_find_interned(j->universe, d->uid);
 		if (unit != NULL) {
 			pkg_get(unit->pkg, PKG_AUTOMATIC, &automatic);
 			if (!automatic) {
@@ -873,7 +875,7 @@ bool
 pkg_jobs_need_upgrade(struct pkg *rp, struct pkg *lp)
 {
 	int ret, ret1, ret2;
-	const char *lversion, *rversion, *larch, *rarch, *reponame, *origin;
+	const char *larch, *rarch, *reponame, *origin;
 	const char *ldigest, *rdigest;
 	struct pkg_option *lo = NULL, *ro = NULL;
 	struct pkg_dep *ld = NULL, *rd = NULL;
@@ -892,9 +894,9 @@ pkg_jobs_need_upgrade(struct pkg *rp, struct pkg *lp)
 		return (false);
 	}
 
-	pkg_get(lp, PKG_VERSION, &lversion, PKG_ARCH, &larch, PKG_ORIGIN, &origin,
+	pkg_get(lp, PKG_ARCH, &larch, PKG_ORIGIN, &origin,
 			PKG_DIGEST, &ldigest);
-	pkg_get(rp, PKG_VERSION, &rversion, PKG_ARCH, &rarch, PKG_DIGEST, &rdigest);
+	pkg_get(rp, PKG_ARCH, &rarch, PKG_DIGEST, &rdigest);
 
 	if (ldigest != NULL && rdigest != NULL &&
 			strcmp(ldigest, rdigest) == 0) {
@@ -905,7 +907,7 @@ pkg_jobs_need_upgrade(struct pkg *rp, struct pkg *lp)
 	 * XXX: for a remote package we also need to check whether options
 	 * are compatible.
 	 */
-	ret = pkg_version_cmp(lversion, rversion);
+	ret = pkg_version_cmp_pkg(lp, rp);
 	if (ret > 0)
 		return (false);
 	else if (ret < 0)
@@ -1103,7 +1105,7 @@ pkg_jobs_find_deinstall_request(struct pkg_job_universe_item *item,
 	HASH_FIND_PTR(j->request_delete, &item, found);
 	if (found == NULL) {
 		while (pkg_deps(pkg, &d) == EPKG_OK) {
-			dep_item = pkg_jobs_universe_find(j->universe, d->uid);
+			dep_item = pkg_jobs_universe_find_interned(j->universe, d->uid);
 			if (dep_item) {
 				found = pkg_jobs_find_deinstall_request(dep_item, j, rec_level + 1);
 				if (found)
@@ -1659,45 +1661,31 @@ pkg_jobs_type(struct pkg_jobs *j)
 	return (j->type);
 }
 
-static int
-pkg_jobs_handle_install(struct pkg_solved *ps, struct pkg_jobs *j, bool handle_rc,
-		struct pkg_manifest_key *keys)
+/*
+ * Compute the archive path and the pkg_add() flags of an install job.
+ */
+static unsigned
+pkg_jobs_install_args(struct pkg_solved *ps, struct pkg_jobs *j,
+    char *path, size_t len, const char **target)
 {
-	struct pkg *new, *old;
-	const char *pkguid, *oldversion = NULL;
-	char path[MAXPATHLEN], *target;
-	bool automatic, upgrade = false;
-	int flags = 0;
-	int retcode = EPKG_FATAL;
+	struct pkg *new = ps->items[0]->pkg;
+	bool automatic;
+	unsigned flags = 0;
 
-	old = ps->items[1] ? ps->items[1]->pkg : NULL;
-	new = ps->items[0]->pkg;
-
-	pkg_get(new, PKG_UNIQUEID, &pkguid, PKG_AUTOMATIC, &automatic);
-	if (old != NULL) {
-		pkg_get(old, PKG_VERSION, &oldversion);
-		upgrade = true;
-	}
+	pkg_get(new, PKG_AUTOMATIC, &automatic);
 
 	if (ps->items[0]->jp != NULL && ps->items[0]->jp->is_file) {
 		/*
 		 * We have package as a file, set special repository name
 		 */
-		target = ps->items[0]->jp->path;
+		*target = ps->items[0]->jp->path;
 		pkg_set(new, PKG_REPONAME, "local file");
 	}
 	else {
-		pkg_snprintf(path, sizeof(path), "%R", new);
+		pkg_snprintf(path, len, "%R", new);
 		if (*path != '/')
-			pkg_repo_cached_name(new, path, sizeof(path));
-		target = path;
-	}
-
-	if (oldversion != NULL) {
-		pkg_set(new, PKG_OLD_VERSION, oldversion);
-		pkg_emit_upgrade_begin(new, old);
-	} else {
-		pkg_emit_install_begin(new);
+			pkg_repo_cached_name(new, path, len);
+		*target = path;
 	}
 
 	if ((j->flags & PKG_FLAG_FORCE) == PKG_FLAG_FORCE)
@@ -1710,6 +1698,41 @@ pkg_jobs_handle_install(struct pkg_solved *ps, struct pkg_jobs *j, bool handle_r
 	if (automatic || (j->flags & PKG_FLAG_AUTOMATIC) == PKG_FLAG_AUTOMATIC)
 		flags |= PKG_ADD_AUTOMATIC;
 
+	return (flags);
+}
+
+static int
+pkg_jobs_handle_install(struct pkg_solved *ps, struct pkg_jobs *j, bool handle_rc,
+		struct pkg_manifest_key *keys)
+{
+	struct pkg *new, *old;
+	const char *oldversion = NULL, *target;
+	char path[MAXPATHLEN];
+	bool upgrade = false;
+	unsigned flags;
+	int retcode = EPKG_FATAL;
+
+	old = ps->items[1] ? ps->items[1]->pkg : NULL;
+	new = ps->items[0]->pkg;
+
+	if (j->fetcher != NULL &&
+	    (retcode = pkg_jobs_fetch_wait(j->fetcher, new, true)) != EPKG_OK)
+		return (retcode);
+
+	if (old != NULL) {
+		pkg_get(old, PKG_VERSION, &oldversion);
+		upgrade = true;
+	}
+
+	flags = pkg_jobs_install_args(ps, j, path, sizeof(path), &target);
+
+	if (oldversion != NULL) {
+		pkg_set(new, PKG_OLD_VERSION, oldversion);
+		pkg_emit_upgrade_begin(new, old);
+	} else {
+		pkg_emit_install_begin(new);
+	}
+
 #if 0
 	if (old != NULL && !ps->already_deleted) {
 		if ((retcode = pkg_delete(old, j->db, PKG_DELETE_UPGRADE)) != EPKG_OK) {
@@ -1740,12 +1763,427 @@ cleanup:
 	return (retcode);
 }
 
+/*
+ * Extract new packages from worker threads while the jobs are executed.
+ * The workers only write the files under temporary names: deletions,
+ * upgrades, scripts, registration in the database and renaming the files
+ * in place stay in job order, in the thread running pkg_jobs_execute(), as
+ * do the messages of the workers.  A package is extracted once all the
+ * jobs ordered before it that are not extracted in parallel have been
+ * executed, and its dependencies are on disk.
+ */
+enum pkg_jobs_extract_state {
+	EXTRACT_PENDING = 0,
+	EXTRACT_RUNNING,
+	EXTRACT_DONE,
+	EXTRACT_DEFERRED,
+	EXTRACT_FAILED
+};
+
+struct pkg_jobs_extract_item {
+	struct pkg_solved *ps;
+	const char *target;
+	char path[MAXPATHLEN];
+	unsigned flags;
+	int nserial;
+	int *deps;
+	int ndeps;
+	enum pkg_jobs_extract_state state;
+	bool committed;
+	struct pkg_stage *stage;
+	struct pkg_event_queue events;
+};
+
+struct pkg_jobs_extract_env {
+	struct pkg_jobs *j;
+	struct pkg_manifest_key *keys;
+	struct pkg_jobs_extract_item *items;
+	int nitems;
+	int next;
+	int pending;
+	int serial_done;
+	bool failed;
+	pthread_t *threads;
+	int nthreads;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct pkg_jobs_extract_origin {
+	const char *origin;
+	int idx;
+	UT_hash_handle hh;
+};
+
+static bool
+pkg_jobs_extract_ready(struct pkg_jobs_extract_env *env,
+    struct pkg_jobs_extract_item *it)
+{
+	struct pkg_jobs_extract_item *dep;
+	int i;
+
+	if (it->state != EXTRACT_PENDING || it->nserial > env->serial_done)
+		return (false);
+
+	for (i = 0; i < it->ndeps; i++) {
+		dep = &env->items[it->deps[i]];
+		if (dep->state != EXTRACT_DONE && !dep->committed)
+			return (false);
+	}
+
+	return (true);
+}
+
+static void *
+pkg_jobs_extract_worker(void *arg)
+{
+	struct pkg_jobs_extract_env *env = arg;
+	struct pkg_jobs_extract_item *it;
+	struct pkg_stage *stage;
+	int i, rc;
+
+	pthread_mutex_lock(&env->lock);
+	while (!env->failed && env->pending > 0) {
+		for (i = 0; i < env->nitems; i++)
+			if (pkg_jobs_extract_ready(env, &env->items[i]))
+				break;
+		if (i == env->nitems) {
+			pthread_cond_wait(&env->cond, &env->lock);
+			continue;
+		}
+		it = &env->items[i];
+		it->state = EXTRACT_RUNNING;
+		env->pending--;
+		pthread_mutex_unlock(&env->lock);
+
+		/* Reported by pkg_jobs_execute() when it reaches the item */
+		pkg_event_queue_begin(&it->events);
+		stage = NULL;
+		rc = EPKG_OK;
+		if (env->j->fetcher != NULL)
+			rc = pkg_jobs_fetch_wait(env->j->fetcher,
+			    it->ps->items[0]->pkg, false);
+		if (rc == EPKG_OK)
+			rc = pkg_add_stage(it->target, it->flags, env->keys,
+			    &stage);
+		pkg_event_queue_end();
+
+		pthread_mutex_lock(&env->lock);
+		it->stage = stage;
+		if (rc == EPKG_OK) {
+			it->state = EXTRACT_DONE;
+		} else if (rc == EPKG_END) {
+			it->state = EXTRACT_DEFERRED;
+		} else {
+			it->state = EXTRACT_FAILED;
+			env->failed = true;
+		}
+		pthread_cond_broadcast(&env->cond);
+	}
+	env->running--;
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+
+	return (NULL);
+}
+
+static void
+pkg_jobs_extract_free(struct pkg_jobs_extract_env *env)
+{
+	int i;
+
+	for (i = 0; i < env->nitems; i++)
+		free(env->items[i].deps);
+	free(env->items);
+	free(env->threads);
+	free(env);
+}
+
+/*
+ * Plan the parallel extraction of the new packages of the jobs, which
+ * must be in execution order.  Returns NULL if it is disabled or if there
+ * is nothing to extract in parallel.
+ */
+static struct pkg_jobs_extract_env *
+pkg_jobs_extract_new(struct pkg_jobs *j, struct pkg_manifest_key *keys)
+{
+	struct pkg_jobs_extract_env *env;
+	struct pkg_jobs_extract_item *it;
+	struct pkg_jobs_extract_origin *origins = NULL, *o;
+	struct pkg_solved *ps;
+	struct pkg_dep *dep;
+	const char *origin;
+	int64_t nthreads;
+	int nserial = 0, i;
+
+	nthreads = pkg_object_int(pkg_config_get("EXTRACT_CONCURRENCY"));
+	if (nthreads <= 1)
+		return (NULL);
+
+	env = calloc(1, sizeof(*env));
+	if (env == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_jobs_extract_env");
+		return (NULL);
+	}
+	env->j = j;
+	env->keys = keys;
+	env->items = calloc(j->count, sizeof(*env->items));
+	if (env->items == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_jobs_extract_item");
+		free(env);
+		return (NULL);
+	}
+
+	/* Upgrades replace files in use: only new packages are extracted */
+	DL_FOREACH(j->jobs, ps) {
+		if (ps->type != PKG_SOLVED_INSTALL || ps->items[1] != NULL) {
+			nserial++;
+			continue;
+		}
+		it = &env->items[env->nitems];
+		it->ps = ps;
+		it->nserial = nserial;
+		it->flags = pkg_jobs_install_args(ps, j, it->path,
+		    sizeof(it->path), &it->target);
+
+		pkg_get(ps->items[0]->pkg, PKG_ORIGIN, &origin);
+		o = malloc(sizeof(*o));
+		if (o == NULL) {
+			pkg_emit_errno("malloc", "pkg_jobs_extract_origin");
+			goto fail;
+		}
+		o->origin = origin;
+		o->idx = env->nitems;
+		HASH_ADD_KEYPTR(hh, origins, o->origin, strlen(o->origin), o);
+
+		env->nitems++;
+	}
+
+	if (env->nitems < 2)
+		goto fail;
+
+	/* Dependencies ordered later are not waited for */
+	for (i = 0; i < env->nitems; i++) {
+		it = &env->items[i];
+		dep = NULL;
+		while (pkg_deps(it->ps->items[0]->pkg, &dep) == EPKG_OK) {
+			origin = pkg_dep_origin(dep);
+			HASH_FIND_STR(origins, origin, o);
+			if (o == NULL || o->idx >= i)
+				continue;
+			if (it->deps == NULL) {
+				it->deps = calloc(pkg_list_count(
+				    it->ps->items[0]->pkg, PKG_DEPS), sizeof(int));
+				if (it->deps == NULL) {
+					pkg_emit_errno("calloc", "extract deps");
+					goto fail;
+				}
+			}
+			it->deps[it->ndeps++] = o->idx;
+		}
+	}
+	HASH_FREE(origins, free);
+
+	env->pending = env->nitems;
+	env->nthreads = MIN(nthreads, env->nitems);
+	env->threads = calloc(env->nthreads, sizeof(pthread_t));
+	if (env->threads == NULL) {
+		pkg_emit_errno("calloc", "pthread_t");
+		pkg_jobs_extract_free(env);
+		return (NULL);
+	}
+	pthread_mutex_init(&env->lock, NULL);
+	pthread_cond_init(&env->cond, NULL);
+
+	pthread_mutex_lock(&env->lock);
+	for (i = 0; i < env->nthreads; i++) {
+		if (pthread_create(&env->threads[i], NULL,
+		    pkg_jobs_extract_worker, env) != 0) {
+			pkg_emit_errno("pthread_create", "package extractor");
+			break;
+		}
+		env->running++;
+	}
+	env->nthreads = i;
+	pthread_mutex_unlock(&env->lock);
+
+	if (env->nthreads == 0) {
+		pthread_cond_destroy(&env->cond);
+		pthread_mutex_destroy(&env->lock);
+		pkg_jobs_extract_free(env);
+		return (NULL);
+	}
+
+	pkg_debug(1, "extracting %d packages with %d threads", env->nitems,
+	    env->nthreads);
+
+	return (env);
+
+fail:
+	HASH_FREE(origins, free);
+	pkg_jobs_extract_free(env);
+	return (NULL);
+}
+
+/*
+ * Jobs are executed in the order of the items.
+ */
+static struct pkg_jobs_extract_item *
+pkg_jobs_extract_find(struct pkg_jobs_extract_env *env, struct pkg_solved *ps)
+{
+	if (env->next < env->nitems && env->items[env->next].ps == ps)
+		return (&env->items[env->next++]);
+
+	return (NULL);
+}
+
+/*
+ * Record that a job was executed by the calling thread.
+ */
+static void
+pkg_jobs_extract_done(struct pkg_jobs_extract_env *env,
+    struct pkg_jobs_extract_item *it)
+{
+	pthread_mutex_lock(&env->lock);
+	if (it != NULL)
+		it->committed = true;
+	else
+		env->serial_done++;
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+}
+
+/*
+ * Wait for a package to be extracted or deferred to the calling thread.
+ */
+static enum pkg_jobs_extract_state
+pkg_jobs_extract_wait(struct pkg_jobs_extract_env *env,
+    struct pkg_jobs_extract_item *it)
+{
+	enum pkg_jobs_extract_state state;
+
+	pthread_mutex_lock(&env->lock);
+	for (;;) {
+		state = it->state;
+		if (state == EXTRACT_DONE || state == EXTRACT_DEFERRED ||
+		    state == EXTRACT_FAILED)
+			break;
+		if (state == EXTRACT_PENDING &&
+		    (env->failed || env->running == 0)) {
+			state = EXTRACT_FAILED;
+			break;
+		}
+		pthread_cond_wait(&env->cond, &env->lock);
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	return (state);
+}
+
+/*
+ * Stop the workers and remove the packages extracted but not registered.
+ */
+static void
+pkg_jobs_extract_finish(struct pkg_jobs_extract_env *env, struct pkgdb *db)
+{
+	struct pkg_jobs_extract_item *it;
+	int i;
+
+	pthread_mutex_lock(&env->lock);
+	env->failed = true;
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+
+	for (i = 0; i < env->nthreads; i++)
+		pthread_join(env->threads[i], NULL);
+
+	for (i = 0; i < env->nitems; i++) {
+		it = &env->items[i];
+		if (!it->committed)
+			pkg_add_staged_discard(db, it->stage);
+		/* A failure may have stopped the jobs before this item */
+		if (it->state == EXTRACT_FAILED)
+			pkg_event_queue_flush(&it->events);
+		else
+			pkg_event_queue_clear(&it->events);
+	}
+
+	pthread_cond_destroy(&env->cond);
+	pthread_mutex_destroy(&env->lock);
+	pkg_jobs_extract_free(env);
+}
+
+static int
+pkg_jobs_handle_staged(struct pkg_jobs_extract_env *env,
+    struct pkg_jobs_extract_item *it)
+{
+	struct pkg *new = it->ps->items[0]->pkg;
+	struct pkg_stage *stage = it->stage;
+	int retcode;
+
+	pkg_emit_install_begin(new);
+
+	/* The stage is consumed either way */
+	it->stage = NULL;
+	retcode = pkg_add_staged(env->j->db, stage, it->flags, new);
+	pkg_jobs_extract_done(env, it);
+	if (retcode != EPKG_OK) {
+		pkgdb_transaction_rollback(env->j->db->sqlite, "upgrade");
+		return (retcode);
+	}
+
+	pkg_emit_install_finished(new);
+
+	return (EPKG_OK);
+}
+
+/*
+ * When installing while downloading, the files of the packages that were
+ * not in the cache could not be checked for conflicts beforehand.  Wait for
+ * them and check the whole set again, so that they are also checked against
+ * each other, before anything is put in place: a conflict can still be
+ * solved.
+ */
+static int
+pkg_jobs_check_late_conflicts(struct pkg_jobs *j)
+{
+	struct pkg_solved *ps;
+	struct pkg *p;
+	int ret;
+
+	DL_FOREACH(j->jobs, ps) {
+		if (ps->type != PKG_SOLVED_INSTALL &&
+		    ps->type != PKG_SOLVED_UPGRADE)
+			continue;
+		p = ps->items[0]->pkg;
+		if (p->type == PKG_REMOTE && (p->flags & PKG_LOAD_FILES) == 0)
+			break;
+	}
+	if (ps == NULL)
+		return (EPKG_OK);
+
+	if (j->fetcher != NULL &&
+	    (ret = pkg_jobs_fetch_wait(j->fetcher, NULL, true)) != EPKG_OK)
+		return (ret);
+
+	j->conflicts_registered = 0;
+	ret = pkg_jobs_check_conflicts(j);
+	if (ret == EPKG_OK && j->conflicts_registered > 0)
+		ret = EPKG_CONFLICT;
+
+	return (ret);
+}
+
 static int
 pkg_jobs_execute(struct pkg_jobs *j)
 {
 	struct pkg *p = NULL;
 	struct pkg_solved *ps;
 	struct pkg_manifest_key *keys = NULL;
+	struct pkg_jobs_extract_env *extractor;
+	struct pkg_jobs_extract_item *it;
+	enum pkg_jobs_extract_state state;
 	const char *name;
 	int flags = 0;
 	int retcode = EPKG_FATAL;
@@ -1774,7 +2212,35 @@ pkg_jobs_execute(struct pkg_jobs *j)
 
 	pkg_jobs_set_priorities(j);
 
+	extractor = pkg_jobs_extract_new(j, keys);
+
+	/* New packages are only staged by the extractor meanwhile */
+	if (j->late_conflicts &&
+	    (retcode = pkg_jobs_check_late_conflicts(j)) != EPKG_OK)
+		goto cleanup;
+
 	DL_FOREACH(j->jobs, ps) {
+		it = NULL;
+		if (extractor != NULL &&
+		    (it = pkg_jobs_extract_find(extractor, ps)) != NULL) {
+			state = pkg_jobs_extract_wait(extractor, it);
+			pkg_event_queue_flush(&it->events);
+			switch (state) {
+			case EXTRACT_DONE:
+				retcode = pkg_jobs_handle_staged(extractor, it);
+				if (retcode != EPKG_OK)
+					goto cleanup;
+				continue;
+			case EXTRACT_DEFERRED:
+				break;
+			default:
+				retcode = EPKG_FATAL;
+				pkgdb_transaction_rollback(j->db->sqlite,
+				    "upgrade");
+				goto cleanup;
+			}
+		}
+
 		switch (ps->type) {
 		case PKG_SOLVED_DELETE:
 		case PKG_SOLVED_UPGRADE_REMOVE:
@@ -1785,7 +2251,8 @@ pkg_jobs_execute(struct pkg_jobs *j)
 			    strcmp(name, "pkg-devel") == 0) &&
 			    (flags & PKG_DELETE_FORCE) == 0) {
 				pkg_emit_error("Cannot delete pkg itself without force flag");
-				continue;
+				/* Still a serial job done for the extractor */
+				break;
 			}
 			/*
 			 * Assume that in upgrade we can remove packages with rdeps as
@@ -1817,9 +2284,13 @@ pkg_jobs_execute(struct pkg_jobs *j)
 			break;
 		}
 
+		if (extractor != NULL)
+			pkg_jobs_extract_done(extractor, it);
 	}
 
 cleanup:
+	if (extractor != NULL)
+		pkg_jobs_extract_finish(extractor, j->db);
 	pkgdb_transaction_commit(j->db->sqlite, "upgrade");
 	pkgdb_release_lock(j->db, PKGDB_LOCK_EXCLUSIVE);
 	pkg_manifest_keys_free(keys);
@@ -1827,6 +2298,91 @@ cleanup:
 	return (retcode);
 }
 
+static bool
+pkg_jobs_can_stream(struct pkg_jobs *j)
+{
+	if (j->type != PKG_JOBS_INSTALL && j->type != PKG_JOBS_UPGRADE)
+		return (false);
+	if (j->flags & (PKG_FLAG_DRY_RUN|PKG_FLAG_SKIP_INSTALL|
+	    PKG_FLAG_FETCH_MIRROR))
+		return (false);
+
+	return (pkg_object_bool(pkg_config_get("INSTALL_WHILE_FETCHING")));
+}
+
+/*
+ * Install packages while the later ones are still being downloaded.
+ * Conflicts are checked beforehand for the packages already in the cache.
+ * On the first run, the others are only extracted until they are all
+ * downloaded and checked too; once solved, the jobs are executed in
+ * priority order, each install waiting only for its own package.
+ */
+static int
+pkg_jobs_apply_stream(struct pkg_jobs *j, pkg_plugin_hook_t pre)
+{
+	bool has_conflicts = false;
+	int rc = EPKG_OK, frc;
+
+	if (j->solved == 1) {
+		do {
+			j->conflicts_registered = 0;
+			rc = pkg_jobs_check_conflicts(j);
+			if (rc == EPKG_CONFLICT) {
+				/* Cleanup results */
+				LL_FREE(j->jobs, free);
+				j->jobs = NULL;
+				j->count = 0;
+				has_conflicts = true;
+				rc = pkg_jobs_solve(j);
+			}
+			else
+				break;
+		} while (j->conflicts_registered > 0);
+
+		if (has_conflicts) {
+			if (j->conflicts_registered == 0)
+				pkg_jobs_set_priorities(j);
+
+			return (EPKG_CONFLICT);
+		}
+		if (rc != EPKG_OK)
+			return (rc);
+	}
+
+	/* Downloads are queued in the order the jobs will run */
+	pkg_jobs_set_priorities(j);
+
+	pkg_plugins_hook_run(PKG_PLUGIN_HOOK_PRE_FETCH, j, j->db);
+	rc = pkg_jobs_fetch(j, true);
+	if (rc == EPKG_OK) {
+		pkg_plugins_hook_run(pre, j, j->db);
+		j->late_conflicts = (j->solved == 1);
+		rc = pkg_jobs_execute(j);
+		j->late_conflicts = false;
+	}
+	if (j->fetcher != NULL) {
+		frc = pkg_jobs_fetch_finish(j->fetcher, rc != EPKG_OK);
+		j->fetcher = NULL;
+		if (rc == EPKG_OK)
+			rc = frc;
+	}
+	pkg_plugins_hook_run(PKG_PLUGIN_HOOK_POST_FETCH, j, j->db);
+
+	/* Found before installing anything: solve again as above */
+	if (rc == EPKG_CONFLICT) {
+		LL_FREE(j->jobs, free);
+		j->jobs = NULL;
+		j->count = 0;
+		if ((rc = pkg_jobs_solve(j)) != EPKG_OK)
+			return (rc);
+		pkg_jobs_set_priorities(j);
+
+		return (EPKG_CONFLICT);
+	}
+
+	return (rc);
+}
+
 int
 pkg_jobs_apply(struct pkg_jobs *j)
 {
@@ -1861,9 +2417,14 @@ pkg_jobs_apply(struct pkg_jobs *j)
 	case PKG_JOBS_UPGRADE:
 	case PKG_JOBS_DEINSTALL:
 	case PKG_JOBS_AUTOREMOVE:
-		if (j->need_fetch) {
+		if (j->need_fetch && pkg_jobs_can_stream(j)) {
+			rc = pkg_jobs_apply_stream(j, pre);
+			if (rc == EPKG_CONFLICT)
+				return (rc);
+		}
+		else if (j->need_fetch) {
 			pkg_plugins_hook_run(PKG_PLUGIN_HOOK_PRE_FETCH, j, j->db);
-			rc = pkg_jobs_fetch(j);
+			rc = pkg_jobs_fetch(j, false);
 			pkg_plugins_hook_run(PKG_PLUGIN_HOOK_POST_FETCH, j, j->db);
 			if (rc == EPKG_OK) {
 				/* Check local conflicts in the first run */
@@ -1909,7 +2470,7 @@ pkg_jobs_apply(struct pkg_jobs *j)
 		break;
 	case PKG_JOBS_FETCH:
 		pkg_plugins_hook_run(PKG_PLUGIN_HOOK_PRE_FETCH, j, j->db);
-		rc = pkg_jobs_fetch(j);
+		rc = pkg_jobs_fetch(j, false);
 		pkg_plugins_hook_run(PKG_PLUGIN_HOOK_POST_FETCH, j, j->db);
 		break;
 	default:
@@ -1922,8 +2483,353 @@ pkg_jobs_apply(struct pkg_jobs *j)
 }
 
 
+struct pkg_jobs_fetch_slot {
+	struct pkg_repo *repo;
+	int limit;
+	int active;
+};
+
+enum pkg_jobs_fetch_state {
+	FETCH_PENDING = 0,
+	FETCH_RUNNING,
+	FETCH_DONE,
+	FETCH_FAILED
+};
+
+struct pkg_jobs_fetch_env {
+	struct pkg **pkgs;
+	enum pkg_jobs_fetch_state *state;
+	int npkgs;
+	int pending;
+	struct pkg_jobs_fetch_slot *slots;
+	int nslots;
+	const char *cachedir;
+	bool mirror;
+	bool failed;
+	int64_t dlsize;
+	pthread_t *threads;
+	int nthreads;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
 static int
-pkg_jobs_fetch(struct pkg_jobs *j)
+pkg_jobs_fetch_limit(struct pkg_repo *repo)
+{
+	const char *url = pkg_repo_url(repo);
+	int64_t limit;
+
+	/* All requests to a ssh repository share one pipe */
+	if (strncmp(url, "ssh://", 6) == 0 ||
+	    strncmp(url, "pkg+ssh://", 10) == 0)
+		return (1);
+
+	if (repo->fetch_concurrency > 0)
+		limit = repo->fetch_concurrency;
+	else
+		limit = pkg_object_int(pkg_config_get("FETCH_CONCURRENCY"));
+
+	return (limit > 0 ? limit : 1);
+}
+
+static struct pkg_jobs_fetch_slot *
+pkg_jobs_fetch_slot(struct pkg_jobs_fetch_env *env, struct pkg_repo *repo)
+{
+	int i;
+
+	for (i = 0; i < env->nslots; i++)
+		if (env->slots[i].repo == repo)
+			return (&env->slots[i]);
+
+	return (NULL);
+}
+
+static void *
+pkg_jobs_fetch_worker(void *arg)
+{
+	struct pkg_jobs_fetch_env *env = arg;
+	struct pkg_jobs_fetch_slot *slot;
+	int i, rc;
+
+	pthread_mutex_lock(&env->lock);
+	while (!env->failed && env->pending > 0) {
+		/*
+		 * Take the first pending package whose repository has a free
+		 * slot: the list is in installation order.
+		 */
+		for (i = 0; i < env->npkgs; i++) {
+			if (env->state[i] != FETCH_PENDING)
+				continue;
+			slot = pkg_jobs_fetch_slot(env, env->pkgs[i]->repo);
+			if (slot->active < slot->limit)
+				break;
+		}
+		if (i == env->npkgs) {
+			pthread_cond_wait(&env->cond, &env->lock);
+			continue;
+		}
+		env->state[i] = FETCH_RUNNING;
+		slot->active++;
+		env->pending--;
+		pthread_mutex_unlock(&env->lock);
+
+		if (env->mirror)
+			rc = pkg_repo_mirror_package(env->pkgs[i], env->cachedir);
+		else
+			rc = pkg_repo_fetch_package(env->pkgs[i]);
+
+		pthread_mutex_lock(&env->lock);
+		slot->active--;
+		if (rc == EPKG_OK) {
+			env->state[i] = FETCH_DONE;
+		} else {
+			env->state[i] = FETCH_FAILED;
+			env->failed = true;
+		}
+		pthread_cond_broadcast(&env->cond);
+	}
+	env->running--;
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+
+	return (NULL);
+}
+
+static void
+pkg_jobs_fetch_free(struct pkg_jobs_fetch_env *env)
+{
+	free(env->pkgs);
+	free(env->state);
+	free(env->slots);
+	free(env->threads);
+	free(env);
+}
+
+/*
+ * Prepare the download of the packages, which must be given in installation
+ * order.  Takes ownership of pkgs.  The number of threads allowed by the
+ * per-repository limits is returned in nthreads.
+ */
+static struct pkg_jobs_fetch_env *
+pkg_jobs_fetch_new(struct pkg **pkgs, int npkgs, int64_t dlsize,
+    const char *cachedir, bool mirror, int *nthreads)
+{
+	struct pkg_jobs_fetch_env *env;
+	struct pkg_jobs_fetch_slot *slot;
+	int i;
+
+	env = calloc(1, sizeof(struct pkg_jobs_fetch_env));
+	if (env == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_jobs_fetch_env");
+		free(pkgs);
+		return (NULL);
+	}
+
+	env->pkgs = pkgs;
+	env->npkgs = npkgs;
+	env->pending = npkgs;
+	env->dlsize = dlsize;
+	env->cachedir = cachedir;
+	env->mirror = mirror;
+	env->state = calloc(npkgs, sizeof(enum pkg_jobs_fetch_state));
+	env->slots = calloc(npkgs, sizeof(struct pkg_jobs_fetch_slot));
+	if (env->state == NULL || env->slots == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_jobs_fetch_slot");
+		pkg_jobs_fetch_free(env);
+		return (NULL);
+	}
+
+	/* One thread per transfer allowed, but never more than needed */
+	*nthreads = 0;
+	for (i = 0; i < npkgs; i++) {
+		slot = pkg_jobs_fetch_slot(env, pkgs[i]->repo);
+		if (slot == NULL) {
+			slot = &env->slots[env->nslots++];
+			slot->repo = pkgs[i]->repo;
+			slot->limit = pkg_jobs_fetch_limit(slot->repo);
+		}
+		if (slot->active < slot->limit) {
+			slot->active++;
+			(*nthreads)++;
+		}
+	}
+	for (i = 0; i < env->nslots; i++)
+		env->slots[i].active = 0;
+
+	pthread_mutex_init(&env->lock, NULL);
+	pthread_cond_init(&env->cond, NULL);
+
+	return (env);
+}
+
+static int
+pkg_jobs_fetch_start(struct pkg_jobs_fetch_env *env, int nthreads)
+{
+	env->threads = calloc(nthreads, sizeof(pthread_t));
+	if (env->threads == NULL) {
+		pkg_emit_errno("calloc", "pthread_t");
+		return (EPKG_FATAL);
+	}
+
+	pkg_fetch_progress_begin();
+
+	pthread_mutex_lock(&env->lock);
+	for (env->nthreads = 0; env->nthreads < nthreads; env->nthreads++) {
+		if (pthread_create(&env->threads[env->nthreads], NULL,
+		    pkg_jobs_fetch_worker, env) != 0) {
+			pkg_emit_errno("pthread_create", "package fetcher");
+			env->failed = true;
+			break;
+		}
+		env->running++;
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	return (env->nthreads > 0 ? EPKG_OK : EPKG_FATAL);
+}
+
+/*
+ * Report the overall download progress, after waiting a bit for a worker.
+ * Called with the lock held.
+ */
+static void
+pkg_jobs_fetch_progress(struct pkg_jobs_fetch_env *env)
+{
+	struct timespec ts;
+	int64_t done;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&env->cond, &env->lock, &ts);
+	pthread_mutex_unlock(&env->lock);
+	done = pkg_fetch_progress_get();
+	pkg_emit_progress_tick(MIN(done, env->dlsize), env->dlsize);
+	pthread_mutex_lock(&env->lock);
+}
+
+/*
+ * Block until the given package, or all of them if p is NULL, has been
+ * downloaded and verified.  Packages not handled by the fetcher are
+ * considered ready.  If progress is set, the overall progress of the
+ * downloads is reported while waiting.
+ */
+static int
+pkg_jobs_fetch_wait(struct pkg_jobs_fetch_env *env, struct pkg *p,
+    bool progress)
+{
+	int i, last, ret = EPKG_OK;
+	bool started = false;
+
+	if (p == NULL) {
+		i = 0;
+		last = env->npkgs;
+	} else {
+		for (i = 0; i < env->npkgs; i++)
+			if (env->pkgs[i] == p)
+				break;
+		if (i == env->npkgs)
+			return (EPKG_OK);
+		last = i + 1;
+	}
+
+	pthread_mutex_lock(&env->lock);
+	while (i < last) {
+		if (env->state[i] == FETCH_DONE) {
+			i++;
+			continue;
+		}
+		if (env->state[i] == FETCH_FAILED ||
+		    (env->state[i] == FETCH_PENDING &&
+		    (env->failed || env->running == 0))) {
+			ret = EPKG_FATAL;
+			break;
+		}
+		if (!progress) {
+			pthread_cond_wait(&env->cond, &env->lock);
+			continue;
+		}
+		if (!started) {
+			pthread_mutex_unlock(&env->lock);
+			pkg_emit_progress_start("Fetching %d packages",
+			    env->npkgs);
+			pthread_mutex_lock(&env->lock);
+			started = true;
+		}
+		pkg_jobs_fetch_progress(env);
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	if (started && ret == EPKG_OK && p == NULL)
+		pkg_emit_progress_tick(env->dlsize, env->dlsize);
+
+	return (ret);
+}
+
+/*
+ * Wait for the workers to exit and release the fetcher.  If abort is set,
+ * downloads not yet started are dropped.
+ */
+static int
+pkg_jobs_fetch_finish(struct pkg_jobs_fetch_env *env, bool abort)
+{
+	int i, ret = EPKG_FATAL;
+
+	pthread_mutex_lock(&env->lock);
+	if (abort)
+		env->failed = true;
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+
+	for (i = 0; i < env->nthreads; i++)
+		pthread_join(env->threads[i], NULL);
+
+	pkg_fetch_progress_end();
+
+	if (!env->failed && env->pending == 0)
+		ret = EPKG_OK;
+
+	pthread_cond_destroy(&env->cond);
+	pthread_mutex_destroy(&env->lock);
+	pkg_jobs_fetch_free(env);
+
+	return (ret);
+}
+
+/*
+ * Download the packages with up to FETCH_CONCURRENCY transfers per
+ * repository.  The checksum of each package is verified by the worker which
+ * downloaded it, so it overlaps with the transfers still running.
+ */
+static int
+pkg_jobs_fetch_parallel(struct pkg_jobs_fetch_env *env, int nthreads)
+{
+	int64_t dlsize = env->dlsize;
+	int ret;
+
+	pkg_emit_progress_start("Fetching %d packages", env->npkgs);
+
+	ret = pkg_jobs_fetch_start(env, nthreads);
+	if (ret == EPKG_OK) {
+		pthread_mutex_lock(&env->lock);
+		while (env->running > 0)
+			pkg_jobs_fetch_progress(env);
+		pthread_mutex_unlock(&env->lock);
+	}
+
+	if (pkg_jobs_fetch_finish(env, ret != EPKG_OK) != EPKG_OK)
+		return (EPKG_FATAL);
+	pkg_emit_progress_tick(dlsize, dlsize);
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_jobs_fetch(struct pkg_jobs *j, bool stream)
 {
 	struct pkg *p = NULL;
 	struct pkg_solved *ps;
@@ -1933,6 +2839,10 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 	const char *cachedir = NULL, *repopath;
 	char cachedpath[MAXPATHLEN];
 	bool mirror = (j->flags & PKG_FLAG_FETCH_MIRROR) ? true : false;
+	struct pkg **pkgs = NULL, **tmp;
+	struct pkg_jobs_fetch_env *env;
+	int npkgs = 0, cappkgs = 0, nthreads, i;
+	int ret = EPKG_FATAL;
 
 	
 	if (j->destdir == NULL || !mirror)
@@ -1998,19 +2908,55 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 			p = ps->items[0]->pkg;
 			if (p->type != PKG_REMOTE)
 				continue;
-
-			if (mirror) {
-				if (pkg_repo_mirror_package(p, cachedir) != EPKG_OK)
-					return (EPKG_FATAL);
+			if (p->repo == NULL) {
+				pkg_emit_error("Trying to fetch package without repository");
+				goto cleanup;
 			}
-			else {
-				if (pkg_repo_fetch_package(p) != EPKG_OK)
-					return (EPKG_FATAL);
+			if (npkgs == cappkgs) {
+				cappkgs = cappkgs == 0 ? 64 : cappkgs * 2;
+				tmp = realloc(pkgs, cappkgs * sizeof(struct pkg *));
+				if (tmp == NULL) {
+					pkg_emit_errno("realloc", "pkg_jobs_fetch");
+					goto cleanup;
+				}
+				pkgs = tmp;
 			}
+			pkgs[npkgs++] = p;
 		}
 	}
 
-	return (EPKG_OK);
+	env = pkg_jobs_fetch_new(pkgs, npkgs, dlsize, cachedir, mirror,
+	    &nthreads);
+	pkgs = NULL;
+	if (env == NULL)
+		goto cleanup;
+
+	if (stream) {
+		/* Packages are waited for by pkg_jobs_handle_install() */
+		if ((ret = pkg_jobs_fetch_start(env, nthreads)) != EPKG_OK)
+			pkg_jobs_fetch_finish(env, true);
+		else
+			j->fetcher = env;
+	} else if (nthreads > 1) {
+		ret = pkg_jobs_fetch_parallel(env, nthreads);
+	} else {
+		for (i = 0; i < env->npkgs; i++) {
+			if (mirror)
+				ret = pkg_repo_mirror_package(env->pkgs[i], cachedir);
+			else
+				ret = pkg_repo_fetch_package(env->pkgs[i]);
+			if (ret != EPKG_OK) {
+				ret = EPKG_FATAL;
+				break;
+			}
+		}
+		pkg_jobs_fetch_finish(env, false);
+	}
+
+cleanup:
+	free(pkgs);
+
+	return (ret);
 }
 
 static int
@@ -44,17 +44,12 @@ struct pkg_conflict_chain {
 static int
 pkg_conflicts_chain_cmp_cb(struct pkg_conflict_chain *a, struct pkg_conflict_chain *b)
 {
-	const char *vera, *verb;
-
 	if (a->req->skip || b->req->skip) {
 		return (a->req->skip - b->req->skip);
 	}
 
-	pkg_get(a->req->item->pkg, PKG_VERSION, &vera);
-	pkg_get(b->req->item->pkg, PKG_VERSION, &verb);
-
 	/* Inverse sort to get the maximum version as the first element */
-	return (pkg_version_cmp(vera, verb));
+	return (pkg_version_cmp_pkg(a->req->item->pkg, b->req->item->pkg));
 }
 
 static int
@@ -57,7 +57,7 @@ pkg_jobs_universe_get_local(struct pkg_jobs_universe *universe,
 			flag = PKG_LOAD_BASIC|PKG_LOAD_RDEPS|PKG_LOAD_DEPS|PKG_LOAD_ANNOTATIONS;
 	}
 
-	HASH_FIND(hh, universe->items, uid, strlen(uid), unit);
+	unit = pkg_jobs_universe_find(universe, uid);
 	if (unit != NULL && unit->pkg->type == PKG_INSTALLED) {
 		pkgdb_ensure_loaded(universe->j->db, unit->pkg, flag);
 		return (unit->pkg);
@@ -81,6 +81,8 @@ pkg_jobs_universe_get_remote(struct pkg_jobs_universe *universe,
 	struct pkg *pkg = NULL, *selected = NULL;
 	struct pkgdb_it *it;
 	struct pkg_job_universe_item *unit;
+	struct pkg_job_cached_remote *cr = NULL;
+	const char *iuid;
 
 	if (flag == 0) {
 		flag = PKG_LOAD_BASIC|PKG_LOAD_DEPS|PKG_LOAD_OPTIONS|
@@ -88,12 +90,22 @@ pkg_jobs_universe_get_remote(struct pkg_jobs_universe *universe,
 				PKG_LOAD_ANNOTATIONS|PKG_LOAD_CONFLICTS;
 	}
 
-	HASH_FIND(hh, universe->items, uid, strlen(uid), unit);
+	unit = pkg_jobs_universe_find(universe, uid);
 	if (unit != NULL && unit->pkg->type != PKG_INSTALLED) {
 		pkgdb_ensure_loaded(universe->j->db, unit->pkg, flag);
 		return (unit->pkg);
 	}
 
+	/* Fetched ahead by pkg_jobs_universe_prefetch() */
+	if ((iuid = pkg_intern_find(uid)) != NULL)
+		HASH_FIND_PTR(universe->remote_cache, &iuid, cr);
+	if (cr != NULL && cr->pkg != NULL) {
+		selected = cr->pkg;
+		cr->pkg = NULL;
+		pkgdb_ensure_loaded(universe->j->db, selected, flag);
+		return (selected);
+	}
+
 	if ((it = pkgdb_repo_query(universe->j->db, uid, MATCH_EXACT,
 		universe->j->reponame)) == NULL)
 		return (NULL);
@@ -142,7 +154,7 @@ pkg_jobs_universe_add_pkg(struct pkg_jobs_universe *universe, struct pkg *pkg,
 		pkg_get(pkg, PKG_DIGEST, &digest);
 	}
 
-	HASH_FIND_STR(universe->seen, digest, seen);
+	seen = pkg_jobs_universe_seen(universe, digest);
 	if (seen != NULL && !force) {
 		if (found != NULL)
 			*found = seen->un;
@@ -161,10 +173,15 @@ pkg_jobs_universe_add_pkg(struct pkg_jobs_universe *universe, struct pkg *pkg,
 	}
 
 	item->pkg = pkg;
+	item->uid = pkg_intern(uid);
+	if (item->uid == NULL) {
+		free(item);
+		return (EPKG_FATAL);
+	}
 
-	HASH_FIND_STR(universe->items, uid, tmp);
+	tmp = pkg_jobs_universe_find_interned(universe, item->uid);
 	if (tmp == NULL)
-		HASH_ADD_KEYPTR(hh, universe->items, uid, strlen(uid), item);
+		HASH_ADD_PTR(universe->items, uid, item);
 
 	DL_APPEND(tmp, item);
 
@@ -174,10 +191,12 @@ pkg_jobs_universe_add_pkg(struct pkg_jobs_universe *universe, struct pkg *pkg,
 			pkg_emit_errno("pkg_jobs_universe_add_pkg", "calloc: struct pkg_job_seen)");
 			return (EPKG_FATAL);
 		}
-		seen->digest = digest;
+		if ((seen->digest = pkg_intern(digest)) == NULL) {
+			free(seen);
+			return (EPKG_FATAL);
+		}
 		seen->un = item;
-		HASH_ADD_KEYPTR(hh, universe->seen, seen->digest, strlen(seen->digest),
-			seen);
+		HASH_ADD_PTR(universe->seen, digest, seen);
 	}
 
 	universe->nitems++;
@@ -209,7 +228,7 @@ pkg_jobs_universe_process_deps(struct pkg_jobs_universe *universe,
 		deps_func = pkg_deps;
 
 	while (deps_func(pkg, &d) == EPKG_OK) {
-		HASH_FIND_STR(universe->items, d->uid, unit);
+		unit = pkg_jobs_universe_find_interned(universe, d->uid);
 		if (unit != NULL)
 			continue;
 
@@ -280,7 +299,7 @@ pkg_jobs_universe_process_conflicts(struct pkg_jobs_universe *universe,
 	struct pkg *npkg;
 
 	while (pkg_conflicts(pkg, &c) == EPKG_OK) {
-		HASH_FIND_STR(universe->items, pkg_conflict_uniqueid(c), unit);
+		unit = pkg_jobs_universe_find(universe, pkg_conflict_uniqueid(c));
 		if (unit != NULL)
 			continue;
 
@@ -316,126 +335,177 @@ pkg_jobs_universe_process_conflicts(struct pkg_jobs_universe *universe,
 }
 
 
+/*
+ * Register `rpkg' as a provider of `shname', adding it to the universe if it
+ * is newer than the local package.  `taken' tells whether the universe now
+ * owns `rpkg'.
+ * @return EPKG_END if `rpkg' has been skipped
+ */
+static int
+pkg_jobs_universe_process_provide(struct pkg_jobs_universe *universe,
+	const char *shname, struct pkg *rpkg, struct pkg_job_provide **prhead,
+	bool *taken)
+{
+	struct pkg_job_universe_item *unit;
+	struct pkg_job_provide *pr, *head;
+	struct pkg *npkg;
+	const char *digest, *uid;
+	int rc;
+
+	*taken = false;
+	pkg_get(rpkg, PKG_DIGEST, &digest, PKG_UNIQUEID, &uid);
+	/* Check for local packages */
+	unit = pkg_jobs_universe_find(universe, uid);
+	if (unit != NULL) {
+		if (pkg_jobs_need_upgrade (rpkg, unit->pkg)) {
+			/* Remote provide is newer, so we can add it */
+			rc = pkg_jobs_universe_process_item(universe, rpkg, &unit);
+			*taken = (unit != NULL && unit->pkg == rpkg);
+			if (rc != EPKG_OK)
+				return (EPKG_END);
+		}
+	}
+	else {
+		/* Maybe local package has just been not added */
+		npkg = pkg_jobs_universe_get_local(universe, uid, 0);
+		if (npkg != NULL) {
+			if (pkg_jobs_universe_process_item(universe, npkg,
+				&unit) != EPKG_OK)
+				return (EPKG_FATAL);
+			if (pkg_jobs_need_upgrade (rpkg, npkg)) {
+				/* Remote provide is newer, so we can add it */
+				rc = pkg_jobs_universe_process_item(universe, rpkg,
+					&unit);
+				*taken = (unit != NULL && unit->pkg == rpkg);
+				if (rc != EPKG_OK)
+					return (EPKG_END);
+			}
+		}
+	}
+
+	/* Skip seen packages */
+	if (unit == NULL) {
+		struct pkg_job_seen *seen;
+
+		if (digest == NULL) {
+			pkg_debug(3, "no digest found for package %s", uid);
+			if (pkg_checksum_calculate(rpkg, universe->j->db) != EPKG_OK) {
+				return (EPKG_FATAL);
+			}
+			pkg_get(rpkg, PKG_DIGEST, &digest);
+		}
+		seen = pkg_jobs_universe_seen(universe, digest);
+		if (seen == NULL) {
+			pkg_jobs_universe_process_item(universe, rpkg,
+				&unit);
+			*taken = (unit != NULL && unit->pkg == rpkg);
+		}
+		else {
+			unit = seen->un;
+		}
+	}
+
+	pr = calloc (1, sizeof (*pr));
+	if (pr == NULL) {
+		pkg_emit_errno("pkg_jobs_add_universe", "calloc: "
+			"struct pkg_job_provide");
+		return (EPKG_FATAL);
+	}
+
+	pr->un = unit;
+	pr->provide = shname;
+
+	head = *prhead;
+	if (head == NULL) {
+		DL_APPEND(head, pr);
+		HASH_ADD_PTR(universe->provides, provide, head);
+	}
+	else {
+		DL_APPEND(head, pr);
+	}
+	*prhead = head;
+
+	return (EPKG_OK);
+}
+
 static int
 pkg_jobs_universe_process_shlibs(struct pkg_jobs_universe *universe,
 	struct pkg *pkg)
 {
 	struct pkg_shlib *shlib = NULL;
-	struct pkg_job_universe_item *unit;
 	struct pkg_job_provide *pr, *prhead;
+	struct pkg_job_cached_provide *cp;
 	struct pkgdb_it *it;
-	struct pkg *npkg, *rpkg;
+	struct pkg *rpkg;
+	const char *shname;
+	size_t i;
+	bool taken;
+	int rc;
 	unsigned flags = PKG_LOAD_BASIC|PKG_LOAD_OPTIONS|PKG_LOAD_DEPS|
 				PKG_LOAD_SHLIBS_REQUIRED|PKG_LOAD_SHLIBS_PROVIDED|
 				PKG_LOAD_ANNOTATIONS|PKG_LOAD_CONFLICTS;
 
 	while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
-		HASH_FIND_STR(universe->provides, pkg_shlib_name(shlib), pr);
+		shname = pkg_shlib_name(shlib);
+		HASH_FIND_PTR(universe->provides, &shname, pr);
 		if (pr != NULL)
 			continue;
 
-		/* Not found, search in the repos */
-		it = pkgdb_repo_shlib_provide(universe->j->db,
-			pkg_shlib_name(shlib), universe->j->reponame);
-		if (it != NULL) {
+		prhead = NULL;
+		HASH_FIND_PTR(universe->provide_cache, &shname, cp);
+		if (cp != NULL) {
+			/* Providers have been fetched ahead */
+			for (i = 0; i < cp->npkgs; i++) {
+				rc = pkg_jobs_universe_process_provide(universe, shname,
+					cp->pkgs[i]->pkg, &prhead, &taken);
+				if (taken)
+					cp->pkgs[i]->taken = true;
+				if (rc == EPKG_FATAL)
+					return (rc);
+			}
+		}
+		else {
+			/* Not found, search in the repos */
+			it = pkgdb_repo_shlib_provide(universe->j->db,
+				shname, universe->j->reponame);
+			if (it == NULL)
+				continue;
+
 			rpkg = NULL;
-			prhead = NULL;
 			while (pkgdb_it_next(it, &rpkg, flags) == EPKG_OK) {
-				const char *digest, *uid;
-
-				pkg_get(rpkg, PKG_DIGEST, &digest, PKG_UNIQUEID, &uid);
-				/* Check for local packages */
-				HASH_FIND_STR(universe->items, uid, unit);
-				if (unit != NULL) {
-					if (pkg_jobs_need_upgrade (rpkg, unit->pkg)) {
-						/* Remote provide is newer, so we can add it */
-						if (pkg_jobs_universe_process_item(universe, rpkg,
-							&unit) != EPKG_OK)
-							continue;
-
-						rpkg = NULL;
-					}
-				}
-				else {
-					/* Maybe local package has just been not added */
-					npkg = pkg_jobs_universe_get_local(universe, uid, 0);
-					if (npkg != NULL) {
-						if (pkg_jobs_universe_process_item(universe, npkg,
-							&unit) != EPKG_OK)
-							return (EPKG_FATAL);
-						if (pkg_jobs_need_upgrade (rpkg, npkg)) {
-							/* Remote provide is newer, so we can add it */
-							if (pkg_jobs_universe_process_item(universe, rpkg,
-								&unit) != EPKG_OK)
-								continue;
-						}
-					}
-				}
-
-				/* Skip seen packages */
-				if (unit == NULL) {
-					struct pkg_job_seen *seen;
-
-					if (digest == NULL) {
-						pkg_debug(3, "no digest found for package %s", uid);
-						if (pkg_checksum_calculate(pkg, universe->j->db) != EPKG_OK) {
-							return (EPKG_FATAL);
-						}
-						pkg_get(pkg, PKG_DIGEST, &digest);
-					}
-					HASH_FIND_STR(universe->seen, digest, seen);
-					if (seen == NULL) {
-						pkg_jobs_universe_process_item(universe, rpkg,
-							&unit);
-
-						/* Reset package to avoid freeing */
-						rpkg = NULL;
-					}
-					else {
-						unit = seen->un;
-					}
-				}
-
-				pr = calloc (1, sizeof (*pr));
-				if (pr == NULL) {
-					pkg_emit_errno("pkg_jobs_add_universe", "calloc: "
-						"struct pkg_job_provide");
-					return (EPKG_FATAL);
-				}
-
-				pr->un = unit;
-				pr->provide = pkg_shlib_name(shlib);
-
-				if (prhead == NULL) {
-					DL_APPEND(prhead, pr);
-					HASH_ADD_KEYPTR(hh, universe->provides, pr->provide,
-						strlen(pr->provide), prhead);
-				}
-				else {
-					DL_APPEND(prhead, pr);
+				rc = pkg_jobs_universe_process_provide(universe, shname,
+					rpkg, &prhead, &taken);
+				/* Reset package to avoid freeing */
+				if (taken)
+					rpkg = NULL;
+				if (rc == EPKG_FATAL) {
+					pkg_free(rpkg);
+					pkgdb_it_free(it);
+					return (rc);
 				}
 			}
+			pkg_free(rpkg);
 			pkgdb_it_free(it);
-			if (prhead == NULL) {
-				const char *name;
-
-				pkg_get(pkg, PKG_NAME, &name);
-				pkg_debug(1, "cannot find packages that provide %s required for %s",
-					pkg_shlib_name(shlib), name);
-				/*
-				 * XXX: this is not normal but it is very common for the existing
-				 * repos, hence we just ignore this stale dependency
-				 */
-			}
+		}
+
+		if (prhead == NULL) {
+			const char *name;
+
+			pkg_get(pkg, PKG_NAME, &name);
+			pkg_debug(1, "cannot find packages that provide %s required for %s",
+				shname, name);
+			/*
+			 * XXX: this is not normal but it is very common for the existing
+			 * repos, hence we just ignore this stale dependency
+			 */
 		}
 	}
 
 	return (EPKG_OK);
 }
 
-int
-pkg_jobs_universe_process_item(struct pkg_jobs_universe *universe, struct pkg *pkg,
-		struct pkg_job_universe_item **result)
+static int
+pkg_jobs_universe_expand(struct pkg_jobs_universe *universe, struct pkg *pkg)
 {
 	unsigned flags = 0, job_flags;
 	int rc = EPKG_OK;
@@ -443,13 +513,6 @@ pkg_jobs_universe_process_item(struct pkg_jobs_universe *universe, struct pkg *p
 
 	job_flags = universe->j->flags;
 
-	/* Add pkg itself */
-	rc = pkg_jobs_universe_add_pkg(universe, pkg, false, result);
-	if (rc == EPKG_END)
-		return (EPKG_OK);
-	else if (rc != EPKG_OK)
-		return (rc);
-
 	/* Convert jobs flags to dependency logical flags */
 	if (job_flags & PKG_FLAG_FORCE_MISSING)
 		flags |= DEPS_FLAG_FORCE_MISSING;
@@ -498,6 +561,350 @@ pkg_jobs_universe_process_item(struct pkg_jobs_universe *universe, struct pkg *p
 	return (rc);
 }
 
+/* Stay well below SQLITE_MAX_VARIABLE_NUMBER */
+#define PREFETCH_CHUNK 128
+
+struct pkg_jobs_prefetch_list {
+	const char **names;
+	size_t n;
+	size_t size;
+};
+
+static int
+pkg_jobs_prefetch_list_add(struct pkg_jobs_prefetch_list *l, const char *name)
+{
+	const char **names;
+
+	if (l->n == l->size) {
+		l->size = l->size == 0 ? PREFETCH_CHUNK : l->size * 2;
+		names = realloc(l->names, l->size * sizeof(*names));
+		if (names == NULL) {
+			pkg_emit_errno("realloc", "pkg_jobs_prefetch_list");
+			return (EPKG_FATAL);
+		}
+		l->names = names;
+	}
+	l->names[l->n++] = name;
+
+	return (EPKG_OK);
+}
+
+static void
+pkg_jobs_prefetch_uid(struct pkg_jobs_universe *universe,
+	struct pkg_jobs_prefetch_list *l, const char *uid)
+{
+	struct pkg_job_cached_remote *cr;
+
+	if (uid == NULL || pkg_jobs_universe_find_interned(universe, uid) != NULL)
+		return;
+
+	HASH_FIND_PTR(universe->remote_cache, &uid, cr);
+	if (cr != NULL)
+		return;
+
+	cr = calloc(1, sizeof(*cr));
+	if (cr == NULL) {
+		pkg_emit_errno("calloc", "pkg_job_cached_remote");
+		return;
+	}
+	cr->uid = uid;
+	if (pkg_jobs_prefetch_list_add(l, uid) != EPKG_OK) {
+		free(cr);
+		return;
+	}
+	HASH_ADD_PTR(universe->remote_cache, uid, cr);
+}
+
+static void
+pkg_jobs_prefetch_shlib(struct pkg_jobs_universe *universe,
+	struct pkg_jobs_prefetch_list *l, const char *shname)
+{
+	struct pkg_job_cached_provide *cp;
+	struct pkg_job_provide *pr;
+
+	HASH_FIND_PTR(universe->provides, &shname, pr);
+	if (pr != NULL)
+		return;
+
+	HASH_FIND_PTR(universe->provide_cache, &shname, cp);
+	if (cp != NULL)
+		return;
+
+	cp = calloc(1, sizeof(*cp));
+	if (cp == NULL) {
+		pkg_emit_errno("calloc", "pkg_job_cached_provide");
+		return;
+	}
+	cp->provide = shname;
+	if (pkg_jobs_prefetch_list_add(l, shname) != EPKG_OK) {
+		free(cp);
+		return;
+	}
+	HASH_ADD_PTR(universe->provide_cache, provide, cp);
+}
+
+/*
+ * Whether `pkg' provides the shlib `shname', matched the way
+ * pkg_repo_binary_shlib_provide() does: name BETWEEN ?1 AND ?1 || '.9'
+ */
+static bool
+pkg_jobs_prefetch_provides(struct pkg *pkg, const char *shname)
+{
+	struct pkg_shlib *s = NULL;
+	const char *name;
+	size_t len = strlen(shname);
+
+	while (pkg_shlibs_provided(pkg, &s) == EPKG_OK) {
+		name = pkg_shlib_name(s);
+		if (strncmp(name, shname, len) == 0 &&
+		    strcmp(name + len, ".9") <= 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+static void
+pkg_jobs_prefetch_remote(struct pkg_jobs_universe *universe,
+	const char **uids, size_t n, unsigned flags)
+{
+	struct pkg_job_cached_remote *cr;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL, *tmp;
+	const char *uid, *iuid;
+
+	it = pkgdb_repo_query_uids(universe->j->db, uids, n,
+		universe->j->reponame);
+	/* Entries left empty fall back to pkg_jobs_universe_get_remote() */
+	if (it == NULL)
+		return;
+
+	while (pkgdb_it_next(it, &pkg, flags) == EPKG_OK) {
+		pkg_get(pkg, PKG_UNIQUEID, &uid);
+		cr = NULL;
+		if ((iuid = pkg_intern_find(uid)) != NULL)
+			HASH_FIND_PTR(universe->remote_cache, &iuid, cr);
+		if (cr == NULL)
+			continue;
+
+		/* Keep the newest candidate, as pkg_jobs_universe_get_remote() */
+		if (cr->pkg == NULL) {
+			cr->pkg = pkg;
+			pkg = NULL;
+		}
+		else if (pkg_version_change_between(pkg, cr->pkg) == PKG_UPGRADE) {
+			tmp = cr->pkg;
+			cr->pkg = pkg;
+			pkg = tmp;
+		}
+	}
+	pkg_free(pkg);
+	pkgdb_it_free(it);
+}
+
+static void
+pkg_jobs_prefetch_provide(struct pkg_jobs_universe *universe,
+	const char **shlibs, size_t n, unsigned flags)
+{
+	struct pkg_job_cached_provide *cp;
+	struct pkg_job_cached_pkg *cpkg, **pkgs;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	size_t i;
+
+	it = pkgdb_repo_shlibs_provide(universe->j->db, shlibs, n,
+		universe->j->reponame);
+	if (it == NULL) {
+		/* Let pkg_jobs_universe_process_shlibs() query them one by one */
+		for (i = 0; i < n; i++) {
+			HASH_FIND_PTR(universe->provide_cache, &shlibs[i], cp);
+			if (cp != NULL) {
+				HASH_DEL(universe->provide_cache, cp);
+				free(cp);
+			}
+		}
+		return;
+	}
+
+	while (pkgdb_it_next(it, &pkg, flags) == EPKG_OK) {
+		cpkg = NULL;
+		for (i = 0; i < n; i++) {
+			if (!pkg_jobs_prefetch_provides(pkg, shlibs[i]))
+				continue;
+			HASH_FIND_PTR(universe->provide_cache, &shlibs[i], cp);
+			if (cp == NULL)
+				continue;
+			if (cpkg == NULL) {
+				cpkg = calloc(1, sizeof(*cpkg));
+				if (cpkg == NULL) {
+					pkg_emit_errno("calloc", "pkg_job_cached_pkg");
+					break;
+				}
+				cpkg->pkg = pkg;
+				LL_PREPEND(universe->provide_pkgs, cpkg);
+			}
+			pkgs = realloc(cp->pkgs, (cp->npkgs + 1) * sizeof(*pkgs));
+			if (pkgs == NULL) {
+				pkg_emit_errno("realloc", "pkg_job_cached_provide");
+				break;
+			}
+			cp->pkgs = pkgs;
+			cp->pkgs[cp->npkgs++] = cpkg;
+		}
+		if (cpkg != NULL)
+			pkg = NULL;
+	}
+	pkg_free(pkg);
+	pkgdb_it_free(it);
+}
+
+/*
+ * Resolve the remote dependencies, conflicts and shlibs of a whole level of
+ * the universe with one query per repository and chunk of names.  Results
+ * stay cached for the rest of the job.
+ */
+static void
+pkg_jobs_universe_prefetch(struct pkg_jobs_universe *universe,
+	struct pkg **pkgs, size_t npkgs)
+{
+	struct pkg_jobs_prefetch_list uids, shlibs;
+	struct pkg_dep *d;
+	struct pkg_conflict *c;
+	struct pkg_shlib *s;
+	struct pkg *pkg;
+	pkg_jobs_t type = universe->j->type;
+	size_t i;
+	bool full;
+	unsigned flags = PKG_LOAD_BASIC|PKG_LOAD_DEPS|PKG_LOAD_OPTIONS|
+				PKG_LOAD_SHLIBS_REQUIRED|PKG_LOAD_SHLIBS_PROVIDED|
+				PKG_LOAD_ANNOTATIONS|PKG_LOAD_CONFLICTS;
+
+	if (type == PKG_JOBS_INSTALL || type == PKG_JOBS_UPGRADE)
+		full = true;
+	else if (type == PKG_JOBS_FETCH &&
+	    (universe->j->flags & PKG_FLAG_RECURSIVE))
+		full = false;
+	else
+		return;
+
+	memset(&uids, 0, sizeof(uids));
+	memset(&shlibs, 0, sizeof(shlibs));
+
+	for (i = 0; i < npkgs; i++) {
+		pkg = pkgs[i];
+		d = NULL;
+		while (pkg_deps(pkg, &d) == EPKG_OK)
+			pkg_jobs_prefetch_uid(universe, &uids, d->uid);
+		if (!full)
+			continue;
+		d = NULL;
+		while (pkg_rdeps(pkg, &d) == EPKG_OK)
+			pkg_jobs_prefetch_uid(universe, &uids, d->uid);
+		c = NULL;
+		while (pkg_conflicts(pkg, &c) == EPKG_OK)
+			pkg_jobs_prefetch_uid(universe, &uids,
+				pkg_intern(pkg_conflict_uniqueid(c)));
+		if (pkg->type == PKG_INSTALLED)
+			continue;
+		s = NULL;
+		while (pkg_shlibs_required(pkg, &s) == EPKG_OK)
+			pkg_jobs_prefetch_shlib(universe, &shlibs, pkg_shlib_name(s));
+	}
+
+	pkg_debug(2, "universe: prefetching %zu uids and %zu shlibs for %zu packages",
+		uids.n, shlibs.n, npkgs);
+
+	for (i = 0; i < uids.n; i += PREFETCH_CHUNK)
+		pkg_jobs_prefetch_remote(universe, uids.names + i,
+			MIN(PREFETCH_CHUNK, uids.n - i), flags);
+	for (i = 0; i < shlibs.n; i += PREFETCH_CHUNK)
+		pkg_jobs_prefetch_provide(universe, shlibs.names + i,
+			MIN(PREFETCH_CHUNK, shlibs.n - i), flags);
+
+	free(uids.names);
+	free(shlibs.names);
+}
+
+static int
+pkg_jobs_universe_queue(struct pkg_jobs_universe *universe, struct pkg *pkg)
+{
+	struct pkg **frontier;
+
+	if (universe->nfrontier == universe->frontier_size) {
+		universe->frontier_size = universe->frontier_size == 0 ? 64 :
+			universe->frontier_size * 2;
+		frontier = realloc(universe->frontier,
+			universe->frontier_size * sizeof(*frontier));
+		if (frontier == NULL) {
+			pkg_emit_errno("realloc", "pkg_jobs_universe_queue");
+			return (EPKG_FATAL);
+		}
+		universe->frontier = frontier;
+	}
+	universe->frontier[universe->nfrontier++] = pkg;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Expand the queued packages level by level.  Only the errors of the first
+ * level are reported, as the recursive walk ignores the failures of
+ * indirect dependencies.
+ */
+static int
+pkg_jobs_universe_expand_batch(struct pkg_jobs_universe *universe)
+{
+	struct pkg **level;
+	size_t i, n;
+	int rc = EPKG_OK, ret;
+	bool first = true;
+
+	universe->expanding = true;
+	while (universe->nfrontier > 0) {
+		level = universe->frontier;
+		n = universe->nfrontier;
+		universe->frontier = NULL;
+		universe->nfrontier = universe->frontier_size = 0;
+
+		pkg_jobs_universe_prefetch(universe, level, n);
+		for (i = 0; i < n; i++) {
+			ret = pkg_jobs_universe_expand(universe, level[i]);
+			if (first && ret != EPKG_OK)
+				rc = ret;
+		}
+		free(level);
+		first = false;
+	}
+	universe->expanding = false;
+
+	return (rc);
+}
+
+int
+pkg_jobs_universe_process_item(struct pkg_jobs_universe *universe, struct pkg *pkg,
+		struct pkg_job_universe_item **result)
+{
+	int rc;
+
+	/* Add pkg itself */
+	rc = pkg_jobs_universe_add_pkg(universe, pkg, false, result);
+	if (rc == EPKG_END)
+		return (EPKG_OK);
+	else if (rc != EPKG_OK)
+		return (rc);
+
+	if (!universe->batch)
+		return (pkg_jobs_universe_expand(universe, pkg));
+
+	/* Breadth-first: dependencies are expanded with the next level */
+	if (pkg_jobs_universe_queue(universe, pkg) != EPKG_OK)
+		return (EPKG_FATAL);
+	if (universe->expanding)
+		return (EPKG_OK);
+
+	return (pkg_jobs_universe_expand_batch(universe));
+}
+
 int
 pkg_jobs_universe_process(struct pkg_jobs_universe *universe,
 	struct pkg *pkg)
@@ -569,7 +976,7 @@ pkg_jobs_update_universe_item_priority(struct pkg_jobs_universe *universe,
 		}
 
 		while (deps_func(it->pkg, &d) == EPKG_OK) {
-			HASH_FIND_STR(universe->items, d->uid, found);
+			found = pkg_jobs_universe_find_interned(universe, d->uid);
 			if (found != NULL) {
 				LL_FOREACH(found, cur) {
 					if (cur->priority < priority + 1)
@@ -582,7 +989,7 @@ pkg_jobs_update_universe_item_priority(struct pkg_jobs_universe *universe,
 		d = NULL;
 		maxpri = priority;
 		while (rdeps_func(it->pkg, &d) == EPKG_OK) {
-			HASH_FIND_STR(universe->items, d->uid, found);
+			found = pkg_jobs_universe_find_interned(universe, d->uid);
 			if (found != NULL) {
 				LL_FOREACH(found, cur) {
 					if (cur->priority >= maxpri) {
@@ -598,7 +1005,7 @@ pkg_jobs_update_universe_item_priority(struct pkg_jobs_universe *universe,
 		}
 		if (it->pkg->type != PKG_INSTALLED) {
 			while (pkg_conflicts(it->pkg, &c) == EPKG_OK) {
-				HASH_FIND_STR(universe->items, pkg_conflict_uniqueid(c), found);
+				found = pkg_jobs_universe_find(universe, pkg_conflict_uniqueid(c));
 				if (found != NULL) {
 					LL_FOREACH(found, cur) {
 						if (cur->pkg->type == PKG_INSTALLED) {
@@ -626,7 +1033,7 @@ pkg_jobs_update_conflict_priority(struct pkg_jobs_universe *universe,
 
 	while (pkg_conflicts(lp, &c) == EPKG_OK) {
 		rit = NULL;
-		HASH_FIND_STR(universe->items, pkg_conflict_uniqueid(c), found);
+		found = pkg_jobs_universe_find(universe, pkg_conflict_uniqueid(c));
 		assert(found != NULL);
 
 		LL_FOREACH(found, cur) {
@@ -675,6 +1082,28 @@ pkg_jobs_universe_replacement_free(struct pkg_job_replace *r)
 	free(r);
 }
 
+static void
+pkg_jobs_universe_cached_remote_free(struct pkg_job_cached_remote *cr)
+{
+	pkg_free(cr->pkg);
+	free(cr);
+}
+
+static void
+pkg_jobs_universe_cached_provide_free(struct pkg_job_cached_provide *cp)
+{
+	free(cp->pkgs);
+	free(cp);
+}
+
+static void
+pkg_jobs_universe_cached_pkg_free(struct pkg_job_cached_pkg *cpkg)
+{
+	if (!cpkg->taken)
+		pkg_free(cpkg->pkg);
+	free(cpkg);
+}
+
 void
 pkg_jobs_universe_free(struct pkg_jobs_universe *universe)
 {
@@ -691,6 +1120,10 @@ pkg_jobs_universe_free(struct pkg_jobs_universe *universe)
 	HASH_FREE(universe->seen, free);
 	HASH_FREE(universe->provides, pkg_jobs_universe_provide_free);
 	LL_FREE(universe->uid_replaces, pkg_jobs_universe_replacement_free);
+	HASH_FREE(universe->remote_cache, pkg_jobs_universe_cached_remote_free);
+	HASH_FREE(universe->provide_cache, pkg_jobs_universe_cached_provide_free);
+	LL_FREE(universe->provide_pkgs, pkg_jobs_universe_cached_pkg_free);
+	free(universe->frontier);
 }
 
 
@@ -706,16 +1139,30 @@ pkg_jobs_universe_new(struct pkg_jobs *j)
 	}
 
 	universe->j = j;
+	universe->batch = pkg_object_bool(pkg_config_get("SOLVER_BATCH_QUERIES"));
 
 	return (universe);
 }
 
 struct pkg_job_universe_item *
 pkg_jobs_universe_find(struct pkg_jobs_universe *universe, const char *uid)
+{
+	const char *iuid;
+
+	/* A uid that was never interned cannot be in the universe */
+	if ((iuid = pkg_intern_find(uid)) == NULL)
+		return (NULL);
+
+	return (pkg_jobs_universe_find_interned(universe, iuid));
+}
+
+struct pkg_job_universe_item *
+pkg_jobs_universe_find_interned(struct pkg_jobs_universe *universe,
+	const char *uid)
 {
 	struct pkg_job_universe_item *unit;
 
-	HASH_FIND_STR(universe->items, uid, unit);
+	HASH_FIND_PTR(universe->items, &uid, unit);
 
 	return (unit);
 }
@@ -724,8 +1171,12 @@ struct pkg_job_seen *
 pkg_jobs_universe_seen(struct pkg_jobs_universe *universe, const char *digest)
 {
 	struct pkg_job_seen *seen;
+	const char *idigest;
 
-	HASH_FIND_STR(universe->seen, digest, seen);
+	if ((idigest = pkg_intern_find(digest)) == NULL)
+		return (NULL);
+
+	HASH_FIND_PTR(universe->seen, &idigest, seen);
 
 	return (seen);
 }
@@ -746,7 +1197,7 @@ pkg_jobs_universe_change_uid(struct pkg_jobs_universe *universe,
 	if (update_rdeps) {
 		/* For all rdeps update deps accordingly */
 		while (pkg_rdeps(unit->pkg, &rd) == EPKG_OK) {
-			found = pkg_jobs_universe_find(universe, rd->uid);
+			found = pkg_jobs_universe_find_interned(universe, rd->uid);
 			if (found == NULL) {
 				lp = pkg_jobs_universe_get_local(universe, rd->uid, 0);
 				/* XXX */
@@ -756,10 +1207,8 @@ pkg_jobs_universe_change_uid(struct pkg_jobs_universe *universe,
 
 			if (found != NULL) {
 				while (pkg_deps(found->pkg, &d) == EPKG_OK) {
-					if (strcmp(d->uid, old_uid) == 0) {
-						free(d->uid);
-						d->uid = strdup(new_uid);
-					}
+					if (strcmp(d->uid, old_uid) == 0)
+						d->uid = pkg_intern(new_uid);
 				}
 			}
 		}
@@ -774,11 +1223,12 @@ pkg_jobs_universe_change_uid(struct pkg_jobs_universe *universe,
 
 	HASH_DELETE(hh, universe->items, unit);
 	pkg_set(unit->pkg, PKG_UNIQUEID, new_uid);
-	HASH_FIND(hh, universe->items, new_uid, uidlen, found);
+	unit->uid = pkg_intern(new_uid);
+	found = pkg_jobs_universe_find_interned(universe, unit->uid);
 	if (found != NULL)
 		DL_APPEND(found, unit);
 	else
-		HASH_ADD_KEYPTR(hh, universe->items, new_uid, uidlen, unit);
+		HASH_ADD_PTR(universe->items, uid, unit);
 
 }
 
@@ -0,0 +1,683 @@
+/*-
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Binary repository catalogue.
+ *
+ * The catalogue holds the fields of the packagesite manifests that end up
+ * in the repository database, in a form that can be mmap(2)ed and used
+ * without any parsing:
+ *
+ *   header | records | refs | strings
+ *
+ * Records have a fixed width and are sorted by origin, so a package is
+ * found by a binary search. Every string is stored once in the string
+ * table and referenced by its offset; offset 0 is reserved for NULL, the
+ * empty string is interned like any other. Lists (deps, categories,
+ * options...) are ranges of string offsets in the refs table. All integers
+ * are little endian.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "pkg_config.h"
+#endif
+
+#ifdef HAVE_SYS_ENDIAN_H
+#include <sys/endian.h>
+#elif HAVE_ENDIAN_H
+#include <endian.h>
+#elif HAVE_MACHINE_ENDIAN_H
+#include <machine/endian.h>
+#endif
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/pkg.h"
+
+#define PKG_CATALOGUE_MAGIC "PKGC"
+#define PKG_CATALOGUE_VERSION 2
+
+struct pkg_catalogue_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t npkgs;
+	uint32_t nrefs;
+	uint64_t records_off;
+	uint64_t refs_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+};
+
+enum {
+	CAT_ORIGIN = 0,
+	CAT_NAME,
+	CAT_VERSION,
+	CAT_COMMENT,
+	CAT_DESC,
+	CAT_ARCH,
+	CAT_MAINTAINER,
+	CAT_WWW,
+	CAT_PREFIX,
+	CAT_CKSUM,
+	CAT_REPOPATH,
+	CAT_DIGEST,
+	CAT_NSTRINGS
+};
+
+enum {
+	CAT_LIST_DEPS = 0,	/* origin, name, version */
+	CAT_LIST_CATEGORIES,
+	CAT_LIST_LICENSES,
+	CAT_LIST_OPTIONS,	/* key, value */
+	CAT_LIST_SHLIBS_REQUIRED,
+	CAT_LIST_SHLIBS_PROVIDED,
+	CAT_LIST_ANNOTATIONS,	/* tag, value */
+	CAT_NLISTS
+};
+
+static const unsigned cat_list_width[CAT_NLISTS] = {
+	[CAT_LIST_DEPS] = 3,
+	[CAT_LIST_CATEGORIES] = 1,
+	[CAT_LIST_LICENSES] = 1,
+	[CAT_LIST_OPTIONS] = 2,
+	[CAT_LIST_SHLIBS_REQUIRED] = 1,
+	[CAT_LIST_SHLIBS_PROVIDED] = 1,
+	[CAT_LIST_ANNOTATIONS] = 2,
+};
+
+struct pkg_catalogue_record {
+	int64_t flatsize;
+	int64_t pkgsize;
+	uint32_t licenselogic;
+	uint32_t strings[CAT_NSTRINGS];
+	struct {
+		uint32_t off;
+		uint32_t count;
+	} lists[CAT_NLISTS];
+	uint32_t reserved;
+};
+
+struct pkg_catalogue_string {
+	char *str;
+	uint32_t off;
+	UT_hash_handle hh;
+};
+
+struct pkg_catalogue_writer {
+	struct pkg_catalogue_string *strings;
+	struct sbuf *strtab;
+	uint32_t *refs;
+	size_t nrefs;
+	size_t refs_cap;
+	struct pkg_catalogue_record *records;
+	size_t nrecords;
+	size_t records_cap;
+};
+
+struct pkg_catalogue {
+	unsigned char *map;
+	size_t len;
+	const struct pkg_catalogue_record *records;
+	const uint32_t *refs;
+	const char *strings;
+	uint32_t npkgs;
+	uint32_t nrefs;
+	uint64_t strings_len;
+};
+
+int
+pkg_catalogue_writer_new(struct pkg_catalogue_writer **w)
+{
+	if ((*w = calloc(1, sizeof(**w))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_catalogue_writer");
+		return (EPKG_FATAL);
+	}
+
+	(*w)->strtab = sbuf_new_auto();
+	/* Offset 0 stands for NULL */
+	sbuf_putc((*w)->strtab, '\0');
+
+	return (EPKG_OK);
+}
+
+void
+pkg_catalogue_writer_free(struct pkg_catalogue_writer *w)
+{
+	struct pkg_catalogue_string *s, *stmp;
+
+	if (w == NULL)
+		return;
+
+	HASH_ITER(hh, w->strings, s, stmp) {
+		HASH_DEL(w->strings, s);
+		free(s->str);
+		free(s);
+	}
+	sbuf_delete(w->strtab);
+	free(w->refs);
+	free(w->records);
+	free(w);
+}
+
+static int
+pkg_catalogue_intern(struct pkg_catalogue_writer *w, const char *str,
+    uint32_t *off)
+{
+	struct pkg_catalogue_string *s;
+
+	if (str == NULL) {
+		*off = 0;
+		return (EPKG_OK);
+	}
+
+	HASH_FIND_STR(w->strings, str, s);
+	if (s == NULL) {
+		if ((s = malloc(sizeof(*s))) == NULL ||
+		    (s->str = strdup(str)) == NULL) {
+			free(s);
+			pkg_emit_errno("malloc", "pkg_catalogue strings");
+			return (EPKG_FATAL);
+		}
+		s->off = sbuf_len(w->strtab);
+		sbuf_bcat(w->strtab, str, strlen(str) + 1);
+		HASH_ADD_KEYPTR(hh, w->strings, s->str, strlen(s->str), s);
+	}
+	*off = s->off;
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_catalogue_add_ref(struct pkg_catalogue_writer *w, const char *str)
+{
+	uint32_t *nrefs;
+
+	if (w->nrefs == w->refs_cap) {
+		w->refs_cap = MAX(w->refs_cap * 2, 1024);
+		nrefs = realloc(w->refs, w->refs_cap * sizeof(*w->refs));
+		if (nrefs == NULL) {
+			pkg_emit_errno("realloc", "pkg_catalogue refs");
+			return (EPKG_FATAL);
+		}
+		w->refs = nrefs;
+	}
+	if (pkg_catalogue_intern(w, str, &w->refs[w->nrefs]) != EPKG_OK)
+		return (EPKG_FATAL);
+	w->nrefs++;
+
+	return (EPKG_OK);
+}
+
+#define CAT_LIST_BEGIN(rec, list, w) do {				\
+	(rec)->lists[(list)].off = (w)->nrefs;				\
+} while (0)
+#define CAT_LIST_END(rec, list, w) do {					\
+	(rec)->lists[(list)].count = ((w)->nrefs -			\
+	    (rec)->lists[(list)].off) / cat_list_width[(list)];		\
+} while (0)
+
+int
+pkg_catalogue_writer_add(struct pkg_catalogue_writer *w, struct pkg *pkg)
+{
+	struct pkg_catalogue_record *rec;
+	const char *strs[CAT_NSTRINGS];
+	const pkg_object *licenses, *categories, *annotations, *obj;
+	struct pkg_dep *dep = NULL;
+	struct pkg_option *option = NULL;
+	struct pkg_shlib *shlib = NULL;
+	pkg_iter it;
+	int64_t flatsize, pkgsize, licenselogic;
+	int i, ret = EPKG_OK;
+
+	if (w->nrecords == w->records_cap) {
+		w->records_cap = MAX(w->records_cap * 2, 256);
+		rec = realloc(w->records, w->records_cap * sizeof(*rec));
+		if (rec == NULL) {
+			pkg_emit_errno("realloc", "pkg_catalogue records");
+			return (EPKG_FATAL);
+		}
+		w->records = rec;
+	}
+	rec = &w->records[w->nrecords++];
+	memset(rec, 0, sizeof(*rec));
+
+	pkg_get(pkg, PKG_ORIGIN, &strs[CAT_ORIGIN], PKG_NAME, &strs[CAT_NAME],
+	    PKG_VERSION, &strs[CAT_VERSION], PKG_COMMENT, &strs[CAT_COMMENT],
+	    PKG_DESC, &strs[CAT_DESC], PKG_ARCH, &strs[CAT_ARCH],
+	    PKG_MAINTAINER, &strs[CAT_MAINTAINER], PKG_WWW, &strs[CAT_WWW],
+	    PKG_PREFIX, &strs[CAT_PREFIX], PKG_CKSUM, &strs[CAT_CKSUM],
+	    PKG_REPOPATH, &strs[CAT_REPOPATH], PKG_DIGEST, &strs[CAT_DIGEST],
+	    PKG_FLATSIZE, &flatsize, PKG_PKGSIZE, &pkgsize,
+	    PKG_LICENSE_LOGIC, &licenselogic, PKG_LICENSES, &licenses,
+	    PKG_CATEGORIES, &categories, PKG_ANNOTATIONS, &annotations);
+
+	for (i = 0; i < CAT_NSTRINGS && ret == EPKG_OK; i++)
+		ret = pkg_catalogue_intern(w, strs[i], &rec->strings[i]);
+	rec->flatsize = flatsize;
+	rec->pkgsize = pkgsize;
+	rec->licenselogic = licenselogic;
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_DEPS, w);
+	while (ret == EPKG_OK && pkg_deps(pkg, &dep) == EPKG_OK) {
+		if ((ret = pkg_catalogue_add_ref(w, pkg_dep_origin(dep))) == EPKG_OK &&
+		    (ret = pkg_catalogue_add_ref(w, pkg_dep_name(dep))) == EPKG_OK)
+			ret = pkg_catalogue_add_ref(w, pkg_dep_version(dep));
+	}
+	CAT_LIST_END(rec, CAT_LIST_DEPS, w);
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_CATEGORIES, w);
+	it = NULL;
+	while (ret == EPKG_OK && (obj = pkg_object_iterate(categories, &it)))
+		ret = pkg_catalogue_add_ref(w, pkg_object_string(obj));
+	CAT_LIST_END(rec, CAT_LIST_CATEGORIES, w);
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_LICENSES, w);
+	it = NULL;
+	while (ret == EPKG_OK && (obj = pkg_object_iterate(licenses, &it)))
+		ret = pkg_catalogue_add_ref(w, pkg_object_string(obj));
+	CAT_LIST_END(rec, CAT_LIST_LICENSES, w);
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_OPTIONS, w);
+	while (ret == EPKG_OK && pkg_options(pkg, &option) == EPKG_OK) {
+		if ((ret = pkg_catalogue_add_ref(w, pkg_option_opt(option))) == EPKG_OK)
+			ret = pkg_catalogue_add_ref(w, pkg_option_value(option));
+	}
+	CAT_LIST_END(rec, CAT_LIST_OPTIONS, w);
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_SHLIBS_REQUIRED, w);
+	while (ret == EPKG_OK && pkg_shlibs_required(pkg, &shlib) == EPKG_OK)
+		ret = pkg_catalogue_add_ref(w, pkg_shlib_name(shlib));
+	CAT_LIST_END(rec, CAT_LIST_SHLIBS_REQUIRED, w);
+
+	shlib = NULL;
+	CAT_LIST_BEGIN(rec, CAT_LIST_SHLIBS_PROVIDED, w);
+	while (ret == EPKG_OK && pkg_shlibs_provided(pkg, &shlib) == EPKG_OK)
+		ret = pkg_catalogue_add_ref(w, pkg_shlib_name(shlib));
+	CAT_LIST_END(rec, CAT_LIST_SHLIBS_PROVIDED, w);
+
+	CAT_LIST_BEGIN(rec, CAT_LIST_ANNOTATIONS, w);
+	it = NULL;
+	while (ret == EPKG_OK && (obj = pkg_object_iterate(annotations, &it))) {
+		if ((ret = pkg_catalogue_add_ref(w, pkg_object_key(obj))) == EPKG_OK)
+			ret = pkg_catalogue_add_ref(w, pkg_object_string(obj));
+	}
+	CAT_LIST_END(rec, CAT_LIST_ANNOTATIONS, w);
+
+	return (ret);
+}
+
+#undef CAT_LIST_BEGIN
+#undef CAT_LIST_END
+
+static const char *catalogue_sort_strtab;
+
+static int
+pkg_catalogue_record_cmp(const void *a, const void *b)
+{
+	const struct pkg_catalogue_record *r1 = a, *r2 = b;
+
+	return (strcmp(catalogue_sort_strtab + r1->strings[CAT_ORIGIN],
+	    catalogue_sort_strtab + r2->strings[CAT_ORIGIN]));
+}
+
+static void
+pkg_catalogue_record_to_le(struct pkg_catalogue_record *rec)
+{
+	int i;
+
+	rec->flatsize = htole64(rec->flatsize);
+	rec->pkgsize = htole64(rec->pkgsize);
+	rec->licenselogic = htole32(rec->licenselogic);
+	for (i = 0; i < CAT_NSTRINGS; i++)
+		rec->strings[i] = htole32(rec->strings[i]);
+	for (i = 0; i < CAT_NLISTS; i++) {
+		rec->lists[i].off = htole32(rec->lists[i].off);
+		rec->lists[i].count = htole32(rec->lists[i].count);
+	}
+}
+
+int
+pkg_catalogue_writer_finish(struct pkg_catalogue_writer *w, const char *path)
+{
+	struct pkg_catalogue_header hdr;
+	size_t i;
+	FILE *fp;
+
+	sbuf_finish(w->strtab);
+
+	/* Records are sorted by origin, which makes them their own index */
+	catalogue_sort_strtab = sbuf_data(w->strtab);
+	qsort(w->records, w->nrecords, sizeof(*w->records),
+	    pkg_catalogue_record_cmp);
+	catalogue_sort_strtab = NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PKG_CATALOGUE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(PKG_CATALOGUE_VERSION);
+	hdr.npkgs = htole32(w->nrecords);
+	hdr.nrefs = htole32(w->nrefs);
+	hdr.records_off = htole64(sizeof(hdr));
+	hdr.refs_off = htole64(sizeof(hdr) +
+	    w->nrecords * sizeof(struct pkg_catalogue_record));
+	hdr.strings_off = htole64(le64toh(hdr.refs_off) +
+	    w->nrefs * sizeof(uint32_t));
+	hdr.strings_len = htole64(sbuf_len(w->strtab));
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		return (EPKG_FATAL);
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto error;
+
+	for (i = 0; i < w->nrecords; i++) {
+		pkg_catalogue_record_to_le(&w->records[i]);
+		if (fwrite(&w->records[i], sizeof(w->records[i]), 1, fp) != 1)
+			goto error;
+	}
+
+	for (i = 0; i < w->nrefs; i++) {
+		uint32_t ref = htole32(w->refs[i]);
+
+		if (fwrite(&ref, sizeof(ref), 1, fp) != 1)
+			goto error;
+	}
+
+	if (fwrite(sbuf_data(w->strtab), sbuf_len(w->strtab), 1, fp) != 1)
+		goto error;
+
+	if (fclose(fp) != 0) {
+		pkg_emit_errno("fclose", path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+
+error:
+	pkg_emit_errno("fwrite", path);
+	fclose(fp);
+	unlink(path);
+
+	return (EPKG_FATAL);
+}
+
+int
+pkg_catalogue_open(struct pkg_catalogue **cat, int fd)
+{
+	struct pkg_catalogue *c;
+	const struct pkg_catalogue_header *hdr;
+	struct stat st;
+	uint64_t records_off, refs_off, strings_off;
+
+	if (fstat(fd, &st) == -1) {
+		pkg_emit_errno("fstat", "catalogue");
+		return (EPKG_FATAL);
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		pkg_emit_error("binary catalogue is truncated");
+		return (EPKG_FATAL);
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_catalogue");
+		return (EPKG_FATAL);
+	}
+
+	c->len = st.st_size;
+	c->map = mmap(NULL, c->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		pkg_emit_errno("mmap", "catalogue");
+		free(c);
+		return (EPKG_FATAL);
+	}
+
+	hdr = (const struct pkg_catalogue_header *)c->map;
+	c->npkgs = le32toh(hdr->npkgs);
+	c->nrefs = le32toh(hdr->nrefs);
+	c->strings_len = le64toh(hdr->strings_len);
+	records_off = le64toh(hdr->records_off);
+	refs_off = le64toh(hdr->refs_off);
+	strings_off = le64toh(hdr->strings_off);
+
+	if (memcmp(hdr->magic, PKG_CATALOGUE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    le32toh(hdr->version) != PKG_CATALOGUE_VERSION) {
+		pkg_emit_error("binary catalogue has an unsupported format");
+		goto error;
+	}
+
+	/* Written so that no untrusted value can overflow */
+	if (records_off > refs_off || refs_off > strings_off ||
+	    strings_off > c->len ||
+	    c->npkgs > (refs_off - records_off) /
+	    sizeof(struct pkg_catalogue_record) ||
+	    c->nrefs > (strings_off - refs_off) / sizeof(uint32_t) ||
+	    c->strings_len == 0 ||
+	    c->strings_len > c->len - strings_off ||
+	    c->map[strings_off + c->strings_len - 1] != '\0' ||
+	    records_off % sizeof(uint64_t) != 0 ||
+	    refs_off % sizeof(uint32_t) != 0) {
+		pkg_emit_error("binary catalogue is corrupted");
+		goto error;
+	}
+
+	c->records = (const struct pkg_catalogue_record *)(c->map + records_off);
+	c->refs = (const uint32_t *)(c->map + refs_off);
+	c->strings = (const char *)(c->map + strings_off);
+	*cat = c;
+
+	return (EPKG_OK);
+
+error:
+	munmap(c->map, c->len);
+	free(c);
+
+	return (EPKG_FATAL);
+}
+
+void
+pkg_catalogue_close(struct pkg_catalogue *c)
+{
+	if (c == NULL)
+		return;
+
+	munmap(c->map, c->len);
+	free(c);
+}
+
+unsigned
+pkg_catalogue_count(struct pkg_catalogue *c)
+{
+	return (c->npkgs);
+}
+
+static const char *
+pkg_catalogue_string(struct pkg_catalogue *c, uint32_t off)
+{
+	off = le32toh(off);
+	if (off == 0 || off >= c->strings_len)
+		return (NULL);
+
+	return (c->strings + off);
+}
+
+static const uint32_t *
+pkg_catalogue_list(struct pkg_catalogue *c,
+    const struct pkg_catalogue_record *rec, int list, uint32_t *count)
+{
+	uint64_t off, cnt;
+
+	off = le32toh(rec->lists[list].off);
+	cnt = le32toh(rec->lists[list].count);
+	if (off + cnt * cat_list_width[list] > c->nrefs) {
+		*count = 0;
+		return (NULL);
+	}
+	*count = cnt;
+
+	return (c->refs + off);
+}
+
+/* Resolve the n strings of a list entry, none of which may be NULL */
+static bool
+pkg_catalogue_refs(struct pkg_catalogue *c, const uint32_t *refs, int n,
+    const char **strs)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if ((strs[i] = pkg_catalogue_string(c, refs[i])) == NULL)
+			return (false);
+
+	return (true);
+}
+
+static const struct pkg_catalogue_record *
+pkg_catalogue_lookup(struct pkg_catalogue *c, const char *origin)
+{
+	const struct pkg_catalogue_record *rec;
+	const char *rorigin;
+	uint32_t lo = 0, hi = c->npkgs, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = &c->records[mid];
+		rorigin = pkg_catalogue_string(c, rec->strings[CAT_ORIGIN]);
+		if (rorigin == NULL)
+			return (NULL);
+		cmp = strcmp(origin, rorigin);
+		if (cmp == 0)
+			return (rec);
+		else if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (NULL);
+}
+
+int
+pkg_catalogue_find(struct pkg_catalogue *c, const char *origin,
+    struct pkg **pkg_p)
+{
+	const struct pkg_catalogue_record *rec;
+	const uint32_t *refs;
+	const char *strs[3];
+	struct pkg *pkg;
+	uint32_t i, count;
+
+	if ((rec = pkg_catalogue_lookup(c, origin)) == NULL)
+		return (EPKG_END);
+
+	if (*pkg_p == NULL) {
+		if (pkg_new(pkg_p, PKG_REMOTE) != EPKG_OK)
+			return (EPKG_FATAL);
+	} else
+		pkg_reset(*pkg_p, PKG_REMOTE);
+
+	pkg = *pkg_p;
+
+#define CAT_STR(i) pkg_catalogue_string(c, rec->strings[(i)])
+	pkg_set(pkg, PKG_ORIGIN, CAT_STR(CAT_ORIGIN), PKG_NAME, CAT_STR(CAT_NAME),
+	    PKG_VERSION, CAT_STR(CAT_VERSION), PKG_COMMENT, CAT_STR(CAT_COMMENT),
+	    PKG_DESC, CAT_STR(CAT_DESC), PKG_ARCH, CAT_STR(CAT_ARCH),
+	    PKG_MAINTAINER, CAT_STR(CAT_MAINTAINER), PKG_WWW, CAT_STR(CAT_WWW),
+	    PKG_PREFIX, CAT_STR(CAT_PREFIX), PKG_CKSUM, CAT_STR(CAT_CKSUM),
+	    PKG_REPOPATH, CAT_STR(CAT_REPOPATH), PKG_DIGEST, CAT_STR(CAT_DIGEST),
+	    PKG_FLATSIZE, (int64_t)le64toh(rec->flatsize),
+	    PKG_PKGSIZE, (int64_t)le64toh(rec->pkgsize),
+	    PKG_LICENSE_LOGIC, (int64_t)le32toh(rec->licenselogic));
+#undef CAT_STR
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_DEPS, &count);
+	for (i = 0; i < count; i++, refs += 3) {
+		if (!pkg_catalogue_refs(c, refs, 3, strs))
+			goto corrupted;
+		pkg_adddep(pkg, strs[1], strs[0], strs[2], false);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_CATEGORIES, &count);
+	for (i = 0; i < count; i++, refs++) {
+		if (!pkg_catalogue_refs(c, refs, 1, strs))
+			goto corrupted;
+		pkg_addcategory(pkg, strs[0]);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_LICENSES, &count);
+	for (i = 0; i < count; i++, refs++) {
+		if (!pkg_catalogue_refs(c, refs, 1, strs))
+			goto corrupted;
+		pkg_addlicense(pkg, strs[0]);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_OPTIONS, &count);
+	for (i = 0; i < count; i++, refs += 2) {
+		if (!pkg_catalogue_refs(c, refs, 2, strs))
+			goto corrupted;
+		pkg_addoption(pkg, strs[0], strs[1]);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_SHLIBS_REQUIRED, &count);
+	for (i = 0; i < count; i++, refs++) {
+		if (!pkg_catalogue_refs(c, refs, 1, strs))
+			goto corrupted;
+		pkg_addshlib_required(pkg, strs[0]);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_SHLIBS_PROVIDED, &count);
+	for (i = 0; i < count; i++, refs++) {
+		if (!pkg_catalogue_refs(c, refs, 1, strs))
+			goto corrupted;
+		pkg_addshlib_provided(pkg, strs[0]);
+	}
+
+	refs = pkg_catalogue_list(c, rec, CAT_LIST_ANNOTATIONS, &count);
+	for (i = 0; i < count; i++, refs += 2) {
+		if (!pkg_catalogue_refs(c, refs, 2, strs))
+			goto corrupted;
+		pkg_addannotation(pkg, strs[0], strs[1]);
+	}
+
+	return (EPKG_OK);
+
+corrupted:
+	pkg_emit_error("binary catalogue entry for %s is corrupted", origin);
+	return (EPKG_FATAL);
+}
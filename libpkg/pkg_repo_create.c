@@ -31,9 +31,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/sysctl.h>
-#include <sys/wait.h>
-#include <sys/socket.h>
+#include <sys/time.h>
 
 #include <archive_entry.h>
 #include <assert.h>
@@ -49,8 +47,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
-#include <poll.h>
-#include <sys/uio.h>
+#include <pthread.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -65,7 +62,9 @@ struct digest_list_entry {
 	long manifest_pos;
 	long files_pos;
 	long manifest_length;
+	long files_length;
 	char *checksum;
+	struct pkg_fts_item *item;
 	struct digest_list_entry *prev, *next;
 };
 
@@ -160,10 +159,35 @@ struct pkg_fts_item {
 	char *pkg_path;
 	char *fts_name;
 	off_t fts_size;
+	time_t fts_mtime;
+	ino_t fts_ino;
 	int fts_info;
 	struct pkg_fts_item *next;
 };
 
+/*
+ * The repo cache is kept next to the catalogue and records, for every
+ * package file, the stat data it had and the manifest, digest and file
+ * list produced for it, so unchanged packages are not opened again.
+ */
+static const char repo_cache_file[] = ".pkg_repo_cache";
+#define PKG_REPO_CACHE_VERSION 1
+
+struct pkg_repo_cache_entry {
+	char *path;
+	int64_t size;
+	int64_t mtime;
+	int64_t ino;
+	char *origin;
+	char *digest;
+	char *checksum;
+	char *manifest;
+	long manifest_length;
+	char *files;
+	long files_length;
+	UT_hash_handle hh;
+};
+
 static struct pkg_fts_item*
 pkg_create_repo_fts_new(FTSENT *fts, const char *root_path)
 {
@@ -175,6 +199,8 @@ pkg_create_repo_fts_new(FTSENT *fts, const char *root_path)
 		item->fts_accpath = strdup(fts->fts_accpath);
 		item->fts_name = strdup(fts->fts_name);
 		item->fts_size = fts->fts_statp->st_size;
+		item->fts_mtime = fts->fts_statp->st_mtime;
+		item->fts_ino = fts->fts_statp->st_ino;
 		item->fts_info = fts->fts_info;
 
 		pkg_path = fts->fts_path;
@@ -200,6 +226,182 @@ pkg_create_repo_fts_free(struct pkg_fts_item *item)
 	free(item);
 }
 
+static void
+pkg_repo_cache_entry_free(struct pkg_repo_cache_entry *e)
+{
+	free(e->path);
+	free(e->origin);
+	free(e->digest);
+	free(e->checksum);
+	free(e->manifest);
+	free(e->files);
+	free(e);
+}
+
+static int
+pkg_repo_cache_parse_line(char *line, struct pkg_repo_cache_entry *e)
+{
+	char *fields[8];
+	int i;
+
+	/* size mtime ino mlen flen origin digest checksum path */
+	for (i = 0; i < (int)NELEM(fields); i ++) {
+		fields[i] = strsep(&line, " ");
+		if (fields[i] == NULL || line == NULL)
+			return (EPKG_FATAL);
+	}
+
+	e->size = strtoll(fields[0], NULL, 10);
+	e->mtime = strtoll(fields[1], NULL, 10);
+	e->ino = strtoll(fields[2], NULL, 10);
+	e->manifest_length = strtol(fields[3], NULL, 10);
+	e->files_length = strtol(fields[4], NULL, 10);
+	if (e->manifest_length < 0 || e->files_length < 0)
+		return (EPKG_FATAL);
+	e->origin = strdup(fields[5]);
+	e->digest = strdup(fields[6]);
+	e->checksum = strdup(fields[7]);
+	e->path = strdup(line);
+
+	return (EPKG_OK);
+}
+
+static struct pkg_repo_cache_entry *
+pkg_repo_cache_load(const char *output_dir, bool filelist,
+	struct pkg_repo_meta *meta)
+{
+	struct pkg_repo_cache_entry *cache = NULL, *e;
+	char path[MAXPATHLEN];
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int version, has_files, legacy, digest_format;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_cache_file);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (NULL);
+
+	if (getline(&line, &linecap, fp) <= 0 ||
+	    sscanf(line, "%d %d %d %d", &version, &has_files, &legacy,
+	    &digest_format) != 4 ||
+	    version != PKG_REPO_CACHE_VERSION ||
+	    has_files != filelist ||
+	    legacy != (meta == NULL) ||
+	    (meta != NULL && digest_format != (int)meta->digest_format)) {
+		pkg_debug(1, "repo cache %s does not match, ignoring it", path);
+		goto out;
+	}
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+
+		if ((e = calloc(1, sizeof(*e))) == NULL) {
+			pkg_emit_errno("calloc", "struct pkg_repo_cache_entry");
+			goto error;
+		}
+		if (pkg_repo_cache_parse_line(line, e) != EPKG_OK) {
+			pkg_repo_cache_entry_free(e);
+			goto error;
+		}
+
+		e->manifest = malloc(e->manifest_length + 1);
+		e->files = malloc(e->files_length + 1);
+		if (e->manifest == NULL || e->files == NULL ||
+		    fread(e->manifest, 1, e->manifest_length, fp) !=
+		    (size_t)e->manifest_length ||
+		    fread(e->files, 1, e->files_length, fp) !=
+		    (size_t)e->files_length) {
+			pkg_repo_cache_entry_free(e);
+			goto error;
+		}
+
+		HASH_ADD_KEYPTR(hh, cache, e->path, strlen(e->path), e);
+	}
+
+	pkg_debug(1, "loaded %u entries from repo cache %s",
+	    HASH_COUNT(cache), path);
+	goto out;
+
+error:
+	pkg_emit_notice("repo cache %s is corrupted, ignoring it", path);
+	HASH_FREE(cache, pkg_repo_cache_entry_free);
+out:
+	free(line);
+	fclose(fp);
+
+	return (cache);
+}
+
+static int
+pkg_repo_cache_copy(FILE *src, long pos, long len, FILE *dest)
+{
+	char buf[BUFSIZ];
+	size_t r;
+
+	if (fseek(src, pos, SEEK_SET) == -1)
+		return (EPKG_FATAL);
+
+	while (len > 0) {
+		r = fread(buf, 1, MIN((size_t)len, sizeof(buf)), src);
+		if (r == 0 || fwrite(buf, 1, r, dest) != r)
+			return (EPKG_FATAL);
+		len -= r;
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_repo_cache_write(const char *output_dir, bool filelist,
+	struct pkg_repo_meta *meta, struct digest_list_entry *dlist,
+	FILE *mfile, FILE *ffile)
+{
+	struct digest_list_entry *dig;
+	char path[MAXPATHLEN], tmppath[MAXPATHLEN];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_cache_file);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		pkg_emit_errno("fopen", tmppath);
+		return (EPKG_FATAL);
+	}
+
+	fprintf(fp, "%d %d %d %d\n", PKG_REPO_CACHE_VERSION, filelist,
+	    meta == NULL, meta != NULL ? (int)meta->digest_format : 0);
+
+	LL_FOREACH(dlist, dig) {
+		fprintf(fp, "%jd %jd %jd %ld %ld %s %s %s %s\n",
+		    (intmax_t)dig->item->fts_size,
+		    (intmax_t)dig->item->fts_mtime,
+		    (intmax_t)dig->item->fts_ino,
+		    dig->manifest_length, dig->files_length,
+		    dig->origin, dig->digest, dig->checksum,
+		    dig->item->pkg_path);
+
+		if (pkg_repo_cache_copy(mfile, dig->manifest_pos,
+		    dig->manifest_length, fp) != EPKG_OK ||
+		    (ffile != NULL && pkg_repo_cache_copy(ffile, dig->files_pos,
+		    dig->files_length, fp) != EPKG_OK)) {
+			pkg_emit_errno("pkg_repo_cache_write", tmppath);
+			fclose(fp);
+			unlink(tmppath);
+			return (EPKG_FATAL);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmppath, path) == -1) {
+		pkg_emit_errno("pkg_repo_cache_write", path);
+		unlink(tmppath);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 static int
 pkg_create_repo_read_fts(struct pkg_fts_item **items, FTS *fts,
 	const char *repopath, size_t *plen, struct pkg_repo_meta *meta)
@@ -220,7 +422,8 @@ pkg_create_repo_read_fts(struct pkg_fts_item **items, FTS *fts,
 		if (ext == NULL)
 			continue;
 
-		if (strcmp(ext + 1, packing_format_to_string(meta->packing_format)) != 0)
+		/* Packages may be in any format, not only the catalogue one */
+		if (!packing_is_package_ext(ext + 1))
 			continue;
 
 		*ext = '\0';
@@ -248,279 +451,328 @@ pkg_create_repo_read_fts(struct pkg_fts_item **items, FTS *fts,
 	return (EPKG_OK);
 }
 
+struct pkg_repo_create_env;
+
+struct pkg_repo_create_worker {
+	pthread_t thr;
+	FILE *mfile;
+	FILE *ffile;
+	struct digest_list_entry *dlist;
+	int ret;
+	struct pkg_repo_create_env *env;
+};
+
+struct pkg_repo_create_env {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pkg_fts_item *queue;
+	size_t done;
+	int running;
+	bool read_files;
+	struct pkg_repo_meta *meta;
+	struct pkg_repo_cache_entry *cache;
+};
+
 static int
-pkg_create_repo_worker(struct pkg_fts_item *start, size_t nelts,
-	const char *mlfile, const char *flfile, int pip,
-	struct pkg_repo_meta *meta)
+pkg_fts_item_size_cmp(struct pkg_fts_item *i1, struct pkg_fts_item *i2)
 {
-	pid_t pid;
-	int mfd, ffd;
-	bool read_files = (flfile != NULL);
-	bool legacy = (meta == NULL);
-	int flags, ret = EPKG_OK;
-	size_t cur_job = 0;
-	struct pkg_fts_item *cur;
-	struct pkg *pkg = NULL;
-	struct pkg_manifest_key *keys = NULL;
-	char checksum[SHA256_DIGEST_LENGTH * 3 + 1], *mdigest = NULL;
-	char digestbuf[1024];
-	struct iovec iov[2];
-	struct msghdr msg;
+	/* Largest packages first, so they do not end up on the tail */
+	if (i1->fts_size > i2->fts_size)
+		return (-1);
+	else if (i1->fts_size < i2->fts_size)
+		return (1);
+
+	return (0);
+}
+
+static struct pkg_fts_item *
+pkg_create_repo_next_item(struct pkg_repo_create_env *env, bool processed)
+{
+	struct pkg_fts_item *item;
+
+	pthread_mutex_lock(&env->lock);
+	if (processed) {
+		env->done ++;
+		pthread_cond_signal(&env->cond);
+	}
+	item = env->queue;
+	if (item != NULL)
+		env->queue = item->next;
+	pthread_mutex_unlock(&env->lock);
+
+	return (item);
+}
+
+static struct digest_list_entry *
+pkg_create_repo_new_digest(struct pkg_repo_create_worker *w,
+	struct pkg_fts_item *cur, const char *origin, const char *checksum)
+{
+	struct digest_list_entry *dig;
+
+	dig = calloc(1, sizeof(*dig));
+	if (dig == NULL) {
+		pkg_emit_errno("calloc", "struct digest_list_entry");
+		return (NULL);
+	}
+	dig->origin = strdup(origin);
+	dig->checksum = strdup(checksum);
+	dig->item = cur;
+	DL_APPEND(w->dlist, dig);
 
-	struct sbuf *b = sbuf_new_auto();
+	return (dig);
+}
+
+static int
+pkg_create_repo_reuse(struct pkg_repo_create_worker *w,
+	struct pkg_fts_item *cur, struct pkg_repo_cache_entry *ce)
+{
+	struct digest_list_entry *dig;
+	long mpos, fpos = 0;
 
-	mfd = open(mlfile, O_APPEND|O_CREAT|O_WRONLY, 00644);
-	if (mfd == -1) {
-		pkg_emit_errno("pkg_create_repo_worker", "open");
+	mpos = ftell(w->mfile);
+	if (fwrite(ce->manifest, ce->manifest_length, 1, w->mfile) != 1 ||
+	    fputc('\n', w->mfile) == EOF) {
+		pkg_emit_errno("pkg_create_repo_worker", "fwrite");
 		return (EPKG_FATAL);
 	}
 
-	if (read_files) {
-		ffd = open(flfile, O_APPEND|O_CREAT|O_WRONLY, 00644);
-		if (ffd == -1) {
-			pkg_emit_errno("pkg_create_repo_worker", "open");
+	if (w->ffile != NULL) {
+		fpos = ftell(w->ffile);
+		if (ce->files_length > 0 && fwrite(ce->files,
+		    ce->files_length, 1, w->ffile) != 1) {
+			pkg_emit_errno("pkg_create_repo_worker", "fwrite");
 			return (EPKG_FATAL);
 		}
 	}
 
-	pid = fork();
-	switch(pid) {
-	case -1:
-		pkg_emit_errno("pkg_create_repo_worker", "fork");
+	dig = pkg_create_repo_new_digest(w, cur, ce->origin, ce->checksum);
+	if (dig == NULL)
 		return (EPKG_FATAL);
-		break;
-	case 0:
-		break;
-	default:
-		/* Parent */
-		close(mfd);
-		if (read_files)
-			close(ffd);
+	dig->digest = strdup(ce->digest);
+	dig->manifest_pos = mpos;
+	dig->manifest_length = ce->manifest_length;
+	dig->files_pos = fpos;
+	dig->files_length = ce->files_length;
+
+	return (EPKG_OK);
+}
 
+static int
+pkg_create_repo_process(struct pkg_repo_create_worker *w,
+	struct pkg_fts_item *cur, struct pkg_manifest_key *keys, int flags,
+	struct sbuf *b)
+{
+	struct pkg_repo_meta *meta = w->env->meta;
+	bool legacy = (meta == NULL);
+	struct pkg *pkg = NULL;
+	struct digest_list_entry *dig;
+	struct pkg_repo_cache_entry *ce;
+	char checksum[SHA256_DIGEST_LENGTH * 3 + 1], *mdigest = NULL;
+	const char *origin;
+	long mpos, fpos = 0, flen = 0;
+	int ret = EPKG_OK;
+
+	/* The cache is only read while workers are running */
+	HASH_FIND_STR(w->env->cache, cur->pkg_path, ce);
+	if (ce != NULL && ce->size == cur->fts_size &&
+	    ce->mtime == cur->fts_mtime && ce->ino == (int64_t)cur->fts_ino)
+		return (pkg_create_repo_reuse(w, cur, ce));
+
+	/* Broken packages are skipped, not fatal */
+	if (pkg_open_checksum(&pkg, cur->fts_accpath, keys, flags,
+	    checksum) != EPKG_OK) {
+		pkg_free(pkg);
 		return (EPKG_OK);
-		break;
 	}
+	pkg_set(pkg, PKG_CKSUM, checksum,
+		PKG_REPOPATH, cur->pkg_path,
+		PKG_PKGSIZE, cur->fts_size);
+	pkg_get(pkg, PKG_ORIGIN, &origin);
 
-	pkg_manifest_keys_new(&keys);
-	pkg_debug(1, "start worker to parse %d packages", nelts);
+	/*
+	 * TODO: use pkg_checksum for new manifests
+	 */
+	sbuf_clear(b);
+	if (legacy)
+		pkg_emit_manifest_sbuf(pkg, b, PKG_MANIFEST_EMIT_COMPACT, &mdigest);
+	else {
+		mdigest = malloc(pkg_checksum_type_size(meta->digest_format));
 
-	if (read_files)
-		flags = PKG_OPEN_MANIFEST_ONLY;
-	else
-		flags = PKG_OPEN_MANIFEST_ONLY | PKG_OPEN_MANIFEST_COMPACT;
+		pkg_emit_manifest_sbuf(pkg, b, PKG_MANIFEST_EMIT_COMPACT, NULL);
+		if (pkg_checksum_generate(pkg, mdigest,
+		     pkg_checksum_type_size(meta->digest_format),
+		     meta->digest_format) != EPKG_OK) {
+			pkg_emit_error("Cannot generate digest for a package");
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+	sbuf_finish(b);
 
-	if (read(pip, digestbuf, 1) == -1) {
-		pkg_emit_errno("pkg_create_repo_worker", "read");
+	/*
+	 * Offsets are relative to this worker's own buffers, they are
+	 * rebased once all the buffers are merged into the final files
+	 */
+	mpos = ftell(w->mfile);
+	if (fwrite(sbuf_data(b), sbuf_len(b), 1, w->mfile) != 1 ||
+	    fputc('\n', w->mfile) == EOF) {
+		pkg_emit_errno("pkg_create_repo_worker", "fwrite");
+		ret = EPKG_FATAL;
 		goto cleanup;
 	}
 
-	LL_FOREACH(start, cur) {
-		if (cur_job >= nelts)
-			break;
-
-		if (pkg_open(&pkg, cur->fts_accpath, keys, flags) == EPKG_OK) {
-			int r;
-			off_t mpos, fpos = 0;
-			size_t mlen;
-			const char *origin;
-
-			sha256_file(cur->fts_accpath, checksum);
-			pkg_set(pkg, PKG_CKSUM, checksum,
-				PKG_REPOPATH, cur->pkg_path,
-				PKG_PKGSIZE, cur->fts_size);
-			pkg_get(pkg, PKG_ORIGIN, &origin);
-
-			/*
-			 * TODO: use pkg_checksum for new manifests
-			 */
-			sbuf_clear(b);
-			if (legacy)
-				pkg_emit_manifest_sbuf(pkg, b, PKG_MANIFEST_EMIT_COMPACT, &mdigest);
-			else {
-				mdigest = malloc(pkg_checksum_type_size(meta->digest_format));
-
-				pkg_emit_manifest_sbuf(pkg, b, PKG_MANIFEST_EMIT_COMPACT, NULL);
-				if (pkg_checksum_generate(pkg, mdigest,
-				     pkg_checksum_type_size(meta->digest_format),
-				     meta->digest_format) != EPKG_OK) {
-					pkg_emit_error("Cannot generate digest for a package");
-					ret = EPKG_FATAL;
-
-					goto cleanup;
-				}
-			}
-			mlen = sbuf_len(b);
-			sbuf_finish(b);
-
-			if (flock(mfd, LOCK_EX) == -1) {
-				pkg_emit_errno("pkg_create_repo_worker", "flock");
-				ret = EPKG_FATAL;
-				goto cleanup;
-			}
-
-			mpos = lseek(mfd, 0, SEEK_END);
+	if (w->ffile != NULL) {
+		fpos = ftell(w->ffile);
+		pkg_emit_filelist(pkg, w->ffile);
+		flen = ftell(w->ffile) - fpos;
+	}
 
-			iov[0].iov_base = sbuf_data(b);
-			iov[0].iov_len = sbuf_len(b);
-			iov[1].iov_base = (void *)"\n";
-			iov[1].iov_len = 1;
+	dig = pkg_create_repo_new_digest(w, cur, origin, checksum);
+	if (dig == NULL) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	dig->digest = mdigest;
+	dig->manifest_pos = mpos;
+	dig->manifest_length = sbuf_len(b);
+	dig->files_pos = fpos;
+	dig->files_length = flen;
+	mdigest = NULL;
 
-			if (writev(mfd, iov, 2) == -1) {
-				pkg_emit_errno("pkg_create_repo_worker", "write");
-				ret = EPKG_FATAL;
-				flock(mfd, LOCK_UN);
-				goto cleanup;
-			}
+cleanup:
+	free(mdigest);
+	pkg_free(pkg);
 
-			flock(mfd, LOCK_UN);
+	return (ret);
+}
 
-			if (read_files) {
-				FILE *fl;
+static void *
+pkg_create_repo_worker(void *arg)
+{
+	struct pkg_repo_create_worker *w = arg;
+	struct pkg_repo_create_env *env = w->env;
+	struct pkg_fts_item *cur;
+	struct pkg_manifest_key *keys = NULL;
+	struct sbuf *b;
+	int flags;
 
-				if (flock(ffd, LOCK_EX) == -1) {
-					pkg_emit_errno("pkg_create_repo_worker", "flock");
-					ret = EPKG_FATAL;
-					goto cleanup;
-				}
-				fpos = lseek(ffd, 0, SEEK_END);
-				fl = fdopen(dup(ffd), "a");
-				pkg_emit_filelist(pkg, fl);
-				fclose(fl);
+	b = sbuf_new_auto();
+	pkg_manifest_keys_new(&keys);
+	pkg_debug(1, "start repo worker %p", (void *)w);
 
-				flock(ffd, LOCK_UN);
-			}
+	if (env->read_files)
+		flags = PKG_OPEN_MANIFEST_ONLY;
+	else
+		flags = PKG_OPEN_MANIFEST_ONLY | PKG_OPEN_MANIFEST_COMPACT;
 
-			r = snprintf(digestbuf, sizeof(digestbuf), "%s:%s:%ld:%ld:%ld:%s\n",
-				origin, mdigest,
-				(long)mpos,
-				(long)fpos,
-				(long)mlen,
-				checksum);
-
-			free(mdigest);
-			mdigest = NULL;
-			iov[0].iov_base = digestbuf;
-			iov[0].iov_len = r;
-			memset(&msg, 0, sizeof(msg));
-			msg.msg_iov = iov;
-			msg.msg_iovlen = 1;
-			sendmsg(pip, &msg, MSG_EOR);
+	cur = pkg_create_repo_next_item(env, false);
+	while (cur != NULL) {
+		if (pkg_create_repo_process(w, cur, keys, flags, b) != EPKG_OK) {
+			w->ret = EPKG_FATAL;
+			break;
 		}
-		cur_job ++;
+		cur = pkg_create_repo_next_item(env, true);
 	}
 
-cleanup:
 	pkg_manifest_keys_free(keys);
+	sbuf_delete(b);
 
-	write(pip, ".\n", 2);
-	close(pip);
-	close(mfd);
-	if (read_files)
-		close(ffd);
-	if (mdigest)
-		free(mdigest);
+	pthread_mutex_lock(&env->lock);
+	if (cur != NULL) {
+		/* Stop other workers as well */
+		env->queue = NULL;
+	}
+	env->running --;
+	pthread_cond_signal(&env->cond);
+	pthread_mutex_unlock(&env->lock);
+
+	pkg_debug(1, "repo worker %p done", (void *)w);
 
-	pkg_debug(1, "worker done");
-	exit(ret);
+	return (NULL);
 }
 
 static int
-pkg_create_repo_read_pipe(int fd, struct digest_list_entry **dlist)
+pkg_create_repo_merge(FILE *src, FILE *dest, long *base)
 {
-	struct digest_list_entry *dig;
-	char buf[1024];
-	int r, i, start;
-	enum {
-		s_set_origin = 0,
-		s_set_digest,
-		s_set_mpos,
-		s_set_fpos,
-		s_set_mlen,
-		s_set_checksum
-	} state = 0;
-
-	for (;;) {
-		r = read(fd, buf, sizeof(buf));
-
-		if (r == -1) {
-			if (errno == EINTR)
-				continue;
-			else if (errno == ECONNRESET) {
-				/* Treat it as the end of a connection */
-				return (EPKG_END);
-			}
-			else if (errno == EAGAIN || errno == EWOULDBLOCK)
-				return (EPKG_OK);
+	char buf[BUFSIZ];
+	size_t r;
+
+	*base = ftell(dest);
+	rewind(src);
 
-			pkg_emit_errno("pkg_create_repo_read_pipe", "read");
+	while ((r = fread(buf, 1, sizeof(buf), src)) > 0) {
+		if (fwrite(buf, 1, r, dest) != r) {
+			pkg_emit_errno("pkg_create_repo_merge", "fwrite");
 			return (EPKG_FATAL);
 		}
-		else if (r == 0)
-			return (EPKG_END);
-
-		/*
-		 * XXX: can parse merely full lines
-		 */
-		start = 0;
-		for (i = 0; i < r; i ++) {
-			if (buf[i] == ':') {
-				switch(state) {
-				case s_set_origin:
-					dig = calloc(1, sizeof(*dig));
-					dig->origin = malloc(i - start + 1);
-					strlcpy(dig->origin, &buf[start], i - start + 1);
-					state = s_set_digest;
-					break;
-				case s_set_digest:
-					dig->digest = malloc(i - start + 1);
-					strlcpy(dig->digest, &buf[start], i - start + 1);
-					state = s_set_mpos;
-					break;
-				case s_set_mpos:
-					dig->manifest_pos = strtol(&buf[start], NULL, 10);
-					state = s_set_fpos;
-					break;
-				case s_set_fpos:
-					dig->files_pos = strtol(&buf[start], NULL, 10);
-					state = s_set_mlen;
-					break;
-				case s_set_mlen:
-					dig->manifest_length = strtol(&buf[start], NULL, 10);
-					state = s_set_checksum;
-					break;
-				case s_set_checksum:
-					dig->checksum =  malloc(i - start + 1);
-					strlcpy(dig->digest, &buf[start], i - start + 1);
-					state = s_set_origin;
-					break;
-				}
-				start = i + 1;
-			}
-			else if (buf[i] == '\n') {
-				if (state == s_set_mlen) {
-					dig->manifest_length = strtol(&buf[start], NULL, 10);
-				}
-				else if (state == s_set_checksum) {
-					dig->checksum =  malloc(i - start + 1);
-					strlcpy(dig->checksum, &buf[start], i - start + 1);
-				}
-				assert(dig->origin != NULL);
-				assert(dig->digest != NULL);
-				DL_APPEND(*dlist, dig);
-				state = s_set_origin;
-				start = i + 1;
-				break;
-			}
-			else if (buf[i] == '.' && buf[i + 1] == '\n') {
-				return (EPKG_END);
+	}
+
+	if (ferror(src)) {
+		pkg_emit_errno("pkg_create_repo_merge", "fread");
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_create_repo_catalogue(const char *output_dir, struct pkg_repo_meta *meta,
+    struct digest_list_entry *dlist, FILE *mfile)
+{
+	struct pkg_catalogue_writer *w = NULL;
+	struct pkg_manifest_key *keys = NULL;
+	struct digest_list_entry *dig;
+	struct pkg *pkg = NULL;
+	char path[MAXPATHLEN];
+	char *buf = NULL, *nbuf;
+	size_t bufsz = 0;
+	int ret = EPKG_FATAL;
+
+	if (pkg_catalogue_writer_new(&w) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pkg_manifest_keys_new(&keys);
+
+	LL_FOREACH(dlist, dig) {
+		if ((size_t)dig->manifest_length > bufsz) {
+			bufsz = dig->manifest_length;
+			if ((nbuf = realloc(buf, bufsz)) == NULL) {
+				pkg_emit_errno("realloc", "pkg_create_repo_catalogue");
+				goto cleanup;
 			}
+			buf = nbuf;
+		}
+		if (pread(fileno(mfile), buf, dig->manifest_length,
+		    dig->manifest_pos) != dig->manifest_length) {
+			pkg_emit_errno("pread", meta->manifests);
+			goto cleanup;
 		}
+
+		if (pkg == NULL) {
+			if (pkg_new(&pkg, PKG_REMOTE) != EPKG_OK)
+				goto cleanup;
+		} else
+			pkg_reset(pkg, PKG_REMOTE);
+
+		if (pkg_parse_manifest(pkg, buf, dig->manifest_length,
+		    keys) != EPKG_OK)
+			goto cleanup;
+		pkg_set(pkg, PKG_DIGEST, dig->digest);
+
+		if (pkg_catalogue_writer_add(w, pkg) != EPKG_OK)
+			goto cleanup;
 	}
 
-	/*
-	 * Never reached
-	 */
-	return (EPKG_OK);
+	snprintf(path, sizeof(path), "%s/%s", output_dir, meta->catalogue);
+	ret = pkg_catalogue_writer_finish(w, path);
+
+cleanup:
+	pkg_catalogue_writer_free(w);
+	pkg_manifest_keys_free(keys);
+	pkg_free(pkg);
+	free(buf);
+
+	return (ret);
 }
 
 int
@@ -528,23 +780,24 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 	const char *metafile, bool legacy)
 {
 	FTS *fts = NULL;
-	struct pkg_fts_item *fts_items = NULL, *fts_cur, *fts_start;
+	struct pkg_fts_item *fts_items = NULL;
 
 	struct pkg_conflict *c, *ctmp;
 	struct pkg_conflict_bulk *conflicts = NULL, *curcb, *tmpcb;
-	int num_workers, i, remaining_workers, remain, cur_jobs, remain_jobs, nworker;
-	size_t len, tasks_per_worker, ntask;
+	int num_workers, i, nworker = 0;
+	size_t len, done;
 	struct digest_list_entry *dlist = NULL, *cur_dig, *dtmp;
-	struct pollfd *pfd = NULL;
-	int cur_pipe[2], fd;
+	struct pkg_repo_create_worker *workers = NULL;
+	struct pkg_repo_create_env env;
 	struct pkg_repo_meta *meta;
 	int retcode = EPKG_OK;
+	long mbase, fbase;
 
 	char *repopath[2];
 	char packagesite[MAXPATHLEN],
 		 filesite[MAXPATHLEN],
 		 repodb[MAXPATHLEN];
-	FILE *mandigests = NULL;
+	FILE *mandigests = NULL, *mfile = NULL, *ffile = NULL;
 
 	if (!is_dir(path)) {
 		pkg_emit_error("%s is not a directory", path);
@@ -577,15 +830,14 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 		meta = pkg_repo_meta_default();
 	}
 
+	memset(&env, 0, sizeof(env));
+	pthread_mutex_init(&env.lock, NULL);
+	pthread_cond_init(&env.cond, NULL);
+
 	repopath[0] = path;
 	repopath[1] = NULL;
 
-	num_workers = pkg_object_int(pkg_config_get("WORKERS_COUNT"));
-	if (num_workers <= 0) {
-		len = sizeof(num_workers);
-		if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
-			num_workers = 6;
-	}
+	num_workers = worker_count();
 
 	if ((fts = fts_open(repopath, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
 		pkg_emit_errno("fts_open", path);
@@ -595,19 +847,17 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 
 	snprintf(packagesite, sizeof(packagesite), "%s/%s", output_dir,
 	    meta->manifests);
-	if ((fd = open(packagesite, O_CREAT|O_TRUNC|O_WRONLY, 00644)) == -1) {
+	if ((mfile = fopen(packagesite, "w+")) == NULL) {
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
-	close(fd);
 	if (filelist) {
 		snprintf(filesite, sizeof(filesite), "%s/%s", output_dir,
 		    meta->filesite);
-		if ((fd = open(filesite, O_CREAT|O_TRUNC|O_WRONLY, 00644)) == -1) {
+		if ((ffile = fopen(filesite, "w+")) == NULL) {
 			retcode = EPKG_FATAL;
 			goto cleanup;
 		}
-		close(fd);
 	}
 	snprintf(repodb, sizeof(repodb), "%s/%s", output_dir,
 	    meta->digests);
@@ -627,127 +877,118 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 		goto cleanup;
 	}
 
-	/* Split items over all workers */
+	/*
+	 * Workers pull packages from a shared queue, so a worker stuck on
+	 * a huge package does not hold back the others
+	 */
+	LL_SORT(fts_items, pkg_fts_item_size_cmp);
+	env.queue = fts_items;
+	env.read_files = filelist;
+	env.meta = (legacy ? NULL : meta);
+	env.cache = pkg_repo_cache_load(output_dir, filelist, env.meta);
 	num_workers = MIN(num_workers, len);
-	tasks_per_worker = len / num_workers;
-	/* How much extra tasks should be distributed over the workers */
-	remain = len % num_workers;
-	assert(tasks_per_worker > 0);
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL) {
+		pkg_emit_errno("calloc", "struct pkg_repo_create_worker");
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
 
 	/* Launch workers */
 	pkg_emit_progress_start("Creating repository in %s", output_dir);
 
-	pfd = calloc(num_workers, sizeof(struct pollfd));
-	ntask = 0;
-	cur_jobs = (remain > 0) ? tasks_per_worker + 1 : tasks_per_worker;
-	remain_jobs = cur_jobs;
-	fts_start = fts_items;
-	nworker = 0;
-
-	LL_FOREACH(fts_items, fts_cur) {
-		if (--remain_jobs == 0) {
-			/* Create new worker */
-			int ofl;
-			int st = SOCK_DGRAM;
-
-#ifdef HAVE_SEQPACKET
-			st = SOCK_SEQPACKET;
-#endif
-			if (socketpair(AF_UNIX, st, 0, cur_pipe) == -1) {
-				pkg_emit_errno("pkg_create_repo", "pipe");
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+	for (nworker = 0; nworker < num_workers; nworker ++) {
+		struct pkg_repo_create_worker *w = &workers[nworker];
 
-			if (pkg_create_repo_worker(fts_start, cur_jobs,
-					packagesite, (filelist ? filesite : NULL), cur_pipe[1],
-					(legacy ? NULL : meta)) == EPKG_FATAL) {
-				close(cur_pipe[0]);
-				close(cur_pipe[1]);
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+		w->env = &env;
+		w->ret = EPKG_OK;
+		if ((w->mfile = tmpfile()) == NULL ||
+		    (filelist && (w->ffile = tmpfile()) == NULL)) {
+			pkg_emit_errno("pkg_create_repo", "tmpfile");
+			retcode = EPKG_FATAL;
+			break;
+		}
 
-			pfd[nworker].fd = cur_pipe[0];
-			pfd[nworker].events = POLLIN;
-			close(cur_pipe[1]);
-			/* Make our end of the pipe non-blocking */
-			ofl = fcntl(cur_pipe[0], F_GETFL, 0);
-			fcntl(cur_pipe[0], F_SETFL, ofl | O_NONBLOCK);
+		pthread_mutex_lock(&env.lock);
+		env.running ++;
+		pthread_mutex_unlock(&env.lock);
+		if (pthread_create(&w->thr, NULL, pkg_create_repo_worker, w) != 0) {
+			pkg_emit_errno("pkg_create_repo", "pthread_create");
+			pthread_mutex_lock(&env.lock);
+			env.running --;
+			pthread_mutex_unlock(&env.lock);
+			retcode = EPKG_FATAL;
+			break;
+		}
+	}
 
-			if (--remain > 0)
-				cur_jobs = tasks_per_worker + 1;
-			else
-				cur_jobs = tasks_per_worker;
+	if (retcode != EPKG_OK) {
+		/* Drain the queue so that started workers exit */
+		pthread_mutex_lock(&env.lock);
+		env.queue = NULL;
+		pthread_mutex_unlock(&env.lock);
+	}
 
-			remain_jobs = cur_jobs;
-			fts_start = fts_cur->next;
-			nworker ++;
-		}
-		ntask ++;
+	pthread_mutex_lock(&env.lock);
+	while (env.running > 0) {
+		/* The workers must not wait for the event callback */
+		done = env.done;
+		pthread_mutex_unlock(&env.lock);
+		pkg_emit_progress_tick(done, len);
+		pthread_mutex_lock(&env.lock);
+		if (env.running > 0 && env.done == done)
+			pthread_cond_wait(&env.cond, &env.lock);
 	}
+	pthread_mutex_unlock(&env.lock);
 
-	/* Send start marker to all workers */
-	for (i = 0; i < num_workers; i ++) {
-		if (write(pfd[i].fd, ".", 1) == -1)
-			pkg_emit_errno("pkg_create_repo", "write");
+	for (i = 0; i < nworker; i ++) {
+		pthread_join(workers[i].thr, NULL);
+		if (workers[i].ret != EPKG_OK)
+			retcode = EPKG_FATAL;
 	}
 
-	ntask = 0;
-	remaining_workers = num_workers;
-	while(remaining_workers > 0) {
-		int st;
+	if (retcode != EPKG_OK)
+		goto cleanup;
 
-		pkg_debug(1, "checking for %d workers", remaining_workers);
-		retcode = poll(pfd, num_workers, -1);
-		if (retcode == -1) {
-			if (errno == EINTR) {
-				continue;
-			}
-			else {
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+	pkg_emit_progress_tick(len, len);
+
+	/* Merge the per-worker buffers into the final files */
+	for (i = 0; i < nworker; i ++) {
+		struct pkg_repo_create_worker *w = &workers[i];
+
+		fbase = 0;
+		if (pkg_create_repo_merge(w->mfile, mfile, &mbase) != EPKG_OK ||
+		    (w->ffile != NULL &&
+		     pkg_create_repo_merge(w->ffile, ffile, &fbase) != EPKG_OK)) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
 		}
-		else if (retcode > 0) {
-			for (i = 0; i < num_workers; i ++) {
-				if (pfd[i].fd != -1 &&
-								(pfd[i].revents & (POLLIN|POLLHUP|POLLERR))) {
-					if (pkg_create_repo_read_pipe(pfd[i].fd, &dlist) != EPKG_OK) {
-						/*
-						 * Wait for the worker finished
-						 */
-
-						while (wait(&st) == -1) {
-							if (errno == EINTR)
-								continue;
-
-							pkg_emit_errno("pkg_create_repo", "wait");
-							break;
-						}
-
-						remaining_workers --;
-						pkg_debug(1, "finished worker, %d remaining",
-							remaining_workers);
-						pfd[i].events = 0;
-						pfd[i].revents = 0;
-						close(pfd[i].fd);
-						pfd[i].fd = -1;
-					}
-					else {
-						pkg_emit_progress_tick(ntask++, len);
-					}
-				}
-			}
+
+		LL_FOREACH(w->dlist, cur_dig) {
+			cur_dig->manifest_pos += mbase;
+			cur_dig->files_pos += fbase;
 		}
+		DL_CONCAT(dlist, w->dlist);
+		w->dlist = NULL;
 	}
 
-	pkg_emit_progress_tick(len, len);
-	retcode = EPKG_OK;
-
 	/* Now sort all digests */
 	DL_SORT(dlist, pkg_digest_sort_compare_func);
 
+	fflush(mfile);
+	if (ffile != NULL)
+		fflush(ffile);
+	if (pkg_repo_cache_write(output_dir, filelist, env.meta, dlist,
+	    mfile, ffile) != EPKG_OK)
+		pkg_emit_notice("cannot update the repo cache in %s", output_dir);
+
+	if (!legacy && meta->catalogue != NULL &&
+	    pkg_create_repo_catalogue(output_dir, meta, dlist, mfile) != EPKG_OK) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
 	/*
 	 * XXX: it is not used actually
 	 */
@@ -758,15 +999,15 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 	/* Write metafile */
 	if (!legacy) {
 		ucl_object_t *meta_dump;
-		FILE *mfile;
+		FILE *metaf;
 
 		snprintf(repodb, sizeof(repodb), "%s/%s", output_dir,
 			"meta");
-		if ((mfile = fopen(repodb, "w")) != NULL) {
+		if ((metaf = fopen(repodb, "w")) != NULL) {
 			meta_dump = pkg_repo_meta_to_ucl(meta);
-			ucl_object_emit_file(meta_dump, UCL_EMIT_CONFIG, mfile);
+			ucl_object_emit_file(meta_dump, UCL_EMIT_CONFIG, metaf);
 			ucl_object_unref(meta_dump);
-			fclose(mfile);
+			fclose(metaf);
 		}
 		else {
 			pkg_emit_notice("cannot create metafile at %s", repodb);
@@ -783,14 +1024,29 @@ cleanup:
 		free(curcb);
 	}
 
-	if (pfd != NULL)
-		free(pfd);
+	if (workers != NULL) {
+		for (i = 0; i < num_workers; i ++) {
+			if (workers[i].mfile != NULL)
+				fclose(workers[i].mfile);
+			if (workers[i].ffile != NULL)
+				fclose(workers[i].ffile);
+			DL_CONCAT(dlist, workers[i].dlist);
+		}
+		free(workers);
+	}
+	HASH_FREE(env.cache, pkg_repo_cache_entry_free);
+	pthread_cond_destroy(&env.cond);
+	pthread_mutex_destroy(&env.lock);
+
 	if (fts != NULL)
 		fts_close(fts);
 
 	LL_FREE(fts_items, pkg_create_repo_fts_free);
 	LL_FOREACH_SAFE(dlist, cur_dig, dtmp) {
-		if (cur_dig->checksum != NULL)
+		/* Only a complete index is worth writing */
+		if (retcode != EPKG_OK)
+			;
+		else if (cur_dig->checksum != NULL)
 			fprintf(mandigests, "%s:%s:%ld:%ld:%ld:%s\n", cur_dig->origin,
 				cur_dig->digest, cur_dig->manifest_pos, cur_dig->files_pos,
 				cur_dig->manifest_length, cur_dig->checksum);
@@ -801,6 +1057,7 @@ cleanup:
 
 		free(cur_dig->digest);
 		free(cur_dig->origin);
+		free(cur_dig->checksum);
 		free(cur_dig);
 	}
 
@@ -808,6 +1065,10 @@ cleanup:
 
 	if (mandigests != NULL)
 		fclose(mandigests);
+	if (mfile != NULL)
+		fclose(mfile);
+	if (ffile != NULL)
+		fclose(ffile);
 
 	return (retcode);
 }
@@ -951,6 +1212,286 @@ pkg_repo_pack_db(const char *name, const char *archive, char *path,
 	return (EPKG_OK);
 }
 
+/*
+ * Delta updates: every run keeps a copy of the digests it published, and
+ * the next run publishes the difference between that copy and the new
+ * digests as <deltas>-<sha256 of the old digests>. A delta is a text
+ * file:
+ *
+ *   base <sha256 of the old digests>
+ *   target <sha256 of the new digests>
+ *   -origin                          (removed package)
+ *   +origin:digest:length            (new or changed package)
+ *   <length bytes of manifest>
+ */
+static const char repo_digests_file[] = ".pkg_repo_digests";
+static const char repo_deltas_file[] = ".pkg_repo_deltas";
+
+struct pkg_repo_delta_entry {
+	char *origin;
+	char *digest;
+	char *checksum;
+	long manifest_pos;
+	long manifest_length;
+	UT_hash_handle hh;
+	struct pkg_repo_delta_entry *next;
+};
+
+static void
+pkg_repo_delta_entry_free(struct pkg_repo_delta_entry *e)
+{
+	free(e->origin);
+	free(e->digest);
+	free(e->checksum);
+	free(e);
+}
+
+static struct pkg_repo_delta_entry *
+pkg_repo_delta_parse_line(char *line)
+{
+	struct pkg_repo_delta_entry *e;
+	char *fields[6];
+	int i;
+
+	/* origin:digest:manifest_pos:files_pos:manifest_length[:checksum] */
+	line[strcspn(line, "\n")] = '\0';
+	for (i = 0; i < (int)NELEM(fields); i ++)
+		fields[i] = strsep(&line, ":");
+	if (fields[4] == NULL)
+		return (NULL);
+
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_repo_delta_entry");
+		return (NULL);
+	}
+	e->origin = strdup(fields[0]);
+	e->digest = strdup(fields[1]);
+	e->checksum = strdup(fields[5] != NULL ? fields[5] : "");
+	e->manifest_pos = strtol(fields[2], NULL, 10);
+	e->manifest_length = strtol(fields[4], NULL, 10);
+
+	return (e);
+}
+
+static int
+pkg_repo_delta_write(const char *path, const char *prev_digests,
+    const char *digests, const char *manifests, const char *base,
+    const char *target)
+{
+	struct pkg_repo_delta_entry *old = NULL, *changed = NULL, *e, *etmp,
+	    *found;
+	FILE *fp, *out = NULL;
+	char *line = NULL, *buf = NULL, *nbuf;
+	size_t linecap = 0, bufsz = 0;
+	int mfd = -1, ret = EPKG_FATAL;
+
+	if ((fp = fopen(prev_digests, "r")) == NULL) {
+		pkg_emit_errno("fopen", prev_digests);
+		return (EPKG_FATAL);
+	}
+	while (getline(&line, &linecap, fp) > 0) {
+		if ((e = pkg_repo_delta_parse_line(line)) != NULL)
+			HASH_ADD_KEYPTR(hh, old, e->origin, strlen(e->origin), e);
+	}
+	fclose(fp);
+
+	if ((fp = fopen(digests, "r")) == NULL) {
+		pkg_emit_errno("fopen", digests);
+		goto cleanup;
+	}
+	while (getline(&line, &linecap, fp) > 0) {
+		if ((e = pkg_repo_delta_parse_line(line)) == NULL)
+			continue;
+		HASH_FIND_STR(old, e->origin, found);
+		if (found != NULL) {
+			HASH_DEL(old, found);
+			if (strcmp(found->digest, e->digest) == 0 &&
+			    strcmp(found->checksum, e->checksum) == 0) {
+				pkg_repo_delta_entry_free(found);
+				pkg_repo_delta_entry_free(e);
+				continue;
+			}
+			pkg_repo_delta_entry_free(found);
+		}
+		LL_PREPEND(changed, e);
+	}
+	fclose(fp);
+
+	if ((mfd = open(manifests, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", manifests);
+		goto cleanup;
+	}
+	if ((out = fopen(path, "w")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		goto cleanup;
+	}
+
+	fprintf(out, "base %s\ntarget %s\n", base, target);
+
+	/* What is left of the old digests has been removed */
+	HASH_ITER(hh, old, e, etmp)
+		fprintf(out, "-%s\n", e->origin);
+
+	LL_FOREACH(changed, e) {
+		if ((size_t)e->manifest_length > bufsz) {
+			bufsz = e->manifest_length;
+			if ((nbuf = realloc(buf, bufsz)) == NULL) {
+				pkg_emit_errno("realloc", "pkg_repo_delta_write");
+				goto cleanup;
+			}
+			buf = nbuf;
+		}
+		if (pread(mfd, buf, e->manifest_length, e->manifest_pos) !=
+		    e->manifest_length) {
+			pkg_emit_errno("pread", manifests);
+			goto cleanup;
+		}
+		fprintf(out, "+%s:%s:%ld\n", e->origin, e->digest,
+		    e->manifest_length);
+		fwrite(buf, e->manifest_length, 1, out);
+	}
+
+	if (ferror(out)) {
+		pkg_emit_errno("fwrite", path);
+		goto cleanup;
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	if (out != NULL && fclose(out) != 0 && ret == EPKG_OK) {
+		pkg_emit_errno("fclose", path);
+		ret = EPKG_FATAL;
+	}
+	if (ret != EPKG_OK)
+		unlink(path);
+	if (mfd != -1)
+		close(mfd);
+	HASH_ITER(hh, old, e, etmp) {
+		HASH_DEL(old, e);
+		pkg_repo_delta_entry_free(e);
+	}
+	LL_FREE(changed, pkg_repo_delta_entry_free);
+	free(line);
+	free(buf);
+
+	return (ret);
+}
+
+/*
+ * Records a new delta in the history and removes the ones that clients
+ * would never follow anymore.
+ */
+static void
+pkg_repo_delta_expire(const char *output_dir, struct pkg_repo_meta *meta,
+    const char *base)
+{
+	char path[MAXPATHLEN], tmppath[MAXPATHLEN];
+	char **bases = NULL, **nbases;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int count = 0, first, i;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_deltas_file);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while ((linelen = getline(&line, &linecap, fp)) > 0) {
+			if (line[linelen - 1] == '\n')
+				line[linelen - 1] = '\0';
+			nbases = realloc(bases, (count + 1) * sizeof(*bases));
+			if (nbases == NULL)
+				break;
+			bases = nbases;
+			bases[count++] = strdup(line);
+		}
+		fclose(fp);
+	}
+	nbases = realloc(bases, (count + 1) * sizeof(*bases));
+	if (nbases == NULL)
+		goto cleanup;
+	bases = nbases;
+	bases[count++] = strdup(base);
+
+	first = MAX(0, count - PKG_REPO_MAX_DELTAS);
+	for (i = 0; i < first; i ++) {
+		snprintf(tmppath, sizeof(tmppath), "%s/%s-%s.%s", output_dir,
+		    meta->deltas, bases[i],
+		    packing_format_to_string(meta->packing_format));
+		unlink(tmppath);
+	}
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fp = fopen(tmppath, "w")) != NULL) {
+		for (i = first; i < count; i ++)
+			fprintf(fp, "%s\n", bases[i]);
+		if (fclose(fp) != 0 || rename(tmppath, path) == -1)
+			unlink(tmppath);
+	}
+
+cleanup:
+	for (i = 0; i < count; i ++)
+		free(bases[i]);
+	free(bases);
+	free(line);
+}
+
+static int
+pkg_repo_delta_create(const char *output_dir, struct pkg_repo_meta *meta,
+    struct rsa_key *rsa, char **argv, int argc)
+{
+	char digests[MAXPATHLEN], manifests[MAXPATHLEN], prev[MAXPATHLEN];
+	char name[MAXPATHLEN], delta[MAXPATHLEN];
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char prev_cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	FILE *src, *dest;
+	long base;
+	int ret = EPKG_OK;
+
+	snprintf(digests, sizeof(digests), "%s/%s", output_dir, meta->digests);
+	snprintf(manifests, sizeof(manifests), "%s/%s", output_dir,
+	    meta->manifests);
+	snprintf(prev, sizeof(prev), "%s/%s", output_dir, repo_digests_file);
+
+	if (sha256_file(digests, cksum) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	free(meta->digests_checksum);
+	meta->digests_checksum = strdup(cksum);
+
+	if (access(prev, R_OK) == 0 && sha256_file(prev, prev_cksum) == EPKG_OK &&
+	    strcmp(prev_cksum, cksum) != 0) {
+		snprintf(name, sizeof(name), "%s-%s", meta->deltas, prev_cksum);
+		snprintf(delta, sizeof(delta), "%s/%s", output_dir, name);
+		if (pkg_repo_delta_write(delta, prev, digests, manifests,
+		    prev_cksum, cksum) != EPKG_OK ||
+		    pkg_repo_pack_db(name, delta, delta, rsa, meta, argv,
+		    argc) != EPKG_OK)
+			return (EPKG_FATAL);
+		pkg_repo_delta_expire(output_dir, meta, prev_cksum);
+	}
+
+	/* Keep these digests as the base of the next delta */
+	if ((src = fopen(digests, "r")) == NULL) {
+		pkg_emit_errno("fopen", digests);
+		return (EPKG_FATAL);
+	}
+	if ((dest = fopen(prev, "w")) == NULL) {
+		pkg_emit_errno("fopen", prev);
+		fclose(src);
+		return (EPKG_FATAL);
+	}
+	if (pkg_create_repo_merge(src, dest, &base) != EPKG_OK)
+		ret = EPKG_FATAL;
+	fclose(src);
+	if (fclose(dest) != 0)
+		ret = EPKG_FATAL;
+	if (ret != EPKG_OK)
+		unlink(prev);
+
+	return (ret);
+}
+
 int
 pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
     char **argv, int argc, bool filelist)
@@ -994,8 +1535,25 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 			pkg_emit_error("meta loading error while trying %s", repo_path);
 			return (EPKG_FATAL);
 		}
-		else {
-			meta = pkg_repo_meta_default();
+		if (meta->deltas != NULL) {
+			ucl_object_t *meta_dump;
+			FILE *metaf;
+
+			if (pkg_repo_delta_create(output_dir, meta, rsa, argv,
+			    argc) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+			/* Clients need the checksum to find their deltas */
+			if ((metaf = fopen(repo_path, "w")) == NULL) {
+				pkg_emit_errno("fopen", repo_path);
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+			meta_dump = pkg_repo_meta_to_ucl(meta);
+			ucl_object_emit_file(meta_dump, UCL_EMIT_CONFIG, metaf);
+			ucl_object_unref(meta_dump);
+			fclose(metaf);
 		}
 		if (pkg_repo_pack_db(repo_meta_file, repo_path, repo_path, rsa, meta,
 			argv, argc) != EPKG_OK) {
@@ -1046,6 +1604,18 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 
 	pkg_emit_progress_tick(nfile++, files_to_pack);
 
+	if (!legacy && meta->catalogue != NULL) {
+		snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
+		    meta->catalogue);
+		snprintf(repo_archive, sizeof(repo_archive), "%s/%s",
+		    output_dir, meta->catalogue_archive);
+		if (pkg_repo_pack_db(meta->catalogue, repo_archive, repo_path,
+		    rsa, meta, argv, argc) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
 #if 0
 	snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
 		meta->conflicts);
@@ -1088,6 +1658,11 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 				"%s/%s.txz", output_dir, repo_meta_file);
 			utimes(repo_archive, ftimes);
 		}
+		if (!legacy && meta->catalogue != NULL) {
+			snprintf(repo_archive, sizeof(repo_archive),
+			    "%s/%s.txz", output_dir, meta->catalogue_archive);
+			utimes(repo_archive, ftimes);
+		}
 	}
 
 cleanup:
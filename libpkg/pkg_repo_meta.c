@@ -50,6 +50,12 @@ pkg_repo_meta_set_default(struct pkg_repo_meta *meta)
 	/* Not using fulldb */
 	meta->fulldb = NULL;
 	meta->fulldb_archive = NULL;
+	/* Binary catalogue is only published when asked for */
+	meta->catalogue = NULL;
+	meta->catalogue_archive = NULL;
+	/* Neither are delta updates */
+	meta->deltas = NULL;
+	meta->digests_checksum = NULL;
 	meta->version = 1;
 }
 
@@ -72,6 +78,10 @@ pkg_repo_meta_free(struct pkg_repo_meta *meta)
 		free(meta->digests_archive);
 		free(meta->fulldb_archive);
 		free(meta->filesite_archive);
+		free(meta->catalogue);
+		free(meta->catalogue_archive);
+		free(meta->deltas);
+		free(meta->digests_checksum);
 		free(meta->maintainer);
 		free(meta->source);
 		free(meta->source_identifier);
@@ -109,6 +119,10 @@ pkg_repo_meta_open_schema_v1()
 			"conflicts_archive = {type = string};\n"
 			"fulldb_archive = {type = string};\n"
 			"filesite_archive = {type = string};\n"
+			"catalogue = {type = string};\n"
+			"catalogue_archive = {type = string};\n"
+			"deltas = {type = string};\n"
+			"digests_checksum = {type = string};\n"
 			"source_identifier = {type = string};\n"
 			"revision = {type = integer};\n"
 			"eol = {type = integer};\n"
@@ -204,6 +218,12 @@ pkg_repo_meta_parse(ucl_object_t *top, struct pkg_repo_meta **target, int versio
 	META_EXTRACT_STRING(manifests_archive);
 	META_EXTRACT_STRING(fulldb_archive);
 	META_EXTRACT_STRING(filesite_archive);
+	META_EXTRACT_STRING(catalogue);
+	META_EXTRACT_STRING(catalogue_archive);
+	if (meta->catalogue != NULL && meta->catalogue_archive == NULL)
+		meta->catalogue_archive = strdup(meta->catalogue);
+	META_EXTRACT_STRING(deltas);
+	META_EXTRACT_STRING(digests_checksum);
 
 	META_EXTRACT_STRING(source_identifier);
 
@@ -356,6 +376,10 @@ pkg_repo_meta_to_ucl(struct pkg_repo_meta *meta)
 	META_EXPORT_FIELD(result, meta, conflicts_archive, string);
 	META_EXPORT_FIELD(result, meta, fulldb_archive, string);
 	META_EXPORT_FIELD(result, meta, filesite_archive, string);
+	META_EXPORT_FIELD(result, meta, catalogue, string);
+	META_EXPORT_FIELD(result, meta, catalogue_archive, string);
+	META_EXPORT_FIELD(result, meta, deltas, string);
+	META_EXPORT_FIELD(result, meta, digests_checksum, string);
 
 	META_EXPORT_FIELD(result, meta, source_identifier, string);
 	META_EXPORT_FIELD(result, meta, revision, int);
@@ -376,12 +400,21 @@ bool
 pkg_repo_meta_is_special_file(const char *file, struct pkg_repo_meta *meta)
 {
 	bool special = false;
+	size_t len;
 
 	special = META_SPECIAL_FILE(file, meta, digests_archive);
 	special = META_SPECIAL_FILE(file, meta, manifests_archive);
 	special = META_SPECIAL_FILE(file, meta, filesite_archive);
 	special = META_SPECIAL_FILE(file, meta, conflicts_archive);
 	special = META_SPECIAL_FILE(file, meta, fulldb_archive);
+	special = META_SPECIAL_FILE(file, meta, catalogue_archive);
+
+	/* Delta archives are named <deltas>-<base checksum> */
+	if (!special && meta->deltas != NULL) {
+		len = strlen(meta->deltas);
+		special = (strncmp(file, meta->deltas, len) == 0 &&
+		    file[len] == '-');
+	}
 
 	return (special);
 }
@@ -140,13 +140,14 @@ static void
 pkg_solve_variable_set(struct pkg_solve_variable *var,
 	struct pkg_job_universe_item *item)
 {
-	const char *digest, *uid;
+	const char *digest;
 
 	var->unit = item;
-	pkg_get(item->pkg, PKG_UNIQUEID, &uid, PKG_DIGEST, &digest);
+	pkg_get(item->pkg, PKG_DIGEST, &digest);
 	/* XXX: Is it safe to save a ptr here ? */
 	var->digest = digest;
-	var->uid = uid;
+	/* Interned, variables_by_uid is keyed by the pointer */
+	var->uid = item->uid;
 	var->prev = var;
 }
 
@@ -218,7 +219,6 @@ pkg_solve_handle_provide (struct pkg_solve_problem *problem,
 		struct pkg_job_provide *pr, struct pkg_solve_rule *rule, int *cnt)
 {
 	struct pkg_solve_item *it = NULL;
-	const char *uid, *digest;
 	struct pkg_solve_variable *var, *curvar;
 	struct pkg_job_universe_item *un;
 
@@ -229,8 +229,7 @@ pkg_solve_handle_provide (struct pkg_solve_problem *problem,
 	}
 
 	/* Find the corresponding variables chain */
-	pkg_get(un->pkg, PKG_DIGEST, &digest, PKG_UNIQUEID, &uid);
-	HASH_FIND_STR(problem->variables_by_uid, uid, var);
+	HASH_FIND_PTR(problem->variables_by_uid, &un->uid, var);
 
 	LL_FOREACH(var, curvar) {
 		/* For each provide */
@@ -258,7 +257,7 @@ pkg_solve_add_depend_rule(struct pkg_solve_problem *problem,
 	int cnt;
 
 	uid = dep->uid;
-	HASH_FIND_STR(problem->variables_by_uid, uid, depvar);
+	HASH_FIND_PTR(problem->variables_by_uid, &uid, depvar);
 	if (depvar == NULL) {
 		pkg_debug(2, "cannot find variable dependency %s", uid);
 		return (EPKG_END);
@@ -298,13 +297,16 @@ pkg_solve_add_conflict_rule(struct pkg_solve_problem *problem,
 		struct pkg_solve_variable *var,
 		struct pkg_conflict *conflict)
 {
-	const char *uid;
+	const char *uid, *iuid;
 	struct pkg_solve_variable *confvar, *curvar;
 	struct pkg_solve_rule *rule = NULL;
 	struct pkg_solve_item *it = NULL;
 
 	uid = pkg_conflict_uniqueid(conflict);
-	HASH_FIND_STR(problem->variables_by_uid, uid, confvar);
+	iuid = pkg_intern_find(uid);
+	confvar = NULL;
+	if (iuid != NULL)
+		HASH_FIND_PTR(problem->variables_by_uid, &iuid, confvar);
 	if (confvar == NULL) {
 		pkg_debug(2, "cannot find conflict %s", uid);
 		return (EPKG_END);
@@ -365,9 +367,11 @@ pkg_solve_add_require_rule(struct pkg_solve_problem *problem,
 	struct pkg_solve_rule *rule;
 	struct pkg_solve_item *it = NULL;
 	struct pkg_job_provide *pr, *prhead;
+	const char *shname;
 	int cnt;
 
-	HASH_FIND_STR(problem->j->universe->provides, pkg_shlib_name(shlib), prhead);
+	shname = pkg_shlib_name(shlib);
+	HASH_FIND_PTR(problem->j->universe->provides, &shname, prhead);
 	if (prhead != NULL) {
 		/* Require rule !A | P1 | P2 | P3 ... */
 		rule = pkg_solve_rule_new("require");
@@ -540,8 +544,7 @@ pkg_solve_add_variable(struct pkg_job_universe_item *un,
 
 		if (tvar == NULL) {
 			pkg_debug(4, "solver: add variable from universe with uid %s", var->uid);
-			HASH_ADD_KEYPTR(hh, problem->variables_by_uid,
-				var->uid, strlen(var->uid), var);
+			HASH_ADD_PTR(problem->variables_by_uid, uid, var);
 			tvar = var;
 		}
 		else {
@@ -599,8 +602,8 @@ pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 		const char *uid;
 		struct pkg_solve_variable *var;
 
-		pkg_get(un->pkg, PKG_UNIQUEID, &uid);
-		HASH_FIND_STR(problem->variables_by_uid, uid, var);
+		uid = un->uid;
+		HASH_FIND_PTR(problem->variables_by_uid, &uid, var);
 		if (var == NULL) {
 			pkg_emit_error("internal solver error: variable %s is not found",
 				uid);
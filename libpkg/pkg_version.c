@@ -33,6 +33,7 @@
 
 #include "pkg.h"
 #include "private/event.h"
+#include "private/pkg.h"
 
 /*
  * split_version(pkgname, endname, epoch, revision) returns a pointer to
@@ -335,6 +336,172 @@ pkg_version_cmp(const char * const pkg1, const char * const pkg2)
 	return (result);
 }
 
+/*
+ * A version key is a version string run through split_version() and
+ * get_component() once, so that it can be compared any number of times
+ * without reparsing it.  A `+' in the version is kept as a block marker.
+ */
+#define VERSION_BLOCK	-1
+
+struct pkg_version_key {
+	unsigned long	 epoch;
+	unsigned long	 revision;
+	size_t		 ncomponents;
+	version_component components[];
+};
+
+struct pkg_version_key *
+pkg_version_key_new(const char *version)
+{
+	struct pkg_version_key *key;
+	const char *v, *ve;
+	unsigned long epoch, revision;
+	size_t n = 0;
+
+	v = split_version(version, &ve, &epoch, &revision);
+	if (v == NULL)
+		return (NULL);
+
+	/* Every component consumes at least one character */
+	key = malloc(sizeof(*key) + (ve - v) * sizeof(version_component));
+	if (key == NULL) {
+		pkg_emit_errno("malloc", "pkg_version_key");
+		return (NULL);
+	}
+	key->epoch = epoch;
+	key->revision = revision;
+
+	while (v < ve) {
+		if (*v == '+') {
+			key->components[n].n = 0;
+			key->components[n].pl = 0;
+			key->components[n].a = VERSION_BLOCK;
+			v++;
+		} else {
+			v = get_component(v, &key->components[n]);
+		}
+		n++;
+	}
+	key->ncomponents = n;
+
+	return (key);
+}
+
+void
+pkg_version_key_free(struct pkg_version_key *key)
+{
+	free(key);
+}
+
+/*
+ * Size of a key: keys hold no pointer, so they can be copied as is.
+ */
+size_t
+pkg_version_key_size(const struct pkg_version_key *key)
+{
+	return (sizeof(*key) + key->ncomponents * sizeof(version_component));
+}
+
+/*
+ * Whether len bytes read back from a file hold a whole key.
+ */
+bool
+pkg_version_key_valid(const void *mem, size_t len)
+{
+	const struct pkg_version_key *key = mem;
+
+	if (len < sizeof(*key))
+		return (false);
+
+	return (key->ncomponents <=
+	    (len - sizeof(*key)) / sizeof(version_component));
+}
+
+/*
+ * Same ordering as pkg_version_cmp(), walking the components of both keys
+ * in lockstep: a side that is at a block marker (or exhausted) compares as
+ * {0, 0, 0} without advancing, until both sides reach a block.
+ */
+int
+pkg_version_key_cmp(const struct pkg_version_key *k1,
+    const struct pkg_version_key *k2)
+{
+	static const version_component zero = {0, 0, 0};
+	const version_component *vc1, *vc2;
+	size_t i1 = 0, i2 = 0;
+	bool block1, block2;
+
+	if (k1->epoch != k2->epoch)
+		return (k1->epoch < k2->epoch ? -1 : 1);
+
+	while (i1 < k1->ncomponents || i2 < k2->ncomponents) {
+		block1 = (i1 >= k1->ncomponents ||
+		    k1->components[i1].a == VERSION_BLOCK);
+		block2 = (i2 >= k2->ncomponents ||
+		    k2->components[i2].a == VERSION_BLOCK);
+		if (block1 && block2) {
+			if (i1 < k1->ncomponents)
+				i1++;
+			if (i2 < k2->ncomponents)
+				i2++;
+			continue;
+		}
+		vc1 = block1 ? &zero : &k1->components[i1++];
+		vc2 = block2 ? &zero : &k2->components[i2++];
+		if (vc1->n != vc2->n)
+			return (vc1->n < vc2->n ? -1 : 1);
+		if (vc1->a != vc2->a)
+			return (vc1->a < vc2->a ? -1 : 1);
+		if (vc1->pl != vc2->pl)
+			return (vc1->pl < vc2->pl ? -1 : 1);
+	}
+
+	if (k1->revision != k2->revision)
+		return (k1->revision < k2->revision ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * Returns the version key of a package, building it on first use.  The key
+ * is dropped by pkg_set() whenever PKG_VERSION changes.  As it is cached in
+ * the package, this is not thread safe even though the package is const: a
+ * package used by several threads at once must have its key built first.
+ */
+const struct pkg_version_key *
+pkg_version_key_get(const struct pkg *pkg)
+{
+	struct pkg *p = __DECONST(struct pkg *, pkg);
+	const char *version;
+
+	if (p->version_key == NULL) {
+		pkg_get(p, PKG_VERSION, &version);
+		if (version != NULL)
+			p->version_key = pkg_version_key_new(version);
+	}
+
+	return (p->version_key);
+}
+
+int
+pkg_version_cmp_pkg(const struct pkg *pkg1, const struct pkg *pkg2)
+{
+	const struct pkg_version_key *k1, *k2;
+	const char *v1, *v2;
+
+	k1 = pkg_version_key_get(pkg1);
+	k2 = pkg_version_key_get(pkg2);
+
+	/* The key could not be allocated */
+	if (k1 == NULL || k2 == NULL) {
+		pkg_get(pkg1, PKG_VERSION, &v1);
+		pkg_get(pkg2, PKG_VERSION, &v2);
+		return (pkg_version_cmp(v1, v2));
+	}
+
+	return (pkg_version_key_cmp(k1, k2));
+}
+
 pkg_change_t
 pkg_version_change(const struct pkg * restrict pkg)
 {
@@ -360,15 +527,10 @@ pkg_version_change(const struct pkg * restrict pkg)
 pkg_change_t
 pkg_version_change_between(const struct pkg * pkg1, const struct pkg *pkg2)
 {
-	const char *version, *oldversion;
-
 	if (pkg2 == NULL)
 		return PKG_REINSTALL;
 
-	pkg_get(pkg1, PKG_VERSION, &version);
-	pkg_get(pkg2, PKG_VERSION, &oldversion);
-
-	switch (pkg_version_cmp(oldversion, version)) {
+	switch (pkg_version_cmp_pkg(pkg2, pkg1)) {
 	case -1:
 		return (PKG_UPGRADE);
 	default:		/* placate the compiler */
@@ -46,6 +46,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <sqlite3.h>
 
@@ -82,6 +83,7 @@ static int prstmt_initialize(struct pkgdb *db);
 /* static int run_prstmt(sql_prstmt_index s, ...); */
 static void prstmt_finalize(struct pkgdb *db);
 static int pkgdb_insert_scripts(struct pkg *pkg, int64_t package_id, sqlite3 *s);
+static void pkgdb_integrity_free(struct pkgdb *db);
 
 
 extern int sqlite3_shell(int, char**);
@@ -882,6 +884,44 @@ pkgdb_open_repos(struct pkgdb *db, const char *reponame)
 	return (EPKG_OK);
 }
 
+/*
+ * The journal mode is stored in the database file itself: switch it when
+ * SQLITE_WAL has been changed, which needs write access.  Otherwise keep
+ * whatever mode the database is in.
+ */
+static int
+pkgdb_setup_journal(struct pkgdb *db)
+{
+	char	*mode = NULL;
+	bool	 wal;
+
+	wal = pkg_object_bool(pkg_config_get("SQLITE_WAL"));
+
+	if (get_sql_string(db->sqlite, "PRAGMA journal_mode;", &mode) != EPKG_OK)
+		return (EPKG_FATAL);
+	db->wal = (mode != NULL && strcasecmp(mode, "wal") == 0);
+	free(mode);
+	mode = NULL;
+
+	if (wal != db->wal && !sqlite3_db_readonly(db->sqlite, "main")) {
+		pkg_debug(1, "switching the local database to %s journal mode",
+		    wal ? "wal" : "delete");
+		if (get_sql_string(db->sqlite, wal ?
+		    "PRAGMA journal_mode = WAL;" :
+		    "PRAGMA journal_mode = DELETE;", &mode) != EPKG_OK)
+			return (EPKG_FATAL);
+		/* Leaving wal mode fails while other processes use it */
+		db->wal = (mode != NULL && strcasecmp(mode, "wal") == 0);
+		free(mode);
+	}
+
+	/* Commits only need to sync the log in wal mode */
+	if (db->wal)
+		return (sql_exec(db->sqlite, "PRAGMA synchronous = NORMAL;"));
+
+	return (EPKG_OK);
+}
+
 int
 pkgdb_open_all(struct pkgdb **db_p, pkgdb_t type, const char *reponame)
 {
@@ -982,6 +1022,11 @@ pkgdb_open_all(struct pkgdb **db_p, pkgdb_t type, const char *reponame)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
+
+		if (pkgdb_setup_journal(db) != EPKG_OK) {
+			pkgdb_close(db);
+			return (EPKG_FATAL);
+		}
 	}
 
 	if (type == PKGDB_REMOTE || type == PKGDB_MAYBE_REMOTE) {
@@ -1013,6 +1058,192 @@ pkgdb_open_all(struct pkgdb **db_p, pkgdb_t type, const char *reponame)
 	return (EPKG_OK);
 }
 
+/*
+ * Statements run repeatedly with different bindings are prepared once per
+ * connection and kept in a cache keyed by their SQL text.  Callers give
+ * the statement back with pkgdb_stmt_put() instead of resetting or
+ * finalizing it.  Until then it is borrowed: it is never evicted, and a
+ * nested request for the same SQL gets a statement of its own.  The cache
+ * keeps the PKGDB_STMT_CACHE_SIZE most recently used statements, and has
+ * to be flushed with pkgdb_stmt_cache_flush() before the connection is
+ * closed.
+ */
+#define PKGDB_STMT_CACHE_SIZE	64
+
+struct pkgdb_stmt {
+	char		*sql;
+	sqlite3_stmt	*stmt;
+	bool		 borrowed;
+	struct pkgdb_stmt *prev, *next;
+	UT_hash_handle	 hh;
+};
+
+struct pkgdb_stmt_cache {
+	sqlite3		*sqlite;
+	struct pkgdb_stmt *stmts;
+	struct pkgdb_stmt *lru;
+	unsigned	 count;
+	int64_t		 hits;
+	int64_t		 misses;
+	int64_t		 evictions;
+	UT_hash_handle	 hh;
+};
+
+/* Connections can be used from different threads, each on its own */
+static struct pkgdb_stmt_cache *stmt_caches = NULL;
+static pthread_mutex_t stmt_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pkgdb_stmt_cache *
+pkgdb_stmt_cache_find(sqlite3 *sqlite)
+{
+	struct pkgdb_stmt_cache *c;
+
+	pthread_mutex_lock(&stmt_caches_lock);
+	HASH_FIND_PTR(stmt_caches, &sqlite, c);
+	pthread_mutex_unlock(&stmt_caches_lock);
+
+	return (c);
+}
+
+static void
+pkgdb_stmt_free(struct pkgdb_stmt *s)
+{
+	sqlite3_finalize(s->stmt);
+	free(s->sql);
+	free(s);
+}
+
+sqlite3_stmt *
+pkgdb_stmt_get(sqlite3 *sqlite, const char *sql)
+{
+	struct pkgdb_stmt_cache *c;
+	struct pkgdb_stmt *s, *old;
+	sqlite3_stmt *stmt;
+
+	if ((c = pkgdb_stmt_cache_find(sqlite)) == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			pkg_emit_errno("calloc", "pkgdb_stmt_cache");
+			return (NULL);
+		}
+		c->sqlite = sqlite;
+		pthread_mutex_lock(&stmt_caches_lock);
+		HASH_ADD_PTR(stmt_caches, sqlite, c);
+		pthread_mutex_unlock(&stmt_caches_lock);
+	}
+
+	/* The head of the lru list is the most recently used statement */
+	HASH_FIND_STR(c->stmts, sql, s);
+	if (s != NULL && !s->borrowed) {
+		c->hits++;
+		if (s != c->lru) {
+			DL_DELETE(c->lru, s);
+			DL_PREPEND(c->lru, s);
+		}
+		s->borrowed = true;
+		return (s->stmt);
+	}
+
+	c->misses++;
+	pkg_debug(4, "Pkgdb: preparing statement '%s'", sql);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite, sql);
+		return (NULL);
+	}
+
+	/* Still stepped by a caller: this one is finalized when put back */
+	if (s != NULL)
+		return (stmt);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || (s->sql = strdup(sql)) == NULL) {
+		pkg_emit_errno("malloc", "pkgdb_stmt");
+		sqlite3_finalize(stmt);
+		free(s);
+		return (NULL);
+	}
+	s->stmt = stmt;
+	s->borrowed = true;
+
+	if (c->count >= PKGDB_STMT_CACHE_SIZE) {
+		/* The borrowed ones may exceed the size for a while */
+		old = c->lru->prev;
+		while (old->borrowed && old != c->lru)
+			old = old->prev;
+		if (!old->borrowed) {
+			pkg_debug(4, "Pkgdb: evicting statement '%s'",
+			    old->sql);
+			HASH_DEL(c->stmts, old);
+			DL_DELETE(c->lru, old);
+			pkgdb_stmt_free(old);
+			c->evictions++;
+			c->count--;
+		}
+	}
+
+	HASH_ADD_KEYPTR(hh, c->stmts, s->sql, strlen(s->sql), s);
+	DL_PREPEND(c->lru, s);
+	c->count++;
+
+	return (stmt);
+}
+
+void
+pkgdb_stmt_put(sqlite3 *sqlite, sqlite3_stmt *stmt)
+{
+	struct pkgdb_stmt_cache *c;
+	struct pkgdb_stmt *s = NULL;
+
+	if ((c = pkgdb_stmt_cache_find(sqlite)) != NULL)
+		HASH_FIND_STR(c->stmts, sqlite3_sql(stmt), s);
+
+	if (s == NULL || s->stmt != stmt) {
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_reset(stmt);
+	s->borrowed = false;
+}
+
+int64_t
+pkgdb_stmt_cache_stats(sqlite3 *sqlite, pkg_stats_t type)
+{
+	struct pkgdb_stmt_cache *c;
+
+	if ((c = pkgdb_stmt_cache_find(sqlite)) == NULL)
+		return (0);
+
+	switch (type) {
+	case PKG_STATS_STMT_CACHE_HITS:
+		return (c->hits);
+	case PKG_STATS_STMT_CACHE_MISSES:
+		return (c->misses);
+	case PKG_STATS_STMT_CACHE_EVICTIONS:
+		return (c->evictions);
+	default:
+		return (0);
+	}
+}
+
+void
+pkgdb_stmt_cache_flush(sqlite3 *sqlite)
+{
+	struct pkgdb_stmt_cache *c;
+
+	if ((c = pkgdb_stmt_cache_find(sqlite)) == NULL)
+		return;
+
+	pkg_debug(1, "Pkgdb: statement cache: %"PRId64" hits, %"PRId64
+	    " misses, %"PRId64" evictions", c->hits, c->misses, c->evictions);
+
+	pthread_mutex_lock(&stmt_caches_lock);
+	HASH_DEL(stmt_caches, c);
+	pthread_mutex_unlock(&stmt_caches_lock);
+	HASH_FREE(c->stmts, pkgdb_stmt_free);
+	free(c);
+}
+
 void
 pkgdb_close(struct pkgdb *db)
 {
@@ -1024,6 +1255,8 @@ pkgdb_close(struct pkgdb *db)
 	if (db->prstmt_initialized)
 		prstmt_finalize(db);
 
+	pkgdb_integrity_free(db);
+
 	if (db->sqlite != NULL) {
 
 		LL_FOREACH_SAFE(db->repos, cur, tmp) {
@@ -1031,9 +1264,19 @@ pkgdb_close(struct pkgdb *db)
 			free(cur);
 		}
 
-		if (!sqlite3_db_readonly(db->sqlite, "main"))
+		if (!sqlite3_db_readonly(db->sqlite, "main")) {
 			pkg_plugins_hook_run(PKG_PLUGIN_HOOK_PKGDB_CLOSE_RW, NULL, db);
 
+			/*
+			 * Do not wait for the readers: the pages they still
+			 * use are copied back by the next checkpoint
+			 */
+			if (db->wal)
+				sqlite3_wal_checkpoint_v2(db->sqlite, NULL,
+				    SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+		}
+
+		pkgdb_stmt_cache_flush(db->sqlite);
 		sqlite3_close(db->sqlite);
 	}
 
@@ -1980,17 +2223,14 @@ pkgdb_reanalyse_shlibs(struct pkgdb *db, struct pkg *pkg)
 		for (i = 0; i < 2; i++) {
 			/* Clean out old shlibs first */
 			pkg_debug(4, "Pkgdb: running '%s'", sql[i]);
-			if (sqlite3_prepare_v2(db->sqlite, sql[i], -1,
-					       &stmt_del, NULL)
-			    != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite, sql[i]);
+			if ((stmt_del = pkgdb_stmt_get(db->sqlite, sql[i]))
+			    == NULL)
 				return (EPKG_FATAL);
-			}
 
 			sqlite3_bind_int64(stmt_del, 1, package_id);
 
 			ret = sqlite3_step(stmt_del);
-			sqlite3_finalize(stmt_del);
+			pkgdb_stmt_put(db->sqlite, stmt_del);
 
 			if (ret != SQLITE_DONE) {
 				ERROR_SQLITE(db->sqlite, sql[i]);
@@ -2202,16 +2442,13 @@ pkgdb_unregister_pkg(struct pkgdb *db, int64_t id)
 	assert(db != NULL);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt_del, NULL)
-	    != SQLITE_OK){
-		ERROR_SQLITE(db->sqlite, sql);
+	if ((stmt_del = pkgdb_stmt_get(db->sqlite, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt_del, 1, id);
 
 	ret = sqlite3_step(stmt_del);
-	sqlite3_finalize(stmt_del);
+	pkgdb_stmt_put(db->sqlite, stmt_del);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite, sql);
@@ -2356,7 +2593,62 @@ pkgdb_compact(struct pkgdb *db)
 	if (freelist_count / (float)page_count < 0.25)
 		return (EPKG_OK);
 
-	return (sql_exec(db->sqlite, "VACUUM;"));
+	ret = sql_exec(db->sqlite, "VACUUM;");
+
+	/*
+	 * In wal mode the vacuumed database is written to the log: copy it
+	 * back and have the next writer restart the log from its beginning
+	 */
+	if (ret == EPKG_OK && db->wal) {
+		if (sqlite3_wal_checkpoint_v2(db->sqlite, NULL,
+		    SQLITE_CHECKPOINT_RESTART, NULL, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(db->sqlite, "wal checkpoint");
+			ret = EPKG_FATAL;
+		}
+	}
+
+	return (ret);
+}
+
+/*
+ * Files of the packages about to be installed, indexed by path.  Each entry
+ * is allocated together with its path; uids are shared by all the entries of
+ * a package.
+ */
+struct pkgdb_integrity_path {
+	const char *uid;
+	UT_hash_handle hh;
+	char path[];
+};
+
+struct pkgdb_integrity_uid {
+	struct pkgdb_integrity_uid *next;
+	char uid[];
+};
+
+struct pkgdb_integrity {
+	struct pkgdb_integrity_path *paths;
+	struct pkgdb_integrity_uid *uids;
+};
+
+static void
+pkgdb_integrity_free(struct pkgdb *db)
+{
+	struct pkgdb_integrity_path *p, *ptmp;
+	struct pkgdb_integrity_uid *u, *utmp;
+
+	if (db->integrity == NULL)
+		return;
+
+	HASH_ITER(hh, db->integrity->paths, p, ptmp) {
+		HASH_DEL(db->integrity->paths, p);
+		free(p);
+	}
+	LL_FOREACH_SAFE(db->integrity->uids, u, utmp)
+		free(u);
+
+	free(db->integrity);
+	db->integrity = NULL;
 }
 
 int
@@ -2364,82 +2656,64 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p,
 		conflict_func_cb cb, void *cbdata)
 {
 	int		 ret = EPKG_OK;
-	sqlite3_stmt	*stmt = NULL;
-	sqlite3_stmt	*stmt_conflicts = NULL;
 	struct pkg_file	*file = NULL;
+	struct pkgdb_integrity_path *ent;
+	struct pkgdb_integrity_uid *u;
 	const char *puid;
-
-	const char	 sql[] = ""
-		"INSERT INTO integritycheck (uid, path)"
-		"values (?1, ?2);";
-	const char	 sql_conflicts[] = ""
-		"SELECT uid FROM integritycheck where path=?1;";
+	size_t len;
 
 	assert(db != NULL && p != NULL);
 
-	sql_exec(db->sqlite, "CREATE TEMP TABLE IF NOT EXISTS integritycheck ("
-			"uid TEXT, "
-			"path TEXT UNIQUE);"
-		);
-
-	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL)
-	    != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
-		return (EPKG_FATAL);
+	if (db->integrity == NULL) {
+		db->integrity = calloc(1, sizeof(struct pkgdb_integrity));
+		if (db->integrity == NULL) {
+			pkg_emit_errno("calloc", "pkgdb_integrity");
+			return (EPKG_FATAL);
+		}
 	}
 
 	pkg_get(p, PKG_UNIQUEID, &puid);
 
+	u = malloc(sizeof(*u) + strlen(puid) + 1);
+	if (u == NULL) {
+		pkg_emit_errno("malloc", "pkgdb_integrity_uid");
+		return (EPKG_FATAL);
+	}
+	strcpy(u->uid, puid);
+	LL_PREPEND(db->integrity->uids, u);
+
 	pkg_debug(4, "Pkgdb: test conflicts for %s", puid);
 	while (pkg_files(p, &file) == EPKG_OK) {
-		const char	*uid;
 		const char	*pkg_path = pkg_file_path(file);
-		struct pkg_event_conflict *conflicts_list = NULL, *cur;
-
-		pkg_get(p, PKG_UNIQUEID, &uid);
-		sqlite3_bind_text(stmt, 1, uid, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, pkg_path, -1, SQLITE_STATIC);
-
-		if (sqlite3_step(stmt) != SQLITE_DONE) {
-
-			pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-			if (sqlite3_prepare_v2(db->sqlite, sql_conflicts,
-			    -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite, sql_conflicts);
-				sqlite3_finalize(stmt);
+		struct pkg_event_conflict conflict;
+
+		len = strlen(pkg_path);
+		HASH_FIND(hh, db->integrity->paths, pkg_path, len, ent);
+		if (ent == NULL) {
+			ent = malloc(sizeof(*ent) + len + 1);
+			if (ent == NULL) {
+				pkg_emit_errno("malloc", "pkgdb_integrity_path");
 				return (EPKG_FATAL);
 			}
+			memcpy(ent->path, pkg_path, len + 1);
+			ent->uid = u->uid;
+			HASH_ADD(hh, db->integrity->paths, path[0], len, ent);
+			continue;
+		}
 
-			sqlite3_bind_text(stmt_conflicts, 1, pkg_path,
-			    -1, SQLITE_STATIC);
-			cur = conflicts_list;
-			while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
+		if (strcmp(ent->uid, puid) == 0)
+			continue;
 
-				cur = calloc(1, sizeof (struct pkg_event_conflict));
-				cur->uid = strdup(sqlite3_column_text(stmt_conflicts, 0));
-				pkg_debug(3, "found conflict between %s and %s on path %s",
-						puid, cur->uid, pkg_path);
-				LL_PREPEND(conflicts_list, cur);
+		pkg_debug(3, "found conflict between %s and %s on path %s",
+				puid, ent->uid, pkg_path);
+		if (cb != NULL)
+			cb (puid, ent->uid, cbdata);
 
-				if (cb != NULL)
-					cb (puid, cur->uid, cbdata);
-			}
-			sqlite3_finalize(stmt_conflicts);
-			pkg_emit_integritycheck_conflict(uid, pkg_path, conflicts_list);
-
-			cur = conflicts_list;
-			while (cur) {
-				free(cur->uid);
-				cur = cur->next;
-				free(conflicts_list);
-				conflicts_list = cur;
-			}
-			ret = EPKG_CONFLICT;
-		}
-		sqlite3_reset(stmt);
+		memset(&conflict, 0, sizeof(conflict));
+		conflict.uid = __DECONST(char *, ent->uid);
+		pkg_emit_integritycheck_conflict(puid, pkg_path, &conflict);
+		ret = EPKG_CONFLICT;
 	}
-	sqlite3_finalize(stmt);
 
 	return (ret);
 }
@@ -2449,146 +2723,59 @@ pkgdb_integrity_check(struct pkgdb *db, conflict_func_cb cb, void *cbdata)
 {
 	int		 ret, retcode = EPKG_OK;
 	sqlite3_stmt	*stmt;
-	sqlite3_stmt	*stmt_conflicts;
-	struct sbuf	*conflictmsg = NULL;
-	struct sbuf	*uniqueid;
+	struct pkgdb_integrity_path *ent;
+	const char	*path, *uid;
 
 	assert (db != NULL);
 
-	const char	 sql_local_conflict[] = ""
-		"SELECT p.name, p.version, p.origin, p.name || '~' || p.origin as uniqueid FROM packages AS p, files AS f "
-		"WHERE p.id = f.package_id AND f.path = ?1;";
-
-	const char	 sql_conflicts[] = ""
-		"SELECT uid FROM integritycheck WHERE path = ?1;";
-
-	const char sql_integrity_prepare[] = ""
-		"SELECT f.path FROM files as f, integritycheck as i "
-		"LEFT JOIN packages as p ON "
-		"p.id = f.package_id "
-		"WHERE f.path = i.path AND "
-		"p.name || '~' || p.origin != i.uid "
-		"GROUP BY f.path";
-
 	/*
-	 * Select paths that are both in integritycheck and local table but their
-	 * UIDs are different
+	 * One pass over the local files, each path probed against the files
+	 * queued by pkgdb_integrity_append()
 	 */
-	pkg_debug(4, "Pkgdb: running '%s'", sql_integrity_prepare);
-	if (sqlite3_prepare_v2(db->sqlite,
-		sql_integrity_prepare,
-		-1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql_integrity_prepare);
-		return (EPKG_FATAL);
-	}
-
-	conflictmsg = sbuf_new_auto();
-	uniqueid = sbuf_new_auto();
-
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		const char *conflict_path;
-
-		sbuf_clear(conflictmsg);
-		sbuf_clear(uniqueid);
+	const char	 sql_local_files[] = ""
+		"SELECT f.path, p.name || '~' || p.origin "
+		"FROM files AS f, packages AS p "
+		"WHERE p.id = f.package_id;";
 
-		/*
-		 * Conflict found on path, so find the corresponding local
-		 * package
-		 */
-		pkg_debug(4, "Pkgdb: running '%s'", sql_local_conflict);
-		ret = sqlite3_prepare_v2(db->sqlite, sql_local_conflict, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite, sql_local_conflict);
-			sqlite3_finalize(stmt);
-			sbuf_delete(uniqueid);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
-
-		conflict_path = sqlite3_column_text(stmt, 0);
-		sqlite3_bind_text(stmt_conflicts, 1,
-			conflict_path, -1, SQLITE_STATIC);
-
-		sqlite3_step(stmt_conflicts);
-
-		sbuf_printf(conflictmsg,
-		    "WARNING: locally installed %s-%s conflicts on %s with:\n",
-		    sqlite3_column_text(stmt_conflicts, 0),
-		    sqlite3_column_text(stmt_conflicts, 1),
-		    sqlite3_column_text(stmt, 0));
-		sbuf_cpy(uniqueid, sqlite3_column_text(stmt_conflicts, 3));
-		sqlite3_finalize(stmt_conflicts);
-
-		/*
-		 * Now match local and remote conflicting packages
-		 */
-		pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-		ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite, sql_conflicts);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			sbuf_delete(uniqueid);
-			return (EPKG_FATAL);
-		}
-
-		sbuf_finish(uniqueid);
+	if (db->integrity == NULL || db->integrity->paths == NULL) {
+		pkgdb_integrity_free(db);
+		return (EPKG_OK);
+	}
 
-		sqlite3_bind_text(stmt_conflicts, 1,
-		    sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
+	pkg_debug(4, "Pkgdb: running '%s'", sql_local_files);
+	if (sqlite3_prepare_v2(db->sqlite, sql_local_files, -1, &stmt, NULL)
+	    != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite, sql_local_files);
+		pkgdb_integrity_free(db);
+		return (EPKG_FATAL);
+	}
 
-		while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-			/* Append UID of conflicting remote package */
-			sbuf_printf(conflictmsg, "\t- %s\n",
-			    sqlite3_column_text(stmt_conflicts, 0));
-			if (cb != NULL)
-				cb (sbuf_data(uniqueid), sqlite3_column_text(stmt_conflicts, 0), cbdata);
-		}
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		path = sqlite3_column_text(stmt, 0);
+		HASH_FIND_STR(db->integrity->paths, path, ent);
+		if (ent == NULL)
+			continue;
 
-		sbuf_finish(conflictmsg);
-		sqlite3_finalize(stmt_conflicts);
+		uid = sqlite3_column_text(stmt, 1);
+		if (strcmp(uid, ent->uid) == 0)
+			continue;
 
-		//pkg_emit_error("%s", sbuf_get(conflictmsg));
+		pkg_debug(3, "local %s conflicts with %s on %s", uid, ent->uid,
+		    path);
+		if (cb != NULL)
+			cb (uid, ent->uid, cbdata);
 		retcode = EPKG_CONFLICT;
 	}
 
-	sqlite3_finalize(stmt);
-	sbuf_delete(conflictmsg);
-	sbuf_delete(uniqueid);
-
-	assert (sql_exec(db->sqlite, "DROP TABLE IF EXISTS integritycheck") == EPKG_OK);
-
-	return (retcode);
-}
-
-struct pkgdb_it *
-pkgdb_integrity_conflict_local(struct pkgdb *db, const char *uniqueid)
-{
-	sqlite3_stmt	*stmt;
-	int		 ret;
-
-	assert(db != NULL && uniqueid != NULL);
-
-	const char	sql_conflicts [] = ""
-		"SELECT DISTINCT p.id AS rowid, p.origin, p.name, p.version, "
-		    "p.prefix "
-		"FROM packages AS p, files AS f, integritycheck AS i "
-		"WHERE p.id = f.package_id AND f.path = i.path "
-		"AND i.uid = ?1 AND "
-		"i.uid != p.name || '~' || p.origin";
-
-	pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-	ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql_conflicts);
-		return (NULL);
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite, sql_local_files);
+		retcode = EPKG_FATAL;
 	}
 
-	sqlite3_bind_text(stmt, 1, uniqueid, -1, SQLITE_TRANSIENT);
+	sqlite3_finalize(stmt);
+	pkgdb_integrity_free(db);
 
-	return (pkgdb_it_new_sqlite(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
+	return (retcode);
 }
 
 static int
@@ -2620,11 +2807,8 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 
 	while ((attr = va_arg(ap, int)) > 0) {
 		pkg_debug(4, "Pkgdb: running '%s'", sql[attr]);
-		if (sqlite3_prepare_v2(db->sqlite, sql[attr], -1, &stmt, NULL)
-		    != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite, sql[attr]);
+		if ((stmt = pkgdb_stmt_get(db->sqlite, sql[attr])) == NULL)
 			return (EPKG_FATAL);
-		}
 
 		switch (attr) {
 		case PKG_SET_FLATSIZE:
@@ -2635,7 +2819,7 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 		case PKG_SET_AUTOMATIC:
 			automatic = (bool)va_arg(ap, int);
 			if (automatic != 0 && automatic != 1) {
-				sqlite3_finalize(stmt);
+				pkgdb_stmt_put(db->sqlite, stmt);
 				continue;
 			}
 			sqlite3_bind_int64(stmt, 1, automatic);
@@ -2643,8 +2827,10 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 			break;
 		case PKG_SET_LOCKED:
 			locked = (bool)va_arg(ap, int);
-			if (locked != 0 && locked != 1)
+			if (locked != 0 && locked != 1) {
+				pkgdb_stmt_put(db->sqlite, stmt);
 				continue;
+			}
 			sqlite3_bind_int64(stmt, 1, locked);
 			sqlite3_bind_int64(stmt, 2, id);
 			break;
@@ -2664,11 +2850,11 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 
 		if (sqlite3_step(stmt) != SQLITE_DONE) {
 			ERROR_SQLITE(db->sqlite, sql[attr]);
-			sqlite3_finalize(stmt);
+			pkgdb_stmt_put(db->sqlite, stmt);
 			return (EPKG_FATAL);
 		}
 
-		sqlite3_finalize(stmt);
+		pkgdb_stmt_put(db->sqlite, stmt);
 	}
 	return (EPKG_OK);
 }
@@ -2701,20 +2887,17 @@ pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file,
 	int		 ret;
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql_file_update);
-	ret = sqlite3_prepare_v2(db->sqlite, sql_file_update, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql_file_update);
+	if ((stmt = pkgdb_stmt_get(db->sqlite, sql_file_update)) == NULL)
 		return (EPKG_FATAL);
-	}
 	sqlite3_bind_text(stmt, 1, sha256, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt, 2, pkg_file_path(file), -1, SQLITE_STATIC);
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
+	ret = sqlite3_step(stmt);
+	pkgdb_stmt_put(db->sqlite, stmt);
+	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite, sql_file_update);
-		sqlite3_finalize(stmt);
 		return (EPKG_FATAL);
 	}
-	sqlite3_finalize(stmt);
 	strlcpy(file->sum, sha256, sizeof(file->sum));
 
 	return (EPKG_OK);
@@ -2961,6 +3144,15 @@ pkgdb_obtain_lock(struct pkgdb *db, pkgdb_lock_t type)
 	case PKGDB_LOCK_READONLY:
 		if (!ucl_object_toboolean(pkg_config_get("READ_LOCK")))
 				return (EPKG_OK);
+		/*
+		 * In wal mode readers see the last committed state of the
+		 * database while a writer holds its transaction, so they
+		 * neither wait for nor hold off the exclusive lock
+		 */
+		if (db->wal) {
+			pkg_debug(1, "wal mode, no read only lock needed");
+			return (EPKG_OK);
+		}
 		lock_sql = readonly_lock_sql;
 		pkg_debug(1, "want to get a read only lock on a database");
 		break;
@@ -3037,6 +3229,8 @@ pkgdb_release_lock(struct pkgdb *db, pkgdb_lock_t type)
 	case PKGDB_LOCK_READONLY:
 		if (!ucl_object_toboolean(pkg_config_get("READ_LOCK")))
 			return (EPKG_OK);
+		if (db->wal)
+			return (EPKG_OK);
 
 		unlock_sql = readonly_unlock_sql;
 		pkg_debug(1, "release a read only lock on a database");
@@ -3099,6 +3293,18 @@ pkgdb_stats(struct pkgdb *db, pkg_stats_t type)
 		}
 		goto remote;
 		break;
+	case PKG_STATS_STMT_CACHE_HITS:
+	case PKG_STATS_STMT_CACHE_MISSES:
+	case PKG_STATS_STMT_CACHE_EVICTIONS:
+		stats = pkgdb_stmt_cache_stats(db->sqlite, type);
+		LL_FOREACH(db->repos, rit) {
+			struct pkg_repo *repo = rit->repo;
+
+			if (repo->ops->stat != NULL)
+				stats += repo->ops->stat(repo, type);
+		}
+		goto remote;
+		break;
 	}
 
 	sbuf_finish(sql);
@@ -3130,6 +3336,10 @@ pkgdb_begin_solver(struct pkgdb *db)
 		"PRAGMA synchronous = OFF;"
 		"PRAGMA journal_mode = MEMORY;"
 		"BEGIN TRANSACTION;";
+	/* Leaving wal mode would need all the readers to be gone */
+	const char solver_wal_sql[] = ""
+		"PRAGMA synchronous = OFF;"
+		"BEGIN TRANSACTION;";
 	const char update_digests_sql[] = ""
 		"DROP INDEX IF EXISTS pkg_digest_id;"
 		"BEGIN TRANSACTION;";
@@ -3180,12 +3390,13 @@ pkgdb_begin_solver(struct pkgdb *db)
 		}
 
 		if (rc == EPKG_OK)
-			rc = sql_exec(db->sqlite, solver_sql);
+			rc = sql_exec(db->sqlite,
+			    db->wal ? solver_wal_sql : solver_sql);
 
 		LL_FREE(pkglist, pkg_free);
 	}
 	else {
-		rc = sql_exec(db->sqlite, solver_sql);
+		rc = sql_exec(db->sqlite, db->wal ? solver_wal_sql : solver_sql);
 	}
 
 	return (rc);
@@ -3198,8 +3409,11 @@ pkgdb_end_solver(struct pkgdb *db)
 		"END TRANSACTION;"
 		"PRAGMA synchronous = NORMAL;"
 		"PRAGMA journal_mode = DELETE;";
+	const char solver_wal_sql[] = ""
+		"END TRANSACTION;"
+		"PRAGMA synchronous = NORMAL;";
 
-	return (sql_exec(db->sqlite, solver_sql));
+	return (sql_exec(db->sqlite, db->wal ? solver_wal_sql : solver_sql));
 }
 
 int
@@ -3211,10 +3425,8 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 		"SELECT count(package_id) FROM pkg_directories, directories "
 		"WHERE directory_id = directories.id AND directories.path = ?1;";
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(db->sqlite, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_TRANSIENT);
 
@@ -3223,7 +3435,7 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	if (ret == SQLITE_ROW)
 		*res = sqlite3_column_int64(stmt, 0);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_ROW) {
 		ERROR_SQLITE(db->sqlite, sql);
@@ -108,10 +108,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -120,7 +118,7 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
@@ -148,10 +146,8 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -160,7 +156,7 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_addtagval(pkg, sqlite3_column_text(stmt, 0),
 			      sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
@@ -189,7 +185,6 @@ pkgdb_load_deps(sqlite3 *sqlite, struct pkg *pkg)
 	sqlite3_stmt	*stmt = NULL;
 	int		 ret = EPKG_OK;
 	int64_t		 rowid;
-	char		 sql[BUFSIZ];
 	const char	*mainsql = ""
 		"SELECT d.name, d.origin, d.version, 0 "
 		"FROM main.deps AS d "
@@ -204,12 +199,8 @@ pkgdb_load_deps(sqlite3 *sqlite, struct pkg *pkg)
 
 
 	pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-	ret = sqlite3_prepare_v2(sqlite, mainsql, -1, &stmt, NULL);
-
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(sqlite, mainsql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -221,11 +212,11 @@ pkgdb_load_deps(sqlite3 *sqlite, struct pkg *pkg)
 			   sqlite3_column_text(stmt, 2),
 			   sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(sqlite, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
-		ERROR_SQLITE(sqlite, sql);
+		ERROR_SQLITE(sqlite, mainsql);
 		return (EPKG_FATAL);
 	}
 
@@ -253,12 +244,8 @@ pkgdb_load_rdeps(sqlite3 *sqlite, struct pkg *pkg)
 
 
 	pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-	ret = sqlite3_prepare_v2(sqlite, mainsql, -1, &stmt, NULL);
-
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(sqlite, mainsql);
+	if ((stmt = pkgdb_stmt_get(sqlite, mainsql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_UNIQUEID, &uniqueid);
 	sqlite3_bind_text(stmt, 1, uniqueid, -1, SQLITE_STATIC);
@@ -270,7 +257,7 @@ pkgdb_load_rdeps(sqlite3 *sqlite, struct pkg *pkg)
 			    sqlite3_column_text(stmt, 2),
 			    sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(sqlite, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -301,10 +288,8 @@ pkgdb_load_files(sqlite3 *sqlite, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(sqlite, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -313,7 +298,7 @@ pkgdb_load_files(sqlite3 *sqlite, struct pkg *pkg)
 		pkg_addfile(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1), false);
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(sqlite, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -345,10 +330,8 @@ pkgdb_load_dirs(sqlite3 *sqlite, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(sqlite, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -358,7 +341,7 @@ pkgdb_load_dirs(sqlite3 *sqlite, struct pkg *pkg)
 		    sqlite3_column_int(stmt, 1), false);
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(sqlite, stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(sqlite, sql);
@@ -543,10 +526,8 @@ pkgdb_load_scripts(sqlite3 *sqlite, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(sqlite, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -555,7 +536,7 @@ pkgdb_load_scripts(sqlite3 *sqlite, struct pkg *pkg)
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(sqlite, stmt);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(sqlite, sql);
@@ -778,6 +759,227 @@ static struct load_on_flag {
 	{ -1,			        NULL }
 };
 
+/*
+ * Prefetching iterators read PKGDB_IT_BATCH packages ahead and load each
+ * relation of the whole batch with a single query ordered by package.
+ * Relations not listed here are loaded package by package.
+ */
+#define PKGDB_IT_BATCH	128
+
+struct pkgdb_bulk_loader {
+	unsigned	 flag;
+	int		 list;
+	bool		 installed_only;
+	const char	*sql;
+	void		(*add)(const struct pkgdb_bulk_loader *, struct pkg *,
+			    sqlite3_stmt *);
+	int		(*adddata)(struct pkg *, const char *);
+	int		(*addtagval)(struct pkg *, const char *, const char *);
+};
+
+static void
+bulk_add_dep(const struct pkgdb_bulk_loader *l __unused, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	pkg_adddep(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2),
+	    sqlite3_column_text(stmt, 3),
+	    sqlite3_column_int(stmt, 4));
+}
+
+static void
+bulk_add_file(const struct pkgdb_bulk_loader *l __unused, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	pkg_addfile(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2), false);
+}
+
+static void
+bulk_add_dir(const struct pkgdb_bulk_loader *l __unused, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	pkg_adddir(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2), false);
+}
+
+static void
+bulk_add_script(const struct pkgdb_bulk_loader *l __unused, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	pkg_addscript(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2));
+}
+
+static void
+bulk_add_val(const struct pkgdb_bulk_loader *l, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	l->adddata(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+bulk_add_tag_val(const struct pkgdb_bulk_loader *l, struct pkg *pkg,
+    sqlite3_stmt *stmt)
+{
+	l->addtagval(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2));
+}
+
+/* Same queries as the pkgdb_load_* functions, `%s' being the package ids */
+static const struct pkgdb_bulk_loader bulk_loaders[] = {
+	{ PKG_LOAD_DEPS, PKG_DEPS, false,
+		"SELECT d.package_id, d.name, d.origin, d.version, 0 "
+		"FROM main.deps AS d "
+		"WHERE d.package_id IN (%s) ORDER BY d.package_id, d.origin DESC;",
+		bulk_add_dep, NULL, NULL },
+	{ PKG_LOAD_FILES, PKG_FILES, true,
+		"SELECT package_id, path, sha256 "
+		"FROM main.files "
+		"WHERE package_id IN (%s) "
+		"ORDER BY package_id, path ASC",
+		bulk_add_file, NULL, NULL },
+	{ PKG_LOAD_DIRS, PKG_DIRS, true,
+		"SELECT package_id, path, try "
+		"FROM main.pkg_directories, main.directories "
+		"WHERE package_id IN (%s) "
+		"AND directory_id = directories.id "
+		"ORDER by package_id, path DESC",
+		bulk_add_dir, NULL, NULL },
+	{ PKG_LOAD_SCRIPTS, -1, true,
+		"SELECT package_id, script, type "
+		"FROM main.pkg_script JOIN main.script USING(script_id) "
+		"WHERE package_id IN (%s) ORDER BY package_id",
+		bulk_add_script, NULL, NULL },
+	{ PKG_LOAD_CATEGORIES, PKG_CATEGORIES, false,
+		"SELECT package_id, name "
+		"FROM main.pkg_categories, main.categories AS c "
+		"WHERE package_id IN (%s) "
+			"AND category_id = c.id "
+		"ORDER by package_id, name DESC",
+		bulk_add_val, pkg_addcategory, NULL },
+	{ PKG_LOAD_LICENSES, PKG_LICENSES, false,
+		"SELECT package_id, name "
+		"FROM main.pkg_licenses, main.licenses AS l "
+		"WHERE package_id IN (%s) "
+			"AND license_id = l.id "
+		"ORDER by package_id, name DESC",
+		bulk_add_val, pkg_addlicense, NULL },
+	{ PKG_LOAD_SHLIBS_REQUIRED, PKG_SHLIBS_REQUIRED, false,
+		"SELECT package_id, name "
+		"FROM main.pkg_shlibs_required, main.shlibs AS s "
+		"WHERE package_id IN (%s) "
+			"AND shlib_id = s.id "
+		"ORDER by package_id, name DESC",
+		bulk_add_val, pkg_addshlib_required, NULL },
+	{ PKG_LOAD_SHLIBS_PROVIDED, PKG_SHLIBS_PROVIDED, false,
+		"SELECT package_id, name "
+		"FROM main.pkg_shlibs_provided, main.shlibs AS s "
+		"WHERE package_id IN (%s) "
+			"AND shlib_id = s.id "
+		"ORDER by package_id, name DESC",
+		bulk_add_val, pkg_addshlib_provided, NULL },
+	{ PKG_LOAD_ANNOTATIONS, PKG_ANNOTATIONS, false,
+		"SELECT p.package_id, k.annotation AS tag, v.annotation AS value"
+		"  FROM main.pkg_annotation p"
+		"    JOIN main.annotation k ON (p.tag_id = k.annotation_id)"
+		"    JOIN main.annotation v ON (p.value_id = v.annotation_id)"
+		"  WHERE p.package_id IN (%s)"
+		"  ORDER BY p.package_id, tag, value",
+		bulk_add_tag_val, NULL, pkg_addannotation },
+	{ PKG_LOAD_CONFLICTS, PKG_CONFLICTS, false,
+		"SELECT pkg_conflicts.package_id, packages.origin "
+		"FROM main.pkg_conflicts "
+		"LEFT JOIN main.packages ON "
+		"packages.id = pkg_conflicts.conflict_id "
+		"WHERE pkg_conflicts.package_id IN (%s) "
+		"ORDER BY pkg_conflicts.package_id",
+		bulk_add_val, pkg_addconflict, NULL },
+	{ PKG_LOAD_PROVIDES, PKG_PROVIDES, false,
+		"SELECT package_id, provide "
+		"FROM main.provides "
+		"WHERE package_id IN (%s) ORDER BY package_id",
+		bulk_add_val, pkg_addconflict, NULL },
+	{ 0, -1, false, NULL, NULL, NULL, NULL }
+};
+
+static int
+pkgdb_load_bulk(struct pkgdb_sqlite_it *it, const struct pkgdb_bulk_loader *l)
+{
+	struct sbuf	*ids, *sql;
+	sqlite3_stmt	*stmt;
+	struct pkg	*pkg = NULL;
+	int64_t		 rowids[PKGDB_IT_BATCH], id;
+	size_t		 i;
+	int		 ret;
+
+	/* Always bind the whole batch, so that one statement serves them all */
+	ids = sbuf_new_auto();
+	for (i = 0; i < PKGDB_IT_BATCH; i++)
+		sbuf_printf(ids, "%s?%zu", i > 0 ? ", " : "", i + 1);
+	sbuf_finish(ids);
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, l->sql, sbuf_data(ids));
+	sbuf_finish(sql);
+	sbuf_delete(ids);
+
+	if ((stmt = pkgdb_stmt_get(it->sqlite, sbuf_data(sql))) == NULL) {
+		sbuf_delete(sql);
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < PKGDB_IT_BATCH; i++) {
+		if (i < it->nbatch) {
+			pkg_get(it->batch[i], PKG_ROWID, &rowids[i]);
+			sqlite3_bind_int64(stmt, i + 1, rowids[i]);
+		} else {
+			sqlite3_bind_null(stmt, i + 1);
+		}
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		id = sqlite3_column_int64(stmt, 0);
+		/* Rows are grouped by package */
+		if (pkg == NULL || id != rowids[i]) {
+			pkg = NULL;
+			for (i = 0; i < it->nbatch; i++) {
+				if (rowids[i] == id) {
+					pkg = it->batch[i];
+					break;
+				}
+			}
+			if (pkg == NULL)
+				continue;
+		}
+		l->add(l, pkg, stmt);
+	}
+	pkgdb_stmt_put(it->sqlite, stmt);
+
+	if (ret != SQLITE_DONE) {
+		if (l->list != -1) {
+			for (i = 0; i < it->nbatch; i++)
+				pkg_list_free(it->batch[i], l->list);
+		}
+		ERROR_SQLITE(it->sqlite, sbuf_data(sql));
+		sbuf_delete(sql);
+		return (EPKG_FATAL);
+	}
+	sbuf_delete(sql);
+
+	for (i = 0; i < it->nbatch; i++)
+		it->batch[i]->flags |= l->flag;
+
+	return (EPKG_OK);
+}
+
+static void
+pkgdb_sqlite_it_drop_batch(struct pkgdb_sqlite_it *it)
+{
+	while (it->ibatch < it->nbatch)
+		pkg_free(it->batch[it->ibatch++]);
+	it->ibatch = it->nbatch = 0;
+}
+
 static void
 pkgdb_sqlite_it_reset(struct pkgdb_sqlite_it *it)
 {
@@ -785,6 +987,7 @@ pkgdb_sqlite_it_reset(struct pkgdb_sqlite_it *it)
 		return;
 
 	it->finished = 0;
+	pkgdb_sqlite_it_drop_batch(it);
 	sqlite3_reset(it->stmt);
 }
 
@@ -794,19 +997,18 @@ pkgdb_sqlite_it_free(struct pkgdb_sqlite_it *it)
 	if (it == NULL)
 		return;
 
+	pkgdb_sqlite_it_drop_batch(it);
+	free(it->batch);
+	it->batch = NULL;
 	sqlite3_finalize(it->stmt);
 }
 
-static int
-pkgdb_sqlite_it_next(struct pkgdb_sqlite_it *it,
-	struct pkg **pkg_p, unsigned flags)
+static void
+pkgdb_sqlite_it_populate(struct pkgdb_sqlite_it *it, struct pkg *pkg)
 {
-	struct pkg	*pkg;
-	int		 i;
-	int		 ret;
 	const char *digest;
 
-	assert(it != NULL);
+	populate_pkg(it->stmt, pkg);
 
 	/*
 	 * XXX:
@@ -816,6 +1018,100 @@ pkgdb_sqlite_it_next(struct pkgdb_sqlite_it *it,
 	 * manifest digests and set it to NULL if it is invalid.
 	 *
 	 */
+	pkg_get(pkg, PKG_DIGEST, &digest);
+	if (digest != NULL && !pkg_checksum_is_valid(digest, strlen(digest)))
+		pkg_set(pkg, PKG_DIGEST, NULL);
+}
+
+static int
+pkgdb_sqlite_it_fill(struct pkgdb_sqlite_it *it, unsigned flags)
+{
+	const struct pkgdb_bulk_loader *l;
+	struct pkg *pkg;
+	size_t i;
+	int ret;
+
+	if (it->batch == NULL) {
+		it->batch = calloc(PKGDB_IT_BATCH, sizeof(*it->batch));
+		if (it->batch == NULL) {
+			pkg_emit_errno("calloc", "pkgdb_it batch");
+			return (EPKG_FATAL);
+		}
+	}
+
+	while (it->nbatch < PKGDB_IT_BATCH) {
+		ret = sqlite3_step(it->stmt);
+		if (ret == SQLITE_DONE) {
+			it->finished++;
+			break;
+		}
+		if (ret != SQLITE_ROW) {
+			ERROR_SQLITE(it->sqlite, "iterator");
+			return (EPKG_FATAL);
+		}
+
+		pkg = NULL;
+		if ((ret = pkg_new(&pkg, it->pkg_type)) != EPKG_OK)
+			return (ret);
+		pkgdb_sqlite_it_populate(it, pkg);
+		it->batch[it->nbatch++] = pkg;
+	}
+
+	if (it->nbatch == 0)
+		return (EPKG_END);
+
+	for (l = bulk_loaders; l->sql != NULL; l++) {
+		if (!(flags & l->flag))
+			continue;
+		if (l->installed_only && it->pkg_type != PKG_INSTALLED)
+			continue;
+		if ((ret = pkgdb_load_bulk(it, l)) != EPKG_OK)
+			return (ret);
+	}
+
+	for (i = 0; i < it->nbatch; i++) {
+		ret = pkgdb_ensure_loaded_sqlite(it->sqlite, it->batch[i], flags);
+		if (ret != EPKG_OK)
+			return (ret);
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+pkgdb_sqlite_it_next_batch(struct pkgdb_sqlite_it *it,
+	struct pkg **pkg_p, unsigned flags)
+{
+	int ret;
+
+	if (it->ibatch == it->nbatch) {
+		it->ibatch = it->nbatch = 0;
+		if (it->finished)
+			return (EPKG_END);
+		if ((ret = pkgdb_sqlite_it_fill(it, flags)) != EPKG_OK)
+			return (ret);
+	}
+
+	/* Hand out the package read ahead in place of the caller's one */
+	pkg_free(*pkg_p);
+	*pkg_p = it->batch[it->ibatch];
+	it->batch[it->ibatch++] = NULL;
+
+	return (pkgdb_ensure_loaded_sqlite(it->sqlite, *pkg_p, flags));
+}
+
+static int
+pkgdb_sqlite_it_next(struct pkgdb_sqlite_it *it,
+	struct pkg **pkg_p, unsigned flags)
+{
+	struct pkg	*pkg;
+	int		 i;
+	int		 ret;
+
+	assert(it != NULL);
+
+	if (it->flags & PKGDB_IT_FLAG_PREFETCH)
+		return (pkgdb_sqlite_it_next_batch(it, pkg_p, flags));
 
 	if (it->finished && (it->flags & PKGDB_IT_FLAG_ONCE))
 		return (EPKG_END);
@@ -830,11 +1126,7 @@ pkgdb_sqlite_it_next(struct pkgdb_sqlite_it *it,
 			pkg_reset(*pkg_p, it->pkg_type);
 		pkg = *pkg_p;
 
-		populate_pkg(it->stmt, pkg);
-
-		pkg_get(pkg, PKG_DIGEST, &digest);
-		if (digest != NULL && !pkg_checksum_is_valid(digest, strlen(digest)))
-			pkg_set(pkg, PKG_DIGEST, NULL);
+		pkgdb_sqlite_it_populate(it, pkg);
 
 		for (i = 0; load_on_flag[i].load != NULL; i++) {
 			if (flags & load_on_flag[i].flag) {
@@ -1013,10 +1305,35 @@ pkgdb_it_new_sqlite(struct pkgdb *db, sqlite3_stmt *s, int type, short flags)
 
 	it->un.local.flags = flags;
 	it->un.local.finished = 0;
+	it->un.local.batch = NULL;
+	it->un.local.nbatch = it->un.local.ibatch = 0;
 
 	return (it);
 }
 
+void
+pkgdb_it_set_prefetch(struct pkgdb_it *it, bool prefetch)
+{
+	struct pkgdb_sqlite_it *sit;
+
+	assert(it != NULL);
+
+	/* Repository iterators and cycling ones keep the row by row mode */
+	if (it->type != PKGDB_IT_LOCAL)
+		return;
+
+	sit = &it->un.local;
+	if (sit->flags & (PKGDB_IT_FLAG_CYCLED|PKGDB_IT_FLAG_AUTO))
+		return;
+
+	if (prefetch) {
+		sit->flags |= PKGDB_IT_FLAG_PREFETCH;
+	} else {
+		pkgdb_sqlite_it_drop_batch(sit);
+		sit->flags &= ~PKGDB_IT_FLAG_PREFETCH;
+	}
+}
+
 struct pkgdb_it *
 pkgdb_it_new_repo(struct pkgdb *db)
 {
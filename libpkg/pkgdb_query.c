@@ -326,6 +326,61 @@ pkgdb_repo_shlib_provide(struct pkgdb *db, const char *require, const char *repo
 	return (it);
 }
 
+struct pkgdb_it *
+pkgdb_repo_query_uids(struct pkgdb *db, const char **uids, size_t n,
+    const char *repo)
+{
+	struct pkgdb_it *it;
+	struct pkg_repo_it *rit;
+	struct _pkg_repo_list_item *cur;
+
+	it = pkgdb_it_new_repo(db);
+	if (it == NULL)
+		return (NULL);
+
+	LL_FOREACH(db->repos, cur) {
+		if (repo == NULL || strcasecmp(cur->repo->name, repo) == 0) {
+			/* A partial answer would hide the other repos */
+			if (cur->repo->ops->query_uids == NULL) {
+				pkgdb_it_free(it);
+				return (NULL);
+			}
+			rit = cur->repo->ops->query_uids(cur->repo, uids, n);
+			if (rit != NULL)
+				pkgdb_it_repo_attach(it, rit);
+		}
+	}
+
+	return (it);
+}
+
+struct pkgdb_it *
+pkgdb_repo_shlibs_provide(struct pkgdb *db, const char **requires, size_t n,
+    const char *repo)
+{
+	struct pkgdb_it *it;
+	struct pkg_repo_it *rit;
+	struct _pkg_repo_list_item *cur;
+
+	it = pkgdb_it_new_repo(db);
+	if (it == NULL)
+		return (NULL);
+
+	LL_FOREACH(db->repos, cur) {
+		if (repo == NULL || strcasecmp(cur->repo->name, repo) == 0) {
+			if (cur->repo->ops->shlibs_provided == NULL) {
+				pkgdb_it_free(it);
+				return (NULL);
+			}
+			rit = cur->repo->ops->shlibs_provided(cur->repo, requires, n);
+			if (rit != NULL)
+				pkgdb_it_repo_attach(it, rit);
+		}
+	}
+
+	return (it);
+}
+
 struct pkgdb_it *
 pkgdb_repo_search(struct pkgdb *db, const char *pattern, match_t match,
     pkgdb_field field, pkgdb_field sort, const char *repo)
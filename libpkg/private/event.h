@@ -77,4 +77,19 @@ void pkg_emit_extract_finished(struct pkg *p);
 void pkg_emit_delete_files_begin(struct pkg *p);
 void pkg_emit_delete_files_finished(struct pkg *p);
 
+/*
+ * Errors, notices and debug messages of a worker thread, kept to be emitted
+ * in order by the thread driving it.
+ */
+struct pkg_event_queued;
+struct pkg_event_queue {
+	struct pkg_event_queued	*head;
+	struct pkg_event_queued	*tail;
+};
+
+void pkg_event_queue_begin(struct pkg_event_queue *q);
+void pkg_event_queue_end(void);
+void pkg_event_queue_flush(struct pkg_event_queue *q);
+void pkg_event_queue_clear(struct pkg_event_queue *q);
+
 #endif
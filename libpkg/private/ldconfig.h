@@ -60,14 +60,15 @@ struct elfhints_hdr
 
 extern int	insecure;	/* -i flag, needed here for elfhints.c */
 
+struct shlib_list;
+
 __BEGIN_DECLS
-void		shlib_list_init(void);
-void		rpath_list_init(void);
-const char     *shlib_list_find_by_name(const char *);
+const char     *shlib_list_find_by_name(struct shlib_list *, const char *);
 void		shlib_list_free(void);
-void		rpath_list_free(void);
+void		rpath_list_free(struct shlib_list **);
 int		shlib_list_from_elf_hints(const char *);
-int		shlib_list_from_rpath(const char *, const char *);
+int		shlib_list_from_rpath(struct shlib_list **, const char *,
+		    const char *);
 
 void		list_elf_hints(const char *);
 void		update_elf_hints(const char *, int, char **, int);
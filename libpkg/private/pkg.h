@@ -137,6 +137,7 @@ struct pkg {
 	struct pkg_dep		*deps;
 	struct pkg_dep		*rdeps;
 	struct pkg_file		*files;
+	struct pkg_arena	 file_arena;
 	struct pkg_dir		*dirs;
 	struct pkg_option	*options;
 	struct pkg_user		*users;
@@ -145,6 +146,7 @@ struct pkg {
 	struct pkg_shlib	*shlibs_provided;
 	struct pkg_conflict *conflicts;
 	struct pkg_provide	*provides;
+	struct pkg_version_key	*version_key;
 	unsigned			flags;
 	int		rootfd;
 	pkg_t		 type;
@@ -153,11 +155,12 @@ struct pkg {
 	struct pkg	*next;
 };
 
+/* All the strings of a dependency are interned, see pkg_intern() */
 struct pkg_dep {
-	struct sbuf	*origin;
-	struct sbuf	*name;
-	struct sbuf	*version;
-	char		*uid;
+	const char	*origin;
+	const char	*name;
+	const char	*version;
+	const char	*uid;
 	bool		 locked;
 	UT_hash_handle	 hh;
 };
@@ -180,15 +183,19 @@ struct pkg_provide {
 	UT_hash_handle	hh;
 };
 
+/*
+ * Files are allocated from the file_arena of their package, with the path
+ * stored inline and the owners interned.
+ */
 struct pkg_file {
-	char		 path[MAXPATHLEN];
 	int64_t		 size;
-	char		 sum[SHA256_DIGEST_LENGTH * 2 + 1];
-	char		 uname[MAXLOGNAME];
-	char		 gname[MAXLOGNAME];
+	const char	*uname;
+	const char	*gname;
 	bool		 keep;
 	mode_t		 perm;
 	UT_hash_handle	 hh;
+	char		 sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char		 path[];
 };
 
 struct pkg_dir {
@@ -222,7 +229,7 @@ struct pkg_group {
 };
 
 struct pkg_shlib {
-	struct sbuf	*name;
+	const char	*name;	/* interned */
 	UT_hash_handle	hh;
 };
 
@@ -264,6 +271,10 @@ struct pkg_repo_meta {
 	char *conflicts_archive;
 	char *fulldb;
 	char *fulldb_archive;
+	char *catalogue;
+	char *catalogue_archive;
+	char *deltas;
+	char *digests_checksum;
 
 	char *source_identifier;
 	int64_t revision;
@@ -307,6 +318,11 @@ struct pkg_repo_ops {
 					const char *);
 	struct pkg_repo_it * (*shlib_provided)(struct pkg_repo *,
 					const char *);
+	/* Optional set-based lookups, see pkg_jobs_universe.c */
+	struct pkg_repo_it * (*query_uids)(struct pkg_repo *,
+					const char **, size_t);
+	struct pkg_repo_it * (*shlibs_provided)(struct pkg_repo *,
+					const char **, size_t);
 	struct pkg_repo_it * (*search)(struct pkg_repo *, const char *, match_t,
 					pkgdb_field field, pkgdb_field sort);
 
@@ -348,6 +364,9 @@ struct pkg_repo {
 
 	struct pkg_repo_meta *meta;
 
+	/* Parallel package downloads, 0 means FETCH_CONCURRENCY */
+	int fetch_concurrency;
+
 	bool enable;
 	UT_hash_handle hh;
 
@@ -395,6 +414,9 @@ extern struct pkg_key {
 
 int pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url,
 		int dest, time_t *t);
+void pkg_fetch_progress_begin(void);
+int64_t pkg_fetch_progress_get(void);
+void pkg_fetch_progress_end(void);
 int pkg_repo_fetch_package(struct pkg *pkg);
 int pkg_repo_mirror_package(struct pkg *pkg, const char *destdir);
 FILE* pkg_repo_fetch_remote_extract_tmp(struct pkg_repo *repo,
@@ -407,6 +429,22 @@ void pkg_repo_meta_free(struct pkg_repo_meta *meta);
 ucl_object_t * pkg_repo_meta_to_ucl(struct pkg_repo_meta *meta);
 bool pkg_repo_meta_is_special_file(const char *file, struct pkg_repo_meta *meta);
 
+/* How many delta updates a repository keeps, and a client follows */
+#define PKG_REPO_MAX_DELTAS 16
+
+struct pkg_catalogue;
+struct pkg_catalogue_writer;
+int pkg_catalogue_writer_new(struct pkg_catalogue_writer **w);
+int pkg_catalogue_writer_add(struct pkg_catalogue_writer *w, struct pkg *pkg);
+int pkg_catalogue_writer_finish(struct pkg_catalogue_writer *w,
+    const char *path);
+void pkg_catalogue_writer_free(struct pkg_catalogue_writer *w);
+int pkg_catalogue_open(struct pkg_catalogue **c, int fd);
+void pkg_catalogue_close(struct pkg_catalogue *c);
+unsigned pkg_catalogue_count(struct pkg_catalogue *c);
+int pkg_catalogue_find(struct pkg_catalogue *c, const char *origin,
+    struct pkg **pkg_p);
+
 typedef enum {
 	HASH_UNKNOWN,
 	HASH_SHA256,
@@ -429,6 +467,9 @@ int pkg_delete_user_group(struct pkgdb *db, struct pkg *pkg);
 
 int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae,
 	      const char *path, struct pkg_manifest_key *keys, int flags, int fd);
+int pkg_open_checksum(struct pkg **p, const char *path,
+    struct pkg_manifest_key *keys, int flags,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1]);
 
 int pkg_validate(struct pkg *pkg);
 
@@ -437,8 +478,6 @@ void pkg_list_free(struct pkg *, pkg_list);
 int pkg_dep_new(struct pkg_dep **);
 void pkg_dep_free(struct pkg_dep *);
 
-int pkg_file_new(struct pkg_file **);
-void pkg_file_free(struct pkg_file *);
 
 int pkg_dir_new(struct pkg_dir **);
 void pkg_dir_free(struct pkg_dir *);
@@ -477,6 +516,7 @@ int packing_append_tree(struct packing *pack, const char *treepath,
 int packing_finish(struct packing *pack);
 pkg_formats packing_format_from_string(const char *str);
 const char* packing_format_to_string(pkg_formats format);
+bool packing_is_package_ext(const char *ext);
 
 int pkg_delete_files(struct pkg *pkg, unsigned force);
 int pkg_delete_dirs(struct pkgdb *db, struct pkg *pkg);
@@ -485,8 +525,6 @@ typedef void (*conflict_func_cb)(const char *, const char *, void *);
 int pkgdb_integrity_append(struct pkgdb *db, struct pkg *p,
 		conflict_func_cb cb, void *cbdata);
 int pkgdb_integrity_check(struct pkgdb *db, conflict_func_cb cb, void *cbdata);
-struct pkgdb_it *pkgdb_integrity_conflict_local(struct pkgdb *db,
-						const char *uniqueid);
 
 int pkg_set_mtree(struct pkg *, const char *mtree);
 
@@ -535,8 +573,19 @@ int pkg_checksum_calculate(struct pkg *pkg, struct pkgdb *db);
 int pkg_add_upgrade(struct pkgdb *db, const char *path, unsigned flags,
     struct pkg_manifest_key *keys, const char *location,
     struct pkg *rp, struct pkg *lp);
+struct pkg_stage;
+int pkg_add_stage(const char *path, unsigned flags,
+    struct pkg_manifest_key *keys, struct pkg_stage **stage_p);
+int pkg_add_staged(struct pkgdb *db, struct pkg_stage *stage, unsigned flags,
+    struct pkg *remote);
+void pkg_add_staged_discard(struct pkgdb *db, struct pkg_stage *stage);
 void pkg_delete_dir(struct pkg *pkg, struct pkg_dir *dir);
 void pkg_delete_file(struct pkg *pkg, struct pkg_file *file, unsigned force);
 int pkg_open_root_fd(struct pkg *pkg);
 
+const struct pkg_version_key *pkg_version_key_get(const struct pkg *pkg);
+size_t pkg_version_key_size(const struct pkg_version_key *key);
+bool pkg_version_key_valid(const void *mem, size_t len);
+int pkg_version_cmp_pkg(const struct pkg *pkg1, const struct pkg *pkg2);
+
 #endif
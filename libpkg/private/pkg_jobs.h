@@ -37,10 +37,12 @@
 #include "pkg.h"
 
 struct pkg_jobs;
+struct pkg_jobs_fetch_env;
 struct job_pattern;
 
 struct pkg_job_universe_item {
 	struct pkg *pkg;
+	const char *uid;	/* interned, key of the universe */
 	struct job_pattern *jp;
 	int priority;
 	UT_hash_handle hh;
@@ -62,13 +64,13 @@ struct pkg_solved {
 
 struct pkg_job_seen {
 	struct pkg_job_universe_item *un;
-	const char *digest;
+	const char *digest;	/* interned */
 	UT_hash_handle hh;
 };
 
 struct pkg_job_provide {
 	struct pkg_job_universe_item *un;
-	const char *provide;
+	const char *provide;	/* interned */
 	struct pkg_job_provide *next, *prev;
 	UT_hash_handle hh;
 };
@@ -79,6 +81,28 @@ struct pkg_job_replace {
 	struct pkg_job_replace *next;
 };
 
+/*
+ * Remote packages fetched ahead by the batched universe expansion: the best
+ * candidate for a uid, and the candidates providing a shlib.
+ */
+struct pkg_job_cached_remote {
+	const char *uid;	/* interned */
+	struct pkg *pkg;	/* NULL once handed out or if not found */
+	UT_hash_handle hh;
+};
+
+struct pkg_job_cached_pkg {
+	struct pkg *pkg;
+	bool taken;		/* owned by the universe */
+	struct pkg_job_cached_pkg *next;
+};
+
+struct pkg_job_cached_provide {
+	const char *provide;	/* interned */
+	struct pkg_job_cached_pkg **pkgs;
+	size_t npkgs;
+	UT_hash_handle hh;
+};
 
 struct pkg_jobs_universe {
 	struct pkg_job_universe_item *items;
@@ -87,6 +111,15 @@ struct pkg_jobs_universe {
 	struct pkg_job_replace *uid_replaces;
 	struct pkg_jobs *j;
 	size_t nitems;
+	/* Breadth-first expansion, see pkg_jobs_universe_process_item() */
+	bool batch;
+	bool expanding;
+	struct pkg **frontier;
+	size_t nfrontier;
+	size_t frontier_size;
+	struct pkg_job_cached_remote *remote_cache;
+	struct pkg_job_cached_provide *provide_cache;
+	struct pkg_job_cached_pkg *provide_pkgs;
 };
 
 struct pkg_jobs {
@@ -102,6 +135,8 @@ struct pkg_jobs {
 	int total;
 	int conflicts_registered;
 	bool need_fetch;
+	bool late_conflicts;
+	struct pkg_jobs_fetch_env *fetcher;
 	const char *reponame;
 	const char *destdir;
 	struct job_pattern *patterns;
@@ -173,6 +208,13 @@ struct pkg_job_seen* pkg_jobs_universe_seen(struct pkg_jobs_universe *universe,
 struct pkg_job_universe_item* pkg_jobs_universe_find(struct pkg_jobs_universe
 	*universe, const char *uid);
 
+/*
+ * Same as above for a uid returned by pkg_intern(), such as the uid of a
+ * pkg_dep: only the pointer is hashed
+ */
+struct pkg_job_universe_item* pkg_jobs_universe_find_interned(
+	struct pkg_jobs_universe *universe, const char *uid);
+
 /*
  * Add a single package to the universe
  */
@@ -32,9 +32,16 @@
 
 #include "sqlite3.h"
 
+struct pkgdb_integrity;
+
 struct pkgdb {
 	sqlite3		*sqlite;
 	bool		 prstmt_initialized;
+	/* The local database uses write-ahead logging */
+	bool		 wal;
+
+	/* Files queued for the conflict check */
+	struct pkgdb_integrity *integrity;
 
 	struct _pkg_repo_list_item {
 		struct pkg_repo *repo;
@@ -53,6 +60,10 @@ struct pkgdb_sqlite_it {
 	short	flags;
 	short	finished;
 	short	pkg_type;
+	/* Packages read ahead by PKGDB_IT_FLAG_PREFETCH */
+	struct pkg **batch;
+	size_t	nbatch;
+	size_t	ibatch;
 };
 
 struct pkg_repo_it;
@@ -72,6 +83,7 @@ struct pkgdb_it {
 #define PKGDB_IT_FLAG_CYCLED (0x1)
 #define PKGDB_IT_FLAG_ONCE (0x1 << 1)
 #define PKGDB_IT_FLAG_AUTO (0x1 << 2)
+#define PKGDB_IT_FLAG_PREFETCH (0x1 << 3)
 
 
 /**
@@ -93,6 +105,15 @@ void pkgdb_it_repo_attach(struct pkgdb_it *it, struct pkg_repo_it *rit);
  * Load missing flags for a specific package from pkgdb
  */
 int pkgdb_ensure_loaded(struct pkgdb *db, struct pkg *pkg, unsigned flags);
+
+/*
+ * Prepared statements cached per connection and keyed by their SQL text,
+ * see pkgdb.c
+ */
+sqlite3_stmt *pkgdb_stmt_get(sqlite3 *sqlite, const char *sql);
+void pkgdb_stmt_put(sqlite3 *sqlite, sqlite3_stmt *stmt);
+int64_t pkgdb_stmt_cache_stats(sqlite3 *sqlite, pkg_stats_t type);
+void pkgdb_stmt_cache_flush(sqlite3 *sqlite);
 int pkgdb_ensure_loaded_sqlite(sqlite3 *sqlite, struct pkg *pkg, unsigned flags);
 
 void pkgshell_open(const char **r);
@@ -135,6 +156,20 @@ struct pkgdb_it *pkgdb_repo_shlib_require(struct pkgdb *db,
 struct pkgdb_it *pkgdb_repo_shlib_provide(struct pkgdb *db,
 		const char *require, const char *repo);
 
+/**
+ * Find the packages matching any of the `n` uids in repos
+ * @return NULL if one of the repos does not support set-based queries
+ */
+struct pkgdb_it *pkgdb_repo_query_uids(struct pkgdb *db,
+		const char **uids, size_t n, const char *repo);
+
+/**
+ * Find the packages providing any of the `n` shlibs in repos
+ * @return NULL if one of the repos does not support set-based queries
+ */
+struct pkgdb_it *pkgdb_repo_shlibs_provide(struct pkgdb *db,
+		const char **requires, size_t n, const char *repo);
+
 /**
  * Unregister a package from the database
  * @return An error code.
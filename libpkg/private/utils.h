@@ -73,6 +73,18 @@ struct dns_srvinfo {
 	struct dns_srvinfo *next;
 };
 
+/*
+ * Bump allocator for many small objects freed together; strings can be
+ * interned so that repeated values share one copy.
+ */
+struct pkg_arena_chunk;
+struct pkg_arena_str;
+
+struct pkg_arena {
+	struct pkg_arena_chunk *chunks;
+	struct pkg_arena_str *strings;
+};
+
 struct rsa_key {
 	pem_password_cb *pw_cb;
 	char *path;
@@ -94,6 +106,8 @@ int format_exec_cmd(char **, const char *, const char *, const char *, char *);
 int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
+void sha256_hash(unsigned char[SHA256_DIGEST_LENGTH],
+    char[SHA256_DIGEST_LENGTH * 2 + 1]);
 void sha256_buf(const char *, size_t len, char[SHA256_DIGEST_LENGTH * 2 +1]);
 void sha256_buf_bin(const char *, size_t len, char[SHA256_DIGEST_LENGTH]);
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
@@ -109,6 +123,15 @@ int rsa_verify(const char *path, const char *key,
 int rsa_verify_cert(const char *path, unsigned char *cert,
     int certlen, unsigned char *sig, int sig_len, int fd);
 
+void *pkg_arena_alloc(struct pkg_arena *, size_t);
+char *pkg_arena_strdup(struct pkg_arena *, const char *);
+const char *pkg_arena_intern(struct pkg_arena *, const char *);
+void pkg_arena_free(struct pkg_arena *);
+
+const char *pkg_intern(const char *);
+const char *pkg_intern_find(const char *);
+
+int worker_count(void);
 bool check_for_hardlink(struct hardlinks **hl, struct stat *st);
 bool is_valid_abi(const char *arch, bool emit_error);
 
@@ -34,6 +34,8 @@ struct pkg_repo_ops pkg_repo_binary_ops = {
 	.query = pkg_repo_binary_query,
 	.shlib_provided = pkg_repo_binary_shlib_provide,
 	.shlib_required = pkg_repo_binary_shlib_require,
+	.query_uids = pkg_repo_binary_query_uids,
+	.shlibs_provided = pkg_repo_binary_shlibs_provide,
 	.search = pkg_repo_binary_search,
 	.fetch_pkg = pkg_repo_binary_fetch,
 	.mirror_pkg = pkg_repo_binary_mirror,
@@ -45,6 +45,10 @@ struct pkg_repo_it *pkg_repo_binary_shlib_provide(struct pkg_repo *repo,
 	const char *require);
 struct pkg_repo_it *pkg_repo_binary_shlib_require(struct pkg_repo *repo,
 	const char *provide);
+struct pkg_repo_it *pkg_repo_binary_query_uids(struct pkg_repo *repo,
+	const char **uids, size_t n);
+struct pkg_repo_it *pkg_repo_binary_shlibs_provide(struct pkg_repo *repo,
+	const char **requires, size_t n);
 struct pkg_repo_it *pkg_repo_binary_search(struct pkg_repo *repo,
 	const char *pattern, match_t match,
     pkgdb_field field, pkgdb_field sort);
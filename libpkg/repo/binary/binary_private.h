@@ -28,6 +28,26 @@
 #include "pkg.h"
 #include "private/pkg.h"
 
+/*
+ * Indexes that are only needed for queries: a bulk load drops them and
+ * creates them again once all packages are in
+ */
+#define BINARY_REPO_SECONDARY_INDEXES \
+	"CREATE INDEX IF NOT EXISTS packages_origin ON packages(origin COLLATE NOCASE);" \
+	"CREATE INDEX IF NOT EXISTS packages_name ON packages(name COLLATE NOCASE);" \
+	"CREATE INDEX IF NOT EXISTS packages_uid_nocase ON packages(name COLLATE NOCASE, origin COLLATE NOCASE);" \
+	"CREATE INDEX IF NOT EXISTS packages_version_nocase ON packages(name COLLATE NOCASE, version);" \
+	"CREATE INDEX IF NOT EXISTS packages_uid ON packages(name, origin);" \
+	"CREATE INDEX IF NOT EXISTS packages_version ON packages(name, version);"
+
+#define BINARY_REPO_SECONDARY_INDEXES_DROP \
+	"DROP INDEX IF EXISTS packages_origin;" \
+	"DROP INDEX IF EXISTS packages_name;" \
+	"DROP INDEX IF EXISTS packages_uid_nocase;" \
+	"DROP INDEX IF EXISTS packages_version_nocase;" \
+	"DROP INDEX IF EXISTS packages_uid;" \
+	"DROP INDEX IF EXISTS packages_version;"
+
 static const char binary_repo_initsql[] = ""
 	"CREATE TABLE packages ("
 	    "id INTEGER PRIMARY KEY,"
@@ -163,12 +183,7 @@ static const char binary_repo_initsql[] = ""
 	    "  ON DELETE RESTRICT ON UPDATE RESTRICT,"
 	    "UNIQUE(package_id, provide_id)"
 	");"
-	"CREATE INDEX packages_origin ON packages(origin COLLATE NOCASE);"
-	"CREATE INDEX packages_name ON packages(name COLLATE NOCASE);"
-	"CREATE INDEX packages_uid_nocase ON packages(name COLLATE NOCASE, origin COLLATE NOCASE);"
-	"CREATE INDEX packages_version_nocase ON packages(name COLLATE NOCASE, version);"
-	"CREATE INDEX packages_uid ON packages(name, origin);"
-	"CREATE INDEX packages_version ON packages(name, version);"
+	BINARY_REPO_SECONDARY_INDEXES
 	"CREATE UNIQUE INDEX packages_digest ON packages(manifestdigest);"
 	/* FTS search table */
 	"CREATE VIRTUAL TABLE pkg_search USING fts4(id, name, origin);"
@@ -41,7 +41,6 @@
 #include <errno.h>
 #include <limits.h>
 
-#include <libgen.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -167,13 +166,19 @@ pkg_repo_binary_try_fetch(struct pkg_repo *repo, struct pkg *pkg,
 	if (access(dest, F_OK) == 0)
 		goto checksum;
 
-	/* Create the dirs in cachedir */
+	/*
+	 * Create the dirs in cachedir; dirname(3) may use a static buffer
+	 * and packages are fetched concurrently, so strip the last component
+	 * by hand.
+	 */
 	dir = strdup(dest);
-	if (dir == NULL || (path = dirname(dir)) == NULL) {
+	if (dir == NULL || (path = strrchr(dir, '/')) == NULL) {
 		pkg_emit_errno("dirname", dest);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
+	*path = '\0';
+	path = dir;
 
 	if ((retcode = mkdirs(path)) != EPKG_OK)
 		goto cleanup;
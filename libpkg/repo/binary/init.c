@@ -388,6 +388,7 @@ pkg_repo_binary_open(struct pkg_repo *repo, unsigned mode)
 		pkg_emit_notice("Repository %s has incompatible checksum format, need to "
 			"re-create database", repo->name);
 		pkg_free(pkg);
+		pkgdb_stmt_cache_flush(sqlite);
 		sqlite3_close(sqlite);
 		repo->priv = NULL;
 		return (EPKG_FATAL);
@@ -512,6 +513,7 @@ pkg_repo_binary_close(struct pkg_repo *repo, bool commit)
 	}
 
 	pkg_repo_binary_finalize_prstatements();
+	pkgdb_stmt_cache_flush(sqlite);
 	sqlite3_free(sqlite);
 
 	repo->priv = NULL;
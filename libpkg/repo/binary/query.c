@@ -219,6 +219,104 @@ pkg_repo_binary_shlib_require(struct pkg_repo *repo, const char *provide)
 	return (pkg_repo_binary_it_new(repo, stmt, PKGDB_IT_FLAG_ONCE));
 }
 
+/*
+ * Set-based variants of the two queries above, used to expand the solver
+ * universe one level at a time.  The caller keeps the number of patterns
+ * below the sqlite limit of bound variables.
+ */
+struct pkg_repo_it *
+pkg_repo_binary_query_uids(struct pkg_repo *repo, const char **uids,
+	size_t n)
+{
+	sqlite3_stmt	*stmt;
+	sqlite3 *sqlite = PRIV_GET(repo);
+	struct sbuf	*sql = NULL;
+	size_t		 i;
+	int		 ret;
+	const char	 basesql[] = ""
+		"SELECT id, origin, name, name || '~' || origin as uniqueid, version, comment, "
+		"prefix, desc, arch, maintainer, www, "
+		"licenselogic, flatsize, pkgsize, "
+		"cksum, manifestdigest, path AS repopath, '%s' AS dbname "
+		"FROM packages AS p WHERE name IN (";
+
+	if (n == 0)
+		return (NULL);
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, basesql, repo->name);
+	/* Filter on the name first so that the index can be used */
+	for (i = 0; i < n; i++)
+		sbuf_printf(sql, "%sSPLIT_UID('name', ?%zu)", i > 0 ? ", " : "",
+		    i + 1);
+	sbuf_cat(sql, ") AND name || '~' || origin IN (");
+	for (i = 0; i < n; i++)
+		sbuf_printf(sql, "%s?%zu", i > 0 ? ", " : "", i + 1);
+	sbuf_cat(sql, ");");
+	sbuf_finish(sql);
+
+	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
+	ret = sqlite3_prepare_v2(sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(sqlite, sbuf_get(sql));
+		sbuf_delete(sql);
+		return (NULL);
+	}
+
+	sbuf_delete(sql);
+
+	for (i = 0; i < n; i++)
+		sqlite3_bind_text(stmt, i + 1, uids[i], -1, SQLITE_TRANSIENT);
+
+	return (pkg_repo_binary_it_new(repo, stmt, PKGDB_IT_FLAG_ONCE));
+}
+
+struct pkg_repo_it *
+pkg_repo_binary_shlibs_provide(struct pkg_repo *repo, const char **requires,
+	size_t n)
+{
+	sqlite3_stmt	*stmt;
+	sqlite3 *sqlite = PRIV_GET(repo);
+	struct sbuf	*sql = NULL;
+	size_t		 i;
+	int		 ret;
+	const char	 basesql[] = ""
+			"SELECT p.id, p.origin, p.name, p.version, p.comment, "
+			"p.name || '~' || p.origin as uniqueid, "
+			"p.prefix, p.desc, p.arch, p.maintainer, p.www, "
+			"p.licenselogic, p.flatsize, p.pkgsize, "
+			"p.cksum, p.manifestdigest, p.path AS repopath, '%s' AS dbname "
+			"FROM packages AS p WHERE p.id IN ("
+			"SELECT ps.package_id FROM pkg_shlibs_provided AS ps "
+			"INNER JOIN shlibs AS s ON s.id = ps.shlib_id WHERE ";
+
+	if (n == 0)
+		return (NULL);
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, basesql, repo->name);
+	for (i = 0; i < n; i++)
+		sbuf_printf(sql, "%ss.name BETWEEN ?%zu AND ?%zu || '.9'",
+		    i > 0 ? " OR " : "", i + 1, i + 1);
+	sbuf_cat(sql, ");");
+	sbuf_finish(sql);
+
+	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
+	ret = sqlite3_prepare_v2(sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(sqlite, sbuf_get(sql));
+		sbuf_delete(sql);
+		return (NULL);
+	}
+
+	sbuf_delete(sql);
+
+	for (i = 0; i < n; i++)
+		sqlite3_bind_text(stmt, i + 1, requires[i], -1, SQLITE_TRANSIENT);
+
+	return (pkg_repo_binary_it_new(repo, stmt, PKGDB_IT_FLAG_ONCE));
+}
+
 static const char *
 pkg_repo_binary_search_how(match_t match)
 {
@@ -376,9 +474,12 @@ pkg_repo_binary_ensure_loaded(struct pkg_repo *repo,
 			return (EPKG_FATAL);
 
 		/* Now move required elements to the provided package */
+		pkg_list_free(pkg, PKG_FILES);
 		pkg->files = cached->files;
+		pkg->file_arena = cached->file_arena;
 		pkg->dirs = cached->dirs;
 		cached->files = NULL;
+		memset(&cached->file_arena, 0, sizeof(cached->file_arena));
 		cached->dirs = NULL;
 
 		pkg_free(cached);
@@ -419,6 +520,12 @@ pkg_repo_binary_stat(struct pkg_repo *repo, pkg_stats_t type)
 	case PKG_STATS_REMOTE_REPOS:
 		goto out;
 		break;
+	case PKG_STATS_STMT_CACHE_HITS:
+	case PKG_STATS_STMT_CACHE_MISSES:
+	case PKG_STATS_STMT_CACHE_EVICTIONS:
+		stats = pkgdb_stmt_cache_stats(sqlite, type);
+		goto out;
+		break;
 	}
 
 	sbuf_finish(sql);
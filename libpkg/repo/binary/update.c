@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -150,7 +151,7 @@ cleanup:
 
 static int
 pkg_repo_binary_add_pkg(struct pkg *pkg, const char *pkg_path,
-		sqlite3 *sqlite, bool forced)
+		sqlite3 *sqlite, bool forced, bool bulk)
 {
 	const char *name, *version, *origin, *comment, *desc;
 	const char *arch, *maintainer, *www, *prefix, *sum, *rpath;
@@ -202,7 +203,8 @@ try_again:
 	}
 	package_id = sqlite3_last_insert_rowid(sqlite);
 
-	if (pkg_repo_binary_run_prstatement (FTS_APPEND, package_id,
+	/* During a bulk load, pkg_repo_binary_bulk_end() fills the search table */
+	if (!bulk && pkg_repo_binary_run_prstatement (FTS_APPEND, package_id,
 			name, version, origin) != SQLITE_DONE) {
 		ERROR_SQLITE(sqlite, pkg_repo_binary_sql_prstatement(FTS_APPEND));
 		return (EPKG_FATAL);
@@ -405,49 +407,29 @@ pkg_repo_binary_register_conflicts(const char *origin, char **conflicts,
 }
 
 static int
-pkg_repo_binary_add_from_manifest(char *buf, const char *origin, const char *digest,
-		long offset, sqlite3 *sqlite,
-		struct pkg_manifest_key **keys, struct pkg **p, bool is_legacy,
-		struct pkg_repo *repo)
+pkg_repo_binary_register_manifest(struct pkg *pkg, const char *origin,
+		const char *digest, sqlite3 *sqlite, bool is_legacy,
+		struct pkg_repo *repo, bool bulk)
 {
-	int rc = EPKG_OK;
-	struct pkg *pkg;
+	int rc;
 	const char *local_origin, *pkg_arch;
 
-	if (*p == NULL) {
-		rc = pkg_new(p, PKG_REMOTE);
-		if (rc != EPKG_OK)
-			return (EPKG_FATAL);
-	} else {
-		pkg_reset(*p, PKG_REMOTE);
-	}
-
-	pkg = *p;
-
-	pkg_manifest_keys_new(keys);
-	rc = pkg_parse_manifest(pkg, buf, offset, *keys);
-	if (rc != EPKG_OK) {
-		goto cleanup;
-	}
 	rc = pkg_is_valid(pkg);
-	if (rc != EPKG_OK) {
-		goto cleanup;
-	}
+	if (rc != EPKG_OK)
+		return (rc);
 
 	/* Ensure that we have a proper origin and arch*/
 	pkg_get(pkg, PKG_ORIGIN, &local_origin, PKG_ARCH, &pkg_arch);
 	if (local_origin == NULL || strcmp(local_origin, origin) != 0) {
 		pkg_emit_error("manifest contains origin %s while we wanted to add origin %s",
 				local_origin ? local_origin : "NULL", origin);
-		rc = EPKG_FATAL;
-		goto cleanup;
+		return (EPKG_FATAL);
 	}
 
 	if (pkg_arch == NULL || !is_valid_abi(pkg_arch, true)) {
-		rc = EPKG_FATAL;
 		pkg_emit_error("repository %s contains packages with wrong ABI: %s",
 			repo->name, pkg_arch);
-		goto cleanup;
+		return (EPKG_FATAL);
 	}
 
 	pkg_set(pkg, PKG_REPONAME, repo->name);
@@ -459,10 +441,103 @@ pkg_repo_binary_add_from_manifest(char *buf, const char *origin, const char *dig
 		pkg_set(pkg, PKG_DIGEST, digest);
 	}
 
-	rc = pkg_repo_binary_add_pkg(pkg, NULL, sqlite, true);
+	return (pkg_repo_binary_add_pkg(pkg, NULL, sqlite, true, bulk));
+}
 
-cleanup:
-	return (rc);
+/*
+ * Returns EPKG_END if the catalogue has no usable entry for this origin,
+ * in which case the caller should use the manifest instead
+ */
+static int
+pkg_repo_binary_add_from_catalogue(struct pkg_catalogue *cat,
+		const char *origin, const char *digest, sqlite3 *sqlite,
+		struct pkg **p, struct pkg_repo *repo, bool bulk)
+{
+	int rc;
+	struct pkg *pkg;
+	const char *cat_digest, *pkg_arch;
+
+	rc = pkg_catalogue_find(cat, origin, p);
+	if (rc != EPKG_OK)
+		return (rc);
+
+	pkg = *p;
+
+	/* The digests file is authoritative, skip stale entries */
+	pkg_get(pkg, PKG_DIGEST, &cat_digest, PKG_ARCH, &pkg_arch);
+	if (cat_digest == NULL || strcmp(cat_digest, digest) != 0) {
+		pkg_debug(1, "catalogue entry for %s is stale", origin);
+		return (EPKG_END);
+	}
+
+	if (pkg_is_valid(pkg) != EPKG_OK)
+		return (EPKG_END);
+
+	if (pkg_arch == NULL || !is_valid_abi(pkg_arch, true)) {
+		pkg_emit_error("repository %s contains packages with wrong ABI: %s",
+			repo->name, pkg_arch);
+		return (EPKG_FATAL);
+	}
+
+	pkg_set(pkg, PKG_REPONAME, repo->name);
+
+	return (pkg_repo_binary_add_pkg(pkg, NULL, sqlite, true, bulk));
+}
+
+static int
+pkg_repo_binary_map_manifests(struct pkg_repo *repo, time_t *t,
+		char **map, size_t *len)
+{
+	FILE *fmanifest;
+	int rc = EPKG_FATAL;
+
+	fmanifest = pkg_repo_fetch_remote_extract_tmp(repo,
+			repo->meta->manifests, t, &rc);
+	if (fmanifest == NULL)
+		return (rc);
+
+	fseek(fmanifest, 0, SEEK_END);
+	*len = ftell(fmanifest);
+
+	if (*len == 0 || *len >= SSIZE_MAX) {
+		if (*len == 0)
+			pkg_emit_error("Empty catalogue");
+		else
+			pkg_emit_error("Catalogue too large");
+		fclose(fmanifest);
+		return (EPKG_FATAL);
+	}
+
+	*map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fileno(fmanifest), 0);
+	fclose(fmanifest);
+	if (*map == MAP_FAILED) {
+		pkg_emit_errno("mmap", repo->meta->manifests);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static struct pkg_catalogue *
+pkg_repo_binary_open_catalogue(struct pkg_repo *repo, time_t *t)
+{
+	FILE *fcatalogue;
+	struct pkg_catalogue *cat = NULL;
+	int rc;
+
+	if (repo->meta->catalogue == NULL)
+		return (NULL);
+
+	fcatalogue = pkg_repo_fetch_remote_extract_tmp(repo,
+			repo->meta->catalogue, t, &rc);
+	if (fcatalogue == NULL)
+		return (NULL);
+
+	if (pkg_catalogue_open(&cat, fileno(fcatalogue)) != EPKG_OK)
+		cat = NULL;
+	fclose(fcatalogue);
+
+	return (cat);
 }
 
 struct pkg_increment_task_item {
@@ -494,6 +569,187 @@ pkg_repo_binary_update_item_new(struct pkg_increment_task_item **head, const cha
 	HASH_ADD_KEYPTR(hh, *head, item->origin, strlen(item->origin), item);
 }
 
+/*
+ * A forced update fills an empty database: secondary indexes and the
+ * search table are built once at the end instead of being updated for
+ * every row, and nothing is synced until the data is complete. An
+ * interrupted load leaves the repo_update marker behind, so the next
+ * update starts over anyway.
+ */
+static int
+pkg_repo_binary_bulk_begin(sqlite3 *sqlite)
+{
+	if (sql_exec(sqlite, BINARY_REPO_SECONDARY_INDEXES_DROP) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_repo_binary_bulk_end(sqlite3 *sqlite)
+{
+	const char fts_sql[] = ""
+		"INSERT OR IGNORE INTO pkg_search(id, name, origin) "
+		"SELECT id, name || '-' || version, origin FROM packages;";
+
+	pkg_debug(1, "Pkgrepo, building indexes");
+	if (sql_exec(sqlite, fts_sql) != EPKG_OK ||
+	    sql_exec(sqlite, BINARY_REPO_SECONDARY_INDEXES) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Manifests are parsed by a pool of threads while the calling thread,
+ * which owns the sqlite handle, inserts the parsed packages in order.
+ * Parsers never run more than a window of slots ahead of the writer.
+ */
+#define PKG_REPO_PARSE_WINDOW 64
+
+struct pkg_repo_parse_slot {
+	struct pkg_increment_task_item *item;
+	struct pkg *pkg;
+	int rc;
+	bool done;
+};
+
+struct pkg_repo_parse_env {
+	pthread_mutex_t lock;
+	pthread_cond_t parsed;
+	pthread_cond_t consumed;
+	struct pkg_repo_parse_slot *slots;
+	size_t nslots;
+	size_t next;
+	size_t written;
+	size_t window;
+	bool stop;
+	char *map;
+	size_t len;
+};
+
+static void *
+pkg_repo_binary_parse_worker(void *arg)
+{
+	struct pkg_repo_parse_env *env = arg;
+	struct pkg_repo_parse_slot *slot;
+	struct pkg_increment_task_item *item;
+	struct pkg_manifest_key *keys = NULL;
+	size_t len;
+	int rc;
+
+	pkg_manifest_keys_new(&keys);
+
+	pthread_mutex_lock(&env->lock);
+	for (;;) {
+		while (!env->stop && env->next < env->nslots &&
+		    env->next >= env->written + env->window)
+			pthread_cond_wait(&env->consumed, &env->lock);
+		if (env->stop || env->next >= env->nslots)
+			break;
+		slot = &env->slots[env->next++];
+		pthread_mutex_unlock(&env->lock);
+
+		item = slot->item;
+		len = item->length != 0 ? (size_t)item->length :
+		    env->len - item->offset;
+		rc = pkg_new(&slot->pkg, PKG_REMOTE);
+		if (rc == EPKG_OK)
+			rc = pkg_parse_manifest(slot->pkg, env->map + item->offset,
+			    len, keys);
+
+		pthread_mutex_lock(&env->lock);
+		slot->rc = rc;
+		slot->done = true;
+		pthread_cond_broadcast(&env->parsed);
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	pkg_manifest_keys_free(keys);
+
+	return (NULL);
+}
+
+static int
+pkg_repo_binary_add_from_manifests(struct pkg_repo_parse_slot *slots,
+		size_t nslots, char *map, size_t len, sqlite3 *sqlite,
+		bool is_legacy, struct pkg_repo *repo, int *progress, int total,
+		bool bulk)
+{
+	struct pkg_repo_parse_env env;
+	struct pkg_repo_parse_slot *slot;
+	pthread_t *threads;
+	int nthreads, started, i;
+	size_t cur;
+	int rc = EPKG_OK;
+
+	nthreads = MIN((size_t)worker_count(), nslots);
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL) {
+		pkg_emit_errno("calloc", "pkg_repo_binary_add_from_manifests");
+		return (EPKG_FATAL);
+	}
+
+	memset(&env, 0, sizeof(env));
+	pthread_mutex_init(&env.lock, NULL);
+	pthread_cond_init(&env.parsed, NULL);
+	pthread_cond_init(&env.consumed, NULL);
+	env.slots = slots;
+	env.nslots = nslots;
+	env.window = PKG_REPO_PARSE_WINDOW * nthreads;
+	env.map = map;
+	env.len = len;
+
+	for (started = 0; started < nthreads; started ++) {
+		if (pthread_create(&threads[started], NULL,
+		    pkg_repo_binary_parse_worker, &env) != 0) {
+			pkg_emit_errno("pthread_create", "manifest parser");
+			break;
+		}
+	}
+	if (started == 0)
+		rc = EPKG_FATAL;
+
+	for (cur = 0; cur < nslots && rc == EPKG_OK; cur ++) {
+		slot = &slots[cur];
+
+		pthread_mutex_lock(&env.lock);
+		while (!slot->done)
+			pthread_cond_wait(&env.parsed, &env.lock);
+		env.written = cur + 1;
+		pthread_cond_broadcast(&env.consumed);
+		pthread_mutex_unlock(&env.lock);
+
+		pkg_emit_progress_tick(++(*progress), total);
+		rc = slot->rc;
+		if (rc == EPKG_OK)
+			rc = pkg_repo_binary_register_manifest(slot->pkg,
+			    slot->item->origin, slot->item->digest, sqlite,
+			    is_legacy, repo, bulk);
+		pkg_free(slot->pkg);
+		slot->pkg = NULL;
+	}
+
+	pthread_mutex_lock(&env.lock);
+	env.stop = true;
+	pthread_cond_broadcast(&env.consumed);
+	pthread_mutex_unlock(&env.lock);
+
+	for (i = 0; i < started; i ++)
+		pthread_join(threads[i], NULL);
+
+	/* Packages parsed ahead of a failure */
+	for (; cur < nslots; cur ++)
+		pkg_free(slots[cur].pkg);
+
+	pthread_cond_destroy(&env.consumed);
+	pthread_cond_destroy(&env.parsed);
+	pthread_mutex_destroy(&env.lock);
+	free(threads);
+
+	return (rc);
+}
+
 static void __unused
 pkg_repo_binary_parse_conflicts(FILE *f, sqlite3 *sqlite)
 {
@@ -566,11 +822,221 @@ pkg_repo_binary_update_item_free(struct pkg_increment_task_item *item)
 	}
 }
 
+static int
+pkg_repo_binary_set_digests_checksum(sqlite3 *sqlite, const char *cksum)
+{
+	sqlite3_stmt *stmt;
+	const char sql[] = ""
+		"INSERT OR REPLACE INTO repodata (key, value) "
+		"VALUES (\"digests_checksum\", ?1);";
+	int ret;
+
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite, sql);
+		return (EPKG_FATAL);
+	}
+
+	sqlite3_bind_text(stmt, 1, cksum, -1, SQLITE_STATIC);
+	ret = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite, sql);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Applies one delta published by pkg_finish_repo, see pkg_repo_create.c
+ * for the format
+ */
+static int
+pkg_repo_binary_apply_delta(FILE *f, const char *base, char **target,
+		sqlite3 *sqlite, struct pkg_manifest_key **keys, struct pkg **p,
+		struct pkg_repo *repo, int *updated, int *added, int *removed)
+{
+	char *line = NULL, *buf = NULL, *nbuf, *s;
+	const char *origin, *digest, *length;
+	size_t linecap = 0, bufsz = 0;
+	ssize_t linelen;
+	long mlen;
+	bool exists;
+	int rc = EPKG_FATAL;
+
+	if ((linelen = getline(&line, &linecap, f)) <= 0 ||
+	    strncmp(line, "base ", 5) != 0 ||
+	    strncmp(line + 5, base, strlen(base)) != 0) {
+		pkg_emit_error("delta for %s has a wrong base", base);
+		goto cleanup;
+	}
+	if ((linelen = getline(&line, &linecap, f)) <= 0 ||
+	    strncmp(line, "target ", 7) != 0) {
+		pkg_emit_error("delta for %s has no target", base);
+		goto cleanup;
+	}
+	line[strcspn(line, "\n")] = '\0';
+	*target = strdup(line + 7);
+
+	pkg_manifest_keys_new(keys);
+
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '-') {
+			if (pkgdb_repo_remove_package(line + 1) != EPKG_OK)
+				goto cleanup;
+			(*removed)++;
+			continue;
+		}
+
+		s = line + 1;
+		origin = strsep(&s, ":");
+		digest = strsep(&s, ":");
+		length = strsep(&s, ":");
+		if (line[0] != '+' || length == NULL) {
+			pkg_emit_error("invalid delta format");
+			goto cleanup;
+		}
+		mlen = strtol(length, NULL, 10);
+		if (mlen <= 0) {
+			pkg_emit_error("invalid delta format");
+			goto cleanup;
+		}
+		if ((size_t)mlen > bufsz) {
+			bufsz = mlen;
+			if ((nbuf = realloc(buf, bufsz)) == NULL) {
+				pkg_emit_errno("realloc", "pkg_repo_binary_apply_delta");
+				goto cleanup;
+			}
+			buf = nbuf;
+		}
+		if (fread(buf, 1, mlen, f) != (size_t)mlen) {
+			pkg_emit_error("delta for %s is truncated", base);
+			goto cleanup;
+		}
+
+		if (*p == NULL) {
+			if (pkg_new(p, PKG_REMOTE) != EPKG_OK)
+				goto cleanup;
+		} else
+			pkg_reset(*p, PKG_REMOTE);
+
+		/* A changed package replaces the one with the same origin */
+		exists = (pkg_repo_binary_run_prstatement(VERSION, origin) ==
+		    SQLITE_ROW);
+		sqlite3_reset(pkg_repo_binary_stmt_prstatement(VERSION));
+
+		if (pkg_parse_manifest(*p, buf, mlen, *keys) != EPKG_OK ||
+		    pkg_repo_binary_register_manifest(*p, origin, digest, sqlite,
+		    false, repo, false) != EPKG_OK)
+			goto cleanup;
+		if (exists)
+			(*updated)++;
+		else
+			(*added)++;
+	}
+
+	rc = EPKG_OK;
+
+cleanup:
+	free(line);
+	free(buf);
+
+	return (rc);
+}
+
+/*
+ * Follows the chain of deltas from the digests the local database was
+ * built from to the ones announced by the meta. Anything unexpected
+ * returns an error and the caller falls back to the full catalogue.
+ */
+static int
+pkg_repo_binary_update_deltas(const char *name, struct pkg_repo *repo)
+{
+	sqlite3 *sqlite;
+	struct pkg_manifest_key *keys = NULL;
+	struct pkg *pkg = NULL;
+	char *cur = NULL, *target = NULL;
+	char fname[MAXPATHLEN];
+	FILE *fdelta;
+	time_t t;
+	int updated = 0, added = 0, removed = 0, ndeltas = 0;
+	int rc;
+
+	rc = pkg_repo_binary_init_update(repo, name, false);
+	if (rc != EPKG_OK) {
+		repo->ops->close(repo, false);
+		return (rc);
+	}
+
+	sqlite = PRIV_GET(repo);
+
+	if (get_sql_string(sqlite, "SELECT value FROM repodata "
+	    "WHERE key = \"digests_checksum\";", &cur) != EPKG_OK ||
+	    cur == NULL) {
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if ((rc = pkgdb_transaction_begin(sqlite, "REPO")) != EPKG_OK)
+		goto cleanup;
+
+	while (strcmp(cur, repo->meta->digests_checksum) != 0) {
+		if (ndeltas++ == PKG_REPO_MAX_DELTAS) {
+			rc = EPKG_FATAL;
+			break;
+		}
+
+		pkg_debug(1, "Pkgrepo, applying delta %s to '%s'", cur, name);
+		snprintf(fname, sizeof(fname), "%s-%s", repo->meta->deltas, cur);
+		t = 0;
+		fdelta = pkg_repo_fetch_remote_extract_tmp(repo, fname, &t, &rc);
+		if (fdelta == NULL) {
+			rc = EPKG_FATAL;
+			break;
+		}
+		rc = pkg_repo_binary_apply_delta(fdelta, cur, &target, sqlite,
+		    &keys, &pkg, repo, &updated, &added, &removed);
+		fclose(fdelta);
+		if (rc != EPKG_OK)
+			break;
+		free(cur);
+		cur = target;
+		target = NULL;
+	}
+
+	if (rc == EPKG_OK)
+		rc = pkg_repo_binary_set_digests_checksum(sqlite, cur);
+
+	if (rc != EPKG_OK)
+		pkgdb_transaction_rollback(sqlite, "REPO");
+	if (pkgdb_transaction_commit(sqlite, "REPO") != EPKG_OK)
+		rc = EPKG_FATAL;
+
+	if (rc == EPKG_OK)
+		pkg_emit_incremental_update(repo->name, updated, removed, added,
+		    updated + added + removed);
+
+cleanup:
+	if (rc != EPKG_OK) {
+		sql_exec(sqlite, "DROP TABLE repo_update;");
+		repo->ops->close(repo, false);
+	}
+	pkg_manifest_keys_free(keys);
+	pkg_free(pkg);
+	free(cur);
+	free(target);
+
+	return (rc);
+}
+
 static int
 pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 	time_t *mtime, bool force)
 {
-	FILE *fmanifest = NULL, *fdigests = NULL /*, *fconflicts = NULL*/;
+	FILE *fdigests = NULL /*, *fconflicts = NULL*/;
+	struct pkg_catalogue *cat = NULL;
 	struct pkg *pkg = NULL;
 	int rc = EPKG_FATAL;
 	sqlite3 *sqlite = NULL;
@@ -581,10 +1047,11 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 	long num_offset, num_length;
 	time_t local_t;
 	time_t digest_t;
-	time_t packagesite_t;
+	char digests_cksum[SHA256_DIGEST_LENGTH * 2 + 1];
 	struct pkg_increment_task_item *ldel = NULL, *ladd = NULL,
 			*item, *tmp_item;
-	struct pkg_manifest_key *keys = NULL;
+	struct pkg_repo_parse_slot *slots = NULL;
+	size_t nslots = 0;
 	size_t linecap = 0;
 	ssize_t linelen;
 	char *map = MAP_FAILED;
@@ -603,10 +1070,22 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 
 	/* Fetch meta */
 	local_t = *mtime;
-	if (pkg_repo_fetch_meta(repo, &local_t) == EPKG_FATAL)
+	rc = pkg_repo_fetch_meta(repo, &local_t);
+	if (rc == EPKG_FATAL)
 		pkg_emit_notice("repository %s has no meta file, using "
 		    "default settings", repo->name);
 
+	/* Try to catch up using deltas only */
+	if (!force && rc == EPKG_OK && repo->meta->deltas != NULL &&
+	    repo->meta->digests_checksum != NULL) {
+		if (pkg_repo_binary_update_deltas(name, repo) == EPKG_OK) {
+			*mtime = local_t;
+			return (EPKG_OK);
+		}
+		pkg_debug(1, "Pkgrepo, deltas cannot be used for '%s', "
+		    "fetching the full catalogue", name);
+	}
+
 	/* Fetch digests */
 	local_t = *mtime;
 	fdigests = pkg_repo_fetch_remote_extract_tmp(repo,
@@ -614,21 +1093,27 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 	if (fdigests == NULL)
 		goto cleanup;
 
-	/* Fetch packagesite */
+	/*
+	 * Prefer the binary catalogue if the repository publishes one,
+	 * packagesite is then only fetched if some entry is missing from it
+	 */
 	digest_t = local_t;
 	local_t = *mtime;
-	fmanifest = pkg_repo_fetch_remote_extract_tmp(repo,
-			repo->meta->manifests, &local_t, &rc);
-	if (fmanifest == NULL)
-		goto cleanup;
+	cat = pkg_repo_binary_open_catalogue(repo, &local_t);
+	if (cat == NULL) {
+		local_t = *mtime;
+		rc = pkg_repo_binary_map_manifests(repo, &local_t, &map, &len);
+		if (rc != EPKG_OK)
+			goto cleanup;
+	}
+	else
+		pkg_debug(1, "Pkgrepo, using binary catalogue of '%s' with %u "
+		    "entries", name, pkg_catalogue_count(cat));
 
-	packagesite_t = local_t;
 	*mtime = digest_t;
 	/*fconflicts = repo_fetch_remote_extract_tmp(repo,
 			repo_conflicts_archive, "txz", &local_t,
 			&rc, repo_conflicts_file);*/
-	fseek(fmanifest, 0, SEEK_END);
-	len = ftell(fmanifest);
 
 	/* Detect whether we have legacy repo */
 	if ((linelen = getline(&linebuf, &linecap, fdigests)) > 0) {
@@ -646,6 +1131,9 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 		}
 	}
 	fseek(fdigests, 0, SEEK_SET);
+	if (sha256_fd(fileno(fdigests), digests_cksum) != EPKG_OK)
+		digests_cksum[0] = '\0';
+	fseek(fdigests, 0, SEEK_SET);
 
 	/* Load local repository data */
 	rc = pkg_repo_binary_init_update(repo, name, force);
@@ -751,12 +1239,19 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 
 	pkg_debug(1, "Pkgrepo, removing old entries for '%s'", name);
 
+	/* The database is rebuilt from scratch, see pkg_repo_binary_bulk_begin() */
+	if (force)
+		sql_exec(sqlite, "PRAGMA synchronous=OFF;");
+
 	rc = pkgdb_transaction_begin(sqlite, "REPO");
 	if (rc != EPKG_OK)
 		goto cleanup;
 
 	in_trans = true;
 
+	if (force && (rc = pkg_repo_binary_bulk_begin(sqlite)) != EPKG_OK)
+		goto cleanup;
+
 	removed = HASH_COUNT(ldel);
 	hash_it = 0;
 	if (removed > 0)
@@ -778,52 +1273,60 @@ pkg_repo_binary_update_incremental(const char *name, struct pkg_repo *repo,
 	pkg_debug(1, "Pkgrepo, pushing new entries for '%s'", name);
 	pkg = NULL;
 
-	if (len > 0 && len < SSIZE_MAX) {
-		map = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(fmanifest), 0);
-		fclose(fmanifest);
-	} else {
-		if (len == 0)
-			pkg_emit_error("Empty catalogue");
-		else
-			pkg_emit_error("Catalogue too large");
-		goto cleanup;
-	}
-
 	hash_it = 0;
 	pushed = HASH_COUNT(ladd);
-	if (pushed > 0)
+	if (pushed > 0) {
 		pkg_emit_progress_start("Processing new repository entries");
+		slots = calloc(pushed, sizeof(*slots));
+		if (slots == NULL) {
+			pkg_emit_errno("calloc", "pkg_repo_parse_slot");
+			rc = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
 	HASH_ITER(hh, ladd, item, tmp_item) {
-		pkg_emit_progress_tick(++hash_it, pushed);
-		if (rc == EPKG_OK) {
-			if (item->length != 0) {
-				rc = pkg_repo_binary_add_from_manifest(map + item->offset, item->origin,
-				    item->digest, item->length, sqlite, &keys, &pkg, legacy_repo,
-				    repo);
-			}
-			else {
-				rc = pkg_repo_binary_add_from_manifest(map + item->offset, item->origin,
-				    item->digest, len - item->offset, sqlite, &keys, &pkg,
-				    legacy_repo, repo);
+		if (rc != EPKG_OK)
+			break;
+		if (cat != NULL && !legacy_repo) {
+			rc = pkg_repo_binary_add_from_catalogue(cat, item->origin,
+			    item->digest, sqlite, &pkg, repo, force);
+			if (rc == EPKG_OK) {
+				pkg_emit_progress_tick(++hash_it, pushed);
+				continue;
 			}
+			if (rc != EPKG_END)
+				break;
+			rc = EPKG_OK;
 		}
-		else {
-			pkg_emit_progress_tick(pushed, pushed);
-		}
-		HASH_DEL(ladd, item);
-		pkg_repo_binary_update_item_free(item);
+		slots[nslots++].item = item;
 	}
-	if (pushed > 0) {
+	if (rc == EPKG_OK && nslots > 0 && map == MAP_FAILED) {
+		local_t = 0;
+		rc = pkg_repo_binary_map_manifests(repo, &local_t, &map, &len);
+	}
+	if (rc == EPKG_OK && nslots > 0)
+		rc = pkg_repo_binary_add_from_manifests(slots, nslots, map, len,
+		    sqlite, legacy_repo, repo, &hash_it, pushed, force);
+	if (pushed > 0)
 		pkg_emit_progress_tick(pushed, pushed);
-		pkg_manifest_keys_free(keys);
+
+	HASH_ITER(hh, ladd, item, tmp_item) {
+		HASH_DEL(ladd, item);
+		pkg_repo_binary_update_item_free(item);
 	}
 
+	if (force && rc == EPKG_OK)
+		rc = pkg_repo_binary_bulk_end(sqlite);
+
+	/* Remember the digests, later updates can use deltas from them */
+	if (rc == EPKG_OK && digests_cksum[0] != '\0')
+		rc = pkg_repo_binary_set_digests_checksum(sqlite, digests_cksum);
+
 	if (rc == EPKG_OK)
 		pkg_emit_incremental_update(repo->name, updated, removed,
 		    added, processed);
 
 cleanup:
-
 	if (in_trans) {
 		if (rc != EPKG_OK)
 			pkgdb_transaction_rollback(sqlite, "REPO");
@@ -834,8 +1337,9 @@ cleanup:
 
 	if (pkg != NULL)
 		pkg_free(pkg);
-	if (map == MAP_FAILED && fmanifest)
-		fclose(fmanifest);
+	free(slots);
+	if (cat != NULL)
+		pkg_catalogue_close(cat);
 	if (fdigests)
 		fclose(fdigests);
 	/* if (fconflicts)
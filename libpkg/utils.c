@@ -30,6 +30,7 @@
 
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/sysctl.h>
 #include <stdio.h>
 
 #include <assert.h>
@@ -38,6 +39,7 @@
 #include <execinfo.h>
 #endif
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -48,6 +50,7 @@
 #include <ctype.h>
 #include <fnmatch.h>
 #include <paths.h>
+#include <pthread.h>
 #include <float.h>
 #include <math.h>
 
@@ -392,7 +395,7 @@ md5_file(const char *path, char out[MD5_DIGEST_LENGTH * 2 + 1])
 	return (EPKG_OK);
 }
 
-static void
+void
 sha256_hash(unsigned char hash[SHA256_DIGEST_LENGTH],
     char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
@@ -530,6 +533,174 @@ is_conf_file(const char *path, char *newpath, size_t len)
 	return (0);
 }
 
+#define ARENA_MIN_CHUNK	1024
+#define ARENA_MAX_CHUNK	(64 * 1024)
+
+/* Anything may be stored in an arena: align as malloc(3) would */
+union pkg_arena_align {
+	long double ld;
+	int64_t i;
+	void *p;
+	void (*fn)(void);
+};
+#define ARENA_ALIGNMENT	\
+	offsetof(struct { char c; union pkg_arena_align u; }, u)
+#define ARENA_ALIGN(x)	(((x) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+struct pkg_arena_chunk {
+	struct pkg_arena_chunk *next;
+	size_t size;
+	size_t used;
+	union pkg_arena_align data[];
+};
+
+struct pkg_arena_str {
+	struct pkg_arena_str *next;
+	char str[];
+};
+
+void *
+pkg_arena_alloc(struct pkg_arena *a, size_t len)
+{
+	struct pkg_arena_chunk *c = a->chunks;
+	size_t size;
+	void *ret;
+
+	len = ARENA_ALIGN(len);
+	if (c == NULL || c->size - c->used < len) {
+		/* Chunks grow with the arena so small packages stay small */
+		size = c == NULL ? ARENA_MIN_CHUNK : MIN(c->size * 2,
+		    ARENA_MAX_CHUNK);
+		if (size < len)
+			size = len;
+		c = malloc(sizeof(*c) + size);
+		if (c == NULL)
+			return (NULL);
+		c->size = size;
+		c->used = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+
+	ret = (char *)c->data + c->used;
+	c->used += len;
+
+	return (ret);
+}
+
+char *
+pkg_arena_strdup(struct pkg_arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *ret;
+
+	if ((ret = pkg_arena_alloc(a, len)) != NULL)
+		memcpy(ret, s, len);
+
+	return (ret);
+}
+
+const char *
+pkg_arena_intern(struct pkg_arena *a, const char *s)
+{
+	struct pkg_arena_str *cur;
+	size_t len;
+
+	/* Only meant for a handful of distinct values, such as owners */
+	LL_FOREACH(a->strings, cur) {
+		if (strcmp(cur->str, s) == 0)
+			return (cur->str);
+	}
+
+	len = strlen(s) + 1;
+	if ((cur = pkg_arena_alloc(a, sizeof(*cur) + len)) == NULL)
+		return (NULL);
+	memcpy(cur->str, s, len);
+	LL_PREPEND(a->strings, cur);
+
+	return (cur->str);
+}
+
+void
+pkg_arena_free(struct pkg_arena *a)
+{
+	struct pkg_arena_chunk *c, *tmp;
+
+	LL_FOREACH_SAFE(a->chunks, c, tmp)
+		free(c);
+
+	a->chunks = NULL;
+	a->strings = NULL;
+}
+
+/*
+ * Process wide pool of immutable strings.  Names, origins, versions, uids
+ * and shlib names are repeated across thousands of packages; interning them
+ * stores each value once and lets hashes be keyed on the pointer.
+ *
+ * Packages hold on to these strings and may outlive pkg_shutdown(), so the
+ * pool is never freed: it lives until the process exits.
+ */
+struct pkg_intern_str {
+	UT_hash_handle hh;
+	char str[];
+};
+
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pkg_intern_str *intern_pool = NULL;
+static struct pkg_arena intern_arena;
+
+const char *
+pkg_intern(const char *s)
+{
+	struct pkg_intern_str *e;
+	size_t len = strlen(s);
+
+	pthread_mutex_lock(&intern_lock);
+	HASH_FIND(hh, intern_pool, s, len, e);
+	if (e == NULL) {
+		e = pkg_arena_alloc(&intern_arena, sizeof(*e) + len + 1);
+		if (e == NULL) {
+			pthread_mutex_unlock(&intern_lock);
+			pkg_emit_errno("malloc", "pkg_intern");
+			return (NULL);
+		}
+		memcpy(e->str, s, len + 1);
+		HASH_ADD(hh, intern_pool, str[0], len, e);
+	}
+	pthread_mutex_unlock(&intern_lock);
+
+	return (e->str);
+}
+
+const char *
+pkg_intern_find(const char *s)
+{
+	struct pkg_intern_str *e;
+
+	pthread_mutex_lock(&intern_lock);
+	HASH_FIND(hh, intern_pool, s, strlen(s), e);
+	pthread_mutex_unlock(&intern_lock);
+
+	return (e != NULL ? e->str : NULL);
+}
+
+int
+worker_count(void)
+{
+	int num_workers;
+	size_t len;
+
+	num_workers = pkg_object_int(pkg_config_get("WORKERS_COUNT"));
+	if (num_workers <= 0) {
+		len = sizeof(num_workers);
+		if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
+			num_workers = 6;
+	}
+
+	return (num_workers);
+}
+
 bool
 check_for_hardlink(struct hardlinks **hl, struct stat *st)
 {
@@ -233,7 +233,7 @@ check_summary(struct pkgdb *db, struct deps_head *dh)
 void
 usage_check(void)
 {
-	fprintf(stderr, "Usage: pkg check [-Bdsr] [-vy] [-a | -Cgix <pattern>]\n\n");
+	fprintf(stderr, "Usage: pkg check [-Bdsr] [-fvy] [-a | -Cgix <pattern>]\n\n");
 	fprintf(stderr, "For more information see 'pkg help check'.\n");
 }
 
@@ -244,6 +244,7 @@ exec_check(int argc, char **argv)
 	struct pkgdb_it *it = NULL;
 	struct pkgdb *db = NULL;
 	struct sbuf *msg = NULL;
+	struct pkg_filesum_cache *sumcache = NULL;
 	match_t match = MATCH_EXACT;
 	int flags = PKG_LOAD_BASIC;
 	int ret, rc = EX_OK;
@@ -253,6 +254,7 @@ exec_check(int argc, char **argv)
 	bool recompute = false;
 	bool reanalyse_shlibs = false;
 	bool noinstall = false;
+	bool force = false;
 	int nbpkgs = 0;
 	int i, processed, total;
 	int verbose = 0;
@@ -262,6 +264,7 @@ exec_check(int argc, char **argv)
 		{ "shlibs",		no_argument,	NULL,	'B' },
 		{ "case-sensitive",	no_argument,	NULL,	'C' },
 		{ "dependencies",	no_argument,	NULL,	'd' },
+		{ "force",		no_argument,	NULL,	'f' },
 		{ "glob",		no_argument,	NULL,	'g' },
 		{ "case-insensitive",	no_argument,	NULL,	'i' },
 		{ "dry-run",		no_argument,	NULL,	'n' },
@@ -275,7 +278,7 @@ exec_check(int argc, char **argv)
 
 	struct deps_head dh = STAILQ_HEAD_INITIALIZER(dh);
 
-	while ((ch = getopt_long(argc, argv, "+aBCdginrsvxy", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "+aBCdfginrsvxy", longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'a':
 			match = MATCH_ALL;
@@ -291,6 +294,9 @@ exec_check(int argc, char **argv)
 			dcheck = true;
 			flags |= PKG_LOAD_DEPS;
 			break;
+		case 'f':
+			force = true;
+			break;
 		case 'g':
 			match = MATCH_GLOB;
 			break;
@@ -360,6 +366,16 @@ exec_check(int argc, char **argv)
 		return (EX_TEMPFAIL);
 	}
 
+	if (checksums && pkg_object_bool(pkg_config_get("CHECKSUM_CACHE"))) {
+		sumcache = pkg_filesum_cache_open(
+		    (force ? PKG_FILESUM_REHASH : 0) |
+		    (match == MATCH_ALL ? PKG_FILESUM_ALL : 0));
+		if (sumcache == NULL) {
+			rc = EX_SOFTWARE;
+			goto cleanup;
+		}
+	}
+
 	i = 0;
 	nbdone = 0;
 	do {
@@ -412,7 +428,7 @@ exec_check(int argc, char **argv)
 			if (checksums) {
 				if (verbose)
 					printf(" checksums...");
-				if (pkg_test_filesum(pkg) != EPKG_OK) {
+				if (pkg_test_filesum_cached(pkg, sumcache) != EPKG_OK) {
 					rc = EX_DATAERR;
 				}
 			}
@@ -497,6 +513,8 @@ cleanup:
 		sbuf_delete(msg);
 	deps_free(&dh);
 	pkg_free(pkg);
+	if (pkg_filesum_cache_close(sumcache) != EPKG_OK && rc == EX_OK)
+		rc = EX_IOERR;
 	pkgdb_release_lock(db, PKGDB_LOCK_ADVISORY);
 	pkgdb_close(db);
 
@@ -113,6 +113,9 @@ pkg_create_matches(int argc, char **argv, match_t match, pkg_formats fmt,
 	case TAR:
 		format = "tar";
 		break;
+	case TZS:
+		format = "tzst";
+		break;
 	}
 
 	for (i = 0; i < argc || match == MATCH_ALL; i++) {
@@ -287,6 +290,8 @@ exec_create(int argc, char **argv)
 			fmt = TGZ;
 		else if (strcmp(format, "tar") == 0)
 			fmt = TAR;
+		else if (strcmp(format, "tzst") == 0)
+			fmt = TZS;
 		else {
 			warnx("unknown format %s, using txz", format);
 			fmt = old ? TBZ : TXZ;
@@ -417,6 +417,7 @@ exec_info(int argc, char **argv)
 		if ((it = pkgdb_query(db, pkgname, match)) == NULL) {
 			goto cleanup;
 		}
+		pkgdb_it_set_prefetch(it, true);
 
 		/* this is place for compatibility hacks */
 
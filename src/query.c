@@ -960,6 +960,7 @@ exec_query(int argc, char **argv)
 			condition_sql = sbuf_data(sqlcond);
 		if ((it = pkgdb_query(db, condition_sql, match)) == NULL)
 			return (EX_IOERR);
+		pkgdb_it_set_prefetch(it, true);
 
 		while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK)
 			print_query(pkg, argv[0],  multiline);
@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+
+#define NPKGS	200
+#define NVULNS	2000
+#define NSETS	8
+/* Issues found in the packages of register_pkgs() by write_vulnxml() */
+#define NISSUES	2717
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Every fourth vulnerability affects one of the registered packages, some
+ * of them through a glob.
+ */
+static void
+write_vulnxml(const char *path)
+{
+	FILE *f;
+	int i;
+
+	ATF_REQUIRE((f = fopen(path, "w")) != NULL);
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+	    "<vuxml xmlns=\"http://www.vuxml.org/apps/vuxml-1\">\n");
+	for (i = 0; i < NVULNS; i++) {
+		fprintf(f, "<vuln vid=\"%08x-0000-0000-0000-000000000000\">\n"
+		    "<topic>issue %d</topic>\n<affects><package>\n", i, i);
+		if (i % 4 != 0)
+			fprintf(f, "<name>other%d</name>\n", i);
+		else if (i % 8 == 0)
+			fprintf(f, "<name>test%d</name>\n", i / 4 % NPKGS);
+		else
+			fprintf(f, "<name>test%d*</name>\n", i / 4 % 10);
+		fprintf(f, "<range><lt>1.%d</lt></range>\n"
+		    "</package></affects>\n<references>"
+		    "<cvename>CVE-2014-%04d</cvename></references>\n"
+		    "</vuln>\n", i % 3, i);
+	}
+	fprintf(f, "</vuxml>\n");
+	fclose(f);
+}
+
+static void
+register_pkgs(void)
+{
+	struct pkgdb *db;
+	struct pkg *pkg;
+	struct pkg_manifest_key *keys = NULL;
+	char manifest[BUFSIZ];
+	int i, len;
+
+	ATF_REQUIRE_EQ(EPKG_OK, pkgdb_open(&db, PKGDB_DEFAULT));
+	pkg_manifest_keys_new(&keys);
+	for (i = 0; i < NPKGS; i++) {
+		len = snprintf(manifest, sizeof(manifest),
+		    "name: test%d\norigin: test/test%d\nversion: \"1.%d\"\n"
+		    "comment: test\ndesc: test\narch: \"freebsd:10:x86:64\"\n"
+		    "maintainer: test\nwww: test\nprefix: /usr/local\n"
+		    "flatsize: 0\n", i, i, i % 3);
+		ATF_REQUIRE_EQ(EPKG_OK, pkg_new(&pkg, PKG_FILE));
+		ATF_REQUIRE_EQ(EPKG_OK,
+		    pkg_parse_manifest(pkg, manifest, len, keys));
+		ATF_REQUIRE_EQ(EPKG_OK, pkgdb_register_ports(db, pkg));
+		pkg_free(pkg);
+	}
+	pkg_manifest_keys_free(keys);
+	pkgdb_close(db);
+}
+
+static void
+setup(struct pkg_audit **audit)
+{
+	char cwd[PATH_MAX];
+
+	ATF_REQUIRE(getcwd(cwd, sizeof(cwd)) != NULL);
+	setenv("PKG_DBDIR", cwd, 1);
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_init(NULL, NULL));
+
+	write_vulnxml("vuln.xml");
+	register_pkgs();
+
+	*audit = pkg_audit_new();
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_audit_load(*audit, "vuln.xml"));
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_audit_process(*audit));
+}
+
+static unsigned int
+count_issues(struct pkg_audit_result *results)
+{
+	struct pkg_audit_result *r;
+	unsigned int n = 0;
+
+	for (r = results; r != NULL; r = r->next)
+		n += r->nissues;
+
+	return (n);
+}
+
+static const char *
+result_name(struct pkg_audit_result *r)
+{
+	const char *name;
+
+	pkg_get(r->pkg, PKG_NAME, &name);
+
+	return (name);
+}
+
+/*
+ * test0 is 1.0, only vulnerabilities 800 and 1600 name it exactly with a
+ * higher bound, and no glob matches it.
+ */
+static void
+check_test0(struct pkg_audit_result *results)
+{
+	struct pkg_audit_result *r;
+	struct pkg_audit_issue *issue;
+	bool found = false;
+
+	for (r = results; r != NULL; r = r->next)
+		if (strcmp(result_name(r), "test0") == 0)
+			break;
+	ATF_REQUIRE(r != NULL);
+	ATF_REQUIRE_EQ(2, r->nissues);
+
+	for (issue = r->issues; issue != NULL; issue = issue->next) {
+		ATF_CHECK_STREQ("test0", issue->name);
+		if (strcmp(issue->id,
+		    "00000320-0000-0000-0000-000000000000") != 0)
+			continue;
+		ATF_CHECK_STREQ("issue 800", issue->topic);
+		ATF_REQUIRE(issue->cves[0] != NULL);
+		ATF_CHECK_STREQ("CVE-2014-0800", issue->cves[0]);
+		ATF_CHECK(issue->cves[1] == NULL);
+		found = true;
+	}
+	ATF_CHECK(found);
+}
+
+static void
+check_same_results(struct pkg_audit_result *r1, struct pkg_audit_result *r2)
+{
+	struct pkg_audit_issue *i1, *i2;
+	int n;
+
+	for (; r1 != NULL && r2 != NULL; r1 = r1->next, r2 = r2->next) {
+		ATF_CHECK_STREQ(result_name(r1), result_name(r2));
+		ATF_CHECK_EQ(r1->nissues, r2->nissues);
+		for (i1 = r1->issues, i2 = r2->issues; i1 != NULL && i2 != NULL;
+		    i1 = i1->next, i2 = i2->next) {
+			ATF_CHECK_STREQ(i1->name, i2->name);
+			ATF_CHECK_STREQ(i1->id, i2->id);
+			ATF_CHECK_STREQ(i1->topic, i2->topic);
+			for (n = 0; i1->cves[n] != NULL && i2->cves[n] != NULL;
+			    n++)
+				ATF_CHECK_STREQ(i1->cves[n], i2->cves[n]);
+			ATF_CHECK(i1->cves[n] == NULL && i2->cves[n] == NULL);
+		}
+		ATF_CHECK(i1 == NULL && i2 == NULL);
+	}
+	ATF_CHECK(r1 == NULL && r2 == NULL);
+}
+
+ATF_TC(check_its);
+
+ATF_TC_HEAD(check_its, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_audit_check_its() shares one audit between threads and "
+	    "finds what pkg_audit_check_it() finds");
+}
+
+ATF_TC_BODY(check_its, tc)
+{
+	struct pkg_audit *audit;
+	struct pkg_audit_result *serial, *expected = NULL, *results[NSETS];
+	struct pkgdb *dbs[NSETS];
+	struct pkgdb_it *its[NSETS];
+	struct timespec start;
+	double tserial, tparallel;
+	int i;
+
+	setup(&audit);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NSETS; i++) {
+		ATF_REQUIRE_EQ(EPKG_OK, pkgdb_open(&dbs[i], PKGDB_DEFAULT));
+		its[i] = pkgdb_query(dbs[i], NULL, MATCH_ALL);
+		ATF_REQUIRE(its[i] != NULL);
+		ATF_REQUIRE_EQ(EPKG_OK,
+		    pkg_audit_check_it(audit, its[i], PKG_LOAD_BASIC, &serial));
+		if (expected == NULL)
+			expected = serial;
+		else
+			pkg_audit_result_free(serial);
+		pkgdb_it_free(its[i]);
+		pkgdb_close(dbs[i]);
+	}
+	tserial = elapsed(&start);
+	ATF_CHECK_EQ(NISSUES, count_issues(expected));
+	check_test0(expected);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NSETS; i++) {
+		ATF_REQUIRE_EQ(EPKG_OK, pkgdb_open(&dbs[i], PKGDB_DEFAULT));
+		its[i] = pkgdb_query(dbs[i], NULL, MATCH_ALL);
+		ATF_REQUIRE(its[i] != NULL);
+	}
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_audit_check_its(audit, its, NSETS,
+	    PKG_LOAD_BASIC, results));
+	tparallel = elapsed(&start);
+
+	for (i = 0; i < NSETS; i++) {
+		ATF_CHECK_EQ(NISSUES, count_issues(results[i]));
+		check_same_results(expected, results[i]);
+		pkg_audit_result_free(results[i]);
+		pkgdb_it_free(its[i]);
+		pkgdb_close(dbs[i]);
+	}
+
+	printf("%d sets of %d packages: serial %.3fs, parallel %.3fs\n",
+	    NSETS, NPKGS, tserial, tparallel);
+
+	pkg_audit_result_free(expected);
+	pkg_audit_free(audit);
+	pkg_shutdown();
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, check_its);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,258 @@
+/*-
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+
+#define NFILES		8
+#define HELLO_SUM	\
+	"5891b5b522d5df086d0ff0b110fbd9d21bb4fc7163af34d08286a2e846f6be03"
+
+static char cwd[PATH_MAX];
+
+static void
+setup(void)
+{
+	ATF_REQUIRE(getcwd(cwd, sizeof(cwd)) != NULL);
+	setenv("PKG_DBDIR", cwd, 1);
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_init(NULL, NULL));
+}
+
+static void
+file_path(char *path, size_t len, int i)
+{
+	snprintf(path, len, "%s/file%d", cwd, i);
+}
+
+static void
+write_file(const char *path, const char *content)
+{
+	FILE *f;
+
+	ATF_REQUIRE((f = fopen(path, "w")) != NULL);
+	fputs(content, f);
+	fclose(f);
+}
+
+/*
+ * A package of the files file<first> to file<first + n - 1> of the working
+ * directory, which all hold "hello\n".
+ */
+static struct pkg *
+hello_pkg(int first, int n)
+{
+	struct pkg *pkg = NULL;
+	char path[PATH_MAX];
+	int i;
+
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_new(&pkg, PKG_INSTALLED));
+	for (i = first; i < first + n; i++) {
+		file_path(path, sizeof(path), i);
+		write_file(path, "hello\n");
+		ATF_REQUIRE_EQ(EPKG_OK, pkg_addfile(pkg, path, HELLO_SUM, false));
+	}
+
+	return (pkg);
+}
+
+/*
+ * Whether the checksum of path is saved in the cache file.
+ */
+static bool
+cached(const char *path)
+{
+	FILE *f;
+	char line[BUFSIZ], *p;
+	bool found = false;
+
+	ATF_REQUIRE((f = fopen("checksums.cache", "r")) != NULL);
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		p = strrchr(line, ' ');
+		found = (p != NULL && strcmp(p + 1, path) == 0);
+	}
+	fclose(f);
+
+	return (found);
+}
+
+ATF_TC(filesum_cache);
+
+ATF_TC_HEAD(filesum_cache, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_test_filesum_cached() still detects files modified after "
+	    "they were cached");
+}
+
+ATF_TC_BODY(filesum_cache, tc)
+{
+	struct pkg *pkg;
+	struct pkg_filesum_cache *cache;
+	struct stat st;
+	char path[PATH_MAX];
+
+	setup();
+	pkg = hello_pkg(0, NFILES);
+	/* Files changed in the second they are hashed are not cached */
+	sleep(1);
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(0)) != NULL);
+	ATF_CHECK_EQ(EPKG_OK, pkg_test_filesum_cached(pkg, cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+	ATF_REQUIRE(stat("checksums.cache", &st) == 0);
+
+	/* Same size, the change time tells it apart */
+	file_path(path, sizeof(path), NFILES / 2);
+	write_file(path, "hellO\n");
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(0)) != NULL);
+	ATF_CHECK_EQ(EPKG_FATAL, pkg_test_filesum_cached(pkg, cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(PKG_FILESUM_REHASH)) != NULL);
+	ATF_CHECK_EQ(EPKG_FATAL, pkg_test_filesum_cached(pkg, cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+
+	ATF_CHECK_EQ(EPKG_FATAL, pkg_test_filesum(pkg));
+
+	pkg_free(pkg);
+	pkg_shutdown();
+}
+
+ATF_TC(filesum_cache_unread);
+
+ATF_TC_HEAD(filesum_cache_unread, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "The files whose checksum is cached are not read, unless "
+	    "rehashing");
+	atf_tc_set_md_var(tc, "require.user", "unprivileged");
+}
+
+ATF_TC_BODY(filesum_cache_unread, tc)
+{
+	struct pkg *pkg;
+	struct pkg_filesum_cache *cache;
+	struct stat st;
+	char path[PATH_MAX];
+	FILE *f;
+
+	setup();
+	pkg = hello_pkg(0, 1);
+	file_path(path, sizeof(path), 0);
+	ATF_REQUIRE(chmod(path, 0) == 0);
+
+	/*
+	 * chmod(2) changed the time of the entry a previous run would have
+	 * saved: save it by hand, for the file as it is now.
+	 */
+	ATF_REQUIRE(lstat(path, &st) == 0);
+	ATF_REQUIRE((f = fopen("checksums.cache", "w")) != NULL);
+	fprintf(f, "pkg-filesum-cache 1\n%s %ju %ju %jd %jd %jd %s\n",
+	    HELLO_SUM, (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+	    (intmax_t)st.st_size, (intmax_t)st.st_mtime,
+	    (intmax_t)st.st_ctime, path);
+	fclose(f);
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(0)) != NULL);
+	ATF_CHECK_EQ(EPKG_OK, pkg_test_filesum_cached(pkg, cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(PKG_FILESUM_REHASH)) != NULL);
+	ATF_CHECK_EQ(EPKG_FATAL, pkg_test_filesum_cached(pkg, cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+
+	ATF_CHECK_EQ(EPKG_FATAL, pkg_test_filesum(pkg));
+
+	pkg_free(pkg);
+	pkg_shutdown();
+}
+
+ATF_TC(filesum_cache_prune);
+
+ATF_TC_HEAD(filesum_cache_prune, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "The entries of the files not checked are only dropped with "
+	    "PKG_FILESUM_ALL");
+}
+
+ATF_TC_BODY(filesum_cache_prune, tc)
+{
+	struct pkg *pkgs[2];
+	struct pkg_filesum_cache *cache;
+	char path[2][PATH_MAX];
+	int i;
+
+	setup();
+	for (i = 0; i < 2; i++) {
+		pkgs[i] = hello_pkg(i, 1);
+		file_path(path[i], sizeof(path[i]), i);
+	}
+	sleep(1);
+
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(PKG_FILESUM_ALL)) != NULL);
+	for (i = 0; i < 2; i++)
+		ATF_CHECK_EQ(EPKG_OK, pkg_test_filesum_cached(pkgs[i], cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+	ATF_CHECK(cached(path[0]) && cached(path[1]));
+
+	/* Checking some packages keeps the other ones */
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(PKG_FILESUM_REHASH)) != NULL);
+	ATF_CHECK_EQ(EPKG_OK, pkg_test_filesum_cached(pkgs[0], cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+	ATF_CHECK(cached(path[0]) && cached(path[1]));
+
+	/* The second package is gone */
+	ATF_REQUIRE((cache = pkg_filesum_cache_open(PKG_FILESUM_ALL)) != NULL);
+	ATF_CHECK_EQ(EPKG_OK, pkg_test_filesum_cached(pkgs[0], cache));
+	ATF_CHECK_EQ(EPKG_OK, pkg_filesum_cache_close(cache));
+	ATF_CHECK(cached(path[0]));
+	ATF_CHECK(!cached(path[1]));
+
+	for (i = 0; i < 2; i++)
+		pkg_free(pkgs[i]);
+	pkg_shutdown();
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, filesum_cache);
+	ATF_TP_ADD_TC(tp, filesum_cache_unread);
+	ATF_TP_ADD_TC(tp, filesum_cache_prune);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+
+#define NVERSIONS	(sizeof(versions) / sizeof(versions[0]))
+#define BENCH_ROUNDS	2000
+
+static const char *versions[] = {
+	"1.0",
+	"1.0.0",
+	"1.0_1",
+	"1.0,1",
+	"1.0a",
+	"1.0b2",
+	"1.0pl1",
+	"1.0alpha3",
+	"1.0beta2",
+	"1.0pre1",
+	"1.0rc1",
+	"1.0.*",
+	"1.0:2003.09.16",
+	"1.0.1:2003.09.16",
+	"1.0+1",
+	"1.0+2.1",
+	"1.0.p20140101+ds_3,2",
+	"2.*",
+	"2pl1",
+	"2alpha3",
+	"2.9f7",
+	"3.*",
+	"10..1",
+	"10a1b2",
+	"a",
+	"0.1beta2",
+	"0.1",
+	"pkg-1.3.0.a.3_1",
+	"5.18.2_7",
+	"20140101",
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+ATF_TC(version_key_cmp);
+
+ATF_TC_HEAD(version_key_cmp, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_version_key_cmp() orders like pkg_version_cmp()");
+}
+
+ATF_TC_BODY(version_key_cmp, tc)
+{
+	struct pkg_version_key *keys[NVERSIONS];
+	size_t i, j;
+
+	for (i = 0; i < NVERSIONS; i++) {
+		keys[i] = pkg_version_key_new(versions[i]);
+		ATF_REQUIRE(keys[i] != NULL);
+	}
+
+	for (i = 0; i < NVERSIONS; i++) {
+		for (j = 0; j < NVERSIONS; j++) {
+			ATF_CHECK_EQ_MSG(pkg_version_cmp(versions[i], versions[j]),
+			    pkg_version_key_cmp(keys[i], keys[j]),
+			    "%s <=> %s", versions[i], versions[j]);
+		}
+	}
+
+	for (i = 0; i < NVERSIONS; i++)
+		pkg_version_key_free(keys[i]);
+}
+
+ATF_TC(version_key_bench);
+
+ATF_TC_HEAD(version_key_bench, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "times version key comparisons against version string "
+	    "comparisons; the timings are informational");
+}
+
+ATF_TC_BODY(version_key_bench, tc)
+{
+	struct pkg_version_key *keys[NVERSIONS];
+	struct timespec start;
+	double tstr, tkey;
+	size_t i, j;
+	int r, sum = 0;
+
+	for (i = 0; i < NVERSIONS; i++)
+		keys[i] = pkg_version_key_new(versions[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < NVERSIONS; i++)
+			for (j = 0; j < NVERSIONS; j++)
+				sum += pkg_version_cmp(versions[i], versions[j]);
+	tstr = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < NVERSIONS; i++)
+			for (j = 0; j < NVERSIONS; j++)
+				sum -= pkg_version_key_cmp(keys[i], keys[j]);
+	tkey = elapsed(&start);
+
+	for (i = 0; i < NVERSIONS; i++)
+		pkg_version_key_free(keys[i]);
+
+	printf("%d comparisons: strings %.3fs, keys %.3fs\n",
+	    BENCH_ROUNDS * (int)(NVERSIONS * NVERSIONS), tstr, tkey);
+
+	ATF_CHECK_EQ(0, sum);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, version_key_cmp);
+	ATF_TP_ADD_TC(tp, version_key_bench);
+
+	return (atf_no_error());
+}